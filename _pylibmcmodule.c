@@ -32,6 +32,17 @@
  */
 
 #include "_pylibmcmodule.h"
+#include <stdarg.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <unistd.h>
 #ifdef USE_ZLIB
 #  include <zlib.h>
 #  define ZLIB_BUFSZ (1 << 14)
@@ -40,6 +51,16 @@
   PyErr_Format(PylibMCExc_MemcachedError, "zlib error %d in " s, rc);
 #endif
 
+/* Each server list or distribution change gets a fresh topology number, which
+ * is what cached server lookups on key objects are checked against. Only
+ * touched while holding the GIL. */
+static unsigned long _PylibMC_topologies = 0;
+#define _PylibMC_NewTopology() (++_PylibMC_topologies)
+
+/* Bumped in the child after every fork(), so that clients can tell the
+ * connections they hold are shared with their parent. */
+static volatile unsigned long _PylibMC_forks = 0;
+
 
 /* {{{ Type methods */
 static PylibMC_Client *PylibMC_ClientType_new(PyTypeObject *type,
@@ -52,15 +73,53 @@ static PylibMC_Client *PylibMC_ClientType_new(PyTypeObject *type,
 
     if (self != NULL) {
         self->mc = memcached_create(NULL);
+        self->forks = _PylibMC_forks;
+        if (self->mc == NULL || !_PylibMC_NewCluster(self)) {
+            Py_DECREF(self);
+            return NULL;
+        }
     }
 
     return self;
 }
 
 static void PylibMC_ClientType_dealloc(PylibMC_Client *self) {
+    /* The last client of a cluster sends what's left of its counters. */
+    if (self->mc != NULL && self->forks == _PylibMC_forks
+            && self->cluster != NULL && self->cluster->refcnt == 1
+            && self->cluster->counters != NULL
+            && self->cluster->counters->pending) {
+        PyObject *type, *value, *tb;
+
+        PyErr_Fetch(&type, &value, &tb);
+        if (_PylibMC_FlushCounters(self) == -1) {
+            PyErr_WriteUnraisable((PyObject *)self);
+        }
+        PyErr_Restore(type, value, tb);
+    }
     if (self->mc != NULL) {
+        /* memcached_free says quit on every connection, which mustn't
+         * happen to those a parent process is still using. */
+        if (self->forks != _PylibMC_forks) {
+            _PylibMC_DropConnections(self->mc);
+        }
+        /* and a continuum shared with proto is proto's to free */
+        if (_PylibMC_SharesContinuum(self)) {
+            self->mc->continuum = NULL;
+        }
         memcached_free(self->mc);
     }
+    if (self->cluster != NULL) {
+        _PylibMC_ReleaseCluster(self->cluster);
+    }
+    Py_XDECREF(self->fork_hook);
+    Py_XDECREF(self->deferred);
+    if (self->async != NULL) {
+        _PylibMC_FreeAsync(self->async);
+    }
+    if (self->lanes != NULL) {
+        _PylibMC_FreeLanes(self->lanes);
+    }
 
     self->ob_type->tp_free(self);
 }
@@ -75,6 +134,8 @@ static int PylibMC_Client_init(PylibMC_Client *self, PyObject *args,
 
     if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|b", kws, &srvs, &bin)) {
         return -1;
+    } else if (!_PylibMC_OwnContinuum(self)) {
+        return -1;
     } else if ((srvs_it = PyObject_GetIter(srvs)) == NULL) {
         return -1;
     }
@@ -154,6 +215,10 @@ it_error:
         goto error;
     }
 
+    if (!_PylibMC_NewCluster(self)) {
+        goto error;
+    }
+
     Py_DECREF(srvs_it);
     return 0;
 error:
@@ -304,9 +369,29 @@ error:
 #endif
 /* }}} */
 
+/* Numbers are stored as their decimal text. Not every reader hands over
+ * values that are NUL-terminated, so parse from a terminated copy. */
+static PyObject *_PylibMC_ParseNumber(const char *value, size_t size) {
+    char buf[32];
+    PyObject *copy, *retval;
+
+    if (size < sizeof(buf)) {
+        memcpy(buf, value, size);
+        buf[size] = '\0';
+        return PyInt_FromString(buf, NULL, 10);
+    } else if ((copy = PyString_FromStringAndSize(value, size)) == NULL) {
+        return NULL;
+    }
+    retval = PyInt_FromString(PyString_AS_STRING(copy), NULL, 10);
+    Py_DECREF(copy);
+    return retval;
+}
+
 static PyObject *_PylibMC_parse_memcached_value(char *value, size_t size,
-        uint32_t flags) {
+        uint32_t flags, PylibMC_Client *self) {
     PyObject *retval, *tmp;
+    int metered = _PylibMC_Metered(self);
+    double start = metered ? _PylibMC_Now() : 0;
 
 #if USE_ZLIB
     PyObject *inflated = NULL;
@@ -316,6 +401,12 @@ static PyObject *_PylibMC_parse_memcached_value(char *value, size_t size,
         inflated = _PylibMC_Inflate(value, size);
         value = PyString_AS_STRING(inflated);
         size = PyString_GET_SIZE(inflated);
+        if (metered) {
+            double now = _PylibMC_Now();
+
+            _PylibMC_MeterTime(self, PYLIBMC_DECOMPRESS, now - start);
+            start = now;
+        }
     }
 #else
     if (flags & PYLIBMC_FLAG_ZLIB) {
@@ -333,10 +424,10 @@ static PyObject *_PylibMC_parse_memcached_value(char *value, size_t size,
             break;
         case PYLIBMC_FLAG_INTEGER:
         case PYLIBMC_FLAG_LONG:
-            retval = PyInt_FromString(value, NULL, 10);
+            retval = _PylibMC_ParseNumber(value, size);
             break;
         case PYLIBMC_FLAG_BOOL:
-            if ((tmp = PyInt_FromString(value, NULL, 10)) == NULL) {
+            if ((tmp = _PylibMC_ParseNumber(value, size)) == NULL) {
                 return NULL;
             }
             retval = PyBool_FromLong(PyInt_AS_LONG(tmp));
@@ -353,33 +444,246 @@ static PyObject *_PylibMC_parse_memcached_value(char *value, size_t size,
 #if USE_ZLIB
     Py_XDECREF(inflated);
 #endif
+    if (metered) {
+        _PylibMC_MeterTime(self, PYLIBMC_DESERIALIZE, _PylibMC_Now() - start);
+    }
 
     return retval;
 }
 
-static PyObject *PylibMC_Client_get(PylibMC_Client *self, PyObject *arg) {
-    char *mc_val;
-    size_t val_size;
+static PyObject *PylibMC_Client_get(PylibMC_Client *self, PyObject *args,
+        PyObject *kwds) {
+    PyObject *arg, *timeout_obj = NULL;
+    double timeout = -1;
+    pylibmc_span trace, *span;
+
+    static char *kws[] = { "key", "timeout", NULL };
+
+    /* Don't go through argument parsing for the common case. */
+    if (kwds == NULL && PyTuple_GET_SIZE(args) == 1) {
+        arg = PyTuple_GET_ITEM(args, 0);
+    } else if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O", kws,
+                                            &arg, &timeout_obj)) {
+        return NULL;
+    } else if (!_PylibMC_ParseTimeout(timeout_obj, &timeout)) {
+        return NULL;
+    }
+
+    if ((span = _PylibMC_TraceStart(self, &trace, PYLIBMC_OP_GET,
+                                    arg)) == NULL) {
+        return _PylibMC_Get(self, arg, timeout);
+    }
+    return _PylibMC_TraceEnd(self, span, _PylibMC_Get(self, arg, timeout));
+}
+
+static PyObject *_PylibMC_Get(PylibMC_Client *self, PyObject *arg,
+        double timeout) {
+    char *mc_val, *key_str;
+    size_t val_size, key_len;
     uint32_t flags;
     memcached_return error;
-
-    if (!_PylibMC_CheckKey(arg)) {
+    PyObject *key;
+    pylibmc_call call;
+    pylibmc_deadline dl;
+    pylibmc_replicas *replicas;
+    pylibmc_hedging *hedging;
+    pylibmc_hotkeys *hotkeys;
+    pylibmc_hot_copies hot;
+    pylibmc_async *prefetches;
+    char copy_key[MEMCACHED_MAX_KEY];
+    time_t copy_ttl = 0;
+    uint32_t primary = 0;
+    unsigned int rank = 0;
+    int down = 0;
+    int metered;
+    double began = 0;
+
+    if (!_PylibMC_ClientReady(self)) {
+        return NULL;
+    } else if ((key = _PylibMC_WireKey(self, arg, NULL, 0)) == NULL) {
         return NULL;
-    } else if (!PySequence_Length(arg) ) {
+    } else if (!PyString_GET_SIZE(key)) {
         /* Others do this, so... */
+        Py_DECREF(key);
         Py_RETURN_NONE;
     }
 
-    Py_BEGIN_ALLOW_THREADS
+    /* A prefetch's reply is as good as the server's; its own request was
+     * metered already. */
+    if ((prefetches = _PylibMC_Prefetches(self)) != NULL) {
+        PyObject *value;
+        int found = _PylibMC_PrefetchTake(self, prefetches, key,
+                (timeout < 0) ? -1 : _PylibMC_Now() + timeout, &value);
+
+        if (found != -1) {
+            Py_DECREF(key);
+            if (found) {
+                return value;
+            }
+            Py_RETURN_NONE;
+        }
+    }
 
-    mc_val = memcached_get(self->mc,
-            PyString_AS_STRING(arg), PyString_GET_SIZE(arg),
-            &val_size, &flags, &error);
+    key_str = PyString_AS_STRING(key);
+    key_len = PyString_GET_SIZE(key);
+    if ((metered = _PylibMC_Metered(self))) {
+        began = _PylibMC_Now();
+    }
 
-    Py_END_ALLOW_THREADS
+    /* Reads of a hot key are spread over its server and its copies. One
+     * that finds its copy missing goes on as usual, and refills it. */
+    hot.n = 0;
+    if ((hotkeys = _PylibMC_HotKeys(self)) != NULL
+            && _PylibMC_HotLookup(hotkeys, key_str, key_len, &hot)) {
+        unsigned int pick = _PylibMC_HotRandom(hotkeys) % (hot.n + 1);
+        pylibmc_breakers *b = _PylibMC_Breakers(self);
+
+        hot.n = 0;
+        if (pick && (b == NULL || !_PylibMC_BreakerOpen(b,
+                        hot.server[pick - 1], _PylibMC_Now()))) {
+            size_t copy_len = _PylibMC_HotCopyKey(key_str, key_len,
+                    hot.suffix[pick - 1], copy_key);
+            PyObject *r;
+
+            r = _PylibMC_HotCopyGet(self, copy_key, copy_len, &val_size,
+                                    &timeout);
+            /* the settings may have been replaced meanwhile */
+            hotkeys = _PylibMC_HotKeys(self);
+            if (r != NULL || PyErr_Occurred()) {
+                if (hotkeys != NULL) {
+                    _PylibMC_HotKeySample(hotkeys, self->mc, key_str,
+                                          key_len, val_size);
+                }
+                if (metered) {
+                    _PylibMC_Meter(self, PYLIBMC_OP_GET,
+                            hot.server[pick - 1], _PylibMC_Now() - began,
+                            (r != NULL) ? PYLIBMC_HIT : PYLIBMC_ERROR,
+                            (r != NULL) ? val_size : 0, key_len);
+                }
+                Py_DECREF(key);
+                return r;
+            }
+            hot.suffix[0] = hot.suffix[pick - 1];
+            hot.n = (hotkeys != NULL);
+            copy_ttl = (hotkeys != NULL) ? hotkeys->ttl : 0;
+        }
+    }
 
-    if (mc_val != NULL) {
-        PyObject *r = _PylibMC_parse_memcached_value(mc_val, val_size, flags);
+    if ((replicas = _PylibMC_Replicas(self)) != NULL || metered
+            || PylibMC_Key_Check(arg)) {
+        primary = _PylibMC_ServerIndex(self, arg, key);
+    }
+    hedging = _PylibMC_Hedging(self);
+
+    switch (_PylibMC_CallStart(self, arg, key, &call)) {
+        case 0:
+            if (replicas == NULL) {
+                if (metered) {
+                    _PylibMC_Meter(self, PYLIBMC_OP_GET, primary, 0,
+                                   PYLIBMC_ERROR, 0, key_len);
+                }
+                Py_DECREF(key);
+                return NULL;
+            }
+            /* it's the replicas' turn; ServerDown only if they miss too */
+            PyErr_Clear();
+            down = 1;
+            break;
+        case -1:
+            if (replicas == NULL) {
+                if (metered) {
+                    _PylibMC_Meter(self, PYLIBMC_OP_GET, primary, 0,
+                                   PYLIBMC_ERROR, 0, key_len);
+                }
+                Py_DECREF(key);
+                Py_RETURN_NONE;
+            }
+            down = -1;
+            break;
+    }
+
+    PYLIBMC_BEGIN_ALLOW_THREADS(self)
+
+    _PylibMC_DeadlineStart(self->mc, timeout, &dl);
+    if (down) {
+        mc_val = NULL;
+        error = MEMCACHED_NOTFOUND;
+    } else {
+        _PylibMC_DeadlineConnect(self->mc, &dl, &key_str, &key_len, 1);
+        if (hedging != NULL && _PylibMC_HedgedGet(self->mc, replicas,
+                    hedging, _PylibMC_Breakers(self), primary,
+                    key_str, key_len, &mc_val, &val_size, &flags, &error,
+                    &rank, &dl)) {
+            /* done by hand */
+        } else if (_PylibMC_DeadlineArm(self->mc, &dl)) {
+            double start = _PylibMC_Now();
+
+            mc_val = memcached_get(self->mc, key_str, key_len,
+                    &val_size, &flags, &error);
+            if (hedging != NULL) {
+                _PylibMC_HedgeSample(hedging, _PylibMC_Now() - start);
+            }
+            if (mc_val == NULL && error != MEMCACHED_SUCCESS
+                    && error != MEMCACHED_NOTFOUND) {
+                _PylibMC_DeadlineCheck(&dl);
+            }
+        } else {
+            mc_val = NULL;
+            error = MEMCACHED_TIMEOUT;
+        }
+        _PylibMC_CallDone(self, &call, error);
+    }
+
+    /* A miss or a failure on the primary is the replicas' to make up for. */
+    if (replicas != NULL && !dl.expired) {
+        if (mc_val != NULL || error == MEMCACHED_SUCCESS) {
+            __sync_fetch_and_add(&replicas->served[rank], 1);
+        } else {
+            mc_val = _PylibMC_ReplicaGet(self->mc, replicas,
+                    _PylibMC_Breakers(self), primary, key_str, key_len,
+                    &val_size, &flags, &error, &dl);
+        }
+    }
+    if (hot.n && mc_val != NULL && !dl.expired) {
+        _PylibMC_HotFanOut(self->mc, &hot, key_str, key_len,
+                           mc_val, val_size, 0, flags, copy_ttl);
+        memcached_flush_buffers(self->mc);
+    }
+    _PylibMC_DeadlineEnd(self->mc, &dl);
+
+    PYLIBMC_END_ALLOW_THREADS
+
+    if ((hotkeys = _PylibMC_HotKeys(self)) != NULL && !dl.expired) {
+        _PylibMC_HotKeySample(hotkeys, self->mc, key_str, key_len,
+                              (mc_val != NULL) ? val_size : 0);
+    }
+    if (metered) {
+        int outcome;
+
+        if (dl.expired || (down == 1 && mc_val == NULL
+                    && error != MEMCACHED_SUCCESS)) {
+            outcome = PYLIBMC_ERROR;
+        } else if (mc_val != NULL) {
+            outcome = PYLIBMC_HIT;
+        } else {
+            outcome = _PylibMC_Outcome(error);
+        }
+        _PylibMC_Meter(self, PYLIBMC_OP_GET, primary,
+                       _PylibMC_Now() - began, outcome,
+                       (mc_val != NULL) ? val_size : 0, key_len);
+    }
+    Py_DECREF(key);
+
+    if (down == 1 && mc_val == NULL && error != MEMCACHED_SUCCESS
+            && !dl.expired) {
+        return _PylibMC_ServerDown(self, primary);
+    } else if (dl.expired) {
+        free(mc_val);
+        Py_INCREF(Py_None);
+        return _PylibMC_DeadlineExceeded(Py_BuildValue("[O]", arg), Py_None);
+    } else if (mc_val != NULL) {
+        PyObject *r = _PylibMC_parse_memcached_value(mc_val, val_size, flags,
+                                                     self);
         free(mc_val);
         return r;
     } else if (error == MEMCACHED_SUCCESS) {
@@ -399,16 +703,26 @@ static PyObject *_PylibMC_RunSetCommandSingle(PylibMC_Client *self,
         _PylibMC_SetCommand f, char *fname, PyObject *args,
         PyObject *kwds) {
   /* function called by the set/add/etc commands */
-  static char *kws[] = { "key", "val", "time", "min_compress_len", NULL };
+  static char *kws[] = { "key", "val", "time", "min_compress_len",
+                         "noreply", NULL };
   PyObject *key;
   PyObject *value;
   unsigned int time = 0; /* this will be turned into a time_t */
   unsigned int min_compress = 0;
+  unsigned char noreply = 0;
   bool success = false;
+  int metered;
+  double start;
+  pylibmc_span trace, *span;
+  PyObject *retval;
 
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, "SO|II", kws,
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|IIb", kws,
                                    &key, &value,
-                                   &time, &min_compress)) {
+                                   &time, &min_compress, &noreply)) {
+    return NULL;
+  } else if (!PyString_Check(key) && !PylibMC_Key_Check(key)) {
+    PyErr_Format(PyExc_TypeError, "argument 1 must be string, not %.50s",
+                 key->ob_type->tp_name);
     return NULL;
   }
 
@@ -425,42 +739,62 @@ static PyObject *_PylibMC_RunSetCommandSingle(PylibMC_Client *self,
                               NULL, NULL, NULL,
                               false };
 
-  success = _PylibMC_SerializeValue(key, NULL, value, time, &serialized);
+  span = _PylibMC_TraceStart(self, &trace, _PylibMC_SetOp(f, 0), key);
+  metered = _PylibMC_Metered(self);
+  start = metered ? _PylibMC_Now() : 0;
+  success = _PylibMC_SerializeValue(self, key, NULL, value, time,
+                                    &serialized);
+  if (metered) {
+    _PylibMC_MeterTime(self, PYLIBMC_SERIALIZE, _PylibMC_Now() - start);
+  }
 
   if(!success) goto cleanup;
 
   success = _PylibMC_RunSetCommand(self, f, fname,
                                    &serialized, 1,
-                                   min_compress);
+                                   min_compress, -1, NULL, noreply);
 
 cleanup:
   _PylibMC_FreeMset(&serialized);
 
-  if(PyErr_Occurred() != NULL) {
-    return NULL;
-  } else if(success) {
-    Py_RETURN_TRUE;
+  if(PyErr_Occurred() != NULL
+     && !(noreply && _PylibMC_Defer(self))) {
+    retval = NULL;
   } else {
-    Py_RETURN_FALSE;
+    retval = (success || noreply) ? Py_True : Py_False;
+    Py_INCREF(retval);
   }
+  return _PylibMC_TraceEnd(self, span, retval);
 }
 
 static PyObject *_PylibMC_RunSetCommandMulti(PylibMC_Client* self,
         _PylibMC_SetCommand f, char *fname, PyObject* args,
         PyObject* kwds) {
   /* function called by the set/add/incr/etc commands */
-  static char *kws[] = { "keys", "key_prefix", "time", "min_compress_len", NULL };
+  static char *kws[] = { "keys", "key_prefix", "time", "min_compress_len",
+                         "timeout", "noreply", NULL };
   PyObject* keys = NULL;
   PyObject* key_prefix = NULL;
+  PyObject* ns_prefix = NULL;
+  PyObject* timeout_obj = NULL;
   unsigned int time = 0;
   unsigned int min_compress = 0;
+  unsigned char noreply = 0;
+  double timeout;
+  size_t expired_at;
   PyObject * retval = NULL;
   size_t idx = 0;
+  int metered;
+  double start;
+  pylibmc_span trace, *span;
 
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|O!II", kws,
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|O!IIOb", kws,
                                    &PyDict_Type, &keys,
                                    &PyString_Type, &key_prefix,
-                                   &time, &min_compress)) {
+                                   &time, &min_compress, &timeout_obj,
+                                   &noreply)) {
+    return NULL;
+  } else if (!_PylibMC_ParseTimeout(timeout_obj, &timeout)) {
     return NULL;
   }
 
@@ -471,9 +805,23 @@ static PyObject *_PylibMC_RunSetCommandMulti(PylibMC_Client* self,
   }
 #endif
 
+  if(key_prefix != NULL && PyString_GET_SIZE(key_prefix)
+      && _PylibMC_Namespaces(self) != NULL) {
+    /* the generation is looked up once, and prefixes every key */
+    ns_prefix = _PylibMC_NamespacePrefix(self,
+        PyString_AS_STRING(key_prefix), PyString_GET_SIZE(key_prefix));
+    if(ns_prefix == NULL) {
+      return NULL;
+    }
+    key_prefix = ns_prefix;
+  }
+
   PyObject *curr_key, *curr_value;
   size_t nkeys = (size_t)PyDict_Size(keys);
 
+  span = _PylibMC_TraceStart(self, &trace, _PylibMC_SetOp(f, 1), NULL);
+  metered = _PylibMC_Metered(self);
+
   pylibmc_mset* serialized = PyMem_New(pylibmc_mset, nkeys);
   if(serialized == NULL) {
     goto cleanup;
@@ -506,8 +854,9 @@ static PyObject *_PylibMC_RunSetCommandMulti(PylibMC_Client* self,
 
   Py_ssize_t pos = 0; /* PyDict_Next's 'pos' isn't an incrementing index */
   idx = 0;
+  start = metered ? _PylibMC_Now() : 0;
   while(PyDict_Next(keys, &pos, &curr_key, &curr_value)) {
-    int success = _PylibMC_SerializeValue(curr_key, key_prefix,
+    int success = _PylibMC_SerializeValue(self, curr_key, key_prefix,
                                           curr_value, time,
                                           &serialized[idx]);
     if(!success || PyErr_Occurred() != NULL) {
@@ -521,8 +870,13 @@ static PyObject *_PylibMC_RunSetCommandMulti(PylibMC_Client* self,
     /* an iteration error of some sort */
     goto cleanup;
   }
+  if (metered) {
+    _PylibMC_MeterTime(self, PYLIBMC_SERIALIZE, _PylibMC_Now() - start);
+  }
 
-  bool allsuccess = _PylibMC_RunSetCommand(self, f, fname, serialized, nkeys, time);
+  bool allsuccess = _PylibMC_RunSetCommand(self, f, fname, serialized, nkeys,
+                                           min_compress, timeout, &expired_at,
+                                           noreply);
 
   if(PyErr_Occurred() != NULL) {
     goto cleanup;
@@ -535,7 +889,7 @@ static PyObject *_PylibMC_RunSetCommandMulti(PylibMC_Client* self,
     goto cleanup;
   }
   if(!allsuccess) {
-    for(idx = 0; idx < nkeys; idx++) {
+    for(idx = 0; idx < expired_at; idx++) {
       if(!serialized[idx].success) {
         if(PyList_Append(retval, serialized[idx].key_obj) != 0) {
           /* Ugh */
@@ -548,6 +902,19 @@ static PyObject *_PylibMC_RunSetCommandMulti(PylibMC_Client* self,
     }
   }
 
+  if(expired_at < nkeys) {
+    /* out of time: what wasn't set goes with the exception */
+    PyObject* unserved = PyList_New(0);
+
+    for(idx = expired_at; unserved != NULL && idx < nkeys; idx++) {
+      if(PyList_Append(unserved, serialized[idx].key_obj) != 0) {
+        Py_DECREF(unserved);
+        unserved = NULL;
+      }
+    }
+    retval = _PylibMC_DeadlineExceeded(unserved, retval);
+  }
+
 cleanup:
   if(serialized != NULL) {
     for(pos = 0; pos < nkeys; pos++) {
@@ -555,8 +922,13 @@ cleanup:
     }
     PyMem_Free(serialized);
   }
+  Py_XDECREF(ns_prefix);
+
+  if(noreply && retval == NULL && _PylibMC_Defer(self)) {
+    retval = PyList_New(0);
+  }
 
-  return retval;
+  return _PylibMC_TraceEnd(self, span, retval);
 }
 
 static void _PylibMC_FreeMset(pylibmc_mset* mset) {
@@ -569,7 +941,7 @@ static void _PylibMC_FreeMset(pylibmc_mset* mset) {
   Py_XDECREF(mset->key_obj);
   mset->key_obj = NULL;
 
-  /* if this isn't NULL then we built it */
+  /* the wire key, which we own a reference to */
   Py_XDECREF(mset->prefixed_key_obj);
   mset->prefixed_key_obj = NULL;
 
@@ -580,7 +952,8 @@ static void _PylibMC_FreeMset(pylibmc_mset* mset) {
   mset->value_obj = NULL;
 }
 
-static int _PylibMC_SerializeValue(PyObject* key_obj,
+static int _PylibMC_SerializeValue(PylibMC_Client* self,
+                                   PyObject* key_obj,
                                    PyObject* key_prefix,
                                    PyObject* value_obj,
                                    time_t time,
@@ -590,45 +963,27 @@ static int _PylibMC_SerializeValue(PyObject* key_obj,
   serialized->success = false;
   serialized->flags = PYLIBMC_FLAG_NONE;
 
-  if(!_PylibMC_CheckKey(key_obj)
-     || PyString_AsStringAndSize(key_obj, &serialized->key,
-                                 &serialized->key_len) == -1) {
+  if(key_prefix != NULL && !_PylibMC_CheckKey(key_prefix)) {
     return false;
   }
 
+  /* the wire key is the prefixed key if appropriate (freed by
+     _PylibMC_FreeMset) */
+  serialized->prefixed_key_obj = _PylibMC_WireKey(self, key_obj,
+      key_prefix ? PyString_AS_STRING(key_prefix) : NULL,
+      key_prefix ? PyString_GET_SIZE(key_prefix) : 0);
+  if(serialized->prefixed_key_obj == NULL) {
+    return false;
+  }
+  serialized->key = PyString_AS_STRING(serialized->prefixed_key_obj);
+  serialized->key_len = PyString_GET_SIZE(serialized->prefixed_key_obj);
+
   /* we need to incr our reference here so that it's guaranteed to
      exist while we release the GIL. Even if we fail after this it
      should be decremeneted by pylib_mset_free */
   serialized->key_obj = key_obj;
   Py_INCREF(key_obj);
 
-  /* make the prefixed key if appropriate */
-  if(key_prefix != NULL) {
-    if(!_PylibMC_CheckKey(key_prefix)) {
-      return false;
-    }
-
-    /* we can safely ignore an empty prefix */
-    if(PyString_Size(key_prefix) > 0) {
-      PyObject* prefixed_key_obj = NULL; /* freed by _PylibMC_FreeMset */
-      prefixed_key_obj = PyString_FromFormat("%s%s",
-                                             PyString_AS_STRING(key_prefix),
-                                             PyString_AS_STRING(key_obj));
-      if(prefixed_key_obj == NULL) {
-        return false;
-      }
-
-      /* check the key and overwrite the C string */
-      if(!_PylibMC_CheckKey(prefixed_key_obj)
-         || PyString_AsStringAndSize(prefixed_key_obj, &serialized->key,
-                                     &serialized->key_len) == -1) {
-        Py_DECREF(prefixed_key_obj);
-        return false;
-      }
-      serialized->prefixed_key_obj = prefixed_key_obj;
-    }
-  }
-
   /* key/key_size should be copasetic, now onto the value */
 
   PyObject* store_val = NULL;
@@ -690,14 +1045,78 @@ static int _PylibMC_SerializeValue(PyObject* key_obj,
 static bool _PylibMC_RunSetCommand(PylibMC_Client* self,
                                    _PylibMC_SetCommand f, char *fname,
                                    pylibmc_mset* msets, size_t nkeys,
-                                   size_t min_compress) {
-    memcached_st* mc = self->mc;
+                                   size_t min_compress,
+                                   double timeout, size_t *expired_at,
+                                   bool noreply) {
+    memcached_st* mc;
     memcached_return rc = MEMCACHED_SUCCESS;
     int pos;
     bool error = false;
     bool allsuccess = true;
+    pylibmc_breakers *breakers;
+    pylibmc_replicas *replicas;
+    pylibmc_hotkeys *hotkeys;
+    pylibmc_hot_copies *hot = NULL;
+    pylibmc_async *prefetches;
+    time_t hot_ttl = 0;
+    uint32_t server = 0;
+    int down = -1;
+    double start = 0;
+    pylibmc_deadline dl;
+    int metered;
+    /* only the _multi variants ask where a deadline stopped them */
+    int op = _PylibMC_SetOp(f, expired_at != NULL);
+    double began = 0;
+    uint64_t noreply_saved[2];
+
+    if (!_PylibMC_ClientReady(self)) {
+      return false;
+    }
+    mc = self->mc;
+    breakers = _PylibMC_Breakers(self);
+    replicas = _PylibMC_Replicas(self);
+    if ((metered = _PylibMC_Metered(self))) {
+      began = _PylibMC_Now();
+    }
+    if ((prefetches = _PylibMC_Prefetches(self)) != NULL) {
+      for (pos = 0; pos < nkeys; pos++) {
+        _PylibMC_PrefetchForget(prefetches, msets[pos].key,
+                                msets[pos].key_len);
+      }
+    }
 
-    Py_BEGIN_ALLOW_THREADS
+    if ((hotkeys = _PylibMC_HotKeys(self)) != NULL && hotkeys->nhot) {
+      if ((hot = PyMem_New(pylibmc_hot_copies, nkeys)) == NULL) {
+        PyErr_NoMemory();
+        return false;
+      }
+      for (pos = 0; pos < nkeys; pos++) {
+        _PylibMC_HotLookup(hotkeys, msets[pos].key, msets[pos].key_len,
+                           &hot[pos]);
+      }
+      hot_ttl = hotkeys->ttl;
+    }
+
+    PYLIBMC_BEGIN_ALLOW_THREADS(self)
+
+    _PylibMC_DeadlineStart(mc, timeout, &dl);
+    if (dl.at >= 0) {
+      char **keys = malloc(sizeof(char *) * nkeys);
+      size_t *key_lens = malloc(sizeof(size_t) * nkeys);
+
+      if (keys != NULL && key_lens != NULL) {
+        for (pos = 0; pos < nkeys; pos++) {
+          keys[pos] = msets[pos].key;
+          key_lens[pos] = msets[pos].key_len;
+        }
+        _PylibMC_DeadlineConnect(mc, &dl, keys, key_lens, nkeys);
+      }
+      free(keys);
+      free(key_lens);
+    }
+    if (noreply) {
+      _PylibMC_NoReplyStart(mc, noreply_saved);
+    }
 
     for(pos=0; pos < nkeys && !error; pos++) {
       pylibmc_mset* mset = &msets[pos];
@@ -706,12 +1125,55 @@ static bool _PylibMC_RunSetCommand(PylibMC_Client* self,
       size_t value_len = mset->value_len;
       uint32_t flags = mset->flags;
 
+      if (!_PylibMC_DeadlineArm(mc, &dl)) {
+        break;
+      }
+
+      if ((breakers != NULL || replicas != NULL || metered)
+          && mset->key_len) {
+        server = memcached_generate_hash(mc, mset->key, mset->key_len);
+      }
+      if (breakers != NULL && mset->key_len) {
+        start = _PylibMC_Now();
+        if (!_PylibMC_BreakerAllow(breakers, server, start)) {
+          /* the replicas may still take it */
+          if (replicas != NULL && _PylibMC_ReplicaWrite(mc, replicas,
+                  breakers, server, _PylibMC_ReplicaCommand(f, 0),
+                  mset->key, mset->key_len, value, value_len,
+                  mset->time, flags, 1)) {
+            mset->success = true;
+            if (metered) {
+              _PylibMC_MeterKey(self, op, server, PYLIBMC_HIT,
+                                0, mset->key_len + value_len);
+            }
+            continue;
+          }
+          mset->success = false;
+          allsuccess = false;
+          if (metered) {
+            _PylibMC_MeterKey(self, op, server, PYLIBMC_ERROR,
+                              0, mset->key_len);
+          }
+          if (!breakers->fallback) {
+            down = (int)server;
+            error = true;
+          }
+          continue;
+        }
+      }
+
 #ifdef USE_ZLIB
       char* compressed_value = NULL;
       size_t compressed_len = 0;
 
       if(min_compress && value_len >= min_compress) {
+        double deflating = metered ? _PylibMC_Now() : 0;
+
         _PylibMC_Deflate(value, value_len, &compressed_value, &compressed_len);
+        if (metered) {
+          _PylibMC_MeterTime(self, PYLIBMC_COMPRESS,
+                              _PylibMC_Now() - deflating);
+        }
       }
 
       if(compressed_value != NULL) {
@@ -733,6 +1195,44 @@ static bool _PylibMC_RunSetCommand(PylibMC_Client* self,
                mset->key, mset->key_len,
                value, value_len,
                mset->time, flags);
+        /* sent off without a reply to wait for, which is all we'll know */
+        if (rc == MEMCACHED_BUFFERED) {
+          rc = MEMCACHED_SUCCESS;
+        }
+        if (breakers != NULL) {
+          _PylibMC_BreakerRecord(breakers, server,
+                                 _PylibMC_IsServerFailure(rc),
+                                 _PylibMC_Now() - start);
+        }
+        /* A write the primary refused for its own reasons, like an add of
+         * a key it has, isn't copied. One it couldn't take is, and if a
+         * replica takes it the write went through. */
+        if (replicas != NULL && (rc == MEMCACHED_SUCCESS
+                                 || _PylibMC_IsServerFailure(rc))) {
+          unsigned int copied = _PylibMC_ReplicaWrite(mc, replicas,
+                  breakers, server,
+                  _PylibMC_ReplicaCommand(f, rc == MEMCACHED_SUCCESS),
+                  mset->key, mset->key_len, value, value_len,
+                  mset->time, flags, rc != MEMCACHED_SUCCESS);
+
+          if (copied && rc != MEMCACHED_SUCCESS && !dl.expired) {
+            rc = MEMCACHED_SUCCESS;
+          }
+        }
+        /* The copies of a hot key get what a plain set stored, and are
+         * dropped on other writes, to be refilled by reads. */
+        if (hot != NULL && hot[pos].n && rc == MEMCACHED_SUCCESS) {
+          _PylibMC_HotFanOut(mc, &hot[pos], mset->key, mset->key_len,
+                             (f == memcached_set) ? value : NULL, value_len,
+                             mset->time, flags, hot_ttl);
+        }
+      }
+
+      if (metered) {
+        _PylibMC_MeterKey(self, op,
+                          mset->key_len ? server : UINT32_MAX,
+                          _PylibMC_Outcome(rc), 0,
+                          mset->key_len + value_len);
       }
 
 #ifdef USE_ZLIB
@@ -741,6 +1241,10 @@ static bool _PylibMC_RunSetCommand(PylibMC_Client* self,
       }
 #endif
 
+      if (_PylibMC_IsServerFailure(rc) && _PylibMC_DeadlineCheck(&dl)) {
+        break;
+      }
+
      switch(rc) {
      case MEMCACHED_SUCCESS:
        mset->success = true;
@@ -762,11 +1266,55 @@ static bool _PylibMC_RunSetCommand(PylibMC_Client* self,
 
   } /* for */
 
-  Py_END_ALLOW_THREADS
+  if (replicas != NULL) {
+    _PylibMC_ReplicaFlush(mc);
+  }
+  if (hot != NULL) {
+    memcached_flush_buffers(mc);
+  }
+  if (noreply) {
+    memcached_return flushed = _PylibMC_NoReplyEnd(mc, noreply_saved,
+                                                   MEMCACHED_SUCCESS);
+
+    if (flushed != MEMCACHED_SUCCESS && !error && down < 0) {
+      rc = flushed;
+      error = true;
+    }
+  }
+  _PylibMC_DeadlineEnd(mc, &dl);
+
+  PYLIBMC_END_ALLOW_THREADS
+
+  PyMem_Free(hot);
+
+  if (metered) {
+    _PylibMC_Meter(self, op,
+                   (expired_at == NULL && msets[0].key_len)
+                        ? server : UINT32_MAX,
+                   _PylibMC_Now() - began, -1, 0, 0);
+  }
+
+  /* everything that was tried counts, stored or not */
+  if ((hotkeys = _PylibMC_HotKeys(self)) != NULL) {
+    int tried = pos;
+
+    for (pos = 0; pos < tried; pos++) {
+      _PylibMC_HotKeySample(hotkeys, mc, msets[pos].key, msets[pos].key_len,
+                            msets[pos].value_len);
+    }
+    pos = tried;
+  }
+
+  if (expired_at != NULL) {
+    *expired_at = dl.expired ? (size_t)pos : nkeys;
+  }
 
   /* we only return the last return value, even for a _multi
      operation, but we do set the success on the mset */
-  if(error) {
+  if(down >= 0) {
+    _PylibMC_ServerDown(self, (uint32_t)down);
+    return false;
+  } else if(error) {
     PylibMC_ErrFromMemcached(self, fname, rc);
     return false;
   } else {
@@ -808,20 +1356,130 @@ static PyObject *PylibMC_Client_append(PylibMC_Client *self, PyObject *args,
 }
 /* }}} */
 
-static PyObject *PylibMC_Client_delete(PylibMC_Client *self, PyObject *args) {
-    PyObject *retval;
-    char *key;
-    Py_ssize_t key_sz;
-    unsigned int time;
-    memcached_return rc;
+static PyObject *PylibMC_Client_delete(PylibMC_Client *self, PyObject *args,
+        PyObject *kwds) {
+    static char *kws[] = { "key", "time", "noreply", NULL };
+    PyObject *key, *retval;
+    unsigned int time = 0;
+    unsigned char noreply = 0;
+    pylibmc_span trace, *span;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|Ib", kws,
+                                     &key, &time, &noreply)) {
+        return NULL;
+    }
 
-    retval = NULL;
-    time = 0;
-    if (PyArg_ParseTuple(args, "s#|I", &key, &key_sz, &time)
-            && _PylibMC_CheckKeyStringAndSize(key, key_sz)) {
-        Py_BEGIN_ALLOW_THREADS
-        rc = memcached_delete(self->mc, key, key_sz, time);
-        Py_END_ALLOW_THREADS
+    span = _PylibMC_TraceStart(self, &trace, PYLIBMC_OP_DELETE, key);
+    retval = _PylibMC_Delete(self, key, time, noreply);
+    if (noreply && retval == NULL && _PylibMC_Defer(self)) {
+        Py_INCREF(Py_True);
+        retval = Py_True;
+    }
+    return _PylibMC_TraceEnd(self, span, retval);
+}
+
+static PyObject *_PylibMC_Delete(PylibMC_Client *self, PyObject *key_obj,
+        unsigned int time, bool noreply) {
+    PyObject *key;
+    memcached_return rc;
+    pylibmc_call call;
+    pylibmc_replicas *replicas;
+    pylibmc_hotkeys *hotkeys;
+    pylibmc_hot_copies hot;
+    pylibmc_async *prefetches;
+    int metered;
+    double began = 0;
+    uint32_t primary = 0;
+    int down = 0;
+    uint64_t noreply_saved[2];
+
+    if (_PylibMC_ClientReady(self)
+            && (key = _PylibMC_WireKey(self, key_obj, NULL, 0)) != NULL) {
+        if ((metered = _PylibMC_Metered(self))) {
+            began = _PylibMC_Now();
+        }
+        if ((prefetches = _PylibMC_Prefetches(self)) != NULL) {
+            _PylibMC_PrefetchForget(prefetches, PyString_AS_STRING(key),
+                                    PyString_GET_SIZE(key));
+        }
+        if ((replicas = _PylibMC_Replicas(self)) != NULL || metered) {
+            primary = _PylibMC_ServerIndex(self, key_obj, key);
+        }
+        hot.n = 0;
+        if ((hotkeys = _PylibMC_HotKeys(self)) != NULL) {
+            _PylibMC_HotLookup(hotkeys, PyString_AS_STRING(key),
+                               PyString_GET_SIZE(key), &hot);
+        }
+        switch (_PylibMC_CallStart(self, key_obj, key, &call)) {
+            case 0:
+                if (replicas == NULL) {
+                    if (metered) {
+                        _PylibMC_Meter(self, PYLIBMC_OP_DELETE, primary,
+                                       0, PYLIBMC_ERROR, 0,
+                                       PyString_GET_SIZE(key));
+                    }
+                    Py_DECREF(key);
+                    return NULL;
+                }
+                PyErr_Clear();
+                down = 1;
+                break;
+            case -1:
+                if (replicas == NULL) {
+                    if (metered) {
+                        _PylibMC_Meter(self, PYLIBMC_OP_DELETE, primary,
+                                       0, PYLIBMC_ERROR, 0,
+                                       PyString_GET_SIZE(key));
+                    }
+                    Py_DECREF(key);
+                    Py_RETURN_FALSE;
+                }
+                down = -1;
+                break;
+        }
+        PYLIBMC_BEGIN_ALLOW_THREADS(self)
+        if (down) {
+            rc = MEMCACHED_SERVER_MARKED_DEAD;
+        } else if (noreply) {
+            _PylibMC_NoReplyStart(self->mc, noreply_saved);
+            rc = memcached_delete(self->mc,
+                    PyString_AS_STRING(key), PyString_GET_SIZE(key), time);
+            rc = _PylibMC_NoReplyEnd(self->mc, noreply_saved, rc);
+            _PylibMC_CallDone(self, &call, rc);
+        } else {
+            rc = memcached_delete(self->mc,
+                    PyString_AS_STRING(key), PyString_GET_SIZE(key), time);
+            _PylibMC_CallDone(self, &call, rc);
+        }
+        if (replicas != NULL && (rc == MEMCACHED_SUCCESS
+                    || rc == MEMCACHED_NOTFOUND
+                    || _PylibMC_IsServerFailure(rc))) {
+            if (_PylibMC_ReplicaWrite(self->mc, replicas,
+                        _PylibMC_Breakers(self), primary, NULL,
+                        PyString_AS_STRING(key), PyString_GET_SIZE(key),
+                        NULL, 0, time, 0, _PylibMC_IsServerFailure(rc))
+                    && _PylibMC_IsServerFailure(rc)) {
+                rc = MEMCACHED_SUCCESS;
+            }
+            _PylibMC_ReplicaFlush(self->mc);
+        }
+        if (hot.n) {
+            _PylibMC_HotFanOut(self->mc, &hot, PyString_AS_STRING(key),
+                               PyString_GET_SIZE(key), NULL, 0, 0, 0, 0);
+            memcached_flush_buffers(self->mc);
+        }
+        PYLIBMC_END_ALLOW_THREADS
+        if (metered) {
+            _PylibMC_Meter(self, PYLIBMC_OP_DELETE, primary,
+                           _PylibMC_Now() - began, _PylibMC_Outcome(rc),
+                           0, PyString_GET_SIZE(key));
+        }
+        Py_DECREF(key);
+        if (down == 1 && rc != MEMCACHED_SUCCESS) {
+            return _PylibMC_ServerDown(self, primary);
+        } else if (down == -1 && rc != MEMCACHED_SUCCESS) {
+            Py_RETURN_FALSE;
+        }
         switch (rc) {
             case MEMCACHED_SUCCESS:
                 Py_RETURN_TRUE;
@@ -844,29 +1502,39 @@ static PyObject *PylibMC_Client_delete(PylibMC_Client *self, PyObject *args) {
 static PyObject *_PylibMC_IncrSingle(PylibMC_Client *self,
                                      _PylibMC_IncrCommand incr_func,
                                      PyObject *args) {
-    char *key;
-    Py_ssize_t key_len;
+    PyObject *key_obj, *key, *retval;
     unsigned int delta = 1;
+    pylibmc_span trace, *span;
 
-    if (!PyArg_ParseTuple(args, "s#|I", &key, &key_len, &delta)) {
+    if (!PyArg_ParseTuple(args, "O|I", &key_obj, &delta)) {
         return NULL;
-    } else if (!_PylibMC_CheckKeyStringAndSize(key, key_len)) {
+    } else if ((key = _PylibMC_WireKey(self, key_obj, NULL, 0)) == NULL) {
         return NULL;
     }
 
-    pylibmc_incr incr = { key, key_len,
+    pylibmc_incr incr = { PyString_AS_STRING(key), PyString_GET_SIZE(key),
                           incr_func, delta,
                           0 };
 
-    _PylibMC_IncrDecr(self, &incr, 1);
-
-    if(PyErr_Occurred() != NULL) {
-      /* exception already on the stack */
-      return NULL;
+    span = _PylibMC_TraceStart(self, &trace,
+            (incr_func == memcached_decrement) ? PYLIBMC_OP_DECR
+                                               : PYLIBMC_OP_INCR, key_obj);
+    if (!_PylibMC_IncrDecr(self, &incr, 1, -1, NULL)) {
+      if (PyErr_Occurred() != NULL) {
+        /* exception already on the stack */
+        retval = NULL;
+      } else {
+        /* skipped, its server being down */
+        Py_INCREF(Py_None);
+        retval = Py_None;
+      }
+    } else {
+      /* might be NULL, but if that's true then it's the right return value */
+      retval = PyLong_FromUnsignedLong((unsigned long)incr.result);
     }
+    Py_DECREF(key);
 
-    /* might be NULL, but if that's true then it's the right return value */
-    return PyLong_FromUnsignedLong((unsigned long)incr.result);
+    return _PylibMC_TraceEnd(self, span, retval);
 }
 
 static PyObject *_PylibMC_IncrMulti(PylibMC_Client *self,
@@ -878,15 +1546,24 @@ static PyObject *_PylibMC_IncrMulti(PylibMC_Client *self,
      and throws an exception on an error incrementing any key */
   PyObject* keys = NULL;
   PyObject* key_prefix = NULL;
+  PyObject* ns_prefix = NULL;
   PyObject* prefixed_keys = NULL;
+  PyObject* key_objs = NULL;
   PyObject* retval = NULL;
   PyObject* iterator = NULL;
+  PyObject* timeout_obj = NULL;
   unsigned int delta = 1;
+  double timeout;
+  size_t expired_at;
+  pylibmc_span trace, *span = NULL;
 
-  static char *kws[] = { "keys", "key_prefix", "delta", NULL };
+  static char *kws[] = { "keys", "key_prefix", "delta", "timeout", NULL };
 
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|SI", kws,
-                                   &keys, &key_prefix, &delta)) {
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|SIO", kws,
+                                   &keys, &key_prefix, &delta,
+                                   &timeout_obj)) {
+    return NULL;
+  } else if (!_PylibMC_ParseTimeout(timeout_obj, &timeout)) {
     return NULL;
   }
 
@@ -898,15 +1575,29 @@ static PyObject *_PylibMC_IncrMulti(PylibMC_Client *self,
     /* if it's 0-length, we can safely pretend it doesn't exist */
     key_prefix = NULL;
   }
-  if(key_prefix != NULL) {
-    if(!_PylibMC_CheckKey(key_prefix)) {
+  if(key_prefix != NULL && !_PylibMC_CheckKey(key_prefix)) {
+    return NULL;
+  }
+  if(key_prefix != NULL && _PylibMC_Namespaces(self) != NULL) {
+    ns_prefix = _PylibMC_NamespacePrefix(self,
+        PyString_AS_STRING(key_prefix), PyString_GET_SIZE(key_prefix));
+    if(ns_prefix == NULL) {
       return NULL;
     }
+    key_prefix = ns_prefix;
+  }
 
-    prefixed_keys = PyList_New(nkeys);
-    if(prefixed_keys == NULL) {
-      return NULL;
-    }
+  prefixed_keys = PyList_New(nkeys);
+  if(prefixed_keys == NULL) {
+    Py_XDECREF(ns_prefix);
+    return NULL;
+  }
+  /* the keys as given, to tell which weren't incremented in time */
+  key_objs = PyList_New(nkeys);
+  if(key_objs == NULL) {
+    Py_DECREF(prefixed_keys);
+    Py_XDECREF(ns_prefix);
+    return NULL;
   }
 
   pylibmc_incr* incrs = PyMem_New(pylibmc_incr, nkeys);
@@ -924,42 +1615,32 @@ static PyObject *_PylibMC_IncrMulti(PylibMC_Client *self,
 
   /* build our list of keys, prefixed as appropriate, and turn that
      into a list of pylibmc_incr objects that can be incred in one
-     go. We're not going to own references to the prefixed keys: so
+     go. We're not going to own references to the wire keys: so
      that we can free them all at once, we'll give ownership to a list
      of them (prefixed_keys) which we'll DECR once at the end */
   while((key = PyIter_Next(iterator)) != NULL) {
-    if(!_PylibMC_CheckKey(key)) goto loopcleanup;
-
-    if(key_prefix != NULL) {
-
-      PyObject* newkey = NULL;
-
-      newkey = PyString_FromFormat("%s%s",
-                                   PyString_AS_STRING(key_prefix),
-                                   PyString_AS_STRING(key));
-      if(!_PylibMC_CheckKey(newkey)) {
-        Py_XDECREF(newkey);
-        goto loopcleanup;
-      }
-
-      /* steals our reference */
-      if(PyList_SetItem(prefixed_keys, idx, newkey) == -1) {
-        /* it wasn't stolen before the error */
-        Py_DECREF(newkey);
-        goto loopcleanup;
-      }
+    PyObject* newkey = NULL;
 
-      /* the list stole our reference to it, and we're going to rely
-         on that list to maintain it while we release the GIL, but
-         since we DECREF the key in loopcleanup we need to INCREF it
-         here */
-      Py_DECREF(key);
-      Py_INCREF(newkey);
-      key = newkey;
+    if(idx >= nkeys) {
+      PyErr_SetString(PyExc_ValueError, "keys changed size during iteration");
+      goto loopcleanup;
     }
 
-    if(PyString_AsStringAndSize(key, &incrs[idx].key, &incrs[idx].key_len) == -1)
+    newkey = _PylibMC_WireKey(self, key,
+        key_prefix ? PyString_AS_STRING(key_prefix) : NULL,
+        key_prefix ? PyString_GET_SIZE(key_prefix) : 0);
+    if(newkey == NULL) {
       goto loopcleanup;
+    }
+
+    /* steals our reference; the list is what keeps the wire key alive
+       while we release the GIL */
+    PyList_SET_ITEM(prefixed_keys, idx, newkey);
+    Py_INCREF(key);
+    PyList_SET_ITEM(key_objs, idx, key);
+
+    incrs[idx].key = PyString_AS_STRING(newkey);
+    incrs[idx].key_len = PyString_GET_SIZE(newkey);
 
     incrs[idx].delta = delta;
     incrs[idx].incr_func = incr_func;
@@ -982,11 +1663,19 @@ loopcleanup:
   /* iteration error */
   if (PyErr_Occurred()) goto cleanup;
 
-  _PylibMC_IncrDecr(self, incrs, nkeys);
+  span = _PylibMC_TraceStart(self, &trace, PYLIBMC_OP_INCR_MULTI, NULL);
+  _PylibMC_IncrDecr(self, incrs, idx, timeout, &expired_at);
 
   /* if that failed, there's an exception on the stack */
   if(PyErr_Occurred()) goto cleanup;
 
+  if(expired_at < idx) {
+    Py_INCREF(Py_None);
+    retval = _PylibMC_DeadlineExceeded(
+        PyList_GetSlice(key_objs, expired_at, idx), Py_None);
+    goto cleanup;
+  }
+
   retval = Py_None;
   Py_INCREF(retval);
 
@@ -996,9 +1685,11 @@ cleanup:
   }
 
   Py_XDECREF(prefixed_keys);
+  Py_XDECREF(key_objs);
   Py_XDECREF(iterator);
+  Py_XDECREF(ns_prefix);
 
-  return retval;
+  return _PylibMC_TraceEnd(self, span, retval);
 }
 
 
@@ -1017,69 +1708,211 @@ static PyObject *PylibMC_Client_incr_multi(PylibMC_Client *self, PyObject *args,
 }
 
 static bool _PylibMC_IncrDecr(PylibMC_Client *self, pylibmc_incr *incrs,
-        size_t nkeys) {
+        size_t nkeys, double timeout, size_t *expired_at) {
 
-  bool error = false;
+  bool error = false, skipped = false;
   memcached_return rc = MEMCACHED_SUCCESS;
   _PylibMC_IncrCommand f = NULL;
   size_t i;
+  pylibmc_breakers *breakers;
+  pylibmc_replicas *replicas;
+  pylibmc_hotkeys *hotkeys;
+  pylibmc_hot_copies *hot = NULL;
+  pylibmc_async *prefetches;
+  uint32_t server = 0;
+  int down = -1;
+  double start = 0;
+  pylibmc_deadline dl;
+  int metered;
+  int op = PYLIBMC_OP_INCR_MULTI;
+  double began = 0;
+
+  if (!_PylibMC_ClientReady(self)) {
+    return false;
+  }
+  breakers = _PylibMC_Breakers(self);
+  replicas = _PylibMC_Replicas(self);
+  if ((metered = _PylibMC_Metered(self))) {
+    /* only incr_multi asks where a deadline stopped it */
+    if (expired_at == NULL && nkeys) {
+      op = (incrs[0].incr_func == memcached_decrement) ? PYLIBMC_OP_DECR
+                                                       : PYLIBMC_OP_INCR;
+    }
+    began = _PylibMC_Now();
+  }
+  if ((prefetches = _PylibMC_Prefetches(self)) != NULL) {
+    for (i = 0; i < nkeys; i++) {
+      _PylibMC_PrefetchForget(prefetches, incrs[i].key, incrs[i].key_len);
+    }
+  }
+
+  if ((hotkeys = _PylibMC_HotKeys(self)) != NULL && hotkeys->nhot) {
+    if ((hot = PyMem_New(pylibmc_hot_copies, nkeys)) == NULL) {
+      PyErr_NoMemory();
+      return false;
+    }
+    for (i = 0; i < nkeys; i++) {
+      _PylibMC_HotLookup(hotkeys, incrs[i].key, incrs[i].key_len, &hot[i]);
+    }
+  }
+
+  PYLIBMC_BEGIN_ALLOW_THREADS(self)
+  _PylibMC_DeadlineStart(self->mc, timeout, &dl);
+  if (dl.at >= 0) {
+    char **keys = malloc(sizeof(char *) * nkeys);
+    size_t *key_lens = malloc(sizeof(size_t) * nkeys);
+
+    if (keys != NULL && key_lens != NULL) {
+      for (i = 0; i < nkeys; i++) {
+        keys[i] = incrs[i].key;
+        key_lens[i] = incrs[i].key_len;
+      }
+      _PylibMC_DeadlineConnect(self->mc, &dl, keys, key_lens, nkeys);
+    }
+    free(keys);
+    free(key_lens);
+  }
 
-  Py_BEGIN_ALLOW_THREADS
   for(i = 0; i < nkeys && !error; i++) {
     pylibmc_incr *incr = &incrs[i];
     uint64_t result = 0;
     f = incr->incr_func;
+    if (!_PylibMC_DeadlineArm(self->mc, &dl)) {
+      break;
+    }
+    if (breakers != NULL || replicas != NULL || metered) {
+      server = memcached_generate_hash(self->mc, incr->key, incr->key_len);
+    }
+    if (breakers != NULL) {
+      start = _PylibMC_Now();
+      if (!_PylibMC_BreakerAllow(breakers, server, start)) {
+        skipped = true;
+        if (metered) {
+          _PylibMC_MeterKey(self, op, server, PYLIBMC_ERROR,
+                            0, incr->key_len);
+        }
+        if (!breakers->fallback) {
+          down = (int)server;
+          error = true;
+        }
+        continue;
+      }
+    }
     rc = f(self->mc, incr->key, incr->key_len, incr->delta, &result);
+    if (breakers != NULL) {
+      _PylibMC_BreakerRecord(breakers, server, _PylibMC_IsServerFailure(rc),
+                             _PylibMC_Now() - start);
+    }
+    if (metered) {
+      _PylibMC_MeterKey(self, op, server, _PylibMC_Outcome(rc),
+                        0, incr->key_len);
+    }
     if (rc == MEMCACHED_SUCCESS) {
       incr->result = result;
-    } else {
-      error = true;
+      /* There's no incrementing by key, so the replicas get the result. */
+      if (replicas != NULL) {
+        char value[24];
+        int value_len = snprintf(value, sizeof(value), "%llu",
+                                 (unsigned long long)result);
+
+        _PylibMC_ReplicaWrite(self->mc, replicas, breakers, server,
+                              memcached_set_by_key, incr->key, incr->key_len,
+                              value, value_len, 0, PYLIBMC_FLAG_INTEGER, 0);
+      }
+      /* copies of a hot counter are refilled by reads */
+      if (hot != NULL && hot[i].n) {
+        _PylibMC_HotFanOut(self->mc, &hot[i], incr->key, incr->key_len,
+                           NULL, 0, 0, 0, 0);
+      }
+    } else if (_PylibMC_IsServerFailure(rc) && _PylibMC_DeadlineCheck(&dl)) {
+      break;
+    } else {
+      error = true;
     }
   }
-  Py_END_ALLOW_THREADS
+  if (replicas != NULL) {
+    _PylibMC_ReplicaFlush(self->mc);
+  }
+  if (hot != NULL) {
+    memcached_flush_buffers(self->mc);
+  }
+  _PylibMC_DeadlineEnd(self->mc, &dl);
+  PYLIBMC_END_ALLOW_THREADS
+
+  PyMem_Free(hot);
+
+  if (metered) {
+    _PylibMC_Meter(self, op, (expired_at == NULL) ? server : UINT32_MAX,
+                   _PylibMC_Now() - began, -1, 0, 0);
+  }
+
+  if (expired_at != NULL) {
+    *expired_at = dl.expired ? i : nkeys;
+  }
 
-  if(error) {
+  if(down >= 0) {
+    _PylibMC_ServerDown(self, (uint32_t)down);
+    return false;
+  } else if(error) {
       char *fname = (f == memcached_decrement) ? "memcached_decrement"
                                                : "memcached_increment";
       PylibMC_ErrFromMemcached(self, fname, rc);
       return false;
   } else {
-    return true;
+    return !skipped;
   }
 }
 /* }}} */
 
 memcached_return pylibmc_memcached_fetch_multi(memcached_st* mc,
+                                               const char* master_key,
+                                               size_t master_key_len,
                                                char** keys,
                                                size_t nkeys,
                                                size_t* key_lens,
                                                pylibmc_mget_result* results,
                                                size_t* nresults,
-                                               char** err_func) {
+                                               size_t max_results,
+                                               char** err_func,
+                                               pylibmc_deadline* dl) {
 
   /* the part of PylibMC_Client_get_multi that does the blocking I/O
-     and can be called while not holding the GIL. Builds an
-     intermediate result set into 'results' that is turned into a
-     PyDict before being returned to the caller */
+     and can be called while not holding the GIL. Adds to the
+     intermediate result set in 'results' that is turned into a
+     PyDict before being returned to the caller. With a master_key,
+     all keys are asked of the server it maps to */
 
   memcached_return rc;
+  bool some_errors = false;
   char curr_key[MEMCACHED_MAX_KEY];
   size_t curr_key_len = 0;
   char* curr_value = NULL;
   size_t curr_value_len = 0;
   uint32_t curr_flags = 0;
 
-  *nresults = 0;
-
-  rc = memcached_mget(mc, (const char **)keys, key_lens, nkeys);
+  if (!_PylibMC_DeadlineArm(mc, dl)) {
+    *err_func = "memcached_mget";
+    return MEMCACHED_TIMEOUT;
+  }
+  if (master_key != NULL) {
+    rc = memcached_mget_by_key(mc, master_key, master_key_len,
+                               (const char **)keys, key_lens, nkeys);
+  } else {
+    rc = memcached_mget(mc, (const char **)keys, key_lens, nkeys);
+  }
 
-  if(rc != MEMCACHED_SUCCESS) {
+  if(rc == MEMCACHED_SOME_ERRORS) {
+    /* the servers that did get the request still answer it, and that's
+       worth having when there are replicas to fill in for the others */
+    some_errors = true;
+  } else if(rc != MEMCACHED_SUCCESS) {
     *err_func = "memcached_mget";
-    return rc;
+    return _PylibMC_DeadlineCheck(dl) ? MEMCACHED_TIMEOUT : rc;
   }
 
-  while((curr_value = memcached_fetch(mc, curr_key, &curr_key_len,
-                                      &curr_value_len, &curr_flags, &rc))
+  while(_PylibMC_DeadlineArm(mc, dl)
+        && (curr_value = memcached_fetch(mc, curr_key, &curr_key_len,
+                                         &curr_value_len, &curr_flags, &rc))
         != NULL) {
     if(curr_value == NULL && rc == MEMCACHED_END) {
       return MEMCACHED_SUCCESS;
@@ -1089,6 +1922,9 @@ memcached_return pylibmc_memcached_fetch_multi(memcached_st* mc,
     } else if (rc != MEMCACHED_SUCCESS) {
       *err_func = "memcached_fetch";
       return rc;
+    } else if (*nresults == max_results) {
+      /* more replies than keys asked for; we've no room for them */
+      free(curr_value);
     } else {
       pylibmc_mget_result r = {"",
                                curr_key_len,
@@ -1102,28 +1938,130 @@ memcached_return pylibmc_memcached_fetch_multi(memcached_st* mc,
     }
   }
 
+  /* a fetch that ran out of time looks just like the end of the results */
+  if (dl->expired || (rc != MEMCACHED_END && _PylibMC_DeadlineCheck(dl))) {
+    *err_func = "memcached_fetch";
+    return MEMCACHED_TIMEOUT;
+  } else if (some_errors) {
+    *err_func = "memcached_mget";
+    return MEMCACHED_SOME_ERRORS;
+  }
+
   return MEMCACHED_SUCCESS;
 }
 
+/* Note in key_map that key asks for wire. When keys that aren't equal ask
+ * for the same wire key, like a Key and a str with its prefix as
+ * key_prefix, wire's entry becomes a list of them all, and each of them
+ * gets the value. */
+static int _PylibMC_MapKey(PyObject *key_map, PyObject *wire, PyObject *key) {
+    PyObject *had, *keys;
+    int same, rc;
+
+    if ((had = PyDict_GetItem(key_map, wire)) == NULL) {
+        return PyDict_SetItem(key_map, wire, key);
+    } else if (PyList_Check(had)) {
+        if ((same = PySequence_Contains(had, key)) != 0) {
+            return (same == 1) ? 0 : -1;
+        }
+        return PyList_Append(had, key);
+    } else if ((same = PyObject_RichCompareBool(had, key, Py_EQ)) != 0) {
+        return (same == 1) ? 0 : -1;
+    } else if ((keys = PyList_New(2)) == NULL) {
+        return -1;
+    }
+
+    Py_INCREF(had);
+    PyList_SET_ITEM(keys, 0, had);
+    Py_INCREF(key);
+    PyList_SET_ITEM(keys, 1, key);
+    rc = PyDict_SetItem(key_map, wire, keys);
+    Py_DECREF(keys);
+    return rc;
+}
+
+/* A key_map of the wire keys so far, n of them at keys and ndown at down,
+ * none of them mapped: they're the keys as given with prefix_len bytes of
+ * key_prefix in front. */
+static PyObject *_PylibMC_NewKeyMap(PyObject **keys, size_t n,
+        PyObject **down, size_t ndown, Py_ssize_t prefix_len) {
+    PyObject *key_map, *key;
+    size_t j;
+    int rc;
+
+    if ((key_map = PyDict_New()) == NULL) {
+        return NULL;
+    }
+    for (j = 0; j < n + ndown; j++) {
+        PyObject *wire = (j < n) ? keys[j] : down[j - n];
+
+        key = PyString_FromStringAndSize(PyString_AS_STRING(wire) + prefix_len,
+                PyString_GET_SIZE(wire) - prefix_len);
+        rc = (key == NULL) ? -1 : _PylibMC_MapKey(key_map, wire, key);
+        Py_XDECREF(key);
+        if (rc == -1) {
+            Py_DECREF(key_map);
+            return NULL;
+        }
+    }
+    return key_map;
+}
+
+/* Set dict's item for key_obj, a key_map entry, to val. */
+static int _PylibMC_MapStore(PyObject *dict, PyObject *key_obj,
+        PyObject *val) {
+    Py_ssize_t i;
+
+    if (!PyList_Check(key_obj)) {
+        return PyDict_SetItem(dict, key_obj, val);
+    }
+    for (i = 0; i < PyList_GET_SIZE(key_obj); i++) {
+        if (PyDict_SetItem(dict, PyList_GET_ITEM(key_obj, i), val) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
 
 static PyObject *PylibMC_Client_get_multi(PylibMC_Client *self, PyObject *args,
         PyObject *kwds) {
-    PyObject *key_seq, **key_objs, *retval = NULL;
+    PyObject *key_seq, **key_objs, *key_map = NULL, *retval = NULL;
+    PyObject *ns_prefix = NULL;
     char **keys, *prefix = NULL;
     pylibmc_mget_result* results = NULL;
+    pylibmc_engine_sink sink;
+    pylibmc_lanes *lanes;
+    pylibmc_async *prefetches;
+    PyObject *served = NULL;
+    char *slab = NULL;
+    size_t nslab = 0, nserved = 0;
+    int engine;
     Py_ssize_t prefix_len = 0;
     Py_ssize_t i;
     PyObject *key_it, *ckey;
     size_t *key_lens;
-    size_t nkeys, nresults = 0;
+    size_t nkeys, nresults = 0, skipped = 0, ndown = 0, nasked;
     memcached_return rc;
-
-    char** err_func = NULL;
-
-    static char *kws[] = { "keys", "key_prefix", NULL };
-
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|s#", kws,
-            &key_seq, &prefix, &prefix_len)) {
+    pylibmc_breakers *breakers;
+    pylibmc_replicas *replicas;
+    pylibmc_hotkeys *hotkeys;
+    pylibmc_deadline dl;
+    PyObject *timeout_obj = NULL;
+    double timeout, now = 0, began = 0, until = -1;
+    unsigned char *pending = NULL;
+    int metered;
+    pylibmc_span trace, *span = NULL;
+
+    char* err_func = NULL;
+
+    static char *kws[] = { "keys", "key_prefix", "timeout", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|s#O", kws,
+            &key_seq, &prefix, &prefix_len, &timeout_obj)) {
+        return NULL;
+    } else if (!_PylibMC_ParseTimeout(timeout_obj, &timeout)) {
+        return NULL;
+    } else if (!_PylibMC_ClientReady(self)) {
         return NULL;
     }
 
@@ -1131,6 +2069,17 @@ static PyObject *PylibMC_Client_get_multi(PylibMC_Client *self, PyObject *args,
         return NULL;
     }
 
+    /* A namespace's generation goes into the prefix, and comes off the
+     * keys of the results with it. */
+    if (prefix_len && _PylibMC_Namespaces(self) != NULL) {
+        if ((ns_prefix = _PylibMC_NamespacePrefix(self, prefix,
+                                                  prefix_len)) == NULL) {
+            return NULL;
+        }
+        prefix = PyString_AS_STRING(ns_prefix);
+        prefix_len = PyString_GET_SIZE(ns_prefix);
+    }
+
     /* this is over-allocating in the majority of cases */
     results = PyMem_New(pylibmc_mget_result, nkeys);
 
@@ -1144,6 +2093,7 @@ static PyObject *PylibMC_Client_get_multi(PylibMC_Client *self, PyObject *args,
         PyMem_Free(keys);
         PyMem_Free(key_lens);
         PyMem_Free(key_objs);
+        Py_XDECREF(ns_prefix);
         return PyErr_NoMemory();
     }
 
@@ -1151,42 +2101,158 @@ static PyObject *PylibMC_Client_get_multi(PylibMC_Client *self, PyObject *args,
      * exceptions as a loop predicate. */
     PyErr_Clear();
 
+    if ((breakers = _PylibMC_Breakers(self)) != NULL) {
+        now = _PylibMC_Now();
+    }
+    replicas = _PylibMC_Replicas(self);
+    span = _PylibMC_TraceStart(self, &trace, PYLIBMC_OP_GET_MULTI, NULL);
+    if ((metered = _PylibMC_Metered(self))) {
+        began = _PylibMC_Now();
+    }
+    if ((prefetches = _PylibMC_Prefetches(self)) != NULL && timeout >= 0) {
+        until = _PylibMC_Now() + timeout;
+    }
+
     /* Iterate through all keys and set lengths etc. */
     i = 0;
     key_it = PyObject_GetIter(key_seq);
-    while (!PyErr_Occurred()
-            && i < nkeys
+    while (key_it != NULL
+            && !PyErr_Occurred()
+            && i + skipped + nserved + ndown < nkeys
             && (ckey = PyIter_Next(key_it)) != NULL) {
         PyObject *rkey;
+        Py_ssize_t at = i;
+        int mapped;
 
-        if (!_PylibMC_CheckKey(ckey)) {
+        rkey = _PylibMC_WireKey(self, ckey, prefix, prefix_len);
+        if (rkey == NULL) {
+            Py_DECREF(ckey);
             break;
-        } else {
-            key_lens[i] = (size_t)(PyString_GET_SIZE(ckey) + prefix_len);
-            if (prefix != NULL) {
-                rkey = PyString_FromFormat("%s%s",
-                        prefix, PyString_AS_STRING(ckey));
+        }
+        /* Key objects carry their own prefix, and hashed keys are shorter
+         * than prefix and key together, so their replies can't be mapped
+         * back by stripping key_prefix off. */
+        mapped = PylibMC_Key_Check(ckey) || PyString_GET_SIZE(rkey)
+                 != prefix_len + PyString_GET_SIZE(ckey);
+
+        /* Keys a prefetch got aren't asked for. */
+        if (prefetches != NULL) {
+            PyObject *val, *key_obj;
+            int found = _PylibMC_PrefetchTake(self, prefetches, rkey, until,
+                                              &val);
+            int ok = 1;
+
+            if (found == 1) {
+                if (mapped) {
+                    Py_INCREF(ckey);
+                    key_obj = ckey;
+                } else {
+                    key_obj = PyString_FromStringAndSize(
+                            PyString_AS_STRING(rkey) + prefix_len,
+                            PyString_GET_SIZE(rkey) - prefix_len);
+                }
+                ok = (key_obj != NULL
+                      && (served != NULL || (served = PyDict_New()) != NULL)
+                      && PyDict_SetItem(served, key_obj, val) == 0);
+                Py_XDECREF(key_obj);
+                Py_DECREF(val);
+            }
+            if (found != -1) {
+                Py_DECREF(rkey);
                 Py_DECREF(ckey);
+                if (!ok) {
+                    break;
+                }
+                nserved++;
+                continue;
+            }
+        }
+
+        /* Keys of servers with open breakers are misses, or fail it all,
+         * unless there are replicas to ask. */
+        if (breakers != NULL) {
+            uint32_t server = _PylibMC_ServerIndex(self, ckey, rkey);
+
+            if (!_PylibMC_BreakerOpen(breakers, server, now)) {
+                /* ask it */
+            } else if (replicas != NULL) {
+                /* Keys of servers that are down go at the end, where
+                 * only their replicas are asked for them. */
+                at = nkeys - ++ndown;
             } else {
-                rkey = ckey;
+                Py_DECREF(rkey);
+                Py_DECREF(ckey);
+                if (!breakers->fallback) {
+                    _PylibMC_ServerDown(self, server);
+                    break;
+                }
+                skipped++;
+                continue;
             }
-            keys[i] = PyString_AS_STRING(rkey);
-            key_objs[i++] = rkey;
+        }
+
+        /* Once there's a key_map, every key goes into it, so that keys
+         * asking for the same wire key all get its value. */
+        if (mapped && key_map == NULL) {
+            size_t down = ndown - (at != i);
+
+            key_map = _PylibMC_NewKeyMap(key_objs, i,
+                                         key_objs + nkeys - down, down,
+                                         prefix_len);
+        }
+        if ((mapped && key_map == NULL) || (key_map != NULL
+                && _PylibMC_MapKey(key_map, rkey, ckey) == -1)) {
+            Py_DECREF(rkey);
+            Py_DECREF(ckey);
+            ndown -= (at != i);
+            break;
+        }
+        Py_DECREF(ckey);
+
+        key_lens[at] = (size_t)PyString_GET_SIZE(rkey);
+        keys[at] = PyString_AS_STRING(rkey);
+        key_objs[at] = rkey;
+        if (at == i) {
+            i++;
         }
     }
     Py_XDECREF(key_it);
 
-    if (nkeys != 0 && i != nkeys) {
+    if (PyErr_Occurred() || i + skipped + nserved + ndown != nkeys) {
         /* There were keys given, but some keys didn't pass validation. */
-        nkeys = 0;
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_ValueError,
+                    "keys changed size during iteration");
+        }
+        /* only the keys at either end are there to let go of */
+        memmove(key_objs + i, key_objs + nkeys - ndown,
+                sizeof(PyObject *) * ndown);
+        nkeys = i + ndown;
         goto cleanup;
-    } else if (nkeys == 0) {
-        retval = PyDict_New();
+    }
+
+    /* Skipping and moving keys to the end don't go together, but keys
+     * served by prefetches can leave a gap before the keys at the end. */
+    if (nserved && ndown) {
+        memmove(keys + i, keys + nkeys - ndown, sizeof(char *) * ndown);
+        memmove(key_lens + i, key_lens + nkeys - ndown,
+                sizeof(size_t) * ndown);
+        memmove(key_objs + i, key_objs + nkeys - ndown,
+                sizeof(PyObject *) * ndown);
+    }
+    if ((nkeys = i + ndown) == 0) {
+        retval = (served != NULL) ? served : PyDict_New();
+        served = NULL;
         goto earlybird;
-    } else if (PyErr_Occurred()) {
-        nkeys--;
-        goto cleanup;
     }
+    /* what waiting on prefetches took is out of the call's time */
+    if (until >= 0) {
+        timeout = until - _PylibMC_Now();
+        timeout = (timeout > 0) ? timeout : 0;
+    }
+    nasked = i;
+    engine = self->cluster->read_engine;
+    lanes = (engine == PYLIBMC_ENGINE_EPOLL) ? _PylibMC_Lanes(self) : NULL;
 
     /* TODO Make an iterator interface for getting each key separately.
      *
@@ -1194,174 +2260,202 @@ static PyObject *PylibMC_Client_get_multi(PylibMC_Client *self, PyObject *args,
      * the data at once isn't needed. (Should probably look into if it's even
      * worth it.)
      */
-    Py_BEGIN_ALLOW_THREADS
-    rc = pylibmc_memcached_fetch_multi(self->mc,
-                                       keys, nkeys, key_lens,
-                                       results,
-                                       &nresults,
-                                       err_func);
-    Py_END_ALLOW_THREADS
+    PYLIBMC_BEGIN_ALLOW_THREADS(self)
+    _PylibMC_DeadlineStart(self->mc, timeout, &dl);
+    _PylibMC_DeadlineConnect(self->mc, &dl, keys, key_lens, nasked);
+    sink.results = results;
+    sink.nresults = 0;
+    sink.max_results = nkeys;
+    sink.slab = NULL;
+    sink.slab_len = sink.slab_size = 0;
+    if (!nasked) {
+        rc = MEMCACHED_SUCCESS;
+    } else if (engine == PYLIBMC_ENGINE_EPOLL
+            && _PylibMC_EngineFetch(self->mc, lanes, keys, key_lens, NULL,
+                                    nasked, &sink, &err_func, &rc, &dl)) {
+        /* the first results' values are all in the slab */
+        nresults = nslab = sink.nresults;
+        slab = sink.slab;
+    } else {
+        rc = pylibmc_memcached_fetch_multi(self->mc, NULL, 0,
+                                           keys, nasked, key_lens,
+                                           results, &nresults, nkeys,
+                                           &err_func, &dl);
+    }
+    /* Whatever the primaries didn't come up with, their replicas might. */
+    if (replicas != NULL && !dl.expired) {
+        _PylibMC_ReplicaGetMulti(self->mc, replicas, breakers,
+                                 keys, key_lens, nkeys,
+                                 results, &nresults, &dl);
+        rc = dl.expired ? MEMCACHED_TIMEOUT : MEMCACHED_SUCCESS;
+    }
+    /* Note which servers never finished answering before they're reset;
+     * if the request didn't even go out, none of them did. */
+    if (dl.expired
+            && (err_func == NULL || strcmp(err_func, "memcached_mget"))) {
+        pending = _PylibMC_DeadlinePending(self->mc);
+    }
+    _PylibMC_DeadlineEnd(self->mc, &dl);
+    PYLIBMC_END_ALLOW_THREADS
+
+    if (metered) {
+      _PylibMC_MeterGetMulti(self, keys, key_lens, nkeys,
+                             results, nresults, skipped,
+                             rc != MEMCACHED_SUCCESS || dl.expired,
+                             _PylibMC_Now() - began);
+    }
 
-    if(rc != MEMCACHED_SUCCESS) {
-      PylibMC_ErrFromMemcached(self, *err_func, rc);
+    if(rc != MEMCACHED_SUCCESS && !dl.expired) {
+      PylibMC_ErrFromMemcached(self, err_func, rc);
       goto cleanup;
     }
 
     retval = PyDict_New();
+    if (retval == NULL
+        || (served != NULL && PyDict_Update(retval, served) == -1)) {
+      goto cleanup;
+    }
+    hotkeys = _PylibMC_HotKeys(self);
 
     for(i = 0; i<nresults; i++) {
-      PyObject *val;
+      PyObject *val, *key_obj = NULL;
+      int set_rc;
 
       /* This is safe because libmemcached's max key length
        * includes space for a NUL-byte. */
       results[i].key[results[i].key_len] = 0;
+      if (hotkeys != NULL) {
+        _PylibMC_HotKeySample(hotkeys, self->mc, results[i].key,
+                              results[i].key_len, results[i].value_len);
+      }
       val = _PylibMC_parse_memcached_value(results[i].value,
                                            results[i].value_len,
-                                           results[i].flags);
+                                           results[i].flags, self);
       if (val == NULL) {
         /* PylibMC_parse_memcached_value raises the exception on its
            own */
         goto cleanup;
       }
-      PyDict_SetItemString(retval, results[i].key + prefix_len,
-                           val);
+
+      if (key_map != NULL) {
+        PyObject *wire_key = PyString_FromStringAndSize(results[i].key,
+                                                        results[i].key_len);
+        if (wire_key == NULL) {
+          Py_DECREF(val);
+          goto cleanup;
+        }
+        key_obj = PyDict_GetItem(key_map, wire_key);
+        Py_DECREF(wire_key);
+      }
+
+      if (key_obj != NULL) {
+        set_rc = _PylibMC_MapStore(retval, key_obj, val);
+      } else {
+        set_rc = PyDict_SetItemString(retval, results[i].key + prefix_len,
+                                      val);
+      }
       Py_DECREF(val);
 
-      if(PyErr_Occurred()) {
-        /* only PyDict_SetItemString can incur this one */
+      if(set_rc == -1) {
+        goto cleanup;
+      }
+    }
+
+    if (dl.expired) {
+      PyObject *unserved = PyList_New(0);
+
+      /* keys we got no reply for, and whose server hadn't answered yet */
+      for (i = 0; unserved != NULL && i < nkeys; i++) {
+        PyObject *wire_key = key_objs[i];
+        PyObject *key_obj = NULL;
+        uint32_t server;
+        int has;
+
+        if (key_map != NULL) {
+          key_obj = PyDict_GetItem(key_map, wire_key);
+        }
+        if (key_obj != NULL) {
+          Py_INCREF(key_obj);
+        } else {
+          key_obj = PyString_FromStringAndSize(
+              PyString_AS_STRING(wire_key) + prefix_len,
+              PyString_GET_SIZE(wire_key) - prefix_len);
+          if (key_obj == NULL) {
+            Py_CLEAR(unserved);
+            break;
+          }
+        }
+        server = memcached_generate_hash(self->mc, keys[i], key_lens[i]);
+        if (PyList_Check(key_obj)) {
+          /* keys sharing a wire key got its value all or none */
+          has = PyDict_Contains(retval, PyList_GET_ITEM(key_obj, 0));
+          if (has == -1 || (!has && (pending == NULL || pending[server])
+                            && PyList_SetSlice(unserved,
+                                   PyList_GET_SIZE(unserved),
+                                   PyList_GET_SIZE(unserved), key_obj) == -1)) {
+            Py_CLEAR(unserved);
+          }
+        } else {
+          has = PyDict_Contains(retval, key_obj);
+          if (has == -1 || (!has && (pending == NULL || pending[server])
+                            && PyList_Append(unserved, key_obj) == -1)) {
+            Py_CLEAR(unserved);
+          }
+        }
+        Py_DECREF(key_obj);
+      }
+      if (unserved == NULL) {
         goto cleanup;
       }
+      /* always NULL, the exception owning what we had */
+      retval = _PylibMC_DeadlineExceeded(unserved, retval);
+      goto cleanup;
     }
 
 earlybird:
+    free(pending);
     PyMem_Free(key_lens);
     PyMem_Free(keys);
     for (i = 0; i < nkeys; i++) {
         Py_DECREF(key_objs[i]);
     }
     if(results != NULL){
-        for (i = 0; i < nresults; i++) {
+        for (i = nslab; i < nresults; i++) {
             /* libmemcached mallocs, so we need to free its memory in
                the same way */
             free(results[i].value);
         }
         PyMem_Free(results);
     }
+    free(slab);
     PyMem_Free(key_objs);
+    Py_XDECREF(key_map);
+    Py_XDECREF(served);
+    Py_XDECREF(ns_prefix);
 
     /* Not INCREFing because the only two outcomes are NULL and a new dict.
      * We're the owner of that dict already, so. */
-    return retval;
+    return _PylibMC_TraceEnd(self, span, retval);
 
 cleanup:
     Py_XDECREF(retval);
+    free(pending);
     PyMem_Free(key_lens);
     PyMem_Free(keys);
     for (i = 0; i < nkeys; i++)
         Py_DECREF(key_objs[i]);
     if(results != NULL){
-        for (i = 0; i < nresults; i++) {
+        for (i = nslab; i < nresults; i++) {
             free(results[i].value);
         }
         PyMem_Free(results);
     }
+    free(slab);
     PyMem_Free(key_objs);
-    return NULL;
-}
-
-/**
- * Run func over every item in value, building arguments of:
- *     *(item + extra_args)
- */
-static PyObject *_PylibMC_DoMulti(PyObject *values, PyObject *func,
-        PyObject *prefix, PyObject *extra_args) {
-    /* TODO: acquire/release the GIL only once per DoMulti rather than
-       once per action; fortunately this is only used for
-       delete_multi, which isn't used very often */
-
-    PyObject *retval = PyList_New(0);
-    PyObject *iter = NULL;
-    PyObject *item = NULL;
-    int is_mapping = PyMapping_Check(values);
-
-    if (retval == NULL)
-        goto error;
-
-    if ((iter = PyObject_GetIter(values)) == NULL)
-        goto error;
-
-    while ((item = PyIter_Next(iter)) != NULL) {
-        PyObject *args_f = NULL;
-        PyObject *args = NULL;
-        PyObject *key = NULL;
-        PyObject *ro = NULL;
-
-        /* Calculate key. */
-        if (prefix == NULL || prefix == Py_None) {
-            /* We now have two owned references to item. */
-            key = item;
-            Py_INCREF(key);
-        } else {
-            key = PySequence_Concat(prefix, item);
-        }
-        if (key == NULL || !_PylibMC_CheckKey(key))
-            goto iter_error;
-
-        /* Calculate args. */
-        if (is_mapping) {
-            PyObject *value;
-            char *key_str = PyString_AS_STRING(item);
-
-            if ((value = PyMapping_GetItemString(values, key_str)) == NULL)
-                goto iter_error;
-
-            args = PyTuple_Pack(2, key, value);
-            Py_DECREF(value);
-        } else {
-            args = PyTuple_Pack(1, key);
-        }
-        if (args == NULL)
-            goto iter_error;
-
-        /* Calculate full argument tuple. */
-        if (extra_args == NULL) {
-            Py_INCREF(args);
-            args_f = args;
-        } else {
-            if ((args_f = PySequence_Concat(args, extra_args)) == NULL)
-                goto iter_error;
-        }
-
-        /* Call stuff. */
-        ro = PyObject_CallObject(func, args_f);
-        /* This is actually safe even if True got deleted because we're
-         * only comparing addresses. */
-        Py_XDECREF(ro);
-        if (ro == NULL) {
-            goto iter_error;
-        } else if (ro != Py_True) {
-            if (PyList_Append(retval, item) != 0)
-                goto iter_error;
-        }
-        Py_DECREF(args_f);
-        Py_DECREF(args);
-        Py_DECREF(key);
-        Py_DECREF(item);
-        continue;
-iter_error:
-        Py_XDECREF(args_f);
-        Py_XDECREF(args);
-        Py_XDECREF(key);
-        Py_DECREF(item);
-        goto error;
-    }
-    Py_DECREF(iter);
-
-    return retval;
-error:
-    Py_XDECREF(retval);
-    Py_XDECREF(iter);
-    return NULL;
+    Py_XDECREF(key_map);
+    Py_XDECREF(served);
+    Py_XDECREF(ns_prefix);
+    return _PylibMC_TraceEnd(self, span, NULL);
 }
 
 static PyObject *PylibMC_Client_set_multi(PylibMC_Client *self, PyObject *args,
@@ -1378,71 +2472,258 @@ static PyObject *PylibMC_Client_add_multi(PylibMC_Client *self, PyObject *args,
 
 static PyObject *PylibMC_Client_delete_multi(PylibMC_Client *self,
         PyObject *args, PyObject *kwds) {
-    PyObject *prefix = NULL;
-    PyObject *time = NULL;
-    PyObject *delete;
-    PyObject *keys;
-    PyObject *call_args;
-    PyObject *retval;
-
-    static char *kws[] = { "keys", "time", "key_prefix", NULL };
-
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O!S", kws,
-                &keys, &PyInt_Type, &time, &prefix))
+    PyObject *keys, *key_seq, *key_strs = NULL, *retval = NULL;
+    PyObject *timeout_obj = NULL, *ns_prefix = NULL;
+    char *prefix = NULL;
+    Py_ssize_t prefix_len = 0;
+    unsigned int time = 0;
+    double timeout;
+    Py_ssize_t i, nkeys;
+    memcached_return rc = MEMCACHED_SUCCESS;
+    pylibmc_breakers *breakers;
+    pylibmc_replicas *replicas;
+    pylibmc_hotkeys *hotkeys;
+    pylibmc_hot_copies *hot = NULL;
+    pylibmc_async *prefetches;
+    pylibmc_deadline dl;
+    char **wire_keys = NULL;
+    size_t *wire_lens = NULL;
+    uint32_t server = 0;
+    int down = -1;
+    double start = 0;
+    bool allsuccess = true, error = false;
+    int metered;
+    double began = 0;
+    pylibmc_span trace, *span = NULL;
+    unsigned char noreply = 0;
+    uint64_t noreply_saved[2];
+
+    static char *kws[] = { "keys", "time", "key_prefix", "timeout",
+                           "noreply", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|Is#Ob", kws,
+                &keys, &time, &prefix, &prefix_len, &timeout_obj,
+                &noreply)) {
+        return NULL;
+    } else if (!_PylibMC_ParseTimeout(timeout_obj, &timeout)) {
         return NULL;
+    }
 
-    /**
-     * Because of how DoMulti works, we have to prohibit the use of mappings
-     * here. Otherwise, the values of the mapping will be the second argument
-     * to the delete function; the time argument will then become a third
-     * argument, which delete doesn't take.
-     *
-     * So a mapping to DoMulti would produce calls like:
-     *   DoMulti({"a": 1, "b": 2}, time=3)
-     *      delete("a", 1, 3)
-     *      delete("b", 2, 3)
-     */
+    /* A mapping would iterate over its keys just fine, but it's far more
+     * likely to be a mistake for set_multi than a wish to delete its keys. */
     if (PyMapping_Check(keys)) {
         PyErr_SetString(PyExc_TypeError,
             "keys must be a sequence, not a mapping");
         return NULL;
     }
 
-    if ((delete = PyObject_GetAttrString((PyObject *)self, "delete")) == NULL)
+    if (!_PylibMC_ClientReady(self)) {
+        return NULL;
+    } else if (prefix_len && _PylibMC_Namespaces(self) != NULL) {
+        if ((ns_prefix = _PylibMC_NamespacePrefix(self, prefix,
+                                                  prefix_len)) == NULL) {
+            return NULL;
+        }
+        prefix = PyString_AS_STRING(ns_prefix);
+        prefix_len = PyString_GET_SIZE(ns_prefix);
+    }
+    if ((key_seq = PySequence_Fast(keys, "keys must be a sequence"))
+            == NULL) {
+        Py_XDECREF(ns_prefix);
         return NULL;
+    }
 
-    if (time == NULL) {
-        retval = _PylibMC_DoMulti(keys, delete, prefix, NULL);
-    } else {
-        if ((call_args = PyTuple_Pack(1, time)) == NULL)
-            goto error;
-        retval = _PylibMC_DoMulti(keys, delete, prefix, call_args);
-        Py_DECREF(call_args);
+    nkeys = PySequence_Fast_GET_SIZE(key_seq);
+    key_strs = PyList_New(nkeys);
+    wire_keys = PyMem_New(char *, nkeys);
+    wire_lens = PyMem_New(size_t, nkeys);
+    if (key_strs == NULL || wire_keys == NULL || wire_lens == NULL) {
+        PyErr_NoMemory();
+        goto cleanup;
     }
-    Py_DECREF(delete);
 
-    if (retval == NULL)
-        return NULL;
+    for (i = 0; i < nkeys; i++) {
+        PyObject *key = _PylibMC_WireKey(self,
+                PySequence_Fast_GET_ITEM(key_seq, i), prefix, prefix_len);
 
-    if (PyList_Size(retval) == 0) {
-        Py_DECREF(retval);
-        retval = Py_True;
+        if (key == NULL) {
+            goto cleanup;
+        }
+        /* the list keeps the wire keys alive while we release the GIL */
+        PyList_SET_ITEM(key_strs, i, key);
+        wire_keys[i] = PyString_AS_STRING(key);
+        wire_lens[i] = PyString_GET_SIZE(key);
+    }
+
+    breakers = _PylibMC_Breakers(self);
+    replicas = _PylibMC_Replicas(self);
+    span = _PylibMC_TraceStart(self, &trace, PYLIBMC_OP_DELETE_MULTI, NULL);
+    if ((metered = _PylibMC_Metered(self))) {
+        began = _PylibMC_Now();
+    }
+    if ((prefetches = _PylibMC_Prefetches(self)) != NULL) {
+        for (i = 0; i < nkeys; i++) {
+            _PylibMC_PrefetchForget(prefetches, wire_keys[i], wire_lens[i]);
+        }
+    }
+
+    if ((hotkeys = _PylibMC_HotKeys(self)) != NULL && hotkeys->nhot) {
+        if ((hot = PyMem_New(pylibmc_hot_copies, nkeys)) == NULL) {
+            PyErr_NoMemory();
+            goto cleanup;
+        }
+        for (i = 0; i < nkeys; i++) {
+            _PylibMC_HotLookup(hotkeys, wire_keys[i], wire_lens[i], &hot[i]);
+        }
+    }
+
+    PYLIBMC_BEGIN_ALLOW_THREADS(self)
+    _PylibMC_DeadlineStart(self->mc, timeout, &dl);
+    _PylibMC_DeadlineConnect(self->mc, &dl, wire_keys, wire_lens, nkeys);
+    if (noreply) {
+        _PylibMC_NoReplyStart(self->mc, noreply_saved);
+    }
+
+    for (i = 0; i < nkeys && !error; i++) {
+        if (!_PylibMC_DeadlineArm(self->mc, &dl)) {
+            break;
+        }
+
+        /* copies of hot keys go whatever happens to the keys */
+        if (hot != NULL && hot[i].n) {
+            _PylibMC_HotFanOut(self->mc, &hot[i], wire_keys[i], wire_lens[i],
+                               NULL, 0, 0, 0, 0);
+        }
+        if (breakers != NULL || replicas != NULL || metered) {
+            server = memcached_generate_hash(self->mc,
+                                             wire_keys[i], wire_lens[i]);
+        }
+        if (breakers != NULL) {
+            start = _PylibMC_Now();
+            if (!_PylibMC_BreakerAllow(breakers, server, start)) {
+                if (replicas != NULL && _PylibMC_ReplicaWrite(self->mc,
+                            replicas, breakers, server, NULL, wire_keys[i],
+                            wire_lens[i], NULL, 0, time, 0, 1)) {
+                    if (metered) {
+                        _PylibMC_MeterKey(self, PYLIBMC_OP_DELETE_MULTI,
+                                server, PYLIBMC_HIT, 0, wire_lens[i]);
+                    }
+                    continue;
+                }
+                allsuccess = false;
+                if (metered) {
+                    _PylibMC_MeterKey(self, PYLIBMC_OP_DELETE_MULTI,
+                            server, PYLIBMC_ERROR, 0, wire_lens[i]);
+                }
+                if (!breakers->fallback) {
+                    down = (int)server;
+                    error = true;
+                }
+                continue;
+            }
+        }
+
+        rc = memcached_delete(self->mc, wire_keys[i], wire_lens[i], time);
+        if (rc == MEMCACHED_BUFFERED) {
+            rc = MEMCACHED_SUCCESS;
+        }
+        if (breakers != NULL) {
+            _PylibMC_BreakerRecord(breakers, server,
+                                   _PylibMC_IsServerFailure(rc),
+                                   _PylibMC_Now() - start);
+        }
+        if (replicas != NULL && (rc == MEMCACHED_SUCCESS
+                    || rc == MEMCACHED_NOTFOUND
+                    || _PylibMC_IsServerFailure(rc))) {
+            if (_PylibMC_ReplicaWrite(self->mc, replicas, breakers, server,
+                        NULL, wire_keys[i], wire_lens[i], NULL, 0, time, 0,
+                        _PylibMC_IsServerFailure(rc))
+                    && _PylibMC_IsServerFailure(rc) && !dl.expired) {
+                rc = MEMCACHED_SUCCESS;
+            }
+        }
+        if (metered) {
+            _PylibMC_MeterKey(self, PYLIBMC_OP_DELETE_MULTI, server,
+                              _PylibMC_Outcome(rc), 0, wire_lens[i]);
+        }
+
+        if (_PylibMC_IsServerFailure(rc) && _PylibMC_DeadlineCheck(&dl)) {
+            break;
+        }
+
+        switch (rc) {
+            case MEMCACHED_SUCCESS:
+                break;
+            case MEMCACHED_FAILURE:
+            case MEMCACHED_NOTFOUND:
+            case MEMCACHED_NO_KEY_PROVIDED:
+            case MEMCACHED_BAD_KEY_PROVIDED:
+                allsuccess = false;
+                break;
+            default:
+                error = true;
+        }
+    }
+    if (replicas != NULL) {
+        _PylibMC_ReplicaFlush(self->mc);
+    }
+    if (hot != NULL) {
+        memcached_flush_buffers(self->mc);
+    }
+    if (noreply) {
+        memcached_return flushed = _PylibMC_NoReplyEnd(self->mc,
+                noreply_saved, MEMCACHED_SUCCESS);
+
+        if (flushed != MEMCACHED_SUCCESS && !error && down < 0) {
+            rc = flushed;
+            error = true;
+        }
+    }
+    _PylibMC_DeadlineEnd(self->mc, &dl);
+    PYLIBMC_END_ALLOW_THREADS
+
+    if (metered) {
+        _PylibMC_Meter(self, PYLIBMC_OP_DELETE_MULTI, UINT32_MAX,
+                       _PylibMC_Now() - began, -1, 0, 0);
+    }
+
+    if (down >= 0) {
+        _PylibMC_ServerDown(self, (uint32_t)down);
+    } else if (error) {
+        PylibMC_ErrFromMemcached(self, "memcached_delete_multi", rc);
+    } else if (dl.expired) {
+        Py_INCREF(Py_None);
+        _PylibMC_DeadlineExceeded(PySequence_GetSlice(key_seq, i, nkeys),
+                                  Py_None);
     } else {
-        Py_DECREF(retval);
-        retval = Py_False;
+        retval = allsuccess ? Py_True : Py_False;
+        Py_INCREF(retval);
     }
-    Py_INCREF(retval);
 
-    return retval;
-error:
-    Py_XDECREF(delete);
-    return NULL;
+cleanup:
+    PyMem_Free(hot);
+    PyMem_Free(wire_keys);
+    PyMem_Free(wire_lens);
+    Py_XDECREF(key_strs);
+    Py_DECREF(key_seq);
+    Py_XDECREF(ns_prefix);
+    if (noreply && retval == NULL && _PylibMC_Defer(self)) {
+        Py_INCREF(Py_True);
+        retval = Py_True;
+    }
+    return _PylibMC_TraceEnd(self, span, retval);
 }
 
 static PyObject *PylibMC_Client_get_behaviors(PylibMC_Client *self) {
-    PyObject *retval = PyDict_New();
+    PyObject *retval;
     PylibMC_Behavior *b;
 
+    if (!_PylibMC_ClientReady(self)) {
+        return NULL;
+    } else if ((retval = PyDict_New()) == NULL) {
+        return NULL;
+    }
+
     for (b = PylibMC_behaviors; b->name != NULL; b++) {
         uint64_t bval;
         PyObject *x;
@@ -1465,6 +2746,23 @@ error:
 static PyObject *PylibMC_Client_set_behaviors(PylibMC_Client *self,
         PyObject *behaviors) {
     PylibMC_Behavior *b;
+    pylibmc_cluster *c;
+    pylibmc_breakers *breakers = NULL;
+    pylibmc_hedging *hedging = NULL;
+    pylibmc_hotkeys *hotkeys = NULL;
+    pylibmc_metrics *metrics = NULL;
+    pylibmc_tracing *tracing = NULL;
+    pylibmc_counters *counters = NULL;
+    pylibmc_writer *writer = NULL;
+    pylibmc_namespaces *namespaces = NULL;
+    unsigned int copies, connections;
+    size_t large_value, key_hash_threshold, key_hash_keep;
+    int read_engine;
+
+    /* The continuum may be rebuilt, and only its own may be. */
+    if (!_PylibMC_ClientReady(self) || !_PylibMC_OwnContinuum(self)) {
+        return NULL;
+    }
 
     for (b = PylibMC_behaviors; b->name != NULL; b++) {
         PyObject *v;
@@ -1488,7 +2786,102 @@ static PyObject *PylibMC_Client_set_behaviors(PylibMC_Client *self,
         }
     }
 
+    /* Hashing and distribution may have changed under us, and shared clones
+     * made from here on must see the change while earlier ones must not.
+     * Breakers are made anew with the same settings, all closed, and with
+     * a prober of their own if they probe; the old ones and their prober
+     * go on for the clones still on the old cluster, and are stopped with
+     * it. Replicas are routed by hash, and hot keys know their servers, so
+     * they're set up anew. Metrics and traces start over with the new
+     * cluster, and so do buffered counters, once what they have is sent.
+     * The write-behind queue gets a writer of its own, and the old one
+     * goes on with what it has for the clones that share it. Namespaces
+     * fetch their generations anew. The read engine, connections and key
+     * hashing stay as they were. */
+    c = self->cluster;
+    copies = (c->replicas != NULL) ? c->replicas->copies : 0;
+    read_engine = c->read_engine;
+    connections = c->connections;
+    large_value = c->large_value;
+    key_hash_threshold = c->key_hash_threshold;
+    key_hash_keep = c->key_hash_keep;
+    if (c->counters != NULL && (_PylibMC_FlushCounters(self) == -1
+                || (counters = _PylibMC_NewCounters(c->counters->interval,
+                        c->counters->size)) == NULL)) {
+        goto undo;
+    } else if (c->breakers != NULL
+            && (breakers = _PylibMC_CopyBreakers(self, c->breakers)) == NULL) {
+        goto undo;
+    } else if (c->hedging != NULL && (hedging = _PylibMC_NewHedging(
+                    c->hedging->after, c->hedging->percentile,
+                    c->hedging->budget)) == NULL) {
+        goto undo;
+    } else if (c->hotkeys != NULL && (hotkeys = _PylibMC_NewHotKeys(
+                    c->hotkeys->rate, c->hotkeys->width, c->hotkeys->depth,
+                    c->hotkeys->size, c->hotkeys->window, c->hotkeys->copies,
+                    c->hotkeys->threshold, c->hotkeys->ttl)) == NULL) {
+        goto undo;
+    } else if (c->metrics != NULL && (metrics = _PylibMC_NewMetrics(
+                    memcached_server_count(self->mc))) == NULL) {
+        goto undo;
+    } else if (c->tracing != NULL && (tracing = _PylibMC_NewTracing(
+                    c->tracing->every, c->tracing->hook,
+                    c->tracing->size)) == NULL) {
+        goto undo;
+    } else if (c->writer != NULL && (writer = _PylibMC_NewWriter(self->mc,
+                    c->writer->size, c->writer->policy,
+                    c->writer->batch)) == NULL) {
+        goto undo;
+    } else if (c->namespaces != NULL && (namespaces = _PylibMC_NewNamespaces(
+                    c->namespaces->ttl,
+                    c->namespaces->counter_prefix)) == NULL) {
+        goto undo;
+    } else if (!_PylibMC_NewCluster(self)) {
+        goto undo;
+    }
+    self->cluster->breakers = breakers;
+    self->cluster->hedging = hedging;
+    self->cluster->hotkeys = hotkeys;
+    self->cluster->metrics = metrics;
+    self->cluster->tracing = tracing;
+    self->cluster->counters = counters;
+    self->cluster->writer = writer;
+    self->cluster->namespaces = namespaces;
+    self->cluster->read_engine = read_engine;
+    self->cluster->connections = connections;
+    self->cluster->large_value = large_value;
+    self->cluster->key_hash_threshold = key_hash_threshold;
+    self->cluster->key_hash_keep = key_hash_keep;
+    if (copies && !_PylibMC_NewReplicas(self, copies)) {
+        goto error;
+    }
+
     Py_RETURN_NONE;
+undo:
+    if (counters != NULL) {
+        _PylibMC_FreeCounters(counters);
+    }
+    if (breakers != NULL) {
+        _PylibMC_FreeBreakers(breakers);
+    }
+    if (hedging != NULL) {
+        _PylibMC_FreeHedging(hedging);
+    }
+    if (hotkeys != NULL) {
+        _PylibMC_FreeHotKeys(hotkeys);
+    }
+    if (metrics != NULL) {
+        _PylibMC_FreeMetrics(metrics);
+    }
+    if (tracing != NULL) {
+        _PylibMC_FreeTracing(tracing);
+    }
+    if (writer != NULL) {
+        _PylibMC_FreeWriter(writer);
+    }
+    if (namespaces != NULL) {
+        _PylibMC_FreeNamespaces(namespaces);
+    }
 error:
     return NULL;
 }
@@ -1505,14 +2898,17 @@ static PyObject *PylibMC_Client_flush_all(PylibMC_Client *self,
                                      &PyInt_Type, &time))
         return NULL;
 
+    if (!_PylibMC_ClientReady(self))
+        return NULL;
+
     if (time != NULL)
         expire = PyInt_AS_LONG(time);
 
     expire = (expire > 0) ? expire : 0;
 
-    Py_BEGIN_ALLOW_THREADS
+    PYLIBMC_BEGIN_ALLOW_THREADS(self)
     rc = memcached_flush(self->mc, expire);
-    Py_END_ALLOW_THREADS
+    PYLIBMC_END_ALLOW_THREADS
     if (rc != MEMCACHED_SUCCESS)
         return PylibMC_ErrFromMemcached(self, "flush_all", rc);
 
@@ -1520,127 +2916,8843 @@ static PyObject *PylibMC_Client_flush_all(PylibMC_Client *self,
 }
 
 static PyObject *PylibMC_Client_disconnect_all(PylibMC_Client *self) {
-    Py_BEGIN_ALLOW_THREADS
+    if (self->mc == NULL) {
+        /* A shared clone that never connected. */
+        Py_RETURN_NONE;
+    } else if (self->forks != _PylibMC_forks) {
+        /* Those connections are still the parent's. */
+        self->forks = _PylibMC_forks;
+        _PylibMC_DropConnections(self->mc);
+        Py_RETURN_NONE;
+    }
+
+    PYLIBMC_BEGIN_ALLOW_THREADS(self)
     memcached_quit(self->mc);
-    Py_END_ALLOW_THREADS
+    PYLIBMC_END_ALLOW_THREADS
     Py_RETURN_NONE;
 }
 
-static PyObject *PylibMC_Client_clone(PylibMC_Client *self) {
-    /* Essentially this is a reimplementation of the allocator, only it uses a
-     * cloned memcached_st for mc. */
-    PylibMC_Client *clone;
+static PyObject *PylibMC_Client_clone(PylibMC_Client *self, PyObject *args,
+        PyObject *kwds) {
+    unsigned char shared = 0;
 
-    clone = (PylibMC_Client *)PyType_GenericNew(self->ob_type, NULL, NULL);
-    if (clone == NULL) {
+    static char *kws[] = { "shared", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|b", kws, &shared)) {
+        return NULL;
+    }
+
+    return (PyObject *)_PylibMC_Clone(self, shared);
+}
+
+/* Essentially this is a reimplementation of the allocator, only it uses a
+ * cloned memcached_st for mc, or none at all for shared clones. */
+static PylibMC_Client *_PylibMC_Clone(PylibMC_Client *self, int shared) {
+    pylibmc_cluster *cluster = self->cluster;
+    PylibMC_Client *clone;
+    memcached_st *mc = NULL, *src;
+
+    if (self->mc == NULL && cluster != NULL && cluster->proto != NULL) {
+        /* A shared clone that's never been used is copied from what it
+         * would be made from, rather than made first. */
+        src = cluster->proto;
+    } else if (!_PylibMC_ClientReady(self)) {
+        return NULL;
+    } else {
+        src = self->mc;
+    }
+
+    if (shared && cluster->proto == NULL) {
+        PYLIBMC_BEGIN_ALLOW_THREADS(self)
+        cluster->proto = memcached_clone(NULL, src);
+        PYLIBMC_END_ALLOW_THREADS
+        if (cluster->proto == NULL) {
+            return (PylibMC_Client *)PyErr_NoMemory();
+        }
+    } else if (!shared) {
+        PYLIBMC_BEGIN_ALLOW_THREADS(self)
+        mc = memcached_clone(NULL, src);
+        PYLIBMC_END_ALLOW_THREADS
+        if (mc == NULL) {
+            return (PylibMC_Client *)PyErr_NoMemory();
+        }
+    }
+
+    clone = (PylibMC_Client *)PyType_GenericNew(self->ob_type, NULL, NULL);
+    if (clone == NULL) {
+        if (mc != NULL) {
+            memcached_free(mc);
+        }
+        return NULL;
+    }
+
+    clone->mc = mc;
+    clone->cluster = cluster;
+    cluster->refcnt++;
+    clone->forks = _PylibMC_forks;
+    Py_XINCREF(self->fork_hook);
+    clone->fork_hook = self->fork_hook;
+    clone->fork_connect = self->fork_connect;
+    return clone;
+}
+
+/* {{{ Clusters */
+/* Give self a cluster of its own, with a fresh topology number. Clones made
+ * before this keep the old one. */
+static int _PylibMC_NewCluster(PylibMC_Client *self) {
+    pylibmc_cluster *cluster;
+
+    if ((cluster = PyMem_New(pylibmc_cluster, 1)) == NULL) {
+        PyErr_NoMemory();
+        return 0;
+    }
+
+    cluster->refcnt = 1;
+    cluster->busy = 0;
+    cluster->retired = NULL;
+    cluster->topology = _PylibMC_NewTopology();
+    cluster->proto = NULL;
+    cluster->breakers = NULL;
+    cluster->replicas = NULL;
+    cluster->hedging = NULL;
+    cluster->hotkeys = NULL;
+    cluster->metrics = NULL;
+    cluster->tracing = NULL;
+    cluster->counters = NULL;
+    cluster->writer = NULL;
+    cluster->namespaces = NULL;
+    cluster->key_hash_threshold = cluster->key_hash_keep = 0;
+    cluster->read_engine = PYLIBMC_ENGINE_LIBMEMCACHED;
+    cluster->connections = 1;
+    cluster->large_value = 0;
+
+    if (self->cluster != NULL) {
+        _PylibMC_ReleaseCluster(self->cluster);
+    }
+    self->cluster = cluster;
+    return 1;
+}
+
+static void _PylibMC_ReleaseCluster(pylibmc_cluster *cluster) {
+    if (--cluster->refcnt) {
+        return;
+    }
+    if (cluster->proto != NULL) {
+        memcached_free(cluster->proto);
+    }
+    if (cluster->breakers != NULL) {
+        _PylibMC_FreeBreakers(cluster->breakers);
+    }
+    if (cluster->replicas != NULL) {
+        _PylibMC_FreeReplicas(cluster->replicas);
+    }
+    if (cluster->hedging != NULL) {
+        _PylibMC_FreeHedging(cluster->hedging);
+    }
+    if (cluster->hotkeys != NULL) {
+        _PylibMC_FreeHotKeys(cluster->hotkeys);
+    }
+    if (cluster->metrics != NULL) {
+        _PylibMC_FreeMetrics(cluster->metrics);
+    }
+    if (cluster->tracing != NULL) {
+        _PylibMC_FreeTracing(cluster->tracing);
+    }
+    if (cluster->counters != NULL) {
+        _PylibMC_FreeCounters(cluster->counters);
+    }
+    if (cluster->writer != NULL) {
+        _PylibMC_FreeWriter(cluster->writer);
+    }
+    if (cluster->namespaces != NULL) {
+        _PylibMC_FreeNamespaces(cluster->namespaces);
+    }
+    _PylibMC_FreeRetired(cluster);
+    PyMem_Free(cluster);
+}
+
+/* The end of one of cluster's busy calls; see PYLIBMC_END_ALLOW_THREADS.
+ * The last one out frees what was retired. */
+static void _PylibMC_ClusterIdle(pylibmc_cluster *cluster) {
+    if (--cluster->busy == 0 && cluster->retired != NULL) {
+        _PylibMC_FreeRetired(cluster);
+    }
+}
+
+/* Let go of block, settings of the given kind that self's cluster no longer
+ * points to. Busy calls of the client or its clones may be using it, in
+ * which case it's retired until they're done; if there's no memory to note
+ * that, it's leaked rather than freed under them. */
+static void _PylibMC_Retire(PylibMC_Client *self, int kind, void *block) {
+    pylibmc_cluster *cluster = self->cluster;
+    pylibmc_retired *r;
+
+    if (block == NULL) {
+        return;
+    } else if (!cluster->busy) {
+        _PylibMC_FreeSettings(kind, block);
+    } else if ((r = PyMem_New(pylibmc_retired, 1)) != NULL) {
+        r->kind = kind;
+        r->block = block;
+        r->next = cluster->retired;
+        cluster->retired = r;
+    }
+}
+
+static void _PylibMC_FreeRetired(pylibmc_cluster *cluster) {
+    pylibmc_retired *r = cluster->retired, *next;
+
+    /* freeing some of them lets go of the GIL */
+    cluster->retired = NULL;
+    for (; r != NULL; r = next) {
+        next = r->next;
+        _PylibMC_FreeSettings(r->kind, r->block);
+        PyMem_Free(r);
+    }
+}
+
+static void _PylibMC_FreeSettings(int kind, void *block) {
+    switch (kind) {
+        case PYLIBMC_RETIRED_REPLICAS:
+            _PylibMC_FreeReplicas(block);
+            break;
+        case PYLIBMC_RETIRED_HEDGING:
+            _PylibMC_FreeHedging(block);
+            break;
+        case PYLIBMC_RETIRED_HOTKEYS:
+            _PylibMC_FreeHotKeys(block);
+            break;
+        case PYLIBMC_RETIRED_METRICS:
+            _PylibMC_FreeMetrics(block);
+            break;
+        case PYLIBMC_RETIRED_TRACING:
+            _PylibMC_FreeTracing(block);
+            break;
+        case PYLIBMC_RETIRED_WRITER:
+            _PylibMC_FreeWriter(block);
+            break;
+    }
+}
+
+/* Make sure self->mc is there and its connections are our own, setting up a
+ * shared clone on its first use and dropping inherited connections on the
+ * first use after a fork. Every operation that touches self->mc goes through
+ * here first. */
+static int _PylibMC_ClientReady(PylibMC_Client *self) {
+    memcached_st *proto;
+
+    if (self->mc != NULL) {
+        if (self->forks == _PylibMC_forks) {
+            return 1;
+        }
+        return _PylibMC_AfterFork(self, self->fork_connect);
+    }
+
+    proto = self->cluster->proto;
+    PYLIBMC_BEGIN_ALLOW_THREADS(self)
+    self->mc = memcached_clone(NULL, proto);
+    if (self->mc != NULL) {
+        _PylibMC_ShareContinuum(self->mc, proto);
+    }
+    PYLIBMC_END_ALLOW_THREADS
+    if (self->mc == NULL) {
+        PyErr_NoMemory();
+        return 0;
+    }
+    self->forks = _PylibMC_forks;
+    _PylibMC_BreakersAfterFork(self->cluster->breakers);
+    _PylibMC_HedgingAfterFork(self->cluster->hedging);
+    return 1;
+}
+
+/* A shared clone needs a server array of its own, as that's where
+ * libmemcached keeps the connections, but the continuum it routes keys by
+ * is the same as proto's, and with ketama over many servers takes about as
+ * much memory. So the one memcached_clone made is dropped for proto's,
+ * which nothing rebuilds: proto doesn't change once made, and whatever
+ * would have libmemcached rebuild a clone's continuum first gives it back
+ * one of its own with _PylibMC_OwnContinuum. With _auto_eject_hosts,
+ * libmemcached rebuilds it by itself as servers fail, so each clone keeps
+ * its own. Doesn't need the GIL. */
+static void _PylibMC_ShareContinuum(memcached_st *mc, memcached_st *proto) {
+    if (proto->continuum == NULL || mc->continuum == NULL
+            || memcached_behavior_get(proto,
+                                      MEMCACHED_BEHAVIOR_AUTO_EJECT_HOSTS)) {
+        return;
+    }
+    free(mc->continuum);
+    mc->continuum = proto->continuum;
+}
+
+static int _PylibMC_SharesContinuum(PylibMC_Client *self) {
+    return self->mc != NULL && self->cluster != NULL
+        && self->cluster->proto != NULL && self->mc->continuum != NULL
+        && self->mc->continuum == self->cluster->proto->continuum;
+}
+
+/* Copy a shared continuum into one of self's own, with room for as many
+ * points as libmemcached could write into it. Returns 0 with an exception
+ * set if that fails. */
+static int _PylibMC_OwnContinuum(PylibMC_Client *self) {
+    memcached_continuum_item_st *own;
+    size_t size;
+
+    if (!_PylibMC_SharesContinuum(self)) {
+        return 1;
+    }
+    size = (size_t)self->mc->continuum_count
+         * MEMCACHED_POINTS_PER_SERVER_KETAMA;
+    if ((own = malloc(sizeof(*own) * size)) == NULL) {
+        PyErr_NoMemory();
+        return 0;
+    }
+    memcpy(own, self->mc->continuum,
+           sizeof(*own) * self->mc->continuum_points_counter);
+    self->mc->continuum = own;
+    return 1;
+}
+/* }}} */
+
+/* {{{ Forks and connecting */
+static void _PylibMC_AtForkChild(void) {
+    _PylibMC_forks++;
+}
+
+/* Hedged gets, the read engine, pipelines and fork recovery work on the
+ * connections libmemcached keeps in memcached_server_st. Its fields aren't
+ * part of the API, so everything that touches them beyond fd goes through
+ * _PylibMC_ResetServer, _PylibMC_CloseServer and _PylibMC_ServerIdle, and
+ * the layout they assume is pinned in _pylibmcmodule.h. */
+static void _PylibMC_ResetServer(memcached_server_st *server) {
+    server->cursor_active = 0;
+    server->read_ptr = server->read_buffer;
+    server->read_buffer_length = 0;
+    server->read_data_length = 0;
+    /* UDP writes leave room for the datagram header. */
+    server->write_buffer_offset =
+        (server->type == MEMCACHED_CONNECTION_UDP) ? 8 : 0;
+}
+
+/* Close server's connection, if any, and forget what was buffered on it. */
+static void _PylibMC_CloseServer(memcached_server_st *server) {
+    if (server->fd != -1) {
+        close(server->fd);
+        server->fd = -1;
+    }
+    _PylibMC_ResetServer(server);
+}
+
+/* Forget every connection of mc without saying goodbye. The parent still has
+ * the same sockets open: a quit from us would end its sessions, but closing
+ * our copies of the descriptors doesn't. Doesn't need the GIL. */
+static void _PylibMC_DropConnections(memcached_st *mc) {
+    uint32_t i;
+
+    for (i = 0; i < memcached_server_count(mc); i++) {
+        _PylibMC_CloseServer(&memcached_server_list(mc)[i]);
+    }
+}
+
+static int _PylibMC_AfterFork(PylibMC_Client *self, int connect) {
+    pylibmc_connect *results = NULL;
+    memcached_st *mc = self->mc;
+
+    self->forks = _PylibMC_forks;
+
+    if (connect) {
+        results = PyMem_New(pylibmc_connect, memcached_server_count(mc));
+        if (results == NULL) {
+            PyErr_NoMemory();
+            return 0;
+        }
+    }
+
+    PYLIBMC_BEGIN_ALLOW_THREADS(self)
+    _PylibMC_DropConnections(mc);
+    if (connect) {
+        _PylibMC_ConnectAll(mc, -1, NULL, results);
+    }
+    PYLIBMC_END_ALLOW_THREADS
+    PyMem_Free(results);
+
+    _PylibMC_BreakersAfterFork(self->cluster->breakers);
+    _PylibMC_HedgingAfterFork(self->cluster->hedging);
+
+    if (self->fork_hook != NULL) {
+        PyObject *r;
+
+        r = PyObject_CallFunctionObjArgs(self->fork_hook, self, NULL);
+        if (r == NULL) {
+            return 0;
+        }
+        Py_DECREF(r);
+    }
+
+    return 1;
+}
+
+/* Start a non-blocking connect to a server. Returns the socket, with *err
+ * set to 0 if it connected right away and EINPROGRESS if it's underway, or
+ * -1 with *err set to what went wrong. */
+static int _PylibMC_StartConnect(const char *hostname, unsigned int port,
+        memcached_connection type, int *err) {
+    struct addrinfo hints, *ai = NULL;
+    struct sockaddr_un sun;
+    struct sockaddr *addr;
+    socklen_t addrlen;
+    char service[8];
+    int fd, rc;
+
+    if (type == MEMCACHED_CONNECTION_UNIX_SOCKET) {
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strncpy(sun.sun_path, hostname, sizeof(sun.sun_path) - 1);
+        addr = (struct sockaddr *)&sun;
+        addrlen = sizeof(sun);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    } else {
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+        snprintf(service, sizeof(service), "%u", port);
+        if ((rc = getaddrinfo(hostname, service, &hints, &ai)) != 0) {
+            *err = (rc == EAI_SYSTEM) ? errno : EHOSTUNREACH;
+            return -1;
+        }
+        addr = ai->ai_addr;
+        addrlen = ai->ai_addrlen;
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    }
+
+    if (fd == -1) {
+        *err = errno;
+    } else if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == -1) {
+        *err = errno;
+        close(fd);
+        fd = -1;
+    } else if (connect(fd, addr, addrlen) == 0) {
+        *err = 0;
+    } else if (errno == EINPROGRESS) {
+        *err = EINPROGRESS;
+    } else {
+        *err = errno;
+        close(fd);
+        fd = -1;
+    }
+
+    if (ai != NULL) {
+        freeaddrinfo(ai);
+    }
+    return fd;
+}
+
+/* Hand a connected socket over to libmemcached, set up the way it would
+ * have set it up itself. The socket stays non-blocking; libmemcached's I/O
+ * polls on EAGAIN either way. */
+static void _PylibMC_FinishConnect(memcached_st *mc,
+        memcached_server_st *server, int fd) {
+    uint64_t usec;
+    struct timeval tv;
+    int one = 1;
+
+    if (server->type == MEMCACHED_CONNECTION_TCP
+            && memcached_behavior_get(mc, MEMCACHED_BEHAVIOR_TCP_NODELAY)) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if ((usec = memcached_behavior_get(mc, MEMCACHED_BEHAVIOR_SND_TIMEOUT))) {
+        tv.tv_sec = usec / 1000000;
+        tv.tv_usec = usec % 1000000;
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+    if ((usec = memcached_behavior_get(mc, MEMCACHED_BEHAVIOR_RCV_TIMEOUT))) {
+        tv.tv_sec = usec / 1000000;
+        tv.tv_usec = usec % 1000000;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+
+    _PylibMC_ResetServer(server);
+    server->fd = fd;
+    server->server_failure_counter = 0;
+}
+
+/* Connect to every server of mc that isn't connected yet, all at once,
+ * waiting at most timeout seconds (or the connect_timeout behavior if
+ * negative) for the lot. results gets one entry per server. UDP servers,
+ * and those not flagged in wanted unless it's NULL, are skipped. Doesn't
+ * need the GIL. */
+static void _PylibMC_ConnectAll(memcached_st *mc, double timeout,
+        const unsigned char *wanted, pylibmc_connect *results) {
+    uint32_t i, nservers = memcached_server_count(mc);
+    struct pollfd *pfds;
+    double start, now;
+    int pending = 0;
+
+    if (timeout < 0) {
+        timeout = memcached_behavior_get(mc,
+                MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT) / 1000.0;
+    }
+
+    if ((pfds = malloc(sizeof(struct pollfd) * (nservers ? nservers : 1))) == NULL) {
+        for (i = 0; i < nservers; i++) {
+            results[i].status = PYLIBMC_CONNECT_FAILED;
+            results[i].err = ENOMEM;
+            results[i].latency = 0;
+        }
+        return;
+    }
+
+    start = _PylibMC_Now();
+    for (i = 0; i < nservers; i++) {
+        memcached_server_st *server = &memcached_server_list(mc)[i];
+        int fd, err;
+
+        pfds[i].fd = -1;
+        pfds[i].events = POLLOUT;
+        pfds[i].revents = 0;
+        results[i].err = 0;
+        results[i].latency = 0;
+
+        if (server->fd != -1) {
+            results[i].status = PYLIBMC_CONNECT_ALREADY;
+        } else if (server->type == MEMCACHED_CONNECTION_UDP
+                || (wanted != NULL && !wanted[i])) {
+            results[i].status = PYLIBMC_CONNECT_SKIPPED;
+        } else if ((fd = _PylibMC_StartConnect(server->hostname, server->port,
+                                               server->type, &err)) == -1) {
+            results[i].status = PYLIBMC_CONNECT_FAILED;
+            results[i].err = err;
+        } else if (!err) {
+            results[i].status = PYLIBMC_CONNECT_OK;
+            results[i].latency = _PylibMC_Now() - start;
+            _PylibMC_FinishConnect(mc, server, fd);
+        } else {
+            pfds[i].fd = fd;
+            pending++;
+        }
+    }
+
+    while (pending) {
+        int wait, n;
+
+        now = _PylibMC_Now();
+        if (now >= start + timeout) {
+            break;
+        }
+        wait = (int)((start + timeout - now) * 1000) + 1;
+        if ((n = poll(pfds, nservers, wait)) == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            break;
+        }
+
+        now = _PylibMC_Now();
+        for (i = 0; i < nservers; i++) {
+            int err = 0;
+            socklen_t errlen = sizeof(err);
+
+            if (pfds[i].fd == -1 || !pfds[i].revents) {
+                continue;
+            }
+
+            if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &errlen)) {
+                err = errno;
+            }
+            if (err) {
+                results[i].status = PYLIBMC_CONNECT_FAILED;
+                results[i].err = err;
+                close(pfds[i].fd);
+            } else {
+                results[i].status = PYLIBMC_CONNECT_OK;
+                _PylibMC_FinishConnect(mc, &memcached_server_list(mc)[i],
+                                       pfds[i].fd);
+            }
+            results[i].latency = now - start;
+            pfds[i].fd = -1;
+            pending--;
+        }
+    }
+
+    now = _PylibMC_Now();
+    for (i = 0; i < nservers; i++) {
+        if (pfds[i].fd != -1) {
+            close(pfds[i].fd);
+            results[i].status = PYLIBMC_CONNECT_FAILED;
+            results[i].err = ETIMEDOUT;
+            results[i].latency = now - start;
+        }
+    }
+
+    free(pfds);
+}
+
+static PyObject *PylibMC_Client_connect_all(PylibMC_Client *self,
+        PyObject *args, PyObject *kwds) {
+    PyObject *timeout_obj = NULL, *retval;
+    pylibmc_connect *results;
+    uint32_t i, nservers;
+    double timeout;
+
+    static char *kws[] = { "timeout", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kws, &timeout_obj)) {
+        return NULL;
+    } else if (!_PylibMC_ParseTimeout(timeout_obj, &timeout)) {
+        return NULL;
+    } else if (!_PylibMC_ClientReady(self)) {
+        return NULL;
+    }
+
+    nservers = memcached_server_count(self->mc);
+    if ((results = PyMem_New(pylibmc_connect, nservers ? nservers : 1)) == NULL) {
+        return PyErr_NoMemory();
+    }
+
+    PYLIBMC_BEGIN_ALLOW_THREADS(self)
+    _PylibMC_ConnectAll(self->mc, timeout, NULL, results);
+    PYLIBMC_END_ALLOW_THREADS
+
+    if ((retval = PyList_New(nservers)) == NULL) {
+        goto error;
+    }
+
+    for (i = 0; i < nservers; i++) {
+        memcached_server_st *server = &memcached_server_list(self->mc)[i];
+        PyObject *name, *entry;
+
+        name = PyString_FromFormat("%s:%u",
+                memcached_server_name(self->mc, *server),
+                (unsigned int)memcached_server_port(self->mc, *server));
+        if (name == NULL) {
+            Py_DECREF(retval);
+            goto error;
+        }
+
+        switch (results[i].status) {
+            case PYLIBMC_CONNECT_OK:
+            case PYLIBMC_CONNECT_ALREADY:
+                entry = Py_BuildValue("(NdO)", name,
+                        results[i].latency, Py_None);
+                break;
+            case PYLIBMC_CONNECT_FAILED:
+                entry = Py_BuildValue("(NOs)", name,
+                        Py_None, strerror(results[i].err));
+                break;
+            default:
+                entry = Py_BuildValue("(NOO)", name, Py_None, Py_None);
+        }
+        if (entry == NULL) {
+            Py_DECREF(retval);
+            goto error;
+        }
+        PyList_SET_ITEM(retval, i, entry);
+    }
+
+    PyMem_Free(results);
+    return retval;
+error:
+    PyMem_Free(results);
+    return NULL;
+}
+
+static PyObject *PylibMC_Client_after_fork(PylibMC_Client *self,
+        PyObject *args, PyObject *kwds) {
+    unsigned char connect = 0;
+
+    static char *kws[] = { "connect", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|b", kws, &connect)) {
+        return NULL;
+    } else if (self->mc == NULL && !_PylibMC_ClientReady(self)) {
+        return NULL;
+    } else if (!_PylibMC_AfterFork(self, connect)) {
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *PylibMC_Client_set_fork_hook(PylibMC_Client *self,
+        PyObject *args, PyObject *kwds) {
+    PyObject *hook, *old;
+    unsigned char connect = 0;
+
+    static char *kws[] = { "hook", "connect", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|b", kws,
+                                     &hook, &connect)) {
+        return NULL;
+    } else if (hook != Py_None && !PyCallable_Check(hook)) {
+        PyErr_SetString(PyExc_TypeError, "hook must be callable or None");
+        return NULL;
+    }
+
+    old = self->fork_hook;
+    if (hook == Py_None) {
+        self->fork_hook = NULL;
+    } else {
+        Py_INCREF(hook);
+        self->fork_hook = hook;
+    }
+    self->fork_connect = connect;
+    Py_XDECREF(old);
+
+    Py_RETURN_NONE;
+}
+/* }}} */
+
+/* {{{ Deadlines */
+/* Start the clock on a call that may take at most timeout seconds, or as
+ * long as it takes if timeout is negative. */
+static void _PylibMC_DeadlineStart(memcached_st *mc, double timeout,
+        pylibmc_deadline *dl) {
+    dl->expired = 0;
+    if (timeout < 0) {
+        dl->at = -1;
+        return;
+    }
+    dl->at = _PylibMC_Now() + timeout;
+    dl->poll_timeout = (int32_t)memcached_behavior_get(mc,
+            MEMCACHED_BEHAVIOR_POLL_TIMEOUT);
+}
+
+/* Keep libmemcached from waiting on a socket past the deadline by capping
+ * its poll timeout to what's left. Returns 0 if nothing is. */
+static int _PylibMC_DeadlineArm(memcached_st *mc, pylibmc_deadline *dl) {
+    double left;
+    int32_t ms;
+
+    if (dl->at < 0) {
+        return 1;
+    } else if (dl->expired || (left = dl->at - _PylibMC_Now()) <= 0) {
+        dl->expired = 1;
+        return 0;
+    }
+
+    ms = (left < 86400) ? (int32_t)(left * 1000) + 1 : INT32_MAX;
+    if (dl->poll_timeout >= 0 && dl->poll_timeout < ms) {
+        ms = dl->poll_timeout;
+    }
+    memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_POLL_TIMEOUT, (uint64_t)ms);
+    return 1;
+}
+
+/* Whether the deadline has passed, e.g. to tell a poll that timed out
+ * because of it from one that timed out on its own. */
+static int _PylibMC_DeadlineCheck(pylibmc_deadline *dl) {
+    if (dl->at >= 0 && !dl->expired && _PylibMC_Now() >= dl->at) {
+        dl->expired = 1;
+    }
+    return dl->expired;
+}
+
+/* Connect the servers the keys map to up front, in parallel and within the
+ * deadline, rather than have libmemcached connect them one by one, each
+ * taking up to connect_timeout. */
+static void _PylibMC_DeadlineConnect(memcached_st *mc, pylibmc_deadline *dl,
+        char **keys, size_t *key_lens, size_t nkeys) {
+    uint32_t nservers = memcached_server_count(mc);
+    unsigned char *wanted;
+    pylibmc_connect *results;
+    size_t i;
+    int any = 0;
+    double left;
+
+    if (dl->at < 0 || nservers == 0) {
+        return;
+    }
+
+    wanted = calloc(nservers, 1);
+    results = malloc(sizeof(pylibmc_connect) * nservers);
+    if (wanted != NULL && results != NULL) {
+        for (i = 0; i < nkeys; i++) {
+            uint32_t server;
+
+            if (!key_lens[i]) {
+                continue;
+            }
+            server = memcached_generate_hash(mc, keys[i], key_lens[i]);
+            if (server < nservers
+                    && memcached_server_list(mc)[server].fd == -1) {
+                wanted[server] = 1;
+                any = 1;
+            }
+        }
+        if (any) {
+            left = dl->at - _PylibMC_Now();
+            _PylibMC_ConnectAll(mc, (left > 0) ? left : 0, wanted, results);
+        }
+    }
+    free(wanted);
+    free(results);
+}
+
+/* Which servers still owed replies, or never got connected, when the
+ * deadline passed. Call it before _PylibMC_DeadlineEnd resets them. NULL if
+ * out of memory. */
+static unsigned char *_PylibMC_DeadlinePending(memcached_st *mc) {
+    uint32_t i, nservers = memcached_server_count(mc);
+    unsigned char *pending = malloc(nservers ? nservers : 1);
+
+    for (i = 0; pending != NULL && i < nservers; i++) {
+        memcached_server_st *server = &memcached_server_list(mc)[i];
+
+        pending[i] = (server->fd == -1 || server->cursor_active > 0);
+    }
+    return pending;
+}
+
+/* Put the poll timeout back. If the deadline passed, also close whatever
+ * was left mid-request: the late replies would be taken for answers to the
+ * next command. */
+static void _PylibMC_DeadlineEnd(memcached_st *mc, pylibmc_deadline *dl) {
+    uint32_t i;
+
+    if (dl->at < 0) {
+        return;
+    }
+    memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_POLL_TIMEOUT,
+                           (uint64_t)dl->poll_timeout);
+    if (!dl->expired) {
+        return;
+    }
+
+    for (i = 0; i < memcached_server_count(mc); i++) {
+        memcached_server_st *server = &memcached_server_list(mc)[i];
+
+        if (server->fd != -1 && (server->cursor_active > 0
+                || server->write_buffer_offset > 0)) {
+            _PylibMC_CloseServer(server);
+        }
+    }
+}
+
+/* Raise DeadlineExceeded, with the keys that weren't served in time as its
+ * keys attribute and what was as partial. Steals both references; if keys
+ * is NULL, the error that caused it is left raised instead. Returns NULL. */
+static PyObject *_PylibMC_DeadlineExceeded(PyObject *keys, PyObject *partial) {
+    PyObject *exc;
+
+    if (keys == NULL) {
+        Py_XDECREF(partial);
+        return NULL;
+    }
+
+    exc = PyObject_CallFunction(PylibMCExc_DeadlineExceeded, "s",
+            "deadline exceeded");
+    if (exc != NULL) {
+        if (PyObject_SetAttrString(exc, "keys", keys) == 0
+                && PyObject_SetAttrString(exc, "partial", partial) == 0) {
+            PyErr_SetObject(PylibMCExc_DeadlineExceeded, exc);
+        }
+        Py_DECREF(exc);
+    }
+    Py_DECREF(keys);
+    Py_DECREF(partial);
+    return NULL;
+}
+/* }}} */
+
+/* {{{ Noreply writes */
+/* Have mc buffer requests and not ask for replies, the binary protocol's
+ * quiet commands or the text protocol's noreply, until _PylibMC_NoReplyEnd.
+ * saved keeps the two behaviors to switch back to. Doesn't need the GIL. */
+static void _PylibMC_NoReplyStart(memcached_st *mc, uint64_t *saved) {
+    saved[0] = memcached_behavior_get(mc, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS);
+    saved[1] = memcached_behavior_get(mc, MEMCACHED_BEHAVIOR_NOREPLY);
+    if (!saved[0]) {
+        memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, 1);
+    }
+    if (!saved[1]) {
+        memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_NOREPLY, 1);
+    }
+}
+
+/* Send off what's buffered, and switch mc back. Gives rc, what the last
+ * request came to, unless that went fine and sending didn't. */
+static memcached_return _PylibMC_NoReplyEnd(memcached_st *mc,
+        const uint64_t *saved, memcached_return rc) {
+    memcached_return flushed = memcached_flush_buffers(mc);
+
+    if (!saved[0]) {
+        memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, 0);
+    }
+    if (!saved[1]) {
+        memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_NOREPLY, 0);
+    }
+    if (rc == MEMCACHED_SUCCESS || rc == MEMCACHED_BUFFERED) {
+        return flushed;
+    }
+    return rc;
+}
+
+/* Keep the exception a noreply call is about to raise for noreply_errors(),
+ * if it's one of ours. Returns 1 if it was kept and cleared. */
+static int _PylibMC_Defer(PylibMC_Client *self) {
+    PyObject *type, *value, *tb;
+
+    if (!PyErr_ExceptionMatches(PylibMCExc_MemcachedError)) {
+        return 0;
+    } else if (self->deferred == NULL
+            && (self->deferred = PyList_New(0)) == NULL) {
+        return 0;
+    }
+
+    PyErr_Fetch(&type, &value, &tb);
+    PyErr_NormalizeException(&type, &value, &tb);
+    if (PyList_Append(self->deferred, value) == -1) {
+        Py_XDECREF(type);
+        Py_XDECREF(value);
+        Py_XDECREF(tb);
+        return 0;
+    }
+    Py_XDECREF(type);
+    Py_XDECREF(value);
+    Py_XDECREF(tb);
+
+    if (PyList_GET_SIZE(self->deferred) > PYLIBMC_MAX_DEFERRED) {
+        PyList_SetSlice(self->deferred, 0, 1, NULL);
+    }
+    return 1;
+}
+
+static PyObject *PylibMC_Client_noreply_errors(PylibMC_Client *self) {
+    PyObject *errors = self->deferred;
+
+    self->deferred = NULL;
+    return (errors != NULL) ? errors : PyList_New(0);
+}
+/* }}} */
+
+/* {{{ Circuit breakers */
+static PyObject *_PylibMC_ServerDown(PylibMC_Client *self, uint32_t server) {
+    memcached_server_st *s = &memcached_server_list(self->mc)[server];
+
+    PyErr_Format(PylibMCExc_ServerDown, "server %s:%u is down",
+            memcached_server_name(self->mc, *s),
+            (unsigned int)memcached_server_port(self->mc, *s));
+    return NULL;
+}
+
+/* Whether rc says something is wrong with the server rather than with the
+ * call. */
+static int _PylibMC_IsServerFailure(memcached_return rc) {
+    switch (rc) {
+        case MEMCACHED_HOST_LOOKUP_FAILURE:
+        case MEMCACHED_CONNECTION_FAILURE:
+        case MEMCACHED_CONNECTION_BIND_FAILURE:
+        case MEMCACHED_WRITE_FAILURE:
+        case MEMCACHED_READ_FAILURE:
+        case MEMCACHED_UNKNOWN_READ_FAILURE:
+        case MEMCACHED_SERVER_ERROR:
+        case MEMCACHED_CONNECTION_SOCKET_CREATE_FAILURE:
+        case MEMCACHED_ERRNO:
+        case MEMCACHED_TIMEOUT:
+        case MEMCACHED_SERVER_MARKED_DEAD:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* The breakers of self's servers if they're enabled, or NULL. */
+static pylibmc_breakers *_PylibMC_Breakers(PylibMC_Client *self) {
+    pylibmc_breakers *b = self->cluster->breakers;
+
+    return (b != NULL && b->enabled) ? b : NULL;
+}
+
+/* The following take b->lock. */
+static void _PylibMC_BreakerTrip(pylibmc_breaker *br, double now) {
+    br->state = PYLIBMC_BREAKER_OPEN;
+    br->opened_at = now;
+    br->trial = 0;
+    br->trips++;
+}
+
+static void _PylibMC_BreakerClose(pylibmc_breaker *br, double now) {
+    br->state = PYLIBMC_BREAKER_CLOSED;
+    br->calls = br->failures = br->slow = 0;
+    br->window_start = now;
+    br->trial = 0;
+}
+
+/* Whether a call to server may go ahead. Doesn't need the GIL. */
+static int _PylibMC_BreakerAllow(pylibmc_breakers *b, uint32_t server,
+        double now) {
+    pylibmc_breaker *br = &b->servers[server];
+    int allow = 1;
+
+    pthread_mutex_lock(&b->lock);
+    if (br->state == PYLIBMC_BREAKER_OPEN
+            && now - br->opened_at >= b->cooldown) {
+        br->state = PYLIBMC_BREAKER_HALF_OPEN;
+        br->trial = 0;
+    }
+    if (br->state == PYLIBMC_BREAKER_OPEN
+            || (br->state == PYLIBMC_BREAKER_HALF_OPEN && br->trial)) {
+        br->rejected++;
+        allow = 0;
+    } else if (br->state == PYLIBMC_BREAKER_HALF_OPEN) {
+        br->trial = 1;
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    return allow;
+}
+
+/* Like _PylibMC_BreakerAllow, for calls to many servers at once, which can't
+ * be trial calls: only says whether server's breaker is open. */
+static int _PylibMC_BreakerOpen(pylibmc_breakers *b, uint32_t server,
+        double now) {
+    pylibmc_breaker *br = &b->servers[server];
+    int open;
+
+    pthread_mutex_lock(&b->lock);
+    open = br->state == PYLIBMC_BREAKER_OPEN
+        && now - br->opened_at < b->cooldown;
+    if (open) {
+        br->rejected++;
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    return open;
+}
+
+/* Account for a call to server that _PylibMC_BreakerAllow let through.
+ * Doesn't need the GIL. */
+static void _PylibMC_BreakerRecord(pylibmc_breakers *b, uint32_t server,
+        int failed, double latency) {
+    pylibmc_breaker *br = &b->servers[server];
+    double now = _PylibMC_Now();
+
+    pthread_mutex_lock(&b->lock);
+    if (br->state == PYLIBMC_BREAKER_HALF_OPEN) {
+        if (failed) {
+            _PylibMC_BreakerTrip(br, now);
+        } else {
+            _PylibMC_BreakerClose(br, now);
+        }
+    } else if (br->state == PYLIBMC_BREAKER_CLOSED) {
+        if (now - br->window_start >= b->window) {
+            br->calls = br->failures = br->slow = 0;
+            br->window_start = now;
+        }
+        br->calls++;
+        br->failures += failed;
+        br->slow += (b->slow_after > 0 && latency >= b->slow_after);
+        if (br->calls >= b->min_calls
+                && (br->failures >= b->error_rate * br->calls
+                    || (b->slow_after > 0
+                        && br->slow >= b->slow_rate * br->calls))) {
+            _PylibMC_BreakerTrip(br, now);
+        }
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+/* Breaker bookkeeping around a single-key call: returns 1 if the call may go
+ * ahead, 0 with ServerDown raised, or -1 if it should act as a miss. */
+static int _PylibMC_CallStart(PylibMC_Client *self, PyObject *key,
+        PyObject *wire, pylibmc_call *call) {
+    pylibmc_breakers *b;
+
+    call->server = -1;
+    if ((b = _PylibMC_Breakers(self)) == NULL) {
+        return 1;
+    }
+
+    call->server = (int)_PylibMC_ServerIndex(self, key, wire);
+    call->start = _PylibMC_Now();
+    if (_PylibMC_BreakerAllow(b, call->server, call->start)) {
+        return 1;
+    } else if (b->fallback) {
+        return -1;
+    }
+    _PylibMC_ServerDown(self, call->server);
+    return 0;
+}
+
+static void _PylibMC_CallDone(PylibMC_Client *self, pylibmc_call *call,
+        memcached_return rc) {
+    if (call->server >= 0) {
+        _PylibMC_BreakerRecord(self->cluster->breakers, call->server,
+                               _PylibMC_IsServerFailure(rc),
+                               _PylibMC_Now() - call->start);
+    }
+}
+
+/* Ask every server for its version at once, giving them timeout seconds to
+ * answer. ok gets 1 for servers that did, 0 for those that didn't and -1 for
+ * those that weren't asked. */
+static void _PylibMC_ProbeAll(pylibmc_breakers *b, double timeout, int *ok,
+        double *latency) {
+    static const char version[] = "version\r\n";
+    struct pollfd *pfds;
+    double start, now;
+    uint32_t i;
+    int pending = 0;
+
+    if ((pfds = malloc(sizeof(struct pollfd) * b->nservers)) == NULL) {
+        for (i = 0; i < b->nservers; i++) {
+            ok[i] = -1;
+        }
+        return;
+    }
+
+    start = _PylibMC_Now();
+    for (i = 0; i < b->nservers; i++) {
+        pylibmc_breaker *br = &b->servers[i];
+        int err;
+
+        ok[i] = 0;
+        latency[i] = 0;
+        pfds[i].fd = -1;
+        pfds[i].revents = 0;
+        if (br->type == MEMCACHED_CONNECTION_UDP) {
+            ok[i] = -1;
+        } else if ((pfds[i].fd = _PylibMC_StartConnect(br->hostname,
+                        br->port, br->type, &err)) != -1) {
+            pfds[i].events = POLLOUT;
+            pending++;
+        }
+    }
+
+    while (pending && (now = _PylibMC_Now()) < start + timeout) {
+        int n = poll(pfds, b->nservers,
+                     (int)((start + timeout - now) * 1000) + 1);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            break;
+        }
+
+        for (i = 0; i < b->nservers; i++) {
+            char buf[64];
+            int err = 0;
+            socklen_t errlen = sizeof(err);
+            ssize_t nread;
+
+            if (pfds[i].fd == -1 || !pfds[i].revents) {
+                continue;
+            } else if (pfds[i].events == POLLOUT) {
+                if (!getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR,
+                                &err, &errlen)
+                        && !err
+                        && write(pfds[i].fd, version, sizeof(version) - 1)
+                           == sizeof(version) - 1) {
+                    pfds[i].events = POLLIN;
+                    continue;
+                }
+            } else {
+                nread = read(pfds[i].fd, buf, sizeof(buf));
+                ok[i] = nread >= 8 && !memcmp(buf, "VERSION ", 8);
+                latency[i] = _PylibMC_Now() - start;
+            }
+            close(pfds[i].fd);
+            pfds[i].fd = -1;
+            pending--;
+        }
+    }
+
+    for (i = 0; i < b->nservers; i++) {
+        if (pfds[i].fd != -1) {
+            close(pfds[i].fd);
+        }
+    }
+    free(pfds);
+}
+
+static void *_PylibMC_Prober(void *arg) {
+    pylibmc_breakers *b = (pylibmc_breakers *)arg;
+    double *latency;
+    int *ok;
+
+    ok = malloc(sizeof(int) * b->nservers);
+    latency = malloc(sizeof(double) * b->nservers);
+
+    pthread_mutex_lock(&b->lock);
+    while (!b->stop && ok != NULL && latency != NULL) {
+        struct timespec until;
+        double now, timeout;
+        uint32_t i;
+
+        _PylibMC_Deadline(b->probe_interval, &until);
+        pthread_cond_timedwait(&b->wakeup, &b->lock, &until);
+        if (b->stop) {
+            break;
+        }
+
+        timeout = b->probe_interval < 1.0 ? b->probe_interval : 1.0;
+        pthread_mutex_unlock(&b->lock);
+        _PylibMC_ProbeAll(b, timeout, ok, latency);
+        pthread_mutex_lock(&b->lock);
+
+        now = _PylibMC_Now();
+        for (i = 0; i < b->nservers; i++) {
+            pylibmc_breaker *br = &b->servers[i];
+
+            if (ok[i] < 0) {
+                continue;
+            }
+            br->probe_ok = ok[i];
+            br->probe_latency = latency[i];
+            if (!ok[i] && br->state != PYLIBMC_BREAKER_OPEN) {
+                _PylibMC_BreakerTrip(br, now);
+            } else if (ok[i] && br->state == PYLIBMC_BREAKER_OPEN) {
+                br->state = PYLIBMC_BREAKER_HALF_OPEN;
+                br->trial = 0;
+            }
+        }
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    free(ok);
+    free(latency);
+    return NULL;
+}
+
+static int _PylibMC_StartProber(pylibmc_breakers *b) {
+    b->stop = 0;
+    b->forks = _PylibMC_forks;
+    if (pthread_create(&b->prober, NULL, _PylibMC_Prober, b) != 0) {
+        return 0;
+    }
+    b->probing = 1;
+    return 1;
+}
+
+static void _PylibMC_StopProber(pylibmc_breakers *b) {
+    if (!b->probing) {
+        return;
+    }
+    b->probing = 0;
+
+    /* A prober started before a fork doesn't exist in the child. */
+    if (b->forks != _PylibMC_forks) {
+        return;
+    }
+
+    pthread_mutex_lock(&b->lock);
+    b->stop = 1;
+    pthread_cond_signal(&b->wakeup);
+    pthread_mutex_unlock(&b->lock);
+
+    Py_BEGIN_ALLOW_THREADS
+    pthread_join(b->prober, NULL);
+    Py_END_ALLOW_THREADS
+}
+
+/* Only the forking thread lives on in a child, so the lock may be held by a
+ * thread that's gone, and the prober needs restarting. */
+static void _PylibMC_BreakersAfterFork(pylibmc_breakers *b) {
+    if (b == NULL || !b->probing || b->forks == _PylibMC_forks) {
+        return;
+    }
+
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->wakeup, NULL);
+    b->probing = 0;
+    _PylibMC_StartProber(b);
+}
+
+static void _PylibMC_FreeBreakers(pylibmc_breakers *b) {
+    _PylibMC_StopProber(b);
+    pthread_mutex_destroy(&b->lock);
+    pthread_cond_destroy(&b->wakeup);
+    PyMem_Free(b->servers);
+    PyMem_Free(b);
+}
+
+static pylibmc_breakers *_PylibMC_NewBreakers(PylibMC_Client *self) {
+    pylibmc_breakers *b;
+    uint32_t i, nservers = memcached_server_count(self->mc);
+
+    if ((b = PyMem_New(pylibmc_breakers, 1)) == NULL) {
+        return (pylibmc_breakers *)PyErr_NoMemory();
+    }
+    memset(b, 0, sizeof(*b));
+    if ((b->servers = PyMem_New(pylibmc_breaker, nservers ? nservers : 1)) == NULL) {
+        PyMem_Free(b);
+        return (pylibmc_breakers *)PyErr_NoMemory();
+    }
+
+    b->nservers = nservers;
+    for (i = 0; i < nservers; i++) {
+        memcached_server_st *server = &memcached_server_list(self->mc)[i];
+        pylibmc_breaker *br = &b->servers[i];
+
+        memset(br, 0, sizeof(*br));
+        strncpy(br->hostname, memcached_server_name(self->mc, *server),
+                sizeof(br->hostname) - 1);
+        br->port = memcached_server_port(self->mc, *server);
+        br->type = server->type;
+    }
+
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->wakeup, NULL);
+    return b;
+}
+
+/* Breakers for self's servers with the settings of old, all closed, and
+ * probing if old does. */
+static pylibmc_breakers *_PylibMC_CopyBreakers(PylibMC_Client *self,
+        pylibmc_breakers *old) {
+    pylibmc_breakers *b;
+    double now;
+    uint32_t i;
+
+    if ((b = _PylibMC_NewBreakers(self)) == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&old->lock);
+    b->enabled = old->enabled;
+    b->fallback = old->fallback;
+    b->error_rate = old->error_rate;
+    b->min_calls = old->min_calls;
+    b->window = old->window;
+    b->cooldown = old->cooldown;
+    b->slow_after = old->slow_after;
+    b->slow_rate = old->slow_rate;
+    b->probe_interval = old->probe_interval;
+    pthread_mutex_unlock(&old->lock);
+
+    now = _PylibMC_Now();
+    for (i = 0; i < b->nservers; i++) {
+        _PylibMC_BreakerClose(&b->servers[i], now);
+        b->servers[i].probe_ok = -1;
+    }
+
+    if (b->enabled && b->probe_interval > 0 && !_PylibMC_StartProber(b)) {
+        _PylibMC_FreeBreakers(b);
+        PyErr_SetString(PyExc_RuntimeError, "can't start probing thread");
+        return NULL;
+    }
+    return b;
+}
+
+static PyObject *PylibMC_Client_set_breaker(PylibMC_Client *self,
+        PyObject *args, PyObject *kwds) {
+    pylibmc_breakers *b;
+    unsigned char enabled = 1, fallback = 0;
+    unsigned int min_calls = 20;
+    double error_rate = 0.5, window = 10.0, cooldown = 5.0;
+    double slow_after = 0, slow_rate = 0.5, probe_interval = 0, now;
+    uint32_t i;
+
+    static char *kws[] = { "enabled", "error_rate", "min_calls", "window",
+                           "cooldown", "slow_after", "slow_rate",
+                           "probe_interval", "fallback", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|bdIdddddb", kws,
+                &enabled, &error_rate, &min_calls, &window, &cooldown,
+                &slow_after, &slow_rate, &probe_interval, &fallback)) {
+        return NULL;
+    } else if (error_rate <= 0 || error_rate > 1
+            || slow_rate <= 0 || slow_rate > 1) {
+        PyErr_SetString(PyExc_ValueError,
+                "error_rate and slow_rate must be within (0, 1]");
+        return NULL;
+    } else if (window <= 0 || cooldown < 0 || slow_after < 0
+            || probe_interval < 0) {
+        PyErr_SetString(PyExc_ValueError,
+                "window must be positive, and times not negative");
+        return NULL;
+    } else if (!_PylibMC_ClientReady(self)) {
+        return NULL;
+    }
+
+    if ((b = self->cluster->breakers) == NULL) {
+        if ((b = _PylibMC_NewBreakers(self)) == NULL) {
+            return NULL;
+        }
+        self->cluster->breakers = b;
+    }
+
+    _PylibMC_StopProber(b);
+
+    now = _PylibMC_Now();
+    pthread_mutex_lock(&b->lock);
+    b->enabled = enabled;
+    b->fallback = fallback;
+    b->error_rate = error_rate;
+    b->min_calls = min_calls;
+    b->window = window;
+    b->cooldown = cooldown;
+    b->slow_after = slow_after;
+    b->slow_rate = slow_rate;
+    b->probe_interval = probe_interval;
+    for (i = 0; i < b->nservers; i++) {
+        _PylibMC_BreakerClose(&b->servers[i], now);
+        b->servers[i].probe_ok = -1;
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    if (enabled && probe_interval > 0 && !_PylibMC_StartProber(b)) {
+        PyErr_SetString(PyExc_RuntimeError, "can't start probing thread");
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *PylibMC_Client_breaker_stats(PylibMC_Client *self) {
+    static char *states[] = { "closed", "open", "half-open" };
+    pylibmc_breakers *b;
+    PyObject *retval;
+    uint32_t i;
+
+    if (!_PylibMC_ClientReady(self)) {
+        return NULL;
+    } else if ((retval = PyList_New(0)) == NULL) {
+        return NULL;
+    } else if ((b = self->cluster->breakers) == NULL) {
+        return retval;
+    }
+
+    for (i = 0; i < b->nservers; i++) {
+        pylibmc_breaker br;
+        PyObject *stats, *probe, *probe_latency;
+        int rc;
+
+        pthread_mutex_lock(&b->lock);
+        br = b->servers[i];
+        pthread_mutex_unlock(&b->lock);
+
+        probe = (br.probe_ok < 0) ? Py_None : PyBool_FromLong(br.probe_ok);
+        probe_latency = (br.probe_ok < 0) ? Py_None
+                                          : PyFloat_FromDouble(br.probe_latency);
+        if (br.probe_ok < 0) {
+            Py_INCREF(Py_None);
+            Py_INCREF(Py_None);
+        }
+        stats = Py_BuildValue("{s:N,s:s,s:I,s:I,s:I,s:k,s:k,s:N,s:N}",
+                "server", PyString_FromFormat("%s:%u", br.hostname, br.port),
+                "state", states[br.state],
+                "calls", br.calls,
+                "failures", br.failures,
+                "slow", br.slow,
+                "trips", br.trips,
+                "rejected", br.rejected,
+                "probe", probe,
+                "probe_latency", probe_latency);
+        if (stats == NULL) {
+            Py_DECREF(retval);
+            return NULL;
+        }
+        rc = PyList_Append(retval, stats);
+        Py_DECREF(stats);
+        if (rc == -1) {
+            Py_DECREF(retval);
+            return NULL;
+        }
+    }
+
+    return retval;
+}
+/* }}} */
+
+/* {{{ Replication */
+/* The replicas of self's keys if replication is on, or NULL. */
+static pylibmc_replicas *_PylibMC_Replicas(PylibMC_Client *self) {
+    pylibmc_replicas *r = self->cluster->replicas;
+
+    return (r != NULL && r->copies) ? r : NULL;
+}
+
+static void _PylibMC_FreeReplicas(pylibmc_replicas *r) {
+    PyMem_Free(r->route);
+    PyMem_Free(r->served);
+    PyMem_Free(r);
+}
+
+/* Set up copies replicas for self's cluster, finding a key that maps to
+ * each server to route by. libmemcached can only be pointed at a server
+ * through a key that hashes to it. */
+static int _PylibMC_NewReplicas(PylibMC_Client *self, unsigned int copies) {
+    uint32_t nservers = memcached_server_count(self->mc);
+    pylibmc_replicas *r, *old;
+    uint32_t covered = 0;
+    unsigned long n;
+
+    if (copies >= nservers) {
+        PyErr_Format(PyExc_ValueError,
+                "can't keep %u replicas with %u servers",
+                copies, (unsigned int)nservers);
+        return 0;
+    }
+
+    if ((r = PyMem_New(pylibmc_replicas, 1)) == NULL) {
+        PyErr_NoMemory();
+        return 0;
+    }
+    r->copies = copies;
+    r->nservers = nservers;
+    r->write_errors = 0;
+    r->route = PyMem_Malloc(sizeof(*r->route) * nservers);
+    r->served = PyMem_New(unsigned long, copies + 1);
+    if (r->route == NULL || r->served == NULL) {
+        _PylibMC_FreeReplicas(r);
+        PyErr_NoMemory();
+        return 0;
+    }
+    memset(r->route, 0, sizeof(*r->route) * nservers);
+    memset(r->served, 0, sizeof(unsigned long) * (copies + 1));
+
+    for (n = 0; covered < nservers && n < 10000UL * nservers; n++) {
+        char key[PYLIBMC_ROUTE_LEN];
+        int len = snprintf(key, sizeof(key), "pylibmc-route-%lu", n);
+        uint32_t server = memcached_generate_hash(self->mc, key, len);
+
+        if (server < nservers && !r->route[server][0]) {
+            memcpy(r->route[server], key, len + 1);
+            covered++;
+        }
+    }
+    if (covered < nservers) {
+        _PylibMC_FreeReplicas(r);
+        PyErr_SetString(PylibMCExc_MemcachedError,
+                "distribution never maps to some server");
+        return 0;
+    }
+
+    old = self->cluster->replicas;
+    self->cluster->replicas = r;
+    _PylibMC_Retire(self, PYLIBMC_RETIRED_REPLICAS, old);
+    return 1;
+}
+
+/* Write to the replicas of a key whose primary is server primary. The
+ * copies are sent noreply, and sets and deletes go through the write
+ * buffers, so they go out together on the next _PylibMC_ReplicaFlush and
+ * leave no replies to wait for. op is a _by_key storage command, or NULL
+ * to delete. Returns how many replicas it went out to.
+ *
+ * With stand_in, the copies stand in for a primary that couldn't take the
+ * write, and whether it went through rests on them: they're sent one at a
+ * time waiting for replies, which are read there and then, and only those
+ * a replica stored count. Doesn't need the GIL. */
+static unsigned int _PylibMC_ReplicaWrite(memcached_st *mc,
+        pylibmc_replicas *r, pylibmc_breakers *b, uint32_t primary,
+        _PylibMC_SetByKeyCommand op, const char *key, size_t key_len,
+        const char *value, size_t value_len, time_t time, uint32_t flags,
+        int stand_in) {
+    uint64_t buffered = memcached_behavior_get(mc,
+            MEMCACHED_BEHAVIOR_BUFFER_REQUESTS);
+    uint64_t noreply = memcached_behavior_get(mc, MEMCACHED_BEHAVIOR_NOREPLY);
+    unsigned int i, ok = 0;
+    int buffer = !stand_in;
+
+    if ((buffered != 0) != buffer) {
+        memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, buffer);
+    }
+    if ((noreply != 0) != buffer) {
+        memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_NOREPLY, buffer);
+    }
+
+    for (i = 1; i <= r->copies; i++) {
+        uint32_t server = (primary + i) % r->nservers;
+        const char *route = r->route[server];
+        memcached_return rc;
+
+        if (b != NULL && _PylibMC_BreakerOpen(b, server, _PylibMC_Now())) {
+            continue;
+        } else if (op == NULL) {
+            rc = memcached_delete_by_key(mc, route, strlen(route),
+                                         key, key_len, time);
+        } else {
+            rc = op(mc, route, strlen(route), key, key_len,
+                    value, value_len, time, flags);
+        }
+
+        switch (rc) {
+            case MEMCACHED_SUCCESS:
+                ok++;
+                break;
+            case MEMCACHED_BUFFERED:
+            case MEMCACHED_NOTFOUND:
+            case MEMCACHED_NOTSTORED:
+                /* sent, but not known to be stored */
+                ok += !stand_in;
+                break;
+            default:
+                __sync_fetch_and_add(&r->write_errors, 1);
+        }
+    }
+
+    if ((buffered != 0) != buffer) {
+        memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS,
+                               buffered);
+    }
+    if ((noreply != 0) != buffer) {
+        memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_NOREPLY, noreply);
+    }
+    return ok;
+}
+
+/* Send off what _PylibMC_ReplicaWrite buffered. */
+static void _PylibMC_ReplicaFlush(memcached_st *mc) {
+    memcached_flush_buffers(mc);
+}
+
+/* The _by_key command to copy a write done with f to the replicas. Writes
+ * that went through on the primary are copied as plain sets, so that an add
+ * or a replace doesn't fail on a replica that missed an earlier write. */
+static _PylibMC_SetByKeyCommand _PylibMC_ReplicaCommand(
+        _PylibMC_SetCommand f, int primary_ok) {
+    if (f == memcached_append) {
+        return memcached_append_by_key;
+    } else if (f == memcached_prepend) {
+        return memcached_prepend_by_key;
+    } else if (primary_ok || f == memcached_set) {
+        return memcached_set_by_key;
+    } else if (f == memcached_add) {
+        return memcached_add_by_key;
+    } else {
+        return memcached_replace_by_key;
+    }
+}
+
+/* Ask the replicas of a key its primary didn't have, in order. Returns what
+ * memcached_get would. Doesn't need the GIL. */
+static char *_PylibMC_ReplicaGet(memcached_st *mc, pylibmc_replicas *r,
+        pylibmc_breakers *b, uint32_t primary, const char *key,
+        size_t key_len, size_t *value_len, uint32_t *flags,
+        memcached_return *error, pylibmc_deadline *dl) {
+    unsigned int i;
+
+    for (i = 1; i <= r->copies; i++) {
+        uint32_t server = (primary + i) % r->nservers;
+        const char *route = r->route[server];
+        char *value;
+
+        if (b != NULL && _PylibMC_BreakerOpen(b, server, _PylibMC_Now())) {
+            continue;
+        } else if (!_PylibMC_DeadlineArm(mc, dl)) {
+            break;
+        }
+        value = memcached_get_by_key(mc, route, strlen(route), key, key_len,
+                                     value_len, flags, error);
+        if (value != NULL || *error == MEMCACHED_SUCCESS) {
+            __sync_fetch_and_add(&r->served[i], 1);
+            return value;
+        } else if (_PylibMC_IsServerFailure(*error)) {
+            _PylibMC_DeadlineCheck(dl);
+        }
+    }
+
+    *error = MEMCACHED_NOTFOUND;
+    return NULL;
+}
+
+/* Slot of a key in a table of 2 ** n slots, as made by _PylibMC_ReplicaGetMulti. */
+static size_t _PylibMC_KeySlot(size_t *table, size_t mask, char **keys,
+        size_t *key_lens, const char *key, size_t key_len) {
+    uint32_t h = 2166136261U;
+    size_t i;
+
+    for (i = 0; i < key_len; i++) {
+        h = (h ^ (unsigned char)key[i]) * 16777619U;
+    }
+    for (i = h & mask; table[i]; i = (i + 1) & mask) {
+        size_t k = table[i] - 1;
+
+        if (key_lens[k] == key_len && !memcmp(keys[k], key, key_len)) {
+            break;
+        }
+    }
+    return i;
+}
+
+/* Look for the keys that the primaries' results lack on their replicas, one
+ * replica at a time, adding what's found to results. nresults can't go past
+ * nkeys. Doesn't need the GIL. */
+static void _PylibMC_ReplicaGetMulti(memcached_st *mc, pylibmc_replicas *r,
+        pylibmc_breakers *b, char **keys, size_t *key_lens, size_t nkeys,
+        pylibmc_mget_result *results, size_t *nresults,
+        pylibmc_deadline *dl) {
+    size_t i, j, mask, served;
+    size_t *table = NULL, *sub_lens = NULL;
+    uint32_t *primary = NULL, server;
+    unsigned char *found = NULL;
+    char **sub = NULL, *err_func;
+    memcached_return rc;
+
+    for (mask = 1; mask < nkeys * 2; mask <<= 1);
+    table = calloc(mask, sizeof(size_t));
+    mask--;
+    primary = malloc(sizeof(uint32_t) * nkeys);
+    found = calloc(nkeys, 1);
+    sub = malloc(sizeof(char *) * nkeys);
+    sub_lens = malloc(sizeof(size_t) * nkeys);
+    if (table == NULL || primary == NULL || found == NULL || sub == NULL
+            || sub_lens == NULL) {
+        goto done;
+    }
+
+    for (i = 0; i < nkeys; i++) {
+        size_t slot = _PylibMC_KeySlot(table, mask, keys, key_lens,
+                                       keys[i], key_lens[i]);
+
+        table[slot] = i + 1;
+        primary[i] = memcached_generate_hash(mc, keys[i], key_lens[i]);
+    }
+
+    served = 0;
+    for (i = 1; i <= r->copies + 1; i++) {
+        /* mark what the last round found */
+        for (j = served; j < *nresults; j++) {
+            size_t slot = _PylibMC_KeySlot(table, mask, keys, key_lens,
+                    results[j].key, results[j].key_len);
+
+            if (table[slot]) {
+                found[table[slot] - 1] = 1;
+            }
+        }
+        __sync_fetch_and_add(&r->served[i - 1], *nresults - served);
+        served = *nresults;
+
+        if (i > r->copies || dl->expired) {
+            break;
+        }
+
+        for (server = 0; server < r->nservers; server++) {
+            const char *route = r->route[server];
+            size_t nsub = 0;
+
+            for (j = 0; j < nkeys; j++) {
+                if (!found[j] && key_lens[j]
+                        && (primary[j] + i) % r->nservers == server) {
+                    sub[nsub] = keys[j];
+                    sub_lens[nsub++] = key_lens[j];
+                }
+            }
+            if (!nsub || (b != NULL
+                    && _PylibMC_BreakerOpen(b, server, _PylibMC_Now()))) {
+                continue;
+            }
+
+            rc = pylibmc_memcached_fetch_multi(mc, route, strlen(route),
+                                               sub, nsub, sub_lens,
+                                               results, nresults, nkeys,
+                                               &err_func, dl);
+            if (rc == MEMCACHED_TIMEOUT && dl->expired) {
+                break;
+            }
+        }
+    }
+
+done:
+    free(table);
+    free(primary);
+    free(found);
+    free(sub);
+    free(sub_lens);
+}
+
+static PyObject *PylibMC_Client_set_replicas(PylibMC_Client *self,
+        PyObject *args) {
+    unsigned int copies;
+
+    if (!PyArg_ParseTuple(args, "I", &copies)) {
+        return NULL;
+    } else if (!_PylibMC_ClientReady(self)) {
+        return NULL;
+    }
+
+    if (copies) {
+        if (!_PylibMC_NewReplicas(self, copies)) {
+            return NULL;
+        }
+    } else {
+        pylibmc_replicas *old = self->cluster->replicas;
+
+        self->cluster->replicas = NULL;
+        _PylibMC_Retire(self, PYLIBMC_RETIRED_REPLICAS, old);
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *PylibMC_Client_replica_stats(PylibMC_Client *self) {
+    pylibmc_replicas *r = self->cluster->replicas;
+    PyObject *served;
+    unsigned int i;
+
+    if (r == NULL) {
+        return Py_BuildValue("{s:I,s:[k],s:k}",
+                "replicas", 0, "served", 0UL, "write_errors", 0UL);
+    } else if ((served = PyList_New(r->copies + 1)) == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i <= r->copies; i++) {
+        PyObject *n = PyLong_FromUnsignedLong(r->served[i]);
+
+        if (n == NULL) {
+            Py_DECREF(served);
+            return NULL;
+        }
+        PyList_SET_ITEM(served, i, n);
+    }
+
+    return Py_BuildValue("{s:I,s:N,s:k}", "replicas", r->copies,
+            "served", served, "write_errors", r->write_errors);
+}
+/* }}} */
+
+/* {{{ Hedged reads */
+/* The hedging settings of self's cluster, if it has some and replicas to
+ * hedge with, or NULL. */
+static pylibmc_hedging *_PylibMC_Hedging(PylibMC_Client *self) {
+    return (_PylibMC_Replicas(self) != NULL) ? self->cluster->hedging : NULL;
+}
+
+static pylibmc_hedging *_PylibMC_NewHedging(double after, double percentile,
+        double budget) {
+    pylibmc_hedging *h;
+
+    if ((h = PyMem_New(pylibmc_hedging, 1)) == NULL) {
+        return (pylibmc_hedging *)PyErr_NoMemory();
+    }
+    memset(h, 0, sizeof(*h));
+    pthread_mutex_init(&h->lock, NULL);
+    h->after = after;
+    h->percentile = percentile;
+    h->budget = budget;
+    h->threshold = after;
+    h->tokens = 1;
+    h->forks = _PylibMC_forks;
+    return h;
+}
+
+static void _PylibMC_FreeHedging(pylibmc_hedging *h) {
+    pthread_mutex_destroy(&h->lock);
+    PyMem_Free(h);
+}
+
+/* Some other thread of the parent may have held the lock when it forked. */
+static void _PylibMC_HedgingAfterFork(pylibmc_hedging *h) {
+    if (h != NULL && h->forks != _PylibMC_forks) {
+        pthread_mutex_init(&h->lock, NULL);
+        h->forks = _PylibMC_forks;
+    }
+}
+
+/* Note how long the primary took to answer a get. Rather than sorting
+ * recent latencies, the estimate is nudged with each: up by a share of
+ * itself when the get took longer, down when it didn't, in proportion so
+ * that it settles where percentile of gets are quicker. */
+static void _PylibMC_HedgeSample(pylibmc_hedging *h, double latency) {
+    double p = h->percentile / 100;
+
+    if (p <= 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&h->lock);
+    if (h->estimate <= 0) {
+        h->estimate = latency;
+    } else if (latency > h->estimate) {
+        h->estimate += h->estimate * PYLIBMC_HEDGE_STEP * p;
+    } else {
+        h->estimate -= h->estimate * PYLIBMC_HEDGE_STEP * (1 - p);
+    }
+    if (h->nsamples < PYLIBMC_HEDGE_WARMUP) {
+        h->nsamples++;
+    } else {
+        h->threshold = h->estimate;
+    }
+    pthread_mutex_unlock(&h->lock);
+}
+
+/* How far along a reply to "get <key>" is: 0 if more is to come, 1 once
+ * it's all there. -1 if it's an error or doesn't make sense. */
+static int _PylibMC_HedgeParse(pylibmc_hedge_read *r) {
+    char line[MEMCACHED_MAX_KEY + 64];
+    char *eol;
+    unsigned int flags;
+    unsigned long bytes;
+    size_t header;
+
+    if ((eol = memchr(r->buf, '\n', r->len)) == NULL) {
+        return (r->len < sizeof(line)) ? 0 : -1;
+    } else if ((header = eol - r->buf + 1) >= sizeof(line)) {
+        return -1;
+    } else if (header == 5 && !memcmp(r->buf, "END\r\n", 5)) {
+        r->status = 2;
+        return 1;
+    }
+
+    memcpy(line, r->buf, header);
+    line[header] = '\0';
+    if (sscanf(line, "VALUE %*s %u %lu", &flags, &bytes) != 2) {
+        return -1;
+    } else if (r->len < header + bytes + 7) {
+        return 0;
+    } else if (memcmp(r->buf + header + bytes, "\r\nEND\r\n", 7)) {
+        return -1;
+    }
+
+    r->status = 1;
+    r->flags = flags;
+    r->value_off = header;
+    r->value_len = bytes;
+    return 1;
+}
+
+/* Read what's there of a reply; returns as _PylibMC_HedgeParse does. */
+static int _PylibMC_HedgeRead(pylibmc_hedge_read *r) {
+    ssize_t n;
+
+    if (r->size - r->len < 4096) {
+        size_t size = r->size * 2 + 4096;
+        char *buf = realloc(r->buf, size);
+
+        if (buf == NULL) {
+            return -1;
+        }
+        r->buf = buf;
+        r->size = size;
+    }
+
+    n = recv(r->fd, r->buf + r->len, r->size - r->len, MSG_DONTWAIT);
+    if (n > 0) {
+        r->len += n;
+        return _PylibMC_HedgeParse(r);
+    } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK
+                           || errno == EINTR)) {
+        return 0;
+    }
+    return -1;
+}
+
+/* Whether libmemcached's connection to a server is there and has nothing
+ * in flight, so a request can be slipped in and its reply read by hand. */
+static int _PylibMC_ServerIdle(memcached_server_st *server) {
+    return server->fd != -1 && server->type != MEMCACHED_CONNECTION_UDP
+        && server->cursor_active == 0 && server->read_data_length == 0
+        && server->write_buffer_offset == 0;
+}
+
+/* Get a key off its primary by hand, and if that hasn't answered within
+ * the threshold and the budget allows, off its first replica as well, and
+ * take whichever answers first. The other one's connection is closed, as
+ * it still owes a reply. *rank is 1 if the replica won, 0 otherwise.
+ *
+ * Returns 0, having done nothing, if the key or the connections aren't
+ * fit for it, leaving the get to libmemcached. Otherwise 1, with the
+ * outcome as memcached_get would have it. Doesn't need the GIL. */
+static int _PylibMC_HedgedGet(memcached_st *mc, pylibmc_replicas *r,
+        pylibmc_hedging *h, pylibmc_breakers *b, uint32_t primary,
+        const char *key, size_t key_len, char **value, size_t *value_len,
+        uint32_t *flags, memcached_return *error, unsigned int *rank,
+        pylibmc_deadline *dl) {
+    memcached_server_st *servers[2];
+    pylibmc_hedge_read reads[2];
+    struct pollfd pfds[2];
+    char request[MEMCACHED_MAX_KEY + 8];
+    double start, now, until, hedge_at, threshold;
+    int32_t poll_timeout;
+    int hedge = 0, winner = -1, i;
+    size_t j;
+
+    servers[0] = &memcached_server_list(mc)[primary];
+    servers[1] = &memcached_server_list(mc)[(primary + 1) % r->nservers];
+    if (memcached_behavior_get(mc, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL)
+            || key_len == 0 || key_len >= MEMCACHED_MAX_KEY
+            || !_PylibMC_ServerIdle(servers[0])) {
+        return 0;
+    }
+    for (j = 0; j < key_len; j++) {
+        if ((unsigned char)key[j] <= ' ' || key[j] == 0x7f) {
+            return 0;
+        }
+    }
+
+    pthread_mutex_lock(&h->lock);
+    h->gets++;
+    h->tokens += h->budget;
+    if (h->tokens > 1 + h->budget * 100) {
+        h->tokens = 1 + h->budget * 100;
+    }
+    threshold = h->threshold;
+    pthread_mutex_unlock(&h->lock);
+
+    memcpy(request, "get ", 4);
+    memcpy(request + 4, key, key_len);
+    memcpy(request + 4 + key_len, "\r\n", 2);
+
+    memset(reads, 0, sizeof(reads));
+    reads[0].fd = servers[0]->fd;
+    reads[1].fd = -1;
+    start = _PylibMC_Now();
+    if (send(reads[0].fd, request, key_len + 6, MSG_DONTWAIT | MSG_NOSIGNAL)
+            != (ssize_t)(key_len + 6)) {
+        /* nothing half-sent is worth keeping the connection around for */
+        reads[0].status = -1;
+    }
+
+    poll_timeout = (int32_t)memcached_behavior_get(mc,
+            MEMCACHED_BEHAVIOR_POLL_TIMEOUT);
+    until = start + ((poll_timeout > 0) ? poll_timeout / 1000.0 : 86400);
+    if (dl->at >= 0 && dl->at < until) {
+        until = dl->at;
+    }
+    hedge_at = (threshold > 0) ? start + threshold : until;
+
+    while (winner == -1) {
+        int wait, n;
+
+        now = _PylibMC_Now();
+        if (!hedge && (now >= hedge_at || reads[0].status == -1)) {
+            int allowed = 0;
+
+            /* it's now or never */
+            hedge = 1;
+            if (_PylibMC_ServerIdle(servers[1]) && (b == NULL
+                    || !_PylibMC_BreakerOpen(b, (primary + 1) % r->nservers,
+                                             now))) {
+                pthread_mutex_lock(&h->lock);
+                if ((allowed = (h->tokens >= 1))) {
+                    h->tokens -= 1;
+                    h->hedged++;
+                }
+                pthread_mutex_unlock(&h->lock);
+            }
+            if (allowed) {
+                reads[1].fd = servers[1]->fd;
+                if (send(reads[1].fd, request, key_len + 6,
+                         MSG_DONTWAIT | MSG_NOSIGNAL)
+                        != (ssize_t)(key_len + 6)) {
+                    reads[1].status = -1;
+                }
+            }
+        }
+
+        if (reads[0].status == -1 && reads[1].status == 3) {
+            /* the primary's gone, so the replica's miss it is */
+            reads[1].status = 2;
+            winner = 1;
+            break;
+        } else if ((reads[0].status == -1 && (reads[1].fd == -1
+                                              || reads[1].status == -1))
+                || now >= until) {
+            break;
+        }
+
+        pfds[0].fd = (reads[0].status == 0) ? reads[0].fd : -1;
+        pfds[1].fd = (reads[1].status == 0) ? reads[1].fd : -1;
+        pfds[0].events = pfds[1].events = POLLIN;
+        pfds[0].revents = pfds[1].revents = 0;
+        wait = (int)(((!hedge && hedge_at < until ? hedge_at : until)
+                      - now) * 1000) + 1;
+        if ((n = poll(pfds, 2, wait)) == -1 && errno != EINTR) {
+            break;
+        }
+
+        for (i = 0; i < 2 && n > 0; i++) {
+            if (pfds[i].fd == -1 || !pfds[i].revents) {
+                continue;
+            } else if (_PylibMC_HedgeRead(&reads[i]) == -1) {
+                reads[i].status = -1;
+            } else if (reads[i].status == 1 || (i == 0
+                                                && reads[i].status == 2)) {
+                winner = i;
+                break;
+            } else if (reads[i].status == 2) {
+                /* a replica that doesn't have it is no reason to stop
+                 * waiting for the primary */
+                reads[i].status = 3;
+            }
+        }
+    }
+
+    /* When the primary lost, how long it's taken so far is all we know. */
+    now = _PylibMC_Now();
+    _PylibMC_HedgeSample(h, now - start);
+    if (winner == 1) {
+        pthread_mutex_lock(&h->lock);
+        h->won++;
+        pthread_mutex_unlock(&h->lock);
+    }
+
+    /* Connections still owing a reply, or that got a bad one, go. */
+    for (i = 0; i < 2; i++) {
+        if (reads[i].fd != -1 && i != winner && reads[i].status != 3) {
+            _PylibMC_CloseServer(servers[i]);
+        }
+    }
+
+    *rank = (winner == 1) ? 1 : 0;
+    *value = NULL;
+    if (winner == -1) {
+        *error = (now >= until) ? MEMCACHED_TIMEOUT : MEMCACHED_READ_FAILURE;
+        if (*error == MEMCACHED_TIMEOUT) {
+            _PylibMC_DeadlineCheck(dl);
+        }
+    } else if (reads[winner].status == 2) {
+        *error = MEMCACHED_NOTFOUND;
+    } else if ((*value = malloc(reads[winner].value_len + 1)) == NULL) {
+        *error = MEMCACHED_MEMORY_ALLOCATION_FAILURE;
+    } else {
+        memcpy(*value, reads[winner].buf + reads[winner].value_off,
+               reads[winner].value_len);
+        (*value)[reads[winner].value_len] = '\0';
+        *value_len = reads[winner].value_len;
+        *flags = reads[winner].flags;
+        *error = MEMCACHED_SUCCESS;
+    }
+
+    free(reads[0].buf);
+    free(reads[1].buf);
+    return 1;
+}
+
+static PyObject *PylibMC_Client_set_hedging(PylibMC_Client *self,
+        PyObject *args, PyObject *kwds) {
+    pylibmc_hedging *h = NULL, *old;
+    double after = 0, percentile = 0, budget = 0.05;
+
+    static char *kws[] = { "after", "percentile", "budget", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ddd", kws,
+                &after, &percentile, &budget)) {
+        return NULL;
+    } else if (after < 0 || percentile < 0 || percentile >= 100) {
+        PyErr_SetString(PyExc_ValueError,
+                "after must not be negative, and percentile within [0, 100)");
+        return NULL;
+    } else if (budget < 0 || budget > 1) {
+        PyErr_SetString(PyExc_ValueError, "budget must be within [0, 1]");
+        return NULL;
+    }
+
+    if ((after > 0 || percentile > 0)
+            && (h = _PylibMC_NewHedging(after, percentile, budget)) == NULL) {
+        return NULL;
+    }
+    old = self->cluster->hedging;
+    self->cluster->hedging = h;
+    _PylibMC_Retire(self, PYLIBMC_RETIRED_HEDGING, old);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *PylibMC_Client_hedge_stats(PylibMC_Client *self) {
+    pylibmc_hedging *h = self->cluster->hedging;
+    unsigned long gets, hedged, won;
+    double threshold;
+
+    if (h == NULL) {
+        return Py_BuildValue("{s:k,s:k,s:k,s:O}", "gets", 0UL,
+                "hedged", 0UL, "won", 0UL, "threshold", Py_None);
+    }
+
+    pthread_mutex_lock(&h->lock);
+    gets = h->gets;
+    hedged = h->hedged;
+    won = h->won;
+    threshold = h->threshold;
+    pthread_mutex_unlock(&h->lock);
+
+    return Py_BuildValue("{s:k,s:k,s:k,s:d}", "gets", gets,
+            "hedged", hedged, "won", won, "threshold", threshold);
+}
+/* }}} */
+
+/* {{{ Hot keys */
+/* The hot key sampler of self's cluster, or NULL. */
+static pylibmc_hotkeys *_PylibMC_HotKeys(PylibMC_Client *self) {
+    return self->cluster->hotkeys;
+}
+
+static pylibmc_hotkeys *_PylibMC_NewHotKeys(double rate, uint32_t width,
+        uint32_t depth, unsigned int size, double window, unsigned int copies,
+        double threshold, time_t ttl) {
+    pylibmc_hotkeys *hk;
+
+    if ((hk = PyMem_New(pylibmc_hotkeys, 1)) == NULL) {
+        return (pylibmc_hotkeys *)PyErr_NoMemory();
+    }
+    memset(hk, 0, sizeof(*hk));
+    hk->rate = rate;
+    hk->cutoff = (uint64_t)(rate * 4294967296.0);
+    hk->rng = ((uint64_t)(size_t)hk << 16) ^ (uint64_t)time(NULL) ^ 1;
+    hk->width = width;
+    hk->depth = depth;
+    hk->size = size;
+    hk->window = window;
+    hk->decayed_at = _PylibMC_Now();
+    hk->copies = copies;
+    hk->threshold = threshold;
+    hk->ttl = ttl;
+    hk->hot_count = (threshold * window * rate < 1)
+                  ? 1 : (uint32_t)(threshold * window * rate);
+    hk->sketch = PyMem_New(uint32_t, (size_t)width * depth);
+    hk->heap = PyMem_New(pylibmc_hot_key, size);
+    if (hk->sketch == NULL || hk->heap == NULL) {
+        _PylibMC_FreeHotKeys(hk);
+        return (pylibmc_hotkeys *)PyErr_NoMemory();
+    }
+    memset(hk->sketch, 0, sizeof(uint32_t) * width * depth);
+
+    /* no more than size keys are hot at once, so the table is never more
+     * than half full */
+    if (copies) {
+        for (hk->hot_mask = 1; hk->hot_mask < size * 2; hk->hot_mask <<= 1);
+        hk->hot = PyMem_New(pylibmc_hot_slot, hk->hot_mask);
+        if (hk->hot == NULL) {
+            _PylibMC_FreeHotKeys(hk);
+            return (pylibmc_hotkeys *)PyErr_NoMemory();
+        }
+        memset(hk->hot, 0, sizeof(pylibmc_hot_slot) * hk->hot_mask);
+        hk->hot_mask--;
+    }
+    return hk;
+}
+
+static void _PylibMC_FreeHotKeys(pylibmc_hotkeys *hk) {
+    PyMem_Free(hk->sketch);
+    PyMem_Free(hk->heap);
+    PyMem_Free(hk->hot);
+    PyMem_Free(hk);
+}
+
+static uint64_t _PylibMC_HotKeyHash(const char *key, size_t key_len) {
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < key_len; i++) {
+        h = (h ^ (unsigned char)key[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+/* xorshift64 */
+static uint32_t _PylibMC_HotRandom(pylibmc_hotkeys *hk) {
+    hk->rng ^= hk->rng << 13;
+    hk->rng ^= hk->rng >> 7;
+    hk->rng ^= hk->rng << 17;
+    return (uint32_t)(hk->rng >> 32);
+}
+
+/* Write the key copy suffix of key is stored under to buf, which has room
+ * for MEMCACHED_MAX_KEY. Returns its length, or 0 if it'd be too long. */
+static size_t _PylibMC_HotCopyKey(const char *key, size_t key_len,
+        uint32_t suffix, char *buf) {
+    char tail[24];
+    int tail_len = snprintf(tail, sizeof(tail), ":hot:%u", suffix);
+
+    if (key_len + tail_len >= MEMCACHED_MAX_KEY) {
+        return 0;
+    }
+    memcpy(buf, key, key_len);
+    memcpy(buf + key_len, tail, tail_len + 1);
+    return key_len + tail_len;
+}
+
+/* The slot of key in the table of hot keys: the one it's in, or the empty
+ * one it'd go in. */
+static pylibmc_hot_slot *_PylibMC_HotSlot(pylibmc_hotkeys *hk,
+        const char *key, size_t key_len, uint64_t hash) {
+    unsigned int i;
+
+    for (i = hash & hk->hot_mask; hk->hot[i].key_len;
+            i = (i + 1) & hk->hot_mask) {
+        pylibmc_hot_slot *slot = &hk->hot[i];
+
+        if (slot->hash == hash && slot->key_len == key_len
+                && !memcmp(slot->key, key, key_len)) {
+            break;
+        }
+    }
+    return &hk->hot[i];
+}
+
+/* Make key hot, picking keys for its copies that map to servers other than
+ * its own and each other's. There may be fewer such servers than copies. */
+static void _PylibMC_HotPromote(pylibmc_hotkeys *hk, memcached_st *mc,
+        const char *key, size_t key_len, uint64_t hash) {
+    pylibmc_hot_slot *slot = _PylibMC_HotSlot(hk, key, key_len, hash);
+    pylibmc_hot_copies *c = &slot->copies;
+    uint32_t primary, suffix;
+    char buf[MEMCACHED_MAX_KEY];
+
+    if (slot->key_len || hk->nhot >= (hk->hot_mask + 1) / 2) {
+        return;
+    }
+
+    memcpy(slot->key, key, key_len);
+    slot->key_len = key_len;
+    slot->hash = hash;
+    hk->nhot++;
+
+    primary = memcached_generate_hash(mc, key, key_len);
+    c->n = 0;
+    for (suffix = 0; c->n < hk->copies && suffix < 64 * hk->copies;
+            suffix++) {
+        size_t len = _PylibMC_HotCopyKey(key, key_len, suffix, buf);
+        uint32_t server;
+        unsigned int i;
+
+        if (!len) {
+            break;
+        }
+        server = memcached_generate_hash(mc, buf, len);
+        for (i = 0; i < c->n && c->server[i] != server; i++);
+        if (server != primary && i == c->n) {
+            c->suffix[c->n] = suffix;
+            c->server[c->n++] = server;
+        }
+    }
+}
+
+/* Make the top keys that are still hot enough the only hot ones. */
+static void _PylibMC_HotRebuild(pylibmc_hotkeys *hk, memcached_st *mc) {
+    unsigned int i;
+
+    memset(hk->hot, 0, sizeof(pylibmc_hot_slot) * (hk->hot_mask + 1));
+    hk->nhot = 0;
+    for (i = 0; i < hk->nheap; i++) {
+        pylibmc_hot_key *e = &hk->heap[i];
+
+        if (e->count >= hk->hot_count) {
+            _PylibMC_HotPromote(hk, mc, e->key, e->key_len, e->hash);
+        }
+    }
+}
+
+/* Copy where key's copies are to c, for use once the GIL is released.
+ * Returns how many there are, 0 if key isn't hot. */
+static unsigned int _PylibMC_HotLookup(pylibmc_hotkeys *hk, const char *key,
+        size_t key_len, pylibmc_hot_copies *c) {
+    pylibmc_hot_slot *slot;
+
+    c->n = 0;
+    if (hk->nhot && key_len) {
+        slot = _PylibMC_HotSlot(hk, key, key_len,
+                                _PylibMC_HotKeyHash(key, key_len));
+        if (slot->key_len) {
+            *c = slot->copies;
+        }
+    }
+    return c->n;
+}
+
+/* Bring the copies of key up to date with a write of value to it, or a
+ * delete if value is NULL. The copies aren't kept for more than ttl
+ * seconds. The commands are buffered and sent noreply, so a write of many
+ * hot keys reaches their copies in one go with memcached_flush_buffers.
+ * Doesn't need the GIL. */
+static void _PylibMC_HotFanOut(memcached_st *mc, const pylibmc_hot_copies *c,
+        const char *key, size_t key_len, const char *value, size_t value_len,
+        time_t time, uint32_t flags, time_t ttl) {
+    uint64_t buffered = memcached_behavior_get(mc,
+            MEMCACHED_BEHAVIOR_BUFFER_REQUESTS);
+    uint64_t noreply = memcached_behavior_get(mc, MEMCACHED_BEHAVIOR_NOREPLY);
+    char buf[MEMCACHED_MAX_KEY];
+    unsigned int i;
+
+    if (!buffered) {
+        memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, 1);
+    }
+    if (!noreply) {
+        memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_NOREPLY, 1);
+    }
+
+    if (time == 0 || time > ttl) {
+        time = ttl;
+    }
+    for (i = 0; i < c->n; i++) {
+        size_t len = _PylibMC_HotCopyKey(key, key_len, c->suffix[i], buf);
+
+        if (value == NULL) {
+            memcached_delete(mc, buf, len, 0);
+        } else {
+            memcached_set(mc, buf, len, value, value_len, time, flags);
+        }
+    }
+
+    if (!buffered) {
+        memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, 0);
+    }
+    if (!noreply) {
+        memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_NOREPLY, 0);
+    }
+}
+
+/* Read the copy of a hot key stored under copy. Returns the value, with
+ * *val_size set to its size on the wire, or NULL without an exception set
+ * if the copy doesn't have it. The key's own server is up next then, with
+ * what's left of *timeout. */
+static PyObject *_PylibMC_HotCopyGet(PylibMC_Client *self, const char *copy,
+        size_t copy_len, size_t *val_size, double *timeout) {
+    char *mc_val = NULL;
+    uint32_t flags = 0;
+    memcached_return error = MEMCACHED_NOTFOUND;
+    pylibmc_deadline dl;
+    PyObject *r;
+
+    PYLIBMC_BEGIN_ALLOW_THREADS(self)
+    _PylibMC_DeadlineStart(self->mc, *timeout, &dl);
+    if (_PylibMC_DeadlineArm(self->mc, &dl)) {
+        mc_val = memcached_get(self->mc, copy, copy_len,
+                               val_size, &flags, &error);
+    }
+    _PylibMC_DeadlineEnd(self->mc, &dl);
+    PYLIBMC_END_ALLOW_THREADS
+
+    if (mc_val != NULL) {
+        r = _PylibMC_parse_memcached_value(mc_val, *val_size, flags, self);
+        free(mc_val);
+        return r;
+    } else if (error == MEMCACHED_SUCCESS) {
+        return PyString_FromStringAndSize("", 0);
+    }
+
+    if (dl.at >= 0) {
+        *timeout = dl.at - _PylibMC_Now();
+        if (*timeout < 0) {
+            *timeout = 0;
+        }
+    }
+    return NULL;
+}
+
+/* Move heap entry i down to where its count belongs. */
+static void _PylibMC_HotKeySift(pylibmc_hotkeys *hk, unsigned int i) {
+    pylibmc_hot_key tmp;
+
+    for (;;) {
+        unsigned int least = i, l = 2 * i + 1, r = 2 * i + 2;
+
+        if (l < hk->nheap && hk->heap[l].count < hk->heap[least].count) {
+            least = l;
+        }
+        if (r < hk->nheap && hk->heap[r].count < hk->heap[least].count) {
+            least = r;
+        }
+        if (least == i) {
+            break;
+        }
+        tmp = hk->heap[i];
+        hk->heap[i] = hk->heap[least];
+        hk->heap[least] = tmp;
+        i = least;
+    }
+}
+
+/* Maybe count a call on key that moved bytes of value. Most calls are let
+ * go after drawing a random number; the sampled ones bump the key's
+ * counters, and it takes the place of the coldest top key if its estimate
+ * beats it. */
+static void _PylibMC_HotKeySample(pylibmc_hotkeys *hk, memcached_st *mc,
+        const char *key, size_t key_len, size_t bytes) {
+    uint64_t h;
+    uint32_t estimate = UINT32_MAX, d, h1, h2;
+    unsigned int i;
+    double now;
+
+    if (_PylibMC_HotRandom(hk) >= hk->cutoff || !key_len) {
+        return;
+    }
+
+    now = _PylibMC_Now();
+    if (now - hk->decayed_at >= hk->window) {
+        for (i = 0; i < hk->width * hk->depth; i++) {
+            hk->sketch[i] >>= 1;
+        }
+        for (i = 0; i < hk->nheap; i++) {
+            hk->heap[i].count >>= 1;
+            hk->heap[i].bytes >>= 1;
+        }
+        hk->decayed_at = now;
+        if (hk->copies) {
+            _PylibMC_HotRebuild(hk, mc);
+        }
+    }
+    hk->samples++;
+
+    h = _PylibMC_HotKeyHash(key, key_len);
+    /* The rows' hashes are made from two halves of one. */
+    h1 = (uint32_t)h;
+    h2 = (uint32_t)(h >> 32) | 1;
+    for (d = 0; d < hk->depth; d++) {
+        uint32_t *c = &hk->sketch[d * hk->width + (h1 + d * h2) % hk->width];
+
+        if (*c < UINT32_MAX) {
+            (*c)++;
+        }
+        if (*c < estimate) {
+            estimate = *c;
+        }
+    }
+
+    for (i = 0; i < hk->nheap; i++) {
+        pylibmc_hot_key *e = &hk->heap[i];
+
+        if (e->hash == h && e->key_len == key_len
+                && !memcmp(e->key, key, key_len)) {
+            e->count = estimate;
+            e->bytes += bytes;
+            _PylibMC_HotKeySift(hk, i);
+            if (hk->copies && estimate >= hk->hot_count) {
+                _PylibMC_HotPromote(hk, mc, key, key_len, h);
+            }
+            return;
+        }
+    }
+
+    if (hk->nheap < hk->size) {
+        /* a new leaf only needs moving up */
+        i = hk->nheap++;
+        while (i && hk->heap[(i - 1) / 2].count > estimate) {
+            hk->heap[i] = hk->heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+    } else if (hk->size && estimate > hk->heap[0].count) {
+        i = 0;
+    } else {
+        return;
+    }
+
+    memcpy(hk->heap[i].key, key, key_len);
+    hk->heap[i].key_len = key_len;
+    hk->heap[i].hash = h;
+    hk->heap[i].server = memcached_generate_hash(mc, key, key_len);
+    hk->heap[i].count = estimate;
+    hk->heap[i].bytes = bytes;
+    if (i == 0) {
+        _PylibMC_HotKeySift(hk, 0);
+    }
+    if (hk->copies && estimate >= hk->hot_count) {
+        _PylibMC_HotPromote(hk, mc, key, key_len, h);
+    }
+}
+
+static PyObject *PylibMC_Client_set_hot_keys(PylibMC_Client *self,
+        PyObject *args, PyObject *kwds) {
+    pylibmc_hotkeys *hk = NULL, *old;
+    double rate = 0.01, window = 60, threshold = 1000;
+    unsigned int width = 1024, depth = 4, size = 32, copies = 0, ttl = 10;
+
+    static char *kws[] = { "sample", "width", "depth", "top", "window",
+                           "copies", "threshold", "ttl", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|dIIIdIdI", kws,
+                &rate, &width, &depth, &size, &window,
+                &copies, &threshold, &ttl)) {
+        return NULL;
+    } else if (rate < 0 || rate > 1) {
+        PyErr_SetString(PyExc_ValueError, "sample must be within [0, 1]");
+        return NULL;
+    } else if (!width || !depth || width > (1 << 24) || depth > 16) {
+        PyErr_SetString(PyExc_ValueError,
+                "width must be within [1, 2**24], and depth within [1, 16]");
+        return NULL;
+    } else if (size > 4096 || window <= 0) {
+        PyErr_SetString(PyExc_ValueError,
+                "top must be at most 4096, and window positive");
+        return NULL;
+    } else if (copies > PYLIBMC_HOT_COPIES_MAX || threshold < 0 || !ttl) {
+        PyErr_Format(PyExc_ValueError, "copies must be at most %d, threshold "
+                "not negative, and ttl positive", PYLIBMC_HOT_COPIES_MAX);
+        return NULL;
+    }
+
+    if (rate > 0 && (hk = _PylibMC_NewHotKeys(rate, width, depth, size,
+                    window, copies, threshold, (time_t)ttl)) == NULL) {
+        return NULL;
+    }
+    old = self->cluster->hotkeys;
+    self->cluster->hotkeys = hk;
+    _PylibMC_Retire(self, PYLIBMC_RETIRED_HOTKEYS, old);
+
+    Py_RETURN_NONE;
+}
+
+static int _PylibMC_CompareHotKeys(const void *a, const void *b) {
+    uint32_t x = ((const pylibmc_hot_key *)a)->count;
+    uint32_t y = ((const pylibmc_hot_key *)b)->count;
+
+    return (x < y) - (x > y);
+}
+
+static PyObject *PylibMC_Client_hot_keys(PylibMC_Client *self,
+        PyObject *args, PyObject *kwds) {
+    pylibmc_hotkeys *hk = _PylibMC_HotKeys(self);
+    pylibmc_hot_key *top;
+    unsigned int n = 10, i;
+    PyObject *retval;
+
+    static char *kws[] = { "n", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|I", kws, &n)) {
+        return NULL;
+    } else if (!_PylibMC_ClientReady(self)) {
+        return NULL;
+    } else if (hk == NULL || !hk->nheap) {
+        return PyList_New(0);
+    }
+
+    if ((top = PyMem_New(pylibmc_hot_key, hk->nheap)) == NULL) {
+        return PyErr_NoMemory();
+    }
+    memcpy(top, hk->heap, sizeof(pylibmc_hot_key) * hk->nheap);
+    qsort(top, hk->nheap, sizeof(pylibmc_hot_key), _PylibMC_CompareHotKeys);
+    if (n > hk->nheap) {
+        n = hk->nheap;
+    }
+
+    if ((retval = PyList_New(n)) == NULL) {
+        goto done;
+    }
+    for (i = 0; i < n; i++) {
+        memcached_server_st *server;
+        pylibmc_hot_copies c;
+        PyObject *item, *name, *copies;
+        char buf[MEMCACHED_MAX_KEY];
+        unsigned int j;
+
+        if (top[i].server < memcached_server_count(self->mc)) {
+            server = &memcached_server_list(self->mc)[top[i].server];
+            name = PyString_FromFormat("%s:%u",
+                    memcached_server_name(self->mc, *server),
+                    (unsigned int)memcached_server_port(self->mc, *server));
+        } else {
+            Py_INCREF(Py_None);
+            name = Py_None;
+        }
+        _PylibMC_HotLookup(hk, top[i].key, top[i].key_len, &c);
+        if ((copies = PyList_New(c.n)) != NULL) {
+            for (j = 0; j < c.n; j++) {
+                size_t len = _PylibMC_HotCopyKey(top[i].key, top[i].key_len,
+                                                 c.suffix[j], buf);
+                PyObject *copy = PyString_FromStringAndSize(buf, len);
+
+                if (copy == NULL) {
+                    Py_CLEAR(copies);
+                    break;
+                }
+                PyList_SET_ITEM(copies, j, copy);
+            }
+        }
+        /* what the sample saw, scaled up to all calls */
+        item = Py_BuildValue("(s#NKKN)", top[i].key,
+                (Py_ssize_t)top[i].key_len, name,
+                (unsigned PY_LONG_LONG)(top[i].count / hk->rate + 0.5),
+                (unsigned PY_LONG_LONG)(top[i].bytes / hk->rate + 0.5),
+                copies);
+        if (item == NULL) {
+            Py_CLEAR(retval);
+            break;
+        }
+        PyList_SET_ITEM(retval, i, item);
+    }
+
+done:
+    PyMem_Free(top);
+    return retval;
+}
+/* }}} */
+
+/* {{{ Metrics */
+#define PYLIBMC_ADD(var, n) \
+    __atomic_fetch_add(&(var), (uint64_t)(n), __ATOMIC_RELAXED)
+
+/* The metrics of self's cluster if they're on, or NULL. */
+static pylibmc_metrics *_PylibMC_Metrics(PylibMC_Client *self) {
+    return self->cluster->metrics;
+}
+
+static pylibmc_metrics *_PylibMC_NewMetrics(uint32_t nservers) {
+    pylibmc_metrics *m;
+
+    if ((m = PyMem_New(pylibmc_metrics, 1)) == NULL) {
+        return (pylibmc_metrics *)PyErr_NoMemory();
+    }
+    memset(m, 0, sizeof(*m));
+    m->nservers = nservers;
+    m->since = _PylibMC_Now();
+    /* one too many, so that there's something to allocate */
+    if ((m->servers = PyMem_New(pylibmc_op_metrics, nservers + 1)) == NULL) {
+        PyMem_Free(m);
+        return (pylibmc_metrics *)PyErr_NoMemory();
+    }
+    memset(m->servers, 0, sizeof(pylibmc_op_metrics) * (nservers + 1));
+    return m;
+}
+
+static void _PylibMC_FreeMetrics(pylibmc_metrics *m) {
+    PyMem_Free(m->servers);
+    PyMem_Free(m);
+}
+
+/* Bucket of a latency of us microseconds. */
+static unsigned int _PylibMC_HistBucket(uint64_t us) {
+    unsigned int e, b;
+
+    if (us < (1 << PYLIBMC_HIST_SUB_BITS)) {
+        return (unsigned int)us;
+    }
+    e = 63 - __builtin_clzll(us);
+    b = ((e - PYLIBMC_HIST_SUB_BITS + 1) << PYLIBMC_HIST_SUB_BITS)
+      + ((us >> (e - PYLIBMC_HIST_SUB_BITS))
+         & ((1 << PYLIBMC_HIST_SUB_BITS) - 1));
+    return (b < PYLIBMC_HIST_BUCKETS) ? b : PYLIBMC_HIST_BUCKETS - 1;
+}
+
+/* Microseconds that latencies in bucket b are less than. */
+static uint64_t _PylibMC_HistUpper(unsigned int b) {
+    unsigned int e, sub;
+
+    if (b < (1 << PYLIBMC_HIST_SUB_BITS)) {
+        return b + 1;
+    }
+    e = (b >> PYLIBMC_HIST_SUB_BITS) + PYLIBMC_HIST_SUB_BITS - 1;
+    sub = b & ((1 << PYLIBMC_HIST_SUB_BITS) - 1);
+    return (uint64_t)((1 << PYLIBMC_HIST_SUB_BITS) + sub + 1)
+           << (e - PYLIBMC_HIST_SUB_BITS);
+}
+
+/* The outcome of a key's memcached_return. */
+static int _PylibMC_Outcome(memcached_return rc) {
+    switch (rc) {
+        case MEMCACHED_SUCCESS:
+        case MEMCACHED_BUFFERED:
+            return PYLIBMC_HIT;
+        case MEMCACHED_NOTFOUND:
+        case MEMCACHED_NOTSTORED:
+        case MEMCACHED_DATA_EXISTS:
+            return PYLIBMC_MISS;
+        default:
+            return PYLIBMC_ERROR;
+    }
+}
+
+/* The operation a set command with f is, multi for the _multi calls. */
+static int _PylibMC_SetOp(_PylibMC_SetCommand f, int multi) {
+    if (f == memcached_add) {
+        return multi ? PYLIBMC_OP_ADD_MULTI : PYLIBMC_OP_ADD;
+    } else if (multi) {
+        return PYLIBMC_OP_SET_MULTI;
+    } else if (f == memcached_replace) {
+        return PYLIBMC_OP_REPLACE;
+    } else if (f == memcached_append) {
+        return PYLIBMC_OP_APPEND;
+    } else if (f == memcached_prepend) {
+        return PYLIBMC_OP_PREPEND;
+    }
+    return PYLIBMC_OP_SET;
+}
+
+/* Count a call of op that took latency seconds. A single-key call gives its
+ * key's server and outcome; a call with many keys gives UINT32_MAX and -1,
+ * and has its keys counted with _PylibMC_RecordKey. */
+static void _PylibMC_Record(pylibmc_metrics *m, int op, uint32_t server,
+        double latency, int outcome, size_t bytes_in, size_t bytes_out) {
+    uint64_t us = (latency > 0) ? (uint64_t)(latency * 1e6) : 0;
+    unsigned int b = _PylibMC_HistBucket(us);
+    pylibmc_op_metrics *om = &m->ops[op];
+
+    PYLIBMC_ADD(om->calls, 1);
+    PYLIBMC_ADD(om->latency_sum, us);
+    PYLIBMC_ADD(om->latency[b], 1);
+    if (server < m->nservers) {
+        PYLIBMC_ADD(m->servers[server].latency_sum, us);
+        PYLIBMC_ADD(m->servers[server].latency[b], 1);
+    }
+    if (outcome >= 0) {
+        _PylibMC_RecordKey(m, op, server, outcome, bytes_in, bytes_out);
+    }
+}
+
+/* Count how a key of a call to op fared, for op and the key's server. */
+static void _PylibMC_RecordKey(pylibmc_metrics *m, int op, uint32_t server,
+        int outcome, size_t bytes_in, size_t bytes_out) {
+    pylibmc_op_metrics *om[2] = { &m->ops[op], NULL };
+    unsigned int i;
+
+    if (server < m->nservers) {
+        om[1] = &m->servers[server];
+        PYLIBMC_ADD(om[1]->calls, 1);
+    }
+    for (i = 0; i < 2 && om[i] != NULL; i++) {
+        if (outcome == PYLIBMC_HIT) {
+            PYLIBMC_ADD(om[i]->hits, 1);
+        } else if (outcome == PYLIBMC_MISS) {
+            PYLIBMC_ADD(om[i]->misses, 1);
+        } else {
+            PYLIBMC_ADD(om[i]->errors, 1);
+        }
+        if (bytes_in) {
+            PYLIBMC_ADD(om[i]->bytes_in, bytes_in);
+        }
+        if (bytes_out) {
+            PYLIBMC_ADD(om[i]->bytes_out, bytes_out);
+        }
+    }
+}
+
+/* Add seconds to one of the serialization and compression timers. */
+static void _PylibMC_RecordTime(uint64_t *counter, double seconds) {
+    if (seconds > 0) {
+        PYLIBMC_ADD(*counter, (uint64_t)(seconds * 1e6));
+    }
+}
+
+/* Whether the calls of self are counted, by metrics or a trace. Calls only
+ * time themselves when they are. */
+static int _PylibMC_Metered(PylibMC_Client *self) {
+    return self->cluster->metrics != NULL || self->span != NULL;
+}
+
+/* _PylibMC_Record for the metrics and the trace of self, whichever are on.
+ * Like the rest of the _PylibMC_Meter functions, it's safe to call without
+ * the GIL. */
+static void _PylibMC_Meter(PylibMC_Client *self, int op, uint32_t server,
+        double latency, int outcome, size_t bytes_in, size_t bytes_out) {
+    if (self->cluster->metrics != NULL) {
+        _PylibMC_Record(self->cluster->metrics, op, server, latency,
+                        outcome, bytes_in, bytes_out);
+    }
+    if (self->span != NULL && outcome >= 0) {
+        _PylibMC_TraceKey(self->span, server, outcome, bytes_in, bytes_out);
+    }
+}
+
+static void _PylibMC_MeterKey(PylibMC_Client *self, int op, uint32_t server,
+        int outcome, size_t bytes_in, size_t bytes_out) {
+    if (self->cluster->metrics != NULL) {
+        _PylibMC_RecordKey(self->cluster->metrics, op, server, outcome,
+                           bytes_in, bytes_out);
+    }
+    if (self->span != NULL) {
+        _PylibMC_TraceKey(self->span, server, outcome, bytes_in, bytes_out);
+    }
+}
+
+/* Count seconds spent on one of the PYLIBMC_SERIALIZE and friends. */
+static void _PylibMC_MeterTime(PylibMC_Client *self, int phase,
+        double seconds) {
+    pylibmc_metrics *m = self->cluster->metrics;
+
+    if (m != NULL) {
+        switch (phase) {
+            case PYLIBMC_SERIALIZE:
+                _PylibMC_RecordTime(&m->serialize, seconds);
+                break;
+            case PYLIBMC_DESERIALIZE:
+                _PylibMC_RecordTime(&m->deserialize, seconds);
+                break;
+            case PYLIBMC_COMPRESS:
+                _PylibMC_RecordTime(&m->compress, seconds);
+                break;
+            default:
+                _PylibMC_RecordTime(&m->decompress, seconds);
+        }
+    }
+    if (self->span != NULL) {
+        if (phase == PYLIBMC_SERIALIZE || phase == PYLIBMC_COMPRESS) {
+            self->span->marshal += seconds;
+        } else {
+            self->span->unmarshal += seconds;
+        }
+    }
+}
+
+/* Count a get_multi: its hits by the replies, and the rest of the keys it
+ * asked for as misses, or as errors when it failed. Keys of servers with
+ * open breakers that it skipped are errors too. */
+static void _PylibMC_MeterGetMulti(PylibMC_Client *self, char **keys,
+        size_t *key_lens, size_t nkeys, pylibmc_mget_result *results,
+        size_t nresults, size_t skipped, bool failed, double latency) {
+    int op = PYLIBMC_OP_GET_MULTI;
+    int outcome = failed ? PYLIBMC_ERROR : PYLIBMC_MISS;
+    uint32_t nservers = memcached_server_count(self->mc);
+    uint64_t *asked;
+    size_t i;
+
+    _PylibMC_Meter(self, op, UINT32_MAX, latency, -1, 0, 0);
+    for (i = 0; i < skipped; i++) {
+        _PylibMC_MeterKey(self, op, UINT32_MAX, PYLIBMC_ERROR, 0, 0);
+    }
+
+    /* what's left per server of what it was asked, keys then bytes */
+    if ((asked = PyMem_New(uint64_t, 2 * nservers)) == NULL) {
+        return;
+    }
+    memset(asked, 0, sizeof(uint64_t) * 2 * nservers);
+    for (i = 0; i < nkeys; i++) {
+        uint32_t server = memcached_generate_hash(self->mc, keys[i],
+                                                  key_lens[i]);
+
+        if (server < nservers) {
+            asked[2 * server]++;
+            asked[2 * server + 1] += key_lens[i];
+        }
+    }
+    for (i = 0; i < nresults; i++) {
+        uint32_t server = memcached_generate_hash(self->mc, results[i].key,
+                                                  results[i].key_len);
+
+        _PylibMC_MeterKey(self, op, server, PYLIBMC_HIT,
+                          results[i].value_len, results[i].key_len);
+        if (server < nservers && asked[2 * server]) {
+            asked[2 * server]--;
+            asked[2 * server + 1] -= results[i].key_len;
+        }
+    }
+    for (i = 0; i < nservers; i++) {
+        uint64_t n;
+
+        for (n = 0; n < asked[2 * i]; n++) {
+            /* the bytes of all of them go with the first */
+            _PylibMC_MeterKey(self, op, (uint32_t)i, outcome, 0,
+                              n ? 0 : asked[2 * i + 1]);
+        }
+    }
+    PyMem_Free(asked);
+}
+
+/* Read metrics a word at a time, as they're being updated. */
+static void _PylibMC_LoadMetrics(pylibmc_op_metrics *from,
+        pylibmc_op_metrics *to) {
+    uint64_t *src = (uint64_t *)from, *dst = (uint64_t *)to;
+    size_t i;
+
+    for (i = 0; i < sizeof(*from) / sizeof(uint64_t); i++) {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+static PyObject *_PylibMC_OpMetrics(pylibmc_op_metrics *live) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999, 1 };
+    static char *names[] = { "p50", "p90", "p99", "p999", "max" };
+    pylibmc_op_metrics om;
+    PyObject *latency, *buckets, *v;
+    uint64_t count = 0, seen = 0;
+    unsigned int b, q = 0;
+
+    _PylibMC_LoadMetrics(live, &om);
+    for (b = 0; b < PYLIBMC_HIST_BUCKETS; b++) {
+        count += om.latency[b];
+    }
+
+    latency = Py_BuildValue("{s:K,s:d}", "count", (unsigned PY_LONG_LONG)count,
+            "sum", om.latency_sum / 1e6);
+    if ((buckets = PyList_New(0)) == NULL || latency == NULL) {
+        goto error;
+    }
+    for (b = 0; b < PYLIBMC_HIST_BUCKETS; b++) {
+        double upper = _PylibMC_HistUpper(b) / 1e6;
+
+        if (!om.latency[b]) {
+            continue;
+        }
+        seen += om.latency[b];
+        for (; q < 5 && seen >= quantiles[q] * count; q++) {
+            if ((v = PyFloat_FromDouble(upper)) == NULL
+                    || PyDict_SetItemString(latency, names[q], v) == -1) {
+                Py_XDECREF(v);
+                goto error;
+            }
+            Py_DECREF(v);
+        }
+        v = Py_BuildValue("(dK)", upper, (unsigned PY_LONG_LONG)om.latency[b]);
+        if (v == NULL || PyList_Append(buckets, v) == -1) {
+            Py_XDECREF(v);
+            goto error;
+        }
+        Py_DECREF(v);
+    }
+    for (; q < 5; q++) {
+        if (PyDict_SetItemString(latency, names[q], Py_None) == -1) {
+            goto error;
+        }
+    }
+
+    return Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K,s:N,s:N}",
+            "calls", (unsigned PY_LONG_LONG)om.calls,
+            "hits", (unsigned PY_LONG_LONG)om.hits,
+            "misses", (unsigned PY_LONG_LONG)om.misses,
+            "errors", (unsigned PY_LONG_LONG)om.errors,
+            "bytes_in", (unsigned PY_LONG_LONG)om.bytes_in,
+            "bytes_out", (unsigned PY_LONG_LONG)om.bytes_out,
+            "latency", latency, "buckets", buckets);
+error:
+    Py_XDECREF(latency);
+    Py_XDECREF(buckets);
+    return NULL;
+}
+
+static PyObject *PylibMC_Client_set_metrics(PylibMC_Client *self,
+        PyObject *args) {
+    pylibmc_metrics *m = NULL, *old;
+    PyObject *enabled = Py_True;
+
+    if (!PyArg_ParseTuple(args, "|O", &enabled)) {
+        return NULL;
+    } else if (!_PylibMC_ClientReady(self)) {
+        return NULL;
+    }
+
+    if (PyObject_IsTrue(enabled) && (m = _PylibMC_NewMetrics(
+                    memcached_server_count(self->mc))) == NULL) {
+        return NULL;
+    }
+    old = self->cluster->metrics;
+    self->cluster->metrics = m;
+    _PylibMC_Retire(self, PYLIBMC_RETIRED_METRICS, old);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *PylibMC_Client_metrics(PylibMC_Client *self) {
+    pylibmc_metrics *m = _PylibMC_Metrics(self);
+    PyObject *ops, *servers, *v;
+    uint32_t i;
+
+    if (m == NULL) {
+        Py_RETURN_NONE;
+    } else if (!_PylibMC_ClientReady(self)) {
+        return NULL;
+    } else if ((ops = PyDict_New()) == NULL) {
+        return NULL;
+    } else if ((servers = PyList_New(0)) == NULL) {
+        Py_DECREF(ops);
+        return NULL;
+    }
+
+    for (i = 0; i < PYLIBMC_OPS; i++) {
+        if ((v = _PylibMC_OpMetrics(&m->ops[i])) == NULL
+                || PyDict_SetItemString(ops, PylibMC_op_names[i], v) == -1) {
+            goto error;
+        }
+        Py_DECREF(v);
+    }
+    for (i = 0; i < m->nservers && i < memcached_server_count(self->mc); i++) {
+        memcached_server_st *server = &memcached_server_list(self->mc)[i];
+        PyObject *name;
+
+        if ((v = _PylibMC_OpMetrics(&m->servers[i])) == NULL) {
+            goto error;
+        }
+        name = PyString_FromFormat("%s:%u",
+                memcached_server_name(self->mc, *server),
+                (unsigned int)memcached_server_port(self->mc, *server));
+        if (name == NULL || PyDict_SetItemString(v, "server", name) == -1
+                || PyList_Append(servers, v) == -1) {
+            Py_XDECREF(name);
+            goto error;
+        }
+        Py_DECREF(name);
+        Py_DECREF(v);
+    }
+
+    return Py_BuildValue("{s:d,s:N,s:N,s:d,s:d,s:d,s:d}",
+            "seconds", _PylibMC_Now() - m->since, "ops", ops,
+            "servers", servers,
+            "serialize", __atomic_load_n(&m->serialize, __ATOMIC_RELAXED) / 1e6,
+            "deserialize",
+            __atomic_load_n(&m->deserialize, __ATOMIC_RELAXED) / 1e6,
+            "compress", __atomic_load_n(&m->compress, __ATOMIC_RELAXED) / 1e6,
+            "decompress",
+            __atomic_load_n(&m->decompress, __ATOMIC_RELAXED) / 1e6);
+error:
+    Py_XDECREF(v);
+    Py_DECREF(ops);
+    Py_DECREF(servers);
+    return NULL;
+}
+
+static PyObject *PylibMC_Client_reset_metrics(PylibMC_Client *self) {
+    pylibmc_metrics *m = _PylibMC_Metrics(self);
+    uint64_t *words;
+    size_t i, n;
+
+    if (m == NULL) {
+        Py_RETURN_NONE;
+    }
+
+    words = (uint64_t *)m->ops;
+    n = sizeof(pylibmc_op_metrics) * PYLIBMC_OPS / sizeof(uint64_t);
+    for (i = 0; i < n; i++) {
+        __atomic_store_n(&words[i], 0, __ATOMIC_RELAXED);
+    }
+    words = (uint64_t *)m->servers;
+    n = sizeof(pylibmc_op_metrics) * m->nservers / sizeof(uint64_t);
+    for (i = 0; i < n; i++) {
+        __atomic_store_n(&words[i], 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&m->serialize, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&m->deserialize, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&m->compress, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&m->decompress, 0, __ATOMIC_RELAXED);
+    m->since = _PylibMC_Now();
+
+    Py_RETURN_NONE;
+}
+
+/* Append to a growing buffer, printf style. Returns 0 if out of memory. */
+static int _PylibMC_Printf(char **buf, size_t *len, size_t *size,
+        const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(*buf + *len, *size - *len, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            return 0;
+        } else if ((size_t)n < *size - *len) {
+            *len += n;
+            return 1;
+        } else {
+            size_t grown = *size * 2 + n;
+            char *p = realloc(*buf, grown);
+
+            if (p == NULL) {
+                return 0;
+            }
+            *buf = p;
+            *size = grown;
+        }
+    }
+}
+
+/* Write the series of one operation or server, labelled with labels. The
+ * histogram only has the buckets that end on a power of two microseconds,
+ * so that every scrape has the same ones. */
+static int _PylibMC_MetricsText(char **buf, size_t *len, size_t *size,
+        const char *prefix, const char *labels, pylibmc_op_metrics *live) {
+    pylibmc_op_metrics om;
+    uint64_t cumulative = 0;
+    unsigned int b;
+    int ok;
+
+    _PylibMC_LoadMetrics(live, &om);
+    if (!om.calls) {
+        return 1;
+    }
+
+    ok = _PylibMC_Printf(buf, len, size,
+            "%s_calls_total{%s} %llu\n%s_hits_total{%s} %llu\n"
+            "%s_misses_total{%s} %llu\n%s_errors_total{%s} %llu\n"
+            "%s_received_bytes_total{%s} %llu\n"
+            "%s_sent_bytes_total{%s} %llu\n",
+            prefix, labels, (unsigned long long)om.calls,
+            prefix, labels, (unsigned long long)om.hits,
+            prefix, labels, (unsigned long long)om.misses,
+            prefix, labels, (unsigned long long)om.errors,
+            prefix, labels, (unsigned long long)om.bytes_in,
+            prefix, labels, (unsigned long long)om.bytes_out);
+
+    for (b = 0; ok && b < PYLIBMC_HIST_BUCKETS; b++) {
+        uint64_t upper = _PylibMC_HistUpper(b);
+
+        cumulative += om.latency[b];
+        if (!(upper & (upper - 1))) {
+            ok = _PylibMC_Printf(buf, len, size,
+                    "%s_latency_seconds_bucket{%s,le=\"%g\"} %llu\n",
+                    prefix, labels, upper / 1e6,
+                    (unsigned long long)cumulative);
+        }
+    }
+    return ok && _PylibMC_Printf(buf, len, size,
+            "%s_latency_seconds_bucket{%s,le=\"+Inf\"} %llu\n"
+            "%s_latency_seconds_sum{%s} %g\n"
+            "%s_latency_seconds_count{%s} %llu\n",
+            prefix, labels, (unsigned long long)cumulative,
+            prefix, labels, om.latency_sum / 1e6,
+            prefix, labels, (unsigned long long)cumulative);
+}
+
+static PyObject *PylibMC_Client_metrics_text(PylibMC_Client *self) {
+    pylibmc_metrics *m = _PylibMC_Metrics(self);
+    char *buf, labels[MEMCACHED_MAX_HOST_LENGTH + 64];
+    size_t len = 0, size = 16384;
+    PyObject *retval;
+    uint32_t i;
+    int ok;
+
+    if (m == NULL) {
+        return PyString_FromString("");
+    } else if (!_PylibMC_ClientReady(self)) {
+        return NULL;
+    } else if ((buf = malloc(size)) == NULL) {
+        return PyErr_NoMemory();
+    }
+
+    ok = _PylibMC_Printf(&buf, &len, &size,
+            "# TYPE pylibmc_calls_total counter\n"
+            "# TYPE pylibmc_hits_total counter\n"
+            "# TYPE pylibmc_misses_total counter\n"
+            "# TYPE pylibmc_errors_total counter\n"
+            "# TYPE pylibmc_received_bytes_total counter\n"
+            "# TYPE pylibmc_sent_bytes_total counter\n"
+            "# TYPE pylibmc_latency_seconds histogram\n");
+    for (i = 0; ok && i < PYLIBMC_OPS; i++) {
+        snprintf(labels, sizeof(labels), "op=\"%s\"", PylibMC_op_names[i]);
+        ok = _PylibMC_MetricsText(&buf, &len, &size, "pylibmc", labels,
+                                  &m->ops[i]);
+    }
+
+    ok = ok && _PylibMC_Printf(&buf, &len, &size,
+            "# TYPE pylibmc_server_calls_total counter\n"
+            "# TYPE pylibmc_server_hits_total counter\n"
+            "# TYPE pylibmc_server_misses_total counter\n"
+            "# TYPE pylibmc_server_errors_total counter\n"
+            "# TYPE pylibmc_server_received_bytes_total counter\n"
+            "# TYPE pylibmc_server_sent_bytes_total counter\n"
+            "# TYPE pylibmc_server_latency_seconds histogram\n");
+    for (i = 0; ok && i < m->nservers
+            && i < memcached_server_count(self->mc); i++) {
+        memcached_server_st *server = &memcached_server_list(self->mc)[i];
+
+        snprintf(labels, sizeof(labels), "server=\"%s:%u\",index=\"%u\"",
+                 memcached_server_name(self->mc, *server),
+                 (unsigned int)memcached_server_port(self->mc, *server),
+                 (unsigned int)i);
+        ok = _PylibMC_MetricsText(&buf, &len, &size, "pylibmc_server",
+                                  labels, &m->servers[i]);
+    }
+
+    ok = ok && _PylibMC_Printf(&buf, &len, &size,
+            "# TYPE pylibmc_serialize_seconds_total counter\n"
+            "pylibmc_serialize_seconds_total %g\n"
+            "# TYPE pylibmc_deserialize_seconds_total counter\n"
+            "pylibmc_deserialize_seconds_total %g\n"
+            "# TYPE pylibmc_compress_seconds_total counter\n"
+            "pylibmc_compress_seconds_total %g\n"
+            "# TYPE pylibmc_decompress_seconds_total counter\n"
+            "pylibmc_decompress_seconds_total %g\n",
+            __atomic_load_n(&m->serialize, __ATOMIC_RELAXED) / 1e6,
+            __atomic_load_n(&m->deserialize, __ATOMIC_RELAXED) / 1e6,
+            __atomic_load_n(&m->compress, __ATOMIC_RELAXED) / 1e6,
+            __atomic_load_n(&m->decompress, __ATOMIC_RELAXED) / 1e6);
+
+    retval = ok ? PyString_FromStringAndSize(buf, len) : PyErr_NoMemory();
+    free(buf);
+    return retval;
+}
+/* }}} */
+
+/* {{{ Tracing */
+static pylibmc_tracing *_PylibMC_NewTracing(unsigned int every,
+        PyObject *hook, size_t size) {
+    pylibmc_tracing *t;
+
+    if ((t = PyMem_New(pylibmc_tracing, 1)) == NULL) {
+        return (pylibmc_tracing *)PyErr_NoMemory();
+    } else if ((t->ring = PyMem_New(pylibmc_span, size)) == NULL) {
+        PyMem_Free(t);
+        return (pylibmc_tracing *)PyErr_NoMemory();
+    }
+    t->every = every;
+    t->counter = 0;
+    Py_XINCREF(hook);
+    t->hook = hook;
+    t->size = size;
+    t->head = t->count = 0;
+    return t;
+}
+
+static void _PylibMC_FreeTracing(pylibmc_tracing *t) {
+    Py_XDECREF(t->hook);
+    PyMem_Free(t->ring);
+    PyMem_Free(t);
+}
+
+/* Start tracing a call of op on key, or on many keys if key is NULL, if
+ * it's one to sample. Gives span, to be passed to _PylibMC_TraceEnd, or
+ * NULL. Calls made from within a traced one aren't traced themselves. */
+static pylibmc_span *_PylibMC_TraceStart(PylibMC_Client *self,
+        pylibmc_span *span, int op, PyObject *key) {
+    pylibmc_tracing *t = self->cluster->tracing;
+    struct timeval now;
+    PyObject *wire;
+
+    if (t == NULL || self->span != NULL || t->counter++ % t->every) {
+        return NULL;
+    }
+
+    memset(span, 0, offsetof(pylibmc_span, key));
+    span->op = op;
+    span->server = UINT32_MAX;
+    if (key != NULL) {
+        if ((wire = _PylibMC_WireKey(self, key, NULL, 0)) != NULL) {
+            span->key_len = PyString_GET_SIZE(wire);
+            memcpy(span->key, PyString_AS_STRING(wire), span->key_len);
+            Py_DECREF(wire);
+        } else {
+            /* the call itself will complain */
+            PyErr_Clear();
+        }
+    }
+    gettimeofday(&now, NULL);
+    span->start = (double)now.tv_sec + (double)now.tv_usec / 1e6;
+    span->began = _PylibMC_Now();
+    self->span = span;
+    return span;
+}
+
+/* Finish the trace of a call that gives result, handing it over to the hook
+ * or the ring. Gives result, whatever the hook does. */
+static PyObject *_PylibMC_TraceEnd(PylibMC_Client *self, pylibmc_span *span,
+        PyObject *result) {
+    pylibmc_tracing *t = self->cluster->tracing;
+
+    if (span == NULL) {
+        return result;
+    }
+    span->total = _PylibMC_Now() - span->began;
+    if (t == NULL) {
+        /* turned off on the way */
+    } else if (t->hook != NULL) {
+        PyObject *type, *value, *tb, *trace, *r = NULL;
+        /* The hook, or whatever runs while it does, may change the tracing
+         * settings and let go of t, so t isn't used past this point and
+         * the hook is held on to until it's done. */
+        PyObject *hook = t->hook;
+
+        Py_INCREF(hook);
+        PyErr_Fetch(&type, &value, &tb);
+        if ((trace = _PylibMC_SpanObject(self, span)) != NULL) {
+            r = PyObject_CallFunctionObjArgs(hook, trace, NULL);
+            Py_DECREF(trace);
+        }
+        if (r == NULL) {
+            PyErr_WriteUnraisable(hook);
+        }
+        Py_XDECREF(r);
+        PyErr_Restore(type, value, tb);
+        Py_DECREF(hook);
+    } else {
+        t->ring[(t->head + t->count) % t->size] = *span;
+        if (t->count < t->size) {
+            t->count++;
+        } else {
+            t->head = (t->head + 1) % t->size;
+        }
+    }
+    /* only now, so that the hook's own calls aren't traced */
+    self->span = NULL;
+    return result;
+}
+
+/* Count how a key of a traced call fared. */
+static void _PylibMC_TraceKey(pylibmc_span *span, uint32_t server,
+        int outcome, size_t bytes_in, size_t bytes_out) {
+    if (!span->hits && !span->misses && !span->errors) {
+        span->server = server;
+    } else if (span->server != server) {
+        span->server = UINT32_MAX;
+    }
+    if (outcome == PYLIBMC_HIT) {
+        span->hits++;
+    } else if (outcome == PYLIBMC_MISS) {
+        span->misses++;
+    } else {
+        span->errors++;
+    }
+    span->bytes_in += bytes_in;
+    span->bytes_out += bytes_out;
+}
+
+static PyObject *_PylibMC_SpanObject(PylibMC_Client *self,
+        pylibmc_span *span) {
+    PyObject *key, *server;
+    double network = span->total - span->marshal - span->unmarshal;
+
+    if (span->key_len) {
+        key = PyString_FromStringAndSize(span->key, span->key_len);
+    } else {
+        Py_INCREF(Py_None);
+        key = Py_None;
+    }
+    if (self->mc != NULL && span->server < memcached_server_count(self->mc)) {
+        memcached_server_st *s = &memcached_server_list(self->mc)[span->server];
+
+        server = PyString_FromFormat("%s:%u",
+                memcached_server_name(self->mc, *s),
+                (unsigned int)memcached_server_port(self->mc, *s));
+    } else {
+        Py_INCREF(Py_None);
+        server = Py_None;
+    }
+    if (key == NULL || server == NULL) {
+        Py_XDECREF(key);
+        Py_XDECREF(server);
+        return NULL;
+    }
+
+    return Py_BuildValue("{s:s,s:N,s:N,s:d,s:d,s:d,s:d,s:d,"
+                         "s:K,s:K,s:K,s:K,s:K,s:K}",
+            "op", PylibMC_op_names[span->op], "key", key, "server", server,
+            "start", span->start, "seconds", span->total,
+            "marshal", span->marshal, "network", (network > 0) ? network : 0,
+            "unmarshal", span->unmarshal,
+            "keys", (unsigned PY_LONG_LONG)(span->hits + span->misses
+                                            + span->errors),
+            "hits", (unsigned PY_LONG_LONG)span->hits,
+            "misses", (unsigned PY_LONG_LONG)span->misses,
+            "errors", (unsigned PY_LONG_LONG)span->errors,
+            "bytes_in", (unsigned PY_LONG_LONG)span->bytes_in,
+            "bytes_out", (unsigned PY_LONG_LONG)span->bytes_out);
+}
+
+static PyObject *PylibMC_Client_set_tracing(PylibMC_Client *self,
+        PyObject *args, PyObject *kwds) {
+    pylibmc_tracing *t = NULL, *old;
+    unsigned int every = 100, size = 1024;
+    PyObject *hook = Py_None;
+
+    static char *kws[] = { "every", "hook", "size", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|IOI", kws,
+                &every, &hook, &size)) {
+        return NULL;
+    } else if (hook != Py_None && !PyCallable_Check(hook)) {
+        PyErr_SetString(PyExc_TypeError, "hook must be callable");
+        return NULL;
+    } else if (!size || size > (1 << 20)) {
+        PyErr_SetString(PyExc_ValueError, "size must be within [1, 2**20]");
+        return NULL;
+    }
+
+    if (every && (t = _PylibMC_NewTracing(every,
+                    (hook != Py_None) ? hook : NULL, size)) == NULL) {
+        return NULL;
+    }
+    old = self->cluster->tracing;
+    self->cluster->tracing = t;
+    _PylibMC_Retire(self, PYLIBMC_RETIRED_TRACING, old);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *PylibMC_Client_traces(PylibMC_Client *self) {
+    pylibmc_tracing *t = self->cluster->tracing;
+    PyObject *retval, *trace;
+
+    if ((retval = PyList_New(0)) == NULL || t == NULL) {
+        return retval;
+    }
+    for (; t->count; t->count--, t->head = (t->head + 1) % t->size) {
+        if ((trace = _PylibMC_SpanObject(self, &t->ring[t->head])) == NULL
+                || PyList_Append(retval, trace) == -1) {
+            Py_XDECREF(trace);
+            Py_DECREF(retval);
+            return NULL;
+        }
+        Py_DECREF(trace);
+    }
+    return retval;
+}
+/* }}} */
+
+/* {{{ Buffered counters */
+static pylibmc_counters *_PylibMC_NewCounters(double interval,
+        unsigned int size) {
+    pylibmc_counters *c;
+    unsigned int nslots = 1, i;
+
+    while (nslots < size + size / 3 + 1) {
+        nslots <<= 1;
+    }
+    if ((c = PyMem_New(pylibmc_counters, 1)) == NULL) {
+        return (pylibmc_counters *)PyErr_NoMemory();
+    } else if ((c->slots = PyMem_New(pylibmc_counter, nslots)) == NULL) {
+        PyMem_Free(c);
+        return (pylibmc_counters *)PyErr_NoMemory();
+    }
+    for (i = 0; i < nslots; i++) {
+        c->slots[i].key_len = 0;
+    }
+    c->interval = interval;
+    c->flushed_at = _PylibMC_Now();
+    c->size = size;
+    c->mask = nslots - 1;
+    c->pending = 0;
+    c->events = c->flushes = c->sent = 0;
+    return c;
+}
+
+static void _PylibMC_FreeCounters(pylibmc_counters *c) {
+    PyMem_Free(c->slots);
+    PyMem_Free(c);
+}
+
+/* Add delta to the counter of key, making it pending if it isn't. There
+ * must be room for it, which there is while fewer than size are pending. */
+static void _PylibMC_CounterAdd(pylibmc_counters *c, const char *key,
+        size_t key_len, int64_t delta) {
+    unsigned int i = (unsigned int)_PylibMC_HotKeyHash(key, key_len) & c->mask;
+
+    for (;; i = (i + 1) & c->mask) {
+        pylibmc_counter *slot = &c->slots[i];
+
+        if (!slot->key_len) {
+            memcpy(slot->key, key, key_len);
+            slot->key_len = key_len;
+            slot->delta = delta;
+            c->pending++;
+            return;
+        } else if (slot->key_len == key_len
+                && !memcmp(slot->key, key, key_len)) {
+            slot->delta += delta;
+            return;
+        }
+    }
+}
+
+static int _PylibMC_CompareCounters(const void *a, const void *b) {
+    uint32_t x = ((const pylibmc_counter *)a)->server;
+    uint32_t y = ((const pylibmc_counter *)b)->server;
+
+    return (x > y) - (x < y);
+}
+
+/* Queue ctr's delta on cmds as increments or decrements of at most 32 bits,
+ * which is what a delta is on the wire, and return how many it took. With
+ * cmds NULL, only count them. */
+static size_t _PylibMC_CounterSteps(pylibmc_counter *ctr,
+        pylibmc_pipe_cmd *cmds) {
+    int64_t left = ctr->delta;
+    size_t n = 0;
+
+    while (left) {
+        uint64_t size = (left > 0) ? (uint64_t)left : -(uint64_t)left;
+        uint32_t step = (size > UINT32_MAX) ? UINT32_MAX : (uint32_t)size;
+
+        if (cmds != NULL) {
+            pylibmc_pipe_cmd *cmd = &cmds[n];
+
+            memset(cmd, 0, sizeof(*cmd));
+            cmd->op = (left > 0) ? PYLIBMC_OP_INCR : PYLIBMC_OP_DECR;
+            cmd->mset.key = cmd->incr.key = ctr->key;
+            cmd->mset.key_len = cmd->incr.key_len = ctr->key_len;
+            cmd->incr.incr_func = (left > 0) ? memcached_increment
+                                             : memcached_decrement;
+            cmd->incr.delta = step;
+            cmd->server = ctr->server;
+            cmd->rc = MEMCACHED_BUFFERED;
+        }
+        if (left > 0) {
+            left -= step;
+        } else {
+            left += step;
+        }
+        n++;
+    }
+    return n;
+}
+
+/* Send the pending deltas as increments and decrements, pipelined by
+ * _PylibMC_PipeSend. Counters that don't exist yet answer NOT_FOUND; those
+ * get an add of 0 and the steps that missed go again, so that they start at
+ * 0 rather than have their deltas dropped, and counters that do exist cost
+ * a single request. Those of servers with open breakers wait for the next
+ * flush. Returns the number of counters sent, or -1 with an exception
+ * set. */
+static Py_ssize_t _PylibMC_FlushCounters(PylibMC_Client *self) {
+    pylibmc_counters *c = self->cluster->counters;
+    pylibmc_breakers *breakers;
+    pylibmc_lanes *lanes;
+    pylibmc_counter *batch;
+    pylibmc_pipe_cmd *cmds = NULL, *retry = NULL;
+    uint64_t buffered, noreply;
+    double now = _PylibMC_Now();
+    Py_ssize_t sent = 0;
+    unsigned int held = 0;
+    size_t n = 0, ncmds = 0, nretry = 0, i, j, k;
+
+    c->flushed_at = now;
+    if (!c->pending) {
+        return 0;
+    } else if (!_PylibMC_ClientReady(self)) {
+        return -1;
+    } else if ((batch = PyMem_New(pylibmc_counter, c->pending)) == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    /* Those to send go at the front of batch. Those of servers with open
+     * breakers go at the back, to be kept for the next flush as long as that
+     * leaves room for more. */
+    breakers = _PylibMC_Breakers(self);
+    for (i = 0; i <= c->mask; i++) {
+        pylibmc_counter *slot = &c->slots[i];
+        uint32_t server;
+
+        if (!slot->key_len || !slot->delta) {
+            continue;
+        }
+        server = memcached_generate_hash(self->mc, slot->key, slot->key_len);
+        if (breakers != NULL && _PylibMC_BreakerOpen(breakers, server, now)) {
+            if (held + 1 < c->size) {
+                batch[c->pending - ++held] = *slot;
+            }
+        } else {
+            batch[n] = *slot;
+            batch[n].server = server;
+            ncmds += _PylibMC_CounterSteps(&batch[n], NULL);
+            n++;
+        }
+    }
+
+    /* at worst, every step misses and every counter needs an add */
+    if (ncmds && ((cmds = PyMem_New(pylibmc_pipe_cmd, ncmds)) == NULL
+                || (retry = PyMem_New(pylibmc_pipe_cmd, ncmds + n)) == NULL)) {
+        PyMem_Free(cmds);
+        PyMem_Free(batch);
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i = 0; i <= c->mask; i++) {
+        c->slots[i].key_len = 0;
+    }
+    i = c->pending - held;
+    c->pending = 0;
+    for (; held; held--, i++) {
+        _PylibMC_CounterAdd(c, batch[i].key, batch[i].key_len,
+                            batch[i].delta);
+    }
+    qsort(batch, n, sizeof(*batch), _PylibMC_CompareCounters);
+    for (i = 0, j = 0; i < n; i++) {
+        j += _PylibMC_CounterSteps(&batch[i], &cmds[j]);
+    }
+    sent = (Py_ssize_t)n;
+    lanes = _PylibMC_Lanes(self);
+
+    PYLIBMC_BEGIN_ALLOW_THREADS(self)
+    buffered = memcached_behavior_get(self->mc,
+                                      MEMCACHED_BEHAVIOR_BUFFER_REQUESTS);
+    noreply = memcached_behavior_get(self->mc, MEMCACHED_BEHAVIOR_NOREPLY);
+
+    /* the replies are what tells a missing counter */
+    if (buffered) {
+        memcached_behavior_set(self->mc, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, 0);
+    }
+    if (noreply) {
+        memcached_behavior_set(self->mc, MEMCACHED_BEHAVIOR_NOREPLY, 0);
+    }
+
+    _PylibMC_PipeSend(self->mc, lanes, cmds, ncmds);
+
+    /* A counter's steps are next to each other; the add goes before the
+     * first of them that missed. */
+    for (j = 0; j < ncmds; j = k) {
+        int added = 0;
+
+        for (k = j; k < ncmds && cmds[k].mset.key == cmds[j].mset.key; k++) {
+            if (cmds[k].rc != MEMCACHED_NOTFOUND) {
+                continue;
+            } else if (!added) {
+                pylibmc_pipe_cmd *add = &retry[nretry++];
+
+                memset(add, 0, sizeof(*add));
+                add->op = PYLIBMC_OP_ADD;
+                add->set_func = memcached_add;
+                add->mset.key = cmds[k].mset.key;
+                add->mset.key_len = cmds[k].mset.key_len;
+                add->mset.value = "0";
+                add->mset.value_len = 1;
+                add->mset.flags = PYLIBMC_FLAG_INTEGER;
+                add->server = cmds[k].server;
+                add->rc = MEMCACHED_BUFFERED;
+                added = 1;
+            }
+            retry[nretry] = cmds[k];
+            retry[nretry++].rc = MEMCACHED_BUFFERED;
+        }
+    }
+    if (nretry) {
+        _PylibMC_PipeSend(self->mc, lanes, retry, nretry);
+    }
+
+    if (buffered) {
+        memcached_behavior_set(self->mc, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, 1);
+    }
+    if (noreply) {
+        memcached_behavior_set(self->mc, MEMCACHED_BEHAVIOR_NOREPLY, 1);
+    }
+    PYLIBMC_END_ALLOW_THREADS
+
+    PyMem_Free(cmds);
+    PyMem_Free(retry);
+    PyMem_Free(batch);
+    /* c may have been replaced meanwhile */
+    if ((c = self->cluster->counters) != NULL) {
+        c->flushes++;
+        c->sent += sent;
+    }
+    return sent;
+}
+
+static PyObject *PylibMC_Client_set_counters(PylibMC_Client *self,
+        PyObject *args, PyObject *kwds) {
+    pylibmc_counters *c;
+    double interval = 1;
+    unsigned int size = 4096;
+
+    static char *kws[] = { "interval", "size", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|dI", kws,
+                &interval, &size)) {
+        return NULL;
+    } else if (interval < 0 || !size || size > (1 << 20)) {
+        PyErr_SetString(PyExc_ValueError,
+                "interval must not be negative, and size within [1, 2**20]");
+        return NULL;
+    }
+
+    if (self->cluster->counters != NULL
+            && _PylibMC_FlushCounters(self) == -1) {
+        return NULL;
+    } else if ((c = _PylibMC_NewCounters(interval, size)) == NULL) {
+        return NULL;
+    }
+    if (self->cluster->counters != NULL) {
+        _PylibMC_FreeCounters(self->cluster->counters);
+    }
+    self->cluster->counters = c;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *PylibMC_Client_incr_buffered(PylibMC_Client *self,
+        PyObject *args) {
+    pylibmc_counters *c;
+    PyObject *key_obj, *key;
+    PY_LONG_LONG delta = 1;
+
+    if (!PyArg_ParseTuple(args, "O|L", &key_obj, &delta)) {
+        return NULL;
+    } else if ((c = self->cluster->counters) == NULL
+            && (c = self->cluster->counters = _PylibMC_NewCounters(1, 4096))
+                == NULL) {
+        return NULL;
+    } else if (c->pending >= c->size && _PylibMC_FlushCounters(self) == -1) {
+        /* no room until it's flushed */
+        return NULL;
+    } else if ((key = _PylibMC_WireKey(self, key_obj, NULL, 0)) == NULL) {
+        return NULL;
+    }
+
+    /* a flush may have replaced them */
+    c = self->cluster->counters;
+    if (PyString_GET_SIZE(key)) {
+        _PylibMC_CounterAdd(c, PyString_AS_STRING(key),
+                            PyString_GET_SIZE(key), (int64_t)delta);
+        c->events++;
+    }
+    Py_DECREF(key);
+
+    if (c->pending >= c->size || (c->interval > 0
+                && _PylibMC_Now() - c->flushed_at >= c->interval)) {
+        if (_PylibMC_FlushCounters(self) == -1) {
+            return NULL;
+        }
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *PylibMC_Client_flush_counters(PylibMC_Client *self) {
+    Py_ssize_t sent = 0;
+
+    if (self->cluster->counters != NULL
+            && (sent = _PylibMC_FlushCounters(self)) == -1) {
+        return NULL;
+    }
+    return PyInt_FromSsize_t(sent);
+}
+
+static PyObject *PylibMC_Client_counter_stats(PylibMC_Client *self) {
+    static pylibmc_counters none;
+    pylibmc_counters *c = self->cluster->counters;
+
+    if (c == NULL) {
+        c = &none;
+    }
+    return Py_BuildValue("{s:I,s:K,s:K,s:K}", "pending", c->pending,
+            "events", (unsigned PY_LONG_LONG)c->events,
+            "flushes", (unsigned PY_LONG_LONG)c->flushes,
+            "sent", (unsigned PY_LONG_LONG)c->sent);
+}
+/* }}} */
+
+static PyObject *PylibMC_Client_server_for(PylibMC_Client *self,
+        PyObject *arg) {
+    PyObject *key;
+    memcached_server_st *server;
+    uint32_t idx;
+
+    if (!_PylibMC_ClientReady(self)) {
+        return NULL;
+    } else if ((key = _PylibMC_WireKey(self, arg, NULL, 0)) == NULL) {
+        return NULL;
+    } else if (!memcached_server_count(self->mc)) {
+        Py_DECREF(key);
+        return PylibMC_ErrFromMemcached(self, "server_for",
+                                        MEMCACHED_NO_SERVERS);
+    }
+
+    idx = _PylibMC_ServerIndex(self, arg, key);
+    Py_DECREF(key);
+
+    server = &memcached_server_list(self->mc)[idx];
+    return PyString_FromFormat("%s:%u",
+            memcached_server_name(self->mc, *server),
+            (unsigned int)memcached_server_port(self->mc, *server));
+}
+/* }}} */
+
+static PyObject *PylibMC_ErrFromMemcached(PylibMC_Client *self, const char *what,
+        memcached_return error) {
+    if (error == MEMCACHED_ERRNO) {
+        PyErr_Format(PylibMCExc_MemcachedError,
+                "system error %d from %s: %s", errno, what, strerror(errno));
+    /* The key exists, but it has no value */
+    } else if (error == MEMCACHED_SUCCESS) {
+        PyErr_Format(PyExc_RuntimeError, "error == 0? %s:%d",
+                     __FILE__, __LINE__);
+    } else { 
+        PylibMC_McErr *err;
+        PyObject *exc = (PyObject *)PylibMCExc_MemcachedError;
+
+        for (err = PylibMCExc_mc_errs; err->name != NULL; err++) {
+            if (err->rc == error) {
+                exc = err->exc;
+                break;
+            }
+        }
+
+        PyErr_Format(exc, "error %d from %s: %s", error, what,
+                     memcached_strerror(self->mc, error));
+    }
+    return NULL;
+}
+
+/* {{{ Read engine */
+static PyObject *PylibMC_Client_set_read_engine(PylibMC_Client *self,
+        PyObject *args) {
+    const char *name;
+    int engine;
+
+    if (!PyArg_ParseTuple(args, "s", &name)) {
+        return NULL;
+    } else if (!strcmp(name, "libmemcached")) {
+        engine = PYLIBMC_ENGINE_LIBMEMCACHED;
+    } else if (!strcmp(name, "epoll")) {
+        engine = PYLIBMC_ENGINE_EPOLL;
+    } else {
+        PyErr_Format(PyExc_ValueError, "unknown read engine %s", name);
+        return NULL;
+    }
+    self->cluster->read_engine = engine;
+
+    Py_RETURN_NONE;
+}
+
+/* Get keys the way get_multi does, with libmemcached only hashing them and
+ * keeping the connections: each connection's keys go out as one get,
+ * written with sendmsg straight from the keys, and the replies of all
+ * servers are read as they come in over a single epoll instance. With
+ * lanes, a server's keys are split into runs, one for each of its striping
+ * connections. Values are copied into sink's slab rather than each into a
+ * malloc of its own.
+ *
+ * Returns 0, having sent nothing, if the keys or the connections aren't fit
+ * for it (the binary protocol, UDP, a key the text protocol can't carry or
+ * a connection libmemcached is in the middle of using), leaving it to
+ * libmemcached. Otherwise 1, with *rc and *err_func as
+ * pylibmc_memcached_fetch_multi would have them. Connections left
+ * mid-reply are closed. servers, unless NULL, has the keys' servers, as
+ * Key objects cache them, so they aren't hashed again. Doesn't need the
+ * GIL. */
+static int _PylibMC_EngineFetch(memcached_st *mc, pylibmc_lanes *lanes,
+        char **keys, size_t *key_lens, const uint32_t *servers, size_t nkeys,
+        pylibmc_engine_sink *sink, char **err_func, memcached_return *rc,
+        pylibmc_deadline *dl) {
+    uint32_t i, nservers = memcached_server_count(mc);
+    unsigned int stripes = (lanes != NULL) ? lanes->stripes : 1;
+    size_t *slots = NULL, *counts = NULL;
+    pylibmc_engine_conn *conns = NULL;
+    pylibmc_connect *connected = NULL;
+    unsigned char *wanted = NULL;
+    size_t j, c, nconns, first = sink->nresults, off = 0, active = 0;
+    int epfd = -1, handled = 0, unreached = 0;
+    double left;
+
+    if (!nservers || !nkeys
+            || memcached_behavior_get(mc, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL)) {
+        return 0;
+    }
+    nconns = (size_t)nservers * stripes;
+    slots = malloc(sizeof(size_t) * nkeys);
+    counts = calloc(nservers * 2, sizeof(size_t));
+    conns = calloc(nconns, sizeof(pylibmc_engine_conn));
+    connected = malloc(sizeof(pylibmc_connect) * nservers);
+    wanted = calloc(nservers, 1);
+    if (slots == NULL || counts == NULL || conns == NULL || connected == NULL
+            || wanted == NULL) {
+        goto done;
+    }
+
+    /* Hash the keys, then give each server's striping connections a run
+     * of its keys each, of about the same length. counts has how many
+     * keys each server has, then how many have been placed. */
+    for (j = 0; j < nkeys; j++) {
+        if (!_PylibMC_TextKey(keys[j], key_lens[j])) {
+            goto done;
+        }
+        i = (servers != NULL) ? servers[j]
+                              : memcached_generate_hash(mc, keys[j],
+                                                        key_lens[j]);
+        if (i >= nservers) {
+            goto done;
+        }
+        slots[j] = i;
+        counts[i]++;
+        wanted[i] = 1;
+    }
+    for (j = 0; j < nkeys; j++) {
+        size_t n;
+
+        i = slots[j];
+        n = (counts[i] < stripes) ? counts[i] : stripes;
+        slots[j] = i * stripes + counts[nservers + i]++ * n / counts[i];
+        conns[slots[j]].nkeys++;
+    }
+
+    left = (dl->at < 0) ? -1 : dl->at - _PylibMC_Now();
+    _PylibMC_ConnectAll(mc, (dl->at < 0) ? -1 : ((left > 0) ? left : 0),
+                        wanted, connected);
+    for (i = 0; i < nservers; i++) {
+        if (wanted[i] && connected[i].status != PYLIBMC_CONNECT_FAILED
+                && !_PylibMC_ServerIdle(&memcached_server_list(mc)[i])) {
+            goto done;
+        }
+    }
+    if (_PylibMC_DeadlineCheck(dl)) {
+        /* nothing went out */
+        *err_func = "memcached_mget";
+        *rc = MEMCACHED_TIMEOUT;
+        handled = 1;
+        goto done;
+    } else if ((epfd = epoll_create(nservers)) == -1) {
+        goto done;
+    }
+    handled = 1;
+
+    /* "get", then " " and the key for each key, then "\r\n" */
+    for (c = 0; c < nconns; c++) {
+        pylibmc_engine_conn *conn = &conns[c];
+
+        conn->server = c / stripes;
+        conn->lane = c % stripes;
+        conn->stats = (lanes != NULL)
+            ? &lanes->lanes[conn->server * lanes->nlanes + conn->lane] : NULL;
+        conn->fd = -1;
+        conn->rc = MEMCACHED_SUCCESS;
+        if (!conn->nkeys) {
+            continue;
+        } else if (connected[conn->server].status == PYLIBMC_CONNECT_FAILED) {
+            unreached = 1;
+            continue;
+        }
+        conn->iov = malloc(sizeof(struct iovec) * (conn->nkeys * 2 + 2));
+        conn->in = malloc(PYLIBMC_ENGINE_BUFFER);
+        if (conn->iov == NULL || conn->in == NULL) {
+            conn->rc = MEMCACHED_MEMORY_ALLOCATION_FAILURE;
+            continue;
+        }
+        conn->in_size = PYLIBMC_ENGINE_BUFFER;
+        conn->iov[0].iov_base = "get";
+        conn->iov[0].iov_len = 3;
+        conn->niov = 1;
+        if (!conn->lane) {
+            conn->fd = memcached_server_list(mc)[conn->server].fd;
+        } else if ((conn->fd = _PylibMC_LaneFd(mc, lanes, conn->server,
+                                               conn->lane)) == -1) {
+            conn->rc = MEMCACHED_CONNECTION_FAILURE;
+        }
+    }
+    for (j = 0; j < nkeys; j++) {
+        pylibmc_engine_conn *conn = &conns[slots[j]];
+
+        if (conn->fd != -1) {
+            conn->iov[conn->niov].iov_base = " ";
+            conn->iov[conn->niov++].iov_len = 1;
+            conn->iov[conn->niov].iov_base = keys[j];
+            conn->iov[conn->niov++].iov_len = key_lens[j];
+        }
+    }
+    for (c = 0; c < nconns; c++) {
+        pylibmc_engine_conn *conn = &conns[c];
+        struct epoll_event ev;
+        size_t k, bytes = 0;
+
+        if (conn->fd == -1) {
+            continue;
+        }
+        conn->iov[conn->niov].iov_base = "\r\n";
+        conn->iov[conn->niov++].iov_len = 2;
+        for (k = 0; k < conn->niov; k++) {
+            bytes += conn->iov[k].iov_len;
+        }
+        _PylibMC_LaneSent(conn->stats, conn->nkeys, bytes);
+
+        /* Most requests fit in the socket buffer, so only those that don't
+         * wait for it to drain. */
+        _PylibMC_EngineWrite(conn);
+        ev.events = EPOLLIN | ((conn->iov_at < conn->niov) ? EPOLLOUT : 0);
+        ev.data.u32 = (uint32_t)c;
+        if (conn->rc == MEMCACHED_SUCCESS
+                && epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev) == -1) {
+            conn->rc = MEMCACHED_ERRNO;
+        }
+        if (conn->rc != MEMCACHED_SUCCESS) {
+            _PylibMC_EngineFail(mc, conn, conn->rc);
+        } else {
+            active++;
+        }
+    }
+
+    _PylibMC_EngineWait(mc, epfd, conns, nconns, active, sink, dl);
+
+    *rc = MEMCACHED_SUCCESS;
+    for (c = 0; c < nconns; c++) {
+        if (conns[c].rc != MEMCACHED_SUCCESS && *rc == MEMCACHED_SUCCESS) {
+            *rc = conns[c].rc;
+        }
+    }
+    if (dl->expired) {
+        *err_func = "memcached_fetch";
+        *rc = MEMCACHED_TIMEOUT;
+    } else if (*rc != MEMCACHED_SUCCESS) {
+        *err_func = "memcached_fetch";
+    } else if (unreached) {
+        *err_func = "memcached_mget";
+        *rc = MEMCACHED_SOME_ERRORS;
+    }
+
+    for (j = first; j < sink->nresults; j++) {
+        sink->results[j].value = sink->slab + off;
+        off += sink->results[j].value_len + 1;
+    }
+
+done:
+    if (epfd != -1) {
+        close(epfd);
+    }
+    for (c = 0; conns != NULL && c < nconns; c++) {
+        free(conns[c].iov);
+        free(conns[c].in);
+    }
+    free(slots);
+    free(counts);
+    free(conns);
+    free(connected);
+    free(wanted);
+    return handled;
+}
+
+/* Write and read for conns until every one of them is done or has failed,
+ * or the deadline passes, in which case those still owing replies are
+ * closed. A poll timeout's worth of quiet fails the lot. */
+static void _PylibMC_EngineWait(memcached_st *mc, int epfd,
+        pylibmc_engine_conn *conns, size_t nconns, size_t active,
+        pylibmc_engine_sink *sink, pylibmc_deadline *dl) {
+    struct epoll_event events[64];
+    int32_t poll_ms;
+    size_t c;
+
+    poll_ms = (dl->at >= 0) ? dl->poll_timeout
+            : (int32_t)memcached_behavior_get(mc,
+                    MEMCACHED_BEHAVIOR_POLL_TIMEOUT);
+
+    while (active) {
+        int ms = (poll_ms > 0) ? poll_ms : -1, n, k;
+
+        if (dl->at >= 0) {
+            double left = dl->at - _PylibMC_Now();
+
+            if (left <= 0) {
+                dl->expired = 1;
+                break;
+            } else if (ms < 0 || left * 1000 < ms) {
+                ms = (int)(left * 1000) + 1;
+            }
+        }
+
+        n = epoll_wait(epfd, events, 64, ms);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            if (n == 0 && _PylibMC_DeadlineCheck(dl)) {
+                break;
+            }
+            for (c = 0; c < nconns; c++) {
+                if (conns[c].fd != -1 && !conns[c].done) {
+                    _PylibMC_EngineFail(mc, &conns[c],
+                            n ? MEMCACHED_ERRNO : MEMCACHED_TIMEOUT);
+                }
+            }
+            return;
+        }
+
+        for (k = 0; k < n; k++) {
+            pylibmc_engine_conn *conn;
+
+            if ((c = events[k].data.u32) >= nconns
+                    || (conn = &conns[c])->fd == -1 || conn->done) {
+                continue;
+            }
+            if ((events[k].events & EPOLLOUT)
+                    && conn->iov_at < conn->niov) {
+                _PylibMC_EngineWrite(conn);
+                if (conn->rc == MEMCACHED_SUCCESS
+                        && conn->iov_at == conn->niov) {
+                    struct epoll_event ev;
+
+                    ev.events = EPOLLIN;
+                    ev.data.u32 = (uint32_t)c;
+                    epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+                }
+            }
+            if (conn->rc == MEMCACHED_SUCCESS && (events[k].events
+                    & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                _PylibMC_EngineRead(conn, sink);
+            }
+            if (conn->rc != MEMCACHED_SUCCESS) {
+                _PylibMC_EngineFail(mc, conn, conn->rc);
+                active--;
+            } else if (conn->done) {
+                if (conn->stats != NULL) {
+                    conn->stats->depth -= conn->nkeys;
+                }
+                active--;
+            }
+        }
+    }
+
+    for (c = 0; dl->expired && c < nconns; c++) {
+        if (conns[c].fd != -1 && !conns[c].done) {
+            _PylibMC_EngineFail(mc, &conns[c], MEMCACHED_TIMEOUT);
+        }
+    }
+}
+
+/* Write as much of conn's request as the socket takes, in one sendmsg. */
+static void _PylibMC_EngineWrite(pylibmc_engine_conn *conn) {
+    struct msghdr msg;
+    size_t left = conn->niov - conn->iov_at;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = conn->iov + conn->iov_at;
+    msg.msg_iovlen = (left < PYLIBMC_ENGINE_IOV) ? left : PYLIBMC_ENGINE_IOV;
+
+    n = sendmsg(conn->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            conn->rc = MEMCACHED_WRITE_FAILURE;
+        }
+        return;
+    }
+    while (n > 0) {
+        struct iovec *v = &conn->iov[conn->iov_at];
+
+        if ((size_t)n >= v->iov_len) {
+            n -= v->iov_len;
+            conn->iov_at++;
+        } else {
+            v->iov_base = (char *)v->iov_base + n;
+            v->iov_len -= n;
+            n = 0;
+        }
+    }
+}
+
+/* Read what's there, making room first if the value being read needs it,
+ * and take the whole replies. */
+static void _PylibMC_EngineRead(pylibmc_engine_conn *conn,
+        pylibmc_engine_sink *sink) {
+    ssize_t n;
+
+    if (conn->in_len == conn->in_size || conn->want > conn->in_size) {
+        size_t size = conn->in_size * 2;
+        char *in;
+
+        if (size < conn->want) {
+            size = conn->want;
+        }
+        if ((in = realloc(conn->in, size)) == NULL) {
+            conn->rc = MEMCACHED_MEMORY_ALLOCATION_FAILURE;
+            return;
+        }
+        conn->in = in;
+        conn->in_size = size;
+    }
+
+    n = recv(conn->fd, conn->in + conn->in_len,
+             conn->in_size - conn->in_len, MSG_DONTWAIT);
+    if (n == 0) {
+        conn->rc = MEMCACHED_READ_FAILURE;
+        return;
+    } else if (n == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            conn->rc = MEMCACHED_READ_FAILURE;
+        }
+        return;
+    }
+    conn->in_len += n;
+    if (conn->stats != NULL) {
+        conn->stats->bytes_in += n;
+    }
+    _PylibMC_EngineParse(conn, sink);
+}
+
+/* Take the VALUE lines and their data read so far, up to END. */
+static void _PylibMC_EngineParse(pylibmc_engine_conn *conn,
+        pylibmc_engine_sink *sink) {
+    const char *p = conn->in, *end = conn->in + conn->in_len, *eol;
+
+    conn->want = 0;
+    while (!conn->done && (eol = memchr(p, '\n', end - p)) != NULL) {
+        size_t len = eol - p + 1;
+
+        if (len < 2 || eol[-1] != '\r') {
+            conn->rc = MEMCACHED_PROTOCOL_ERROR;
+            return;
+        } else if (len == 5 && !memcmp(p, "END\r\n", 5)) {
+            conn->done = 1;
+        } else if (len > 6 && !memcmp(p, "VALUE ", 6)) {
+            const char *key = p + 6, *key_end, *s;
+            unsigned long long flags, bytes;
+
+            if ((key_end = s = memchr(key, ' ', eol - key)) == NULL
+                    || key_end - key >= MEMCACHED_MAX_KEY
+                    || !_PylibMC_AsyncNumber(&s, eol - 1, &flags)
+                    || !_PylibMC_AsyncNumber(&s, eol - 1, &bytes)
+                    || s != eol - 1 || flags > UINT32_MAX) {
+                conn->rc = MEMCACHED_PROTOCOL_ERROR;
+                return;
+            } else if ((size_t)(end - p) < len + bytes + 2) {
+                conn->want = len + bytes + 2;
+                break;
+            } else if (p[len + bytes] != '\r' || p[len + bytes + 1] != '\n') {
+                conn->rc = MEMCACHED_PROTOCOL_ERROR;
+                return;
+            } else if (!_PylibMC_EngineKeep(sink, key, key_end - key,
+                                            p + len, bytes,
+                                            (uint32_t)flags)) {
+                conn->rc = MEMCACHED_MEMORY_ALLOCATION_FAILURE;
+                return;
+            }
+            len += bytes + 2;
+        } else if (len >= 14 && !memcmp(p, "SERVER_ERROR", 12)) {
+            conn->rc = MEMCACHED_SERVER_ERROR;
+            return;
+        } else if (len >= 14 && !memcmp(p, "CLIENT_ERROR", 12)) {
+            conn->rc = MEMCACHED_CLIENT_ERROR;
+            return;
+        } else {
+            conn->rc = MEMCACHED_PROTOCOL_ERROR;
+            return;
+        }
+        p += len;
+    }
+
+    if (conn->done && p != end) {
+        /* nothing was asked that this could answer */
+        conn->rc = MEMCACHED_PROTOCOL_ERROR;
+    }
+    conn->in_len = end - p;
+    memmove(conn->in, p, conn->in_len);
+}
+
+/* Add a value to sink, unless it's full. 0 if out of memory. */
+static int _PylibMC_EngineKeep(pylibmc_engine_sink *sink, const char *key,
+        size_t key_len, const char *value, size_t value_len, uint32_t flags) {
+    pylibmc_mget_result *r;
+
+    if (sink->nresults == sink->max_results) {
+        /* more replies than keys asked for; we've no room for them */
+        return 1;
+    }
+    if (sink->slab_size - sink->slab_len < value_len + 1) {
+        size_t size = sink->slab_size * 2 + value_len + 1 + 4096;
+        char *slab = realloc(sink->slab, size);
+
+        if (slab == NULL) {
+            return 0;
+        }
+        sink->slab = slab;
+        sink->slab_size = size;
+    }
+
+    r = &sink->results[sink->nresults++];
+    memcpy(r->key, key, key_len);
+    r->key_len = key_len;
+    r->value = NULL;
+    r->value_len = value_len;
+    r->flags = flags;
+    memcpy(sink->slab + sink->slab_len, value, value_len);
+    sink->slab[sink->slab_len + value_len] = '\0';
+    sink->slab_len += value_len + 1;
+    return 1;
+}
+
+/* Give up on conn with rc, closing its connection, as it may still owe a
+ * reply. */
+static void _PylibMC_EngineFail(memcached_st *mc, pylibmc_engine_conn *conn,
+        memcached_return rc) {
+    memcached_server_st *server = &memcached_server_list(mc)[conn->server];
+
+    conn->rc = rc;
+    if (conn->stats != NULL) {
+        conn->stats->depth -= conn->nkeys;
+    }
+    if (conn->lane) {
+        close(conn->fd);
+        conn->stats->fd = -1;
+    } else {
+        _PylibMC_CloseServer(server);
+    }
+    conn->fd = -1;
+}
+/* }}} */
+
+/* {{{ Connections */
+static PyObject *PylibMC_Client_set_connections(PylibMC_Client *self,
+        PyObject *args, PyObject *kwds) {
+    unsigned int n;
+    Py_ssize_t large_value = 0;
+
+    static char *kws[] = { "n", "large_value", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "I|n", kws,
+                                     &n, &large_value)) {
+        return NULL;
+    } else if (n < 1 || n > 64) {
+        PyErr_SetString(PyExc_ValueError, "n must be within [1, 64]");
+        return NULL;
+    } else if (large_value < 0) {
+        PyErr_SetString(PyExc_ValueError, "large_value must not be negative");
+        return NULL;
+    }
+    self->cluster->connections = n;
+    self->cluster->large_value = (size_t)large_value;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *PylibMC_Client_connection_stats(PylibMC_Client *self) {
+    pylibmc_lanes *lanes;
+    PyObject *retval;
+    size_t i;
+
+    if (!_PylibMC_ClientReady(self)) {
+        return NULL;
+    } else if ((retval = PyList_New(0)) == NULL) {
+        return NULL;
+    } else if ((lanes = _PylibMC_Lanes(self)) == NULL) {
+        return retval;
+    }
+
+    for (i = 0; i < (size_t)lanes->nservers * lanes->nlanes; i++) {
+        memcached_server_st *server =
+            &memcached_server_list(self->mc)[i / lanes->nlanes];
+        pylibmc_lane *lane = &lanes->lanes[i];
+        unsigned int k = i % lanes->nlanes;
+        PyObject *stats;
+        int rc;
+
+        stats = Py_BuildValue("{s:N,s:s,s:N,s:n,s:n,s:k,s:K,s:K}",
+                "server", PyString_FromFormat("%s:%u", server->hostname,
+                                              server->port),
+                "lane", !k ? "libmemcached"
+                           : (k < lanes->stripes) ? "stripe" : "large",
+                "connected", PyBool_FromLong(k ? lane->fd != -1
+                                               : server->fd != -1),
+                "depth", (Py_ssize_t)lane->depth,
+                "peak_depth", (Py_ssize_t)lane->peak,
+                "requests", lane->requests,
+                "bytes_out", lane->bytes_out,
+                "bytes_in", lane->bytes_in);
+        if (stats == NULL) {
+            Py_DECREF(retval);
+            return NULL;
+        }
+        rc = PyList_Append(retval, stats);
+        Py_DECREF(stats);
+        if (rc == -1) {
+            Py_DECREF(retval);
+            return NULL;
+        }
+    }
+
+    return retval;
+}
+
+/* The connections self stripes over, set up as set_connections has them,
+ * or NULL if it's just libmemcached's (or there's no memory for more).
+ * Those made before a fork are dropped. */
+static pylibmc_lanes *_PylibMC_Lanes(PylibMC_Client *self) {
+    pylibmc_cluster *c = self->cluster;
+    pylibmc_lanes *lanes = self->lanes;
+    uint32_t nservers = memcached_server_count(self->mc);
+    size_t i;
+
+    if (lanes != NULL && (lanes->forks != _PylibMC_forks
+            || lanes->nservers != nservers
+            || lanes->stripes != c->connections
+            || lanes->large_value != c->large_value)) {
+        _PylibMC_FreeLanes(lanes);
+        self->lanes = lanes = NULL;
+    }
+    if (lanes != NULL || !nservers
+            || (c->connections <= 1 && !c->large_value)) {
+        return lanes;
+    }
+
+    if ((lanes = malloc(sizeof(pylibmc_lanes))) == NULL) {
+        return NULL;
+    }
+    lanes->forks = _PylibMC_forks;
+    lanes->nservers = nservers;
+    lanes->stripes = c->connections;
+    lanes->nlanes = c->connections + (c->large_value ? 1 : 0);
+    lanes->large_value = c->large_value;
+    lanes->lanes = calloc((size_t)nservers * lanes->nlanes,
+                          sizeof(pylibmc_lane));
+    if (lanes->lanes == NULL) {
+        free(lanes);
+        return NULL;
+    }
+    for (i = 0; i < (size_t)nservers * lanes->nlanes; i++) {
+        lanes->lanes[i].fd = -1;
+    }
+    return self->lanes = lanes;
+}
+
+/* Close the client's own connections and free lanes. After a fork, that
+ * closes our copies, leaving the parent's connections be. */
+static void _PylibMC_FreeLanes(pylibmc_lanes *lanes) {
+    size_t i;
+
+    for (i = 0; i < (size_t)lanes->nservers * lanes->nlanes; i++) {
+        if (lanes->lanes[i].fd != -1) {
+            close(lanes->lanes[i].fd);
+        }
+    }
+    free(lanes->lanes);
+    free(lanes);
+}
+
+/* The client's own connection k to server i, connecting it if it isn't.
+ * The connect may still be underway: writes wait for it to finish as they
+ * wait for room in the socket buffer. -1 if it can't be made. Doesn't need
+ * the GIL. */
+static int _PylibMC_LaneFd(memcached_st *mc, pylibmc_lanes *lanes,
+        uint32_t i, unsigned int k) {
+    memcached_server_st *server = &memcached_server_list(mc)[i];
+    pylibmc_lane *lane = &lanes->lanes[i * lanes->nlanes + k];
+    int err, one = 1;
+
+    if (lane->fd != -1 || server->type == MEMCACHED_CONNECTION_UDP) {
+        return lane->fd;
+    }
+    lane->fd = _PylibMC_StartConnect(server->hostname, server->port,
+                                     server->type, &err);
+    if (lane->fd != -1 && server->type == MEMCACHED_CONNECTION_TCP
+            && memcached_behavior_get(mc, MEMCACHED_BEHAVIOR_TCP_NODELAY)) {
+        setsockopt(lane->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return lane->fd;
+}
+
+/* Count n keys or commands, of bytes in all, as written to lane. */
+static void _PylibMC_LaneSent(pylibmc_lane *lane, size_t n, size_t bytes) {
+    if (lane == NULL) {
+        return;
+    }
+    lane->depth += n;
+    lane->requests += n;
+    lane->bytes_out += bytes;
+    if (lane->depth > lane->peak) {
+        lane->peak = lane->depth;
+    }
+}
+
+static int _PylibMC_CompareHashes(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+/* }}} */
+
+/* {{{ Pickling */
+static PyObject *_PylibMC_GetPickles(const char *attname) {
+    PyObject *pickle, *pickle_attr;
+
+    pickle_attr = NULL;
+    /* Import cPickle or pickle. */
+    pickle = PyImport_ImportModule("cPickle");
+    if (pickle == NULL) {
+        PyErr_Clear();
+        pickle = PyImport_ImportModule("pickle");
+    }
+
+    /* Find attribute and return it. */
+    if (pickle != NULL) {
+        pickle_attr = PyObject_GetAttrString(pickle, attname);
+        Py_DECREF(pickle);
+    }
+
+    return pickle_attr;
+}
+
+static PyObject *_PylibMC_Unpickle(const char *buff, size_t size) {
+    PyObject *pickle_load;
+    PyObject *retval = NULL;
+    
+    retval = NULL;
+    pickle_load = _PylibMC_GetPickles("loads");
+    if (pickle_load != NULL) {
+        retval = PyObject_CallFunction(pickle_load, "s#", buff, size);
+        Py_DECREF(pickle_load);
+    }
+
+    return retval;
+}
+
+static PyObject *_PylibMC_Pickle(PyObject *val) {
+    PyObject *pickle_dump;
+    PyObject *retval = NULL;
+
+    pickle_dump = _PylibMC_GetPickles("dumps");
+    if (pickle_dump != NULL) {
+        retval = PyObject_CallFunction(pickle_dump, "Oi", val, -1);
+        Py_DECREF(pickle_dump);
+    }
+
+    return retval;
+}
+/* }}} */
+
+static int _PylibMC_CheckKey(PyObject *key) {
+    if (key == NULL) {
+        PyErr_SetString(PyExc_ValueError, "key must be given");
+        return 0;
+    } else if (!PyString_Check(key)) {
+        PyErr_SetString(PyExc_TypeError, "key must be an instance of str");
+        return 0;
+    }
+
+    return _PylibMC_CheckKeyStringAndSize(
+            PyString_AS_STRING(key), PyString_GET_SIZE(key));
+}
+
+static int _PylibMC_CheckKeyStringAndSize(char *key, Py_ssize_t size) {
+    if (size > MEMCACHED_MAX_KEY) {
+        PyErr_Format(PyExc_ValueError, "key too long, max is %d",
+                MEMCACHED_MAX_KEY);
+        return 0;
+    }
+    /* TODO Check key contents here. */
+
+    return key != NULL;
+}
+
+/* Give the key that goes on the wire for *key*, which is either a str that
+ * gets prefixed with *prefix* or a Key, which has its prefix built in. Keys
+ * too long for self's key hashing are hashed; self may be NULL for none.
+ * Returns a new reference to a validated str, or NULL with an exception. */
+static PyObject *_PylibMC_WireKey(PylibMC_Client *self, PyObject *key,
+        const char *prefix, Py_ssize_t prefix_len) {
+    size_t threshold = (self != NULL) ? self->cluster->key_hash_threshold : 0;
+    PyObject *wire, *hashed;
+
+    if (key != NULL && PylibMC_Key_Check(key)) {
+        wire = ((PylibMC_Key *)key)->full;
+        Py_INCREF(wire);
+    } else if (key == NULL || !PyString_Check(key)) {
+        _PylibMC_CheckKey(key);
+        return NULL;
+    } else if (prefix == NULL || !prefix_len) {
+        Py_INCREF(key);
+        wire = key;
+    } else {
+        wire = PyString_FromStringAndSize(NULL,
+                prefix_len + PyString_GET_SIZE(key));
+        if (wire == NULL) {
+            return NULL;
+        }
+        memcpy(PyString_AS_STRING(wire), prefix, prefix_len);
+        memcpy(PyString_AS_STRING(wire) + prefix_len,
+               PyString_AS_STRING(key), PyString_GET_SIZE(key));
+    }
+
+    if (threshold && (size_t)PyString_GET_SIZE(wire) > threshold) {
+        hashed = _PylibMC_HashKey(self->cluster, wire);
+        Py_DECREF(wire);
+        return hashed;
+    } else if (!_PylibMC_CheckKey(wire)) {
+        Py_DECREF(wire);
+        return NULL;
+    }
+    return wire;
+}
+
+/* Index of the server *key* maps to, given its wire key *wire*. Key objects
+ * remember this for as long as the client's topology stays the same. */
+static uint32_t _PylibMC_ServerIndex(PylibMC_Client *self, PyObject *key,
+        PyObject *wire) {
+    if (PylibMC_Key_Check(key)) {
+        PylibMC_Key *k = (PylibMC_Key *)key;
+
+        if (k->topology != self->cluster->topology) {
+            k->server = memcached_generate_hash(self->mc,
+                    PyString_AS_STRING(wire), PyString_GET_SIZE(wire));
+            k->topology = self->cluster->topology;
+        }
+        return k->server;
+    }
+
+    return memcached_generate_hash(self->mc,
+            PyString_AS_STRING(wire), PyString_GET_SIZE(wire));
+}
+
+/* {{{ Key type */
+static PyObject *PylibMC_KeyType_new(PyTypeObject *type, PyObject *args,
+        PyObject *kwds) {
+    PylibMC_Key *self;
+    PyObject *key, *prefix = NULL;
+
+    static char *kws[] = { "key", "key_prefix", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O", kws,
+                                     &key, &prefix)) {
+        return NULL;
+    } else if (!_PylibMC_CheckKey(key)) {
+        return NULL;
+    } else if (prefix == Py_None) {
+        prefix = NULL;
+    } else if (prefix != NULL && !_PylibMC_CheckKey(prefix)) {
+        return NULL;
+    }
+
+    self = (PylibMC_Key *)type->tp_alloc(type, 0);
+    if (self == NULL) {
+        return NULL;
+    }
+
+    self->full = _PylibMC_WireKey(NULL, key,
+            prefix ? PyString_AS_STRING(prefix) : NULL,
+            prefix ? PyString_GET_SIZE(prefix) : 0);
+    if (self->full == NULL) {
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    Py_INCREF(key);
+    self->key = key;
+    Py_XINCREF(prefix);
+    self->prefix = prefix;
+    self->topology = 0;
+    self->server = 0;
+
+    return (PyObject *)self;
+}
+
+static void PylibMC_KeyType_dealloc(PylibMC_Key *self) {
+    Py_XDECREF(self->key);
+    Py_XDECREF(self->prefix);
+    Py_XDECREF(self->full);
+    self->ob_type->tp_free(self);
+}
+
+static PyObject *PylibMC_KeyType_repr(PylibMC_Key *self) {
+    PyObject *key_repr, *prefix_repr, *retval;
+
+    if ((key_repr = PyObject_Repr(self->key)) == NULL) {
+        return NULL;
+    } else if (self->prefix == NULL) {
+        retval = PyString_FromFormat("Key(%s)", PyString_AS_STRING(key_repr));
+        Py_DECREF(key_repr);
+        return retval;
+    } else if ((prefix_repr = PyObject_Repr(self->prefix)) == NULL) {
+        Py_DECREF(key_repr);
+        return NULL;
+    }
+
+    retval = PyString_FromFormat("Key(%s, key_prefix=%s)",
+            PyString_AS_STRING(key_repr), PyString_AS_STRING(prefix_repr));
+    Py_DECREF(key_repr);
+    Py_DECREF(prefix_repr);
+    return retval;
+}
+
+static PyObject *PylibMC_KeyType_str(PylibMC_Key *self) {
+    Py_INCREF(self->full);
+    return self->full;
+}
+
+static long PylibMC_KeyType_hash(PylibMC_Key *self) {
+    return PyObject_Hash(self->full);
+}
+
+static PyObject *PylibMC_KeyType_richcompare(PyObject *a, PyObject *b,
+        int op) {
+    if (!PylibMC_Key_Check(a) || !PylibMC_Key_Check(b)
+            || (op != Py_EQ && op != Py_NE)) {
+        Py_INCREF(Py_NotImplemented);
+        return Py_NotImplemented;
+    }
+
+    return PyObject_RichCompare(((PylibMC_Key *)a)->full,
+                                ((PylibMC_Key *)b)->full, op);
+}
+/* }}} */
+
+/* {{{ Time helpers */
+/* Seconds on a clock that doesn't jump along with the wall clock. */
+static double _PylibMC_Now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* Wall-clock time timeout seconds from now, as pthread_cond_timedwait wants
+ * it. */
+static void _PylibMC_Deadline(double timeout, struct timespec *until) {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    until->tv_sec = now.tv_sec + (time_t)timeout;
+    until->tv_nsec = now.tv_usec * 1000
+                   + (long)((timeout - (time_t)timeout) * 1e9);
+    if (until->tv_nsec >= 1000000000) {
+        until->tv_sec++;
+        until->tv_nsec -= 1000000000;
+    }
+}
+
+/* Read a timeout in seconds from *obj*, where None means no timeout (-1.) */
+static int _PylibMC_ParseTimeout(PyObject *obj, double *timeout) {
+    if (obj == NULL || obj == Py_None) {
+        *timeout = -1.0;
+        return 1;
+    }
+
+    *timeout = PyFloat_AsDouble(obj);
+    if (*timeout == -1.0 && PyErr_Occurred()) {
+        return 0;
+    } else if (*timeout < 0) {
+        PyErr_SetString(PyExc_ValueError, "timeout must not be negative");
+        return 0;
+    }
+    return 1;
+}
+/* }}} */
+
+/* {{{ Pool type */
+static PyObject *PylibMC_PoolType_new(PyTypeObject *type, PyObject *args,
+        PyObject *kwds) {
+    PylibMC_Pool *self;
+
+    self = (PylibMC_Pool *)PyType_GenericNew(type, args, kwds);
+    if (self != NULL) {
+        pthread_mutex_init(&self->wait_lock, NULL);
+        pthread_cond_init(&self->wait_cond, NULL);
+    }
+
+    return (PyObject *)self;
+}
+
+static void PylibMC_PoolType_dealloc(PylibMC_Pool *self) {
+    uint32_t i;
+
+    for (i = 0; i < self->nslots; i++) {
+        Py_XDECREF(self->slots[i]);
+    }
+    PyMem_Free(self->slots);
+    PyMem_Free(self->next);
+    PyMem_Free(self->busy);
+
+    pthread_cond_destroy(&self->wait_cond);
+    pthread_mutex_destroy(&self->wait_lock);
+
+    self->ob_type->tp_free(self);
+}
+
+static int PylibMC_Pool_init(PylibMC_Pool *self, PyObject *args,
+        PyObject *kwds) {
+    PyObject *mc = Py_None, *n_slots = Py_None, *r;
+
+    static char *kws[] = { "mc", "n_slots", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OO", kws, &mc, &n_slots)) {
+        return -1;
+    } else if (mc == Py_None) {
+        return 0;
+    }
+
+    r = PyObject_CallMethod((PyObject *)self, "fill", "OO", mc, n_slots);
+    Py_XDECREF(r);
+    return (r == NULL) ? -1 : 0;
+}
+
+/* The free stack is only ever changed by compare-and-swap on head, so that
+ * threads can give clients back without any lock, and take them without one
+ * as long as there's one to take. A slot counts as in use from before it's
+ * popped, so that fill, which needs none to be, can't miss one being taken
+ * by a waiter that has yet to get the GIL back. */
+static int _PylibMC_PoolPop(PylibMC_Pool *self) {
+    uint64_t head, new_head;
+    uint32_t top;
+
+    __sync_fetch_and_add(&self->in_use, 1);
+    do {
+        head = self->head;
+        if ((top = (uint32_t)head) == 0) {
+            __sync_fetch_and_sub(&self->in_use, 1);
+            return -1;
+        }
+        new_head = (((head >> 32) + 1) << 32) | self->next[top - 1];
+    } while (!__sync_bool_compare_and_swap(&self->head, head, new_head));
+
+    return (int)(top - 1);
+}
+
+static void _PylibMC_PoolPush(PylibMC_Pool *self, int slot) {
+    uint64_t head, new_head;
+
+    do {
+        head = self->head;
+        self->next[slot] = (uint32_t)head;
+        new_head = (((head >> 32) + 1) << 32) | (uint32_t)(slot + 1);
+    } while (!__sync_bool_compare_and_swap(&self->head, head, new_head));
+}
+
+/* Sleep until a slot can be popped, or *timeout* seconds have passed
+ * (negative meaning forever.) Called without the GIL. */
+static int _PylibMC_PoolWait(PylibMC_Pool *self, double timeout) {
+    struct timespec until;
+    int slot;
+
+    if (timeout >= 0) {
+        _PylibMC_Deadline(timeout, &until);
+    }
+
+    pthread_mutex_lock(&self->wait_lock);
+    /* Either this is seen by a releasing thread, which then signals us, or
+     * the release happened before it and the pop below sees the slot. */
+    __sync_fetch_and_add(&self->waiters, 1);
+    while ((slot = _PylibMC_PoolPop(self)) < 0) {
+        if (timeout < 0) {
+            pthread_cond_wait(&self->wait_cond, &self->wait_lock);
+        } else if (pthread_cond_timedwait(&self->wait_cond, &self->wait_lock,
+                                          &until) == ETIMEDOUT) {
+            slot = _PylibMC_PoolPop(self);
+            break;
+        }
+    }
+    __sync_fetch_and_sub(&self->waiters, 1);
+    pthread_mutex_unlock(&self->wait_lock);
+
+    return slot;
+}
+
+/* Take a slot off the pool, possibly waiting for one. Returns the slot index,
+ * or -1 with Queue.Empty raised. */
+static int _PylibMC_PoolAcquire(PylibMC_Pool *self, int block,
+        double timeout) {
+    int slot;
+    uint32_t in_use, high;
+
+    if ((slot = _PylibMC_PoolPop(self)) < 0 && block && timeout != 0) {
+        double started = _PylibMC_Now();
+        uint64_t usec, max;
+
+        Py_BEGIN_ALLOW_THREADS
+        slot = _PylibMC_PoolWait(self, timeout);
+        Py_END_ALLOW_THREADS
+
+        usec = (uint64_t)((_PylibMC_Now() - started) * 1e6);
+        __sync_fetch_and_add(&self->waits, 1);
+        __sync_fetch_and_add(&self->wait_usec, usec);
+        while ((max = self->max_wait_usec) < usec
+                && !__sync_bool_compare_and_swap(&self->max_wait_usec,
+                                                 max, usec));
+    }
+
+    if (slot < 0) {
+        __sync_fetch_and_add(&self->timeouts, 1);
+        PyErr_SetNone(PylibMCExc_PoolEmpty);
+        return -1;
+    }
+
+    self->busy[slot] = 1;
+    __sync_fetch_and_add(&self->acquires, 1);
+    in_use = __sync_add_and_fetch(&self->in_use, 0);
+    while ((high = self->high_water) < in_use
+            && !__sync_bool_compare_and_swap(&self->high_water, high, in_use));
+
+    return slot;
+}
+
+static void _PylibMC_PoolRelease(PyObject *pool, int slot) {
+    PylibMC_Pool *self = (PylibMC_Pool *)pool;
+
+    self->busy[slot] = 0;
+    __sync_fetch_and_sub(&self->in_use, 1);
+    _PylibMC_PoolPush(self, slot);
+
+    if (__sync_fetch_and_add(&self->waiters, 0)) {
+        pthread_mutex_lock(&self->wait_lock);
+        pthread_cond_signal(&self->wait_cond);
+        pthread_mutex_unlock(&self->wait_lock);
+    }
+}
+
+static PyObject *PylibMC_Pool_fill(PylibMC_Pool *self, PyObject *args,
+        PyObject *kwds) {
+    PylibMC_Client *mc;
+    PylibMC_Client **slots;
+    uint32_t *next;
+    unsigned char *busy;
+    unsigned int n_slots;
+    uint32_t nslots, i;
+
+    static char *kws[] = { "mc", "n_slots", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!I", kws,
+                                     &PylibMC_ClientType, &mc, &n_slots)) {
+        return NULL;
+    } else if (self->in_use) {
+        PyErr_SetString(PyExc_RuntimeError,
+                "can't fill a pool while clients are reserved from it");
+        return NULL;
+    }
+
+    nslots = self->nslots + n_slots;
+    slots = PyMem_New(PylibMC_Client *, nslots);
+    next = PyMem_New(uint32_t, nslots);
+    busy = PyMem_New(unsigned char, nslots);
+    if (slots == NULL || next == NULL || busy == NULL) {
+        PyMem_Free(slots);
+        PyMem_Free(next);
+        PyMem_Free(busy);
+        return PyErr_NoMemory();
+    }
+
+    for (i = 0; i < self->nslots; i++) {
+        slots[i] = self->slots[i];
+    }
+    for (; i < nslots; i++) {
+        slots[i] = _PylibMC_Clone((PylibMC_Client *)mc, 0);
+        if (slots[i] == NULL) {
+            while (i-- > self->nslots) {
+                Py_DECREF(slots[i]);
+            }
+            PyMem_Free(slots);
+            PyMem_Free(next);
+            PyMem_Free(busy);
+            return NULL;
+        }
+    }
+
+    /* Every slot is free, so rebuild the stack with slot 0 on top. */
+    for (i = 0; i < nslots; i++) {
+        next[i] = (i + 1 < nslots) ? i + 2 : 0;
+        busy[i] = 0;
+    }
+
+    /* Waiters pop without the GIL, so keep them out while swapping, and
+     * make sure none got a slot while the clients were being cloned. */
+    pthread_mutex_lock(&self->wait_lock);
+    if (self->in_use) {
+        pthread_mutex_unlock(&self->wait_lock);
+        for (i = self->nslots; i < nslots; i++) {
+            Py_DECREF(slots[i]);
+        }
+        PyMem_Free(slots);
+        PyMem_Free(next);
+        PyMem_Free(busy);
+        PyErr_SetString(PyExc_RuntimeError,
+                "can't fill a pool while clients are reserved from it");
+        return NULL;
+    }
+    PyMem_Free(self->slots);
+    PyMem_Free(self->next);
+    PyMem_Free(self->busy);
+    self->slots = slots;
+    self->next = next;
+    self->busy = busy;
+    self->nslots = nslots;
+    self->head = (((self->head >> 32) + 1) << 32) | (nslots ? 1 : 0);
+    __sync_synchronize();
+    pthread_cond_broadcast(&self->wait_cond);
+    pthread_mutex_unlock(&self->wait_lock);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *PylibMC_Pool_acquire(PylibMC_Pool *self, PyObject *args,
+        PyObject *kwds) {
+    PyObject *timeout_obj = Py_None;
+    double timeout;
+    int block = 1, slot;
+
+    static char *kws[] = { "block", "timeout", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iO", kws,
+                                     &block, &timeout_obj)) {
+        return NULL;
+    } else if (!_PylibMC_ParseTimeout(timeout_obj, &timeout)) {
+        return NULL;
+    } else if ((slot = _PylibMC_PoolAcquire(self, block, timeout)) < 0) {
+        return NULL;
+    }
+
+    Py_INCREF(self->slots[slot]);
+    return (PyObject *)self->slots[slot];
+}
+
+static PyObject *PylibMC_Pool_release(PylibMC_Pool *self, PyObject *mc) {
+    uint32_t i;
+
+    for (i = 0; i < self->nslots; i++) {
+        if ((PyObject *)self->slots[i] == mc && self->busy[i]) {
+            _PylibMC_PoolRelease((PyObject *)self, (int)i);
+            Py_RETURN_NONE;
+        }
+    }
+
+    PyErr_SetString(PyExc_ValueError, "client isn't reserved from this pool");
+    return NULL;
+}
+
+static PyObject *PylibMC_Pool_reserve(PylibMC_Pool *self, PyObject *args,
+        PyObject *kwds) {
+    PyObject *timeout_obj = Py_None;
+    double timeout;
+    int block = 1, slot;
+
+    static char *kws[] = { "block", "timeout", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iO", kws,
+                                     &block, &timeout_obj)) {
+        return NULL;
+    } else if (!_PylibMC_ParseTimeout(timeout_obj, &timeout)) {
+        return NULL;
+    } else if ((slot = _PylibMC_PoolAcquire(self, block, timeout)) < 0) {
+        return NULL;
+    }
+
+    return _PylibMC_Reserved((PyObject *)self, (PyObject *)self->slots[slot],
+                             slot, _PylibMC_PoolRelease);
+}
+
+/* The shortcuts borrow a client for exactly the one call. */
+static PyObject *PylibMC_Pool_get(PylibMC_Pool *self, PyObject *arg) {
+    PyObject *retval;
+    int slot;
+
+    if ((slot = _PylibMC_PoolAcquire(self, 1, -1.0)) < 0) {
+        return NULL;
+    }
+    retval = _PylibMC_Get(self->slots[slot], arg, -1);
+    _PylibMC_PoolRelease((PyObject *)self, slot);
+    return retval;
+}
+
+static PyObject *PylibMC_Pool_set(PylibMC_Pool *self, PyObject *args,
+        PyObject *kwds) {
+    PyObject *retval;
+    int slot;
+
+    if ((slot = _PylibMC_PoolAcquire(self, 1, -1.0)) < 0) {
+        return NULL;
+    }
+    retval = PylibMC_Client_set(self->slots[slot], args, kwds);
+    _PylibMC_PoolRelease((PyObject *)self, slot);
+    return retval;
+}
+
+static PyObject *PylibMC_Pool_delete(PylibMC_Pool *self, PyObject *args) {
+    PyObject *retval;
+    int slot;
+
+    if ((slot = _PylibMC_PoolAcquire(self, 1, -1.0)) < 0) {
+        return NULL;
+    }
+    retval = PylibMC_Client_delete(self->slots[slot], args, NULL);
+    _PylibMC_PoolRelease((PyObject *)self, slot);
+    return retval;
+}
+
+static PyObject *PylibMC_Pool_incr(PylibMC_Pool *self, PyObject *args) {
+    PyObject *retval;
+    int slot;
+
+    if ((slot = _PylibMC_PoolAcquire(self, 1, -1.0)) < 0) {
+        return NULL;
+    }
+    retval = PylibMC_Client_incr(self->slots[slot], args);
+    _PylibMC_PoolRelease((PyObject *)self, slot);
+    return retval;
+}
+
+static PyObject *PylibMC_Pool_get_multi(PylibMC_Pool *self, PyObject *args,
+        PyObject *kwds) {
+    PyObject *retval;
+    int slot;
+
+    if ((slot = _PylibMC_PoolAcquire(self, 1, -1.0)) < 0) {
+        return NULL;
+    }
+    retval = PylibMC_Client_get_multi(self->slots[slot], args, kwds);
+    _PylibMC_PoolRelease((PyObject *)self, slot);
+    return retval;
+}
+
+static PyObject *PylibMC_Pool_set_multi(PylibMC_Pool *self, PyObject *args,
+        PyObject *kwds) {
+    PyObject *retval;
+    int slot;
+
+    if ((slot = _PylibMC_PoolAcquire(self, 1, -1.0)) < 0) {
+        return NULL;
+    }
+    retval = PylibMC_Client_set_multi(self->slots[slot], args, kwds);
+    _PylibMC_PoolRelease((PyObject *)self, slot);
+    return retval;
+}
+
+static PyObject *PylibMC_Pool_stats(PylibMC_Pool *self) {
+    return Py_BuildValue("{s:I,s:I,s:I,s:K,s:K,s:K,s:d,s:d}",
+            "size", (unsigned int)self->nslots,
+            "in_use", (unsigned int)self->in_use,
+            "high_water", (unsigned int)self->high_water,
+            "acquires", (unsigned PY_LONG_LONG)self->acquires,
+            "waits", (unsigned PY_LONG_LONG)self->waits,
+            "timeouts", (unsigned PY_LONG_LONG)self->timeouts,
+            "wait_time", (double)self->wait_usec / 1e6,
+            "max_wait_time", (double)self->max_wait_usec / 1e6);
+}
+
+static Py_ssize_t PylibMC_Pool_len(PylibMC_Pool *self) {
+    return (Py_ssize_t)self->nslots;
+}
+/* }}} */
+
+/* {{{ Thread-mapped pool type */
+/* Let go of one of home's references, with its lock held, and unlock it.
+ * Frees it if that was the last one. */
+static void _PylibMC_ThreadHomeRelease(pylibmc_thread_home *home) {
+    unsigned int left = --home->refcnt;
+
+    pthread_mutex_unlock(&home->lock);
+    if (!left) {
+        pthread_mutex_destroy(&home->lock);
+        free(home);
+    }
+}
+
+/* Let go of one of tc's owners, with its home's lock held. */
+static void _PylibMC_ThreadClientRelease(pylibmc_thread_client *tc) {
+    if (!--tc->owners) {
+        free(tc);
+    }
+}
+
+/* Runs as a thread exits, without the GIL: the client's connections are
+ * closed right away, the client object itself is freed by the next thread
+ * that calls into the pool. If the pool is gone, it already let go of the
+ * client, and only the slot is left to free. */
+static void _PylibMC_ThreadExit(void *arg) {
+    pylibmc_thread_client *tc = (pylibmc_thread_client *)arg;
+    pylibmc_thread_home *home = tc->home;
+    PylibMC_Client *client = (PylibMC_Client *)tc->client;
+
+    pthread_mutex_lock(&home->lock);
+    if (home->closed) {
+        /* the pool is gone, and so is the client */
+    } else if (client->mc == NULL) {
+        /* never used */
+    } else if (client->forks != _PylibMC_forks) {
+        _PylibMC_DropConnections(client->mc);
+    } else {
+        memcached_quit(client->mc);
+    }
+    if (!home->closed) {
+        tc->dead_next = home->dead;
+        home->dead = tc;
+    }
+    _PylibMC_ThreadClientRelease(tc);
+    _PylibMC_ThreadHomeRelease(home);
+}
+
+/* Free the clients of exited threads, which have let go of them already.
+ * Clients are freed outside of home's lock, as that can let go of the
+ * GIL. */
+static void _PylibMC_ThreadPoolReap(PylibMC_ThreadPool *self) {
+    pylibmc_thread_client *tc, *dead_next;
+
+    pthread_mutex_lock(&self->home->lock);
+    tc = self->home->dead;
+    self->home->dead = NULL;
+    pthread_mutex_unlock(&self->home->lock);
+    for (; tc != NULL; tc = dead_next) {
+        dead_next = tc->dead_next;
+        if (tc->prev != NULL) {
+            tc->prev->next = tc->next;
+        } else {
+            self->live = tc->next;
+        }
+        if (tc->next != NULL) {
+            tc->next->prev = tc->prev;
+        }
+        Py_DECREF(tc->client);
+        free(tc);
+        self->reaped++;
+    }
+}
+
+/* Borrowed reference to the calling thread's client, made on demand. */
+static PyObject *_PylibMC_ThreadClient(PylibMC_ThreadPool *self) {
+    pylibmc_thread_client *tc;
+    PyObject *client;
+
+    if ((tc = pthread_getspecific(self->key)) != NULL) {
+        return tc->client;
+    }
+
+    _PylibMC_ThreadPoolReap(self);
+
+    client = (PyObject *)_PylibMC_Clone(
+            (PylibMC_Client *)self->master, 1);
+    if (client == NULL) {
+        return NULL;
+    } else if ((tc = malloc(sizeof(pylibmc_thread_client))) == NULL) {
+        Py_DECREF(client);
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    tc->client = client;
+    tc->home = self->home;
+    tc->owners = 2;
+    tc->prev = NULL;
+    tc->next = self->live;
+    tc->dead_next = NULL;
+
+    if (pthread_setspecific(self->key, tc) != 0) {
+        Py_DECREF(client);
+        free(tc);
+        PyErr_SetString(PyExc_RuntimeError, "pthread_setspecific failed");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&self->home->lock);
+    self->home->refcnt++;
+    pthread_mutex_unlock(&self->home->lock);
+    if (self->live != NULL) {
+        self->live->prev = tc;
+    }
+    self->live = tc;
+    self->created++;
+
+    return client;
+}
+
+static PyObject *PylibMC_ThreadPoolType_new(PyTypeObject *type,
+        PyObject *args, PyObject *kwds) {
+    PylibMC_ThreadPool *self;
+    pylibmc_thread_home *home;
+
+    if ((home = calloc(1, sizeof(pylibmc_thread_home))) == NULL) {
+        return PyErr_NoMemory();
+    }
+    pthread_mutex_init(&home->lock, NULL);
+    home->refcnt = 1;
+
+    self = (PylibMC_ThreadPool *)PyType_GenericNew(type, args, kwds);
+    if (self == NULL) {
+        pthread_mutex_destroy(&home->lock);
+        free(home);
+        return NULL;
+    } else if (pthread_key_create(&self->key, _PylibMC_ThreadExit) != 0) {
+        pthread_mutex_destroy(&home->lock);
+        free(home);
+        Py_DECREF(self);
+        PyErr_SetString(PyExc_RuntimeError, "pthread_key_create failed");
+        return NULL;
+    }
+    self->home = home;
+
+    return (PyObject *)self;
+}
+
+static void PylibMC_ThreadPoolType_dealloc(PylibMC_ThreadPool *self) {
+    pylibmc_thread_home *home = self->home;
+    pylibmc_thread_client *tc, *next;
+
+    if (home == NULL) {
+        self->ob_type->tp_free(self);
+        return;
+    }
+
+    /* After this, no thread starts exiting with one of our clients.
+     * Threads already at it wait on the lock, and once it's closed leave
+     * the clients alone. The slots of threads still running are freed
+     * when they exit, or never if they outlive the key. */
+    pthread_key_delete(self->key);
+    pthread_mutex_lock(&home->lock);
+    home->closed = 1;
+    pthread_mutex_unlock(&home->lock);
+
+    _PylibMC_ThreadPoolReap(self);
+    for (tc = self->live; tc != NULL; tc = next) {
+        next = tc->next;
+        Py_DECREF(tc->client);
+        pthread_mutex_lock(&home->lock);
+        _PylibMC_ThreadClientRelease(tc);
+        pthread_mutex_unlock(&home->lock);
+    }
+    self->live = NULL;
+    pthread_mutex_lock(&home->lock);
+    _PylibMC_ThreadHomeRelease(home);
+
+    Py_XDECREF(self->master);
+    self->ob_type->tp_free(self);
+}
+
+static int PylibMC_ThreadPool_init(PylibMC_ThreadPool *self, PyObject *args,
+        PyObject *kwds) {
+    PyObject *master;
+
+    static char *kws[] = { "master", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!", kws,
+                                     &PylibMC_ClientType, &master)) {
+        return -1;
+    }
+
+    Py_INCREF(master);
+    Py_XDECREF(self->master);
+    self->master = master;
+    return 0;
+}
+
+static PyObject *PylibMC_ThreadPool_current(PylibMC_ThreadPool *self) {
+    PyObject *client;
+
+    if (self->master == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "pool has no master client");
+        return NULL;
+    } else if ((client = _PylibMC_ThreadClient(self)) == NULL) {
+        return NULL;
+    }
+
+    Py_INCREF(client);
+    return client;
+}
+
+static PyObject *PylibMC_ThreadPool_reserve(PylibMC_ThreadPool *self) {
+    PyObject *client;
+
+    if (self->master == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "pool has no master client");
+        return NULL;
+    } else if ((client = _PylibMC_ThreadClient(self)) == NULL) {
+        return NULL;
+    }
+
+    /* The client stays with the thread, so there's nothing to give back. */
+    return _PylibMC_Reserved((PyObject *)self, client, -1, NULL);
+}
+
+static PyObject *PylibMC_ThreadPool_stats(PylibMC_ThreadPool *self) {
+    _PylibMC_ThreadPoolReap(self);
+
+    return Py_BuildValue("{s:K,s:K,s:K}",
+            "live", (unsigned PY_LONG_LONG)(self->created - self->reaped),
+            "created", (unsigned PY_LONG_LONG)self->created,
+            "reaped", (unsigned PY_LONG_LONG)self->reaped);
+}
+/* }}} */
+
+/* {{{ Pipeline type */
+static PyObject *PylibMC_Client_pipeline(PylibMC_Client *self) {
+    PylibMC_Pipeline *p;
+
+    p = PyObject_New(PylibMC_Pipeline, &PylibMC_PipelineType);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    Py_INCREF(self);
+    p->client = self;
+    p->cmds = NULL;
+    p->ncmds = p->size = 0;
+    Py_INCREF(Py_None);
+    p->results = Py_None;
+
+    return (PyObject *)p;
+}
+
+static void _PylibMC_PipeClear(PylibMC_Pipeline *self) {
+    size_t i;
+
+    for (i = 0; i < self->ncmds; i++) {
+        _PylibMC_FreeMset(&self->cmds[i].mset);
+    }
+    self->ncmds = 0;
+}
+
+static void PylibMC_PipelineType_dealloc(PylibMC_Pipeline *self) {
+    _PylibMC_PipeClear(self);
+    PyMem_Free(self->cmds);
+    Py_DECREF(self->client);
+    Py_XDECREF(self->results);
+    PyObject_Del(self);
+}
+
+/* Room for one more command, zeroed, or NULL. It's queued once the caller
+ * bumps ncmds. */
+static pylibmc_pipe_cmd *_PylibMC_PipePush(PylibMC_Pipeline *self, int op) {
+    pylibmc_pipe_cmd *cmd;
+
+    if (self->ncmds == self->size) {
+        pylibmc_pipe_cmd *cmds = self->cmds;
+        size_t size = self->size ? self->size * 2 : 16;
+
+        if (PyMem_Resize(cmds, pylibmc_pipe_cmd, size) == NULL) {
+            return (pylibmc_pipe_cmd *)PyErr_NoMemory();
+        }
+        self->cmds = cmds;
+        self->size = size;
+    }
+
+    cmd = &self->cmds[self->ncmds];
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->op = op;
+    return cmd;
+}
+
+/* Values are serialized and compressed as they're queued, so the commands
+ * are ready to go out as they are. */
+static PyObject *_PylibMC_PipeStore(PylibMC_Pipeline *self,
+        _PylibMC_SetCommand f, PyObject *args, PyObject *kwds) {
+    static char *kws[] = { "key", "val", "time", "min_compress_len", NULL };
+    PyObject *key, *value;
+    unsigned int time = 0, min_compress = 0;
+    pylibmc_pipe_cmd *cmd;
+    int metered;
+    double start;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|II", kws,
+                                     &key, &value, &time, &min_compress)) {
+        return NULL;
+    }
+#ifndef USE_ZLIB
+    if (min_compress) {
+        PyErr_SetString(PyExc_TypeError, "min_compress_len without zlib");
+        return NULL;
+    }
+#endif
+
+    if ((cmd = _PylibMC_PipePush(self, _PylibMC_SetOp(f, 0))) == NULL) {
+        return NULL;
+    }
+    cmd->set_func = f;
+
+    metered = _PylibMC_Metered(self->client);
+    start = metered ? _PylibMC_Now() : 0;
+    if (!_PylibMC_SerializeValue(self->client, key, NULL, value, time,
+                                 &cmd->mset)) {
+        _PylibMC_FreeMset(&cmd->mset);
+        return NULL;
+    }
+    if (metered) {
+        _PylibMC_MeterTime(self->client, PYLIBMC_SERIALIZE,
+                           _PylibMC_Now() - start);
+    }
+    if (!_PylibMC_CompressMset(self->client, &cmd->mset, min_compress)) {
+        _PylibMC_FreeMset(&cmd->mset);
+        return NULL;
+    }
+
+    self->ncmds++;
+    Py_RETURN_NONE;
+}
+
+/* Swap a serialized value of min_compress bytes or more for its deflated
+ * self, if that's smaller. 0 with an exception if out of memory. */
+static int _PylibMC_CompressMset(PylibMC_Client *self, pylibmc_mset *m,
+        unsigned int min_compress) {
+#ifdef USE_ZLIB
+    if (min_compress && m->value_len >= min_compress) {
+        char *compressed = NULL;
+        size_t compressed_len = 0;
+        int metered = _PylibMC_Metered(self);
+        double start = metered ? _PylibMC_Now() : 0;
+
+        _PylibMC_Deflate(m->value, m->value_len,
+                         &compressed, &compressed_len);
+        if (metered) {
+            _PylibMC_MeterTime(self, PYLIBMC_COMPRESS,
+                               _PylibMC_Now() - start);
+        }
+        if (compressed != NULL) {
+            PyObject *value_obj = PyString_FromStringAndSize(compressed,
+                                                             compressed_len);
+
+            free(compressed);
+            if (value_obj == NULL) {
+                return 0;
+            }
+            Py_DECREF(m->value_obj);
+            m->value_obj = value_obj;
+            m->value = PyString_AS_STRING(value_obj);
+            m->value_len = compressed_len;
+            m->flags |= PYLIBMC_FLAG_ZLIB;
+        }
+    }
+#endif
+    return 1;
+}
+
+/* Queue a delete, or an incr or decr if f is given. */
+static PyObject *_PylibMC_PipeKey(PylibMC_Pipeline *self, int op,
+        PyObject *key_obj, time_t time, _PylibMC_IncrCommand f,
+        unsigned int delta) {
+    pylibmc_pipe_cmd *cmd;
+    PyObject *key;
+
+    if ((key = _PylibMC_WireKey(self->client, key_obj, NULL, 0)) == NULL) {
+        return NULL;
+    } else if ((cmd = _PylibMC_PipePush(self, op)) == NULL) {
+        Py_DECREF(key);
+        return NULL;
+    }
+
+    Py_INCREF(key_obj);
+    cmd->mset.key_obj = key_obj;
+    cmd->mset.prefixed_key_obj = key;
+    cmd->mset.key = PyString_AS_STRING(key);
+    cmd->mset.key_len = PyString_GET_SIZE(key);
+    cmd->mset.time = time;
+    cmd->incr.key = cmd->mset.key;
+    cmd->incr.key_len = cmd->mset.key_len;
+    cmd->incr.incr_func = f;
+    cmd->incr.delta = delta;
+
+    self->ncmds++;
+    Py_RETURN_NONE;
+}
+
+static PyObject *PylibMC_Pipeline_set(PylibMC_Pipeline *self,
+        PyObject *args, PyObject *kwds) {
+    return _PylibMC_PipeStore(self, memcached_set, args, kwds);
+}
+
+static PyObject *PylibMC_Pipeline_add(PylibMC_Pipeline *self,
+        PyObject *args, PyObject *kwds) {
+    return _PylibMC_PipeStore(self, memcached_add, args, kwds);
+}
+
+static PyObject *PylibMC_Pipeline_replace(PylibMC_Pipeline *self,
+        PyObject *args, PyObject *kwds) {
+    return _PylibMC_PipeStore(self, memcached_replace, args, kwds);
+}
+
+static PyObject *PylibMC_Pipeline_append(PylibMC_Pipeline *self,
+        PyObject *args, PyObject *kwds) {
+    return _PylibMC_PipeStore(self, memcached_append, args, kwds);
+}
+
+static PyObject *PylibMC_Pipeline_prepend(PylibMC_Pipeline *self,
+        PyObject *args, PyObject *kwds) {
+    return _PylibMC_PipeStore(self, memcached_prepend, args, kwds);
+}
+
+static PyObject *PylibMC_Pipeline_delete(PylibMC_Pipeline *self,
+        PyObject *args) {
+    PyObject *key;
+    unsigned int time = 0;
+
+    if (!PyArg_ParseTuple(args, "O|I", &key, &time)) {
+        return NULL;
+    }
+    return _PylibMC_PipeKey(self, PYLIBMC_OP_DELETE, key, time, NULL, 0);
+}
+
+static PyObject *PylibMC_Pipeline_incr(PylibMC_Pipeline *self,
+        PyObject *args) {
+    PyObject *key;
+    unsigned int delta = 1;
+
+    if (!PyArg_ParseTuple(args, "O|I", &key, &delta)) {
+        return NULL;
+    }
+    return _PylibMC_PipeKey(self, PYLIBMC_OP_INCR, key, 0,
+                            memcached_increment, delta);
+}
+
+static PyObject *PylibMC_Pipeline_decr(PylibMC_Pipeline *self,
+        PyObject *args) {
+    PyObject *key;
+    unsigned int delta = 1;
+
+    if (!PyArg_ParseTuple(args, "O|I", &key, &delta)) {
+        return NULL;
+    }
+    return _PylibMC_PipeKey(self, PYLIBMC_OP_DECR, key, 0,
+                            memcached_decrement, delta);
+}
+
+static PyObject *PylibMC_Pipeline_execute(PylibMC_Pipeline *self) {
+    PylibMC_Client *client = self->client;
+    pylibmc_span trace, *span;
+    PyObject *results;
+
+    span = _PylibMC_TraceStart(client, &trace, PYLIBMC_OP_PIPELINE, NULL);
+    results = _PylibMC_PipeExecute(client, self->cmds, self->ncmds);
+    _PylibMC_PipeClear(self);
+
+    Py_DECREF(self->results);
+    self->results = (results != NULL) ? results : Py_None;
+    Py_INCREF(self->results);
+
+    return _PylibMC_TraceEnd(client, span, results);
+}
+
+static PyObject *PylibMC_Pipeline_enter(PylibMC_Pipeline *self) {
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+/* A block that raised leaves nothing sent. */
+static PyObject *PylibMC_Pipeline_exit(PylibMC_Pipeline *self,
+        PyObject *args) {
+    PyObject *results;
+
+    if (PyTuple_GET_SIZE(args) && PyTuple_GET_ITEM(args, 0) != Py_None) {
+        _PylibMC_PipeClear(self);
+    } else if ((results = PylibMC_Pipeline_execute(self)) == NULL) {
+        return NULL;
+    } else {
+        Py_DECREF(results);
+    }
+    Py_RETURN_FALSE;
+}
+
+static Py_ssize_t PylibMC_Pipeline_len(PylibMC_Pipeline *self) {
+    return (Py_ssize_t)self->ncmds;
+}
+
+/* The libmemcached function a command stands for, to name in errors. */
+static const char *_PylibMC_PipeName(pylibmc_pipe_cmd *cmd) {
+    switch (cmd->op) {
+        case PYLIBMC_OP_ADD:     return "memcached_add";
+        case PYLIBMC_OP_REPLACE: return "memcached_replace";
+        case PYLIBMC_OP_APPEND:  return "memcached_append";
+        case PYLIBMC_OP_PREPEND: return "memcached_prepend";
+        case PYLIBMC_OP_DELETE:  return "memcached_delete";
+        case PYLIBMC_OP_INCR:    return "memcached_increment";
+        case PYLIBMC_OP_DECR:    return "memcached_decrement";
+        default:                 return "memcached_set";
+    }
+}
+
+/* Run the commands, all in one go without the GIL, and give their results.
+ * Servers with an open breaker are skipped, and replicas and copies of hot
+ * keys follow along as they do for the plain commands. Outcomes a plain
+ * command raises for are raised for the first command they happen to,
+ * once all have run. */
+static PyObject *_PylibMC_PipeExecute(PylibMC_Client *self,
+        pylibmc_pipe_cmd *cmds, size_t ncmds) {
+    pylibmc_breakers *breakers;
+    pylibmc_replicas *replicas;
+    pylibmc_hotkeys *hotkeys;
+    pylibmc_hot_copies *hot = NULL;
+    pylibmc_pipe_cmd *failed = NULL;
+    pylibmc_lanes *lanes;
+    pylibmc_async *prefetches;
+    time_t hot_ttl = 0;
+    PyObject *results, *result;
+    int metered;
+    double start, began = 0;
+    size_t i;
+
+    if (!_PylibMC_ClientReady(self)) {
+        return NULL;
+    } else if (!ncmds) {
+        return PyList_New(0);
+    }
+    breakers = _PylibMC_Breakers(self);
+    replicas = _PylibMC_Replicas(self);
+    lanes = _PylibMC_Lanes(self);
+    if ((metered = _PylibMC_Metered(self))) {
+        began = _PylibMC_Now();
+    }
+    if ((prefetches = _PylibMC_Prefetches(self)) != NULL) {
+        for (i = 0; i < ncmds; i++) {
+            _PylibMC_PrefetchForget(prefetches, cmds[i].mset.key,
+                                    cmds[i].mset.key_len);
+        }
+    }
+
+    if ((hotkeys = _PylibMC_HotKeys(self)) != NULL && hotkeys->nhot) {
+        if ((hot = PyMem_New(pylibmc_hot_copies, ncmds)) == NULL) {
+            return PyErr_NoMemory();
+        }
+        for (i = 0; i < ncmds; i++) {
+            _PylibMC_HotLookup(hotkeys, cmds[i].mset.key,
+                               cmds[i].mset.key_len, &hot[i]);
+        }
+        hot_ttl = hotkeys->ttl;
+    }
+
+    /* Key objects know their server already. */
+    if (memcached_server_count(self->mc)) {
+        for (i = 0; i < ncmds; i++) {
+            if (cmds[i].mset.key_len) {
+                cmds[i].server = _PylibMC_ServerIndex(self,
+                        cmds[i].mset.key_obj, cmds[i].mset.prefixed_key_obj);
+            }
+        }
+    }
+
+    PYLIBMC_BEGIN_ALLOW_THREADS(self)
+    start = _PylibMC_Now();
+    for (i = 0; i < ncmds; i++) {
+        pylibmc_pipe_cmd *cmd = &cmds[i];
+
+        if (!cmd->mset.key_len) {
+            /* as the plain commands, ignore empty keys */
+            cmd->rc = (cmd->set_func != NULL) ? MEMCACHED_NOTSTORED
+                                              : MEMCACHED_NO_KEY_PROVIDED;
+            continue;
+        } else if (!memcached_server_count(self->mc)) {
+            cmd->rc = MEMCACHED_NO_SERVERS;
+            continue;
+        }
+        if (breakers != NULL
+                && !_PylibMC_BreakerAllow(breakers, cmd->server, start)) {
+            cmd->rc = MEMCACHED_SERVER_MARKED_DEAD;
+        } else {
+            cmd->rc = MEMCACHED_BUFFERED;
+        }
+    }
+
+    _PylibMC_PipeSend(self->mc, lanes, cmds, ncmds);
+
+    for (i = 0; i < ncmds; i++) {
+        if (breakers != NULL && cmds[i].mset.key_len
+                && cmds[i].rc != MEMCACHED_SERVER_MARKED_DEAD) {
+            _PylibMC_BreakerRecord(breakers, cmds[i].server,
+                                   _PylibMC_IsServerFailure(cmds[i].rc),
+                                   _PylibMC_Now() - start);
+        }
+        if (replicas != NULL || hot != NULL) {
+            _PylibMC_PipeCopy(self->mc, replicas, breakers, &cmds[i],
+                              (hot != NULL) ? &hot[i] : NULL, hot_ttl);
+        }
+    }
+    if (replicas != NULL) {
+        _PylibMC_ReplicaFlush(self->mc);
+    }
+    if (hot != NULL) {
+        memcached_flush_buffers(self->mc);
+    }
+    PYLIBMC_END_ALLOW_THREADS
+
+    PyMem_Free(hot);
+    /* looked up again, what we had may be gone by now */
+    hotkeys = _PylibMC_HotKeys(self);
+
+    if ((results = PyList_New(ncmds)) == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < ncmds; i++) {
+        pylibmc_pipe_cmd *cmd = &cmds[i];
+
+        if (metered) {
+            _PylibMC_MeterKey(self, PYLIBMC_OP_PIPELINE,
+                              cmd->mset.key_len ? cmd->server : UINT32_MAX,
+                              _PylibMC_Outcome(cmd->rc), 0,
+                              cmd->mset.key_len + cmd->mset.value_len);
+        }
+        if (hotkeys != NULL && cmd->set_func != NULL) {
+            _PylibMC_HotKeySample(hotkeys, self->mc, cmd->mset.key,
+                                  cmd->mset.key_len, cmd->mset.value_len);
+        }
+
+        switch (cmd->rc) {
+            case MEMCACHED_SUCCESS:
+            case MEMCACHED_FAILURE:
+            case MEMCACHED_NOTFOUND:
+            case MEMCACHED_NOTSTORED:
+            case MEMCACHED_DATA_EXISTS:
+            case MEMCACHED_NO_KEY_PROVIDED:
+            case MEMCACHED_BAD_KEY_PROVIDED:
+                break;
+            case MEMCACHED_SERVER_MARKED_DEAD:
+                if (breakers != NULL && breakers->fallback) {
+                    break;
+                }
+                /* fall through */
+            default:
+                if (failed == NULL) {
+                    failed = cmd;
+                }
+        }
+
+        if (cmd->incr.incr_func == NULL) {
+            result = PyBool_FromLong(cmd->rc == MEMCACHED_SUCCESS);
+        } else if (cmd->rc == MEMCACHED_SUCCESS) {
+            result = PyLong_FromUnsignedLongLong(
+                    (unsigned PY_LONG_LONG)cmd->incr.result);
+        } else {
+            Py_INCREF(Py_None);
+            result = Py_None;
+        }
+        if (result == NULL) {
+            Py_DECREF(results);
+            return NULL;
+        }
+        PyList_SET_ITEM(results, i, result);
+    }
+
+    if (metered) {
+        _PylibMC_Meter(self, PYLIBMC_OP_PIPELINE, UINT32_MAX,
+                       _PylibMC_Now() - began, -1, 0, 0);
+    }
+
+    if (failed == NULL) {
+        return results;
+    }
+    Py_DECREF(results);
+    if (breakers != NULL && failed->rc == MEMCACHED_SERVER_MARKED_DEAD) {
+        return _PylibMC_ServerDown(self, failed->server);
+    }
+    return PylibMC_ErrFromMemcached(self, _PylibMC_PipeName(failed),
+                                    failed->rc);
+}
+
+/* Whether a key can go in a text protocol request as it is. */
+static int _PylibMC_TextKey(const char *key, size_t key_len) {
+    size_t i;
+
+    if (key_len == 0 || key_len >= MEMCACHED_MAX_KEY) {
+        return 0;
+    }
+    for (i = 0; i < key_len; i++) {
+        if ((unsigned char)key[i] <= ' ' || key[i] == 0x7f) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Send the commands whose rc is MEMCACHED_BUFFERED, and set each one's rc
+ * to how it went. The requests for a connection are written back to back
+ * and their replies read as they come, for all connections at once; with
+ * lanes, each server's commands are spread over its connections (see
+ * _PylibMC_PipeLanes), and otherwise go over libmemcached's. What can't go
+ * that way, with the binary protocol, noreply, a connection libmemcached is
+ * in the middle of using or a key the text protocol can't carry, goes
+ * through libmemcached a command at a time, once what was written ahead of
+ * it has been answered, so commands keep their order either way. Doesn't
+ * need the GIL. */
+static void _PylibMC_PipeSend(memcached_st *mc, pylibmc_lanes *lanes,
+        pylibmc_pipe_cmd *cmds, size_t ncmds) {
+    uint32_t i, nservers = memcached_server_count(mc);
+    unsigned int nlanes = (lanes != NULL) ? lanes->nlanes : 1;
+    pylibmc_pipe_conn *conns = NULL;
+    pylibmc_connect *connected = NULL;
+    unsigned char *wanted = NULL;
+    unsigned int *lane = NULL;
+    size_t j, c, nconns = (size_t)nservers * nlanes, pending = 0;
+
+    if (nservers
+            && !memcached_behavior_get(mc, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL)
+            && !memcached_behavior_get(mc, MEMCACHED_BEHAVIOR_NOREPLY)) {
+        conns = calloc(nconns, sizeof(pylibmc_pipe_conn));
+        connected = malloc(sizeof(pylibmc_connect) * nservers);
+        wanted = calloc(nservers, 1);
+        lane = calloc(ncmds, sizeof(unsigned int));
+    }
+
+    if (conns != NULL && connected != NULL && wanted != NULL
+            && lane != NULL) {
+        for (j = 0; j < ncmds; j++) {
+            if (cmds[j].rc == MEMCACHED_BUFFERED) {
+                wanted[cmds[j].server] = 1;
+            }
+        }
+        _PylibMC_ConnectAll(mc, -1, wanted, connected);
+        _PylibMC_PipeLanes(lanes, cmds, ncmds, lane);
+
+        for (c = 0; c < nconns; c++) {
+            pylibmc_pipe_conn *conn = &conns[c];
+            memcached_server_st *server;
+
+            conn->server = i = c / nlanes;
+            conn->lane = c % nlanes;
+            conn->stats = (lanes != NULL) ? &lanes->lanes[c] : NULL;
+            conn->fd = -1;
+            conn->rc = MEMCACHED_SUCCESS;
+            server = &memcached_server_list(mc)[i];
+            if (!wanted[i]) {
+                continue;
+            } else if (connected[i].status == PYLIBMC_CONNECT_FAILED) {
+                conn->rc = MEMCACHED_CONNECTION_FAILURE;
+            } else if (conn->lane) {
+                conn->fd = _PylibMC_LaneFd(mc, lanes, i, conn->lane);
+            } else if (_PylibMC_ServerIdle(server)) {
+                conn->fd = server->fd;
+            }
+        }
+
+        for (j = 0; j < ncmds; j++) {
+            pylibmc_pipe_cmd *cmd = &cmds[j];
+            pylibmc_pipe_conn *conn;
+
+            if (cmd->rc != MEMCACHED_BUFFERED) {
+                continue;
+            }
+            conn = &conns[cmd->server * nlanes + lane[j]];
+            if (conn->rc != MEMCACHED_SUCCESS) {
+                cmd->rc = conn->rc;
+            } else if (conn->fd != -1
+                    && _PylibMC_TextKey(cmd->mset.key, cmd->mset.key_len)) {
+                if (_PylibMC_PipeEncode(conn, cmds, j)) {
+                    pending++;
+                } else {
+                    cmd->rc = MEMCACHED_MEMORY_ALLOCATION_FAILURE;
+                }
+            } else {
+                if (pending) {
+                    _PylibMC_PipeFlush(mc, conns, nconns, cmds);
+                    pending = 0;
+                }
+                _PylibMC_PipeSlow(mc, cmd);
+
+                /* libmemcached may have dropped or replaced its connection
+                 * to the server, so look again before writing to it */
+                for (c = 0; c < nconns; c += nlanes) {
+                    if (wanted[conns[c].server]
+                            && conns[c].rc == MEMCACHED_SUCCESS) {
+                        memcached_server_st *server =
+                            &memcached_server_list(mc)[conns[c].server];
+
+                        conns[c].fd = _PylibMC_ServerIdle(server)
+                                    ? server->fd : -1;
+                    }
+                }
+            }
+        }
+        if (pending) {
+            _PylibMC_PipeFlush(mc, conns, nconns, cmds);
+        }
+
+        for (c = 0; c < nconns; c++) {
+            free(conns[c].out);
+            free(conns[c].cmds);
+        }
+    }
+    free(conns);
+    free(connected);
+    free(wanted);
+    free(lane);
+
+    for (j = 0; j < ncmds; j++) {
+        if (cmds[j].rc == MEMCACHED_BUFFERED) {
+            _PylibMC_PipeSlow(mc, &cmds[j]);
+        }
+    }
+}
+
+/* Run the requests written to conns so far, and empty them for more.
+ * Doesn't need the GIL. */
+static void _PylibMC_PipeFlush(memcached_st *mc, pylibmc_pipe_conn *conns,
+        size_t nconns, pylibmc_pipe_cmd *cmds) {
+    size_t c;
+
+    for (c = 0; c < nconns; c++) {
+        if (conns[c].fd != -1) {
+            _PylibMC_LaneSent(conns[c].stats, conns[c].ncmds,
+                              conns[c].out_len);
+        }
+    }
+
+    _PylibMC_PipeRun(mc, conns, nconns, cmds);
+
+    for (c = 0; c < nconns; c++) {
+        conns[c].out_len = conns[c].out_off = 0;
+        conns[c].ncmds = conns[c].next = 0;
+        conns[c].in_len = 0;
+    }
+}
+
+/* Pick the connection among its server's that each command goes over,
+ * by the hash of its key so that the commands for a key keep their order.
+ * Keys with a value of lanes->large_value bytes or more anywhere in the
+ * batch have all their commands go over the large value lane. */
+static void _PylibMC_PipeLanes(pylibmc_lanes *lanes, pylibmc_pipe_cmd *cmds,
+        size_t ncmds, unsigned int *lane) {
+    uint64_t *large = NULL;
+    size_t j, nlarge = 0;
+
+    if (lanes == NULL) {
+        return;
+    }
+    if (lanes->large_value
+            && (large = malloc(sizeof(uint64_t) * ncmds)) != NULL) {
+        for (j = 0; j < ncmds; j++) {
+            if (cmds[j].rc == MEMCACHED_BUFFERED && cmds[j].set_func != NULL
+                    && (size_t)cmds[j].mset.value_len >= lanes->large_value) {
+                large[nlarge++] = _PylibMC_HotKeyHash(cmds[j].mset.key,
+                                                      cmds[j].mset.key_len);
+            }
+        }
+        qsort(large, nlarge, sizeof(uint64_t), _PylibMC_CompareHashes);
+    }
+
+    for (j = 0; j < ncmds; j++) {
+        uint64_t h = _PylibMC_HotKeyHash(cmds[j].mset.key,
+                                         cmds[j].mset.key_len);
+
+        if (nlarge && bsearch(&h, large, nlarge, sizeof(uint64_t),
+                              _PylibMC_CompareHashes) != NULL) {
+            lane[j] = lanes->stripes;
+        } else {
+            lane[j] = (unsigned int)(h % lanes->stripes);
+        }
+    }
+    free(large);
+}
+
+/* Add the request for cmds[i] to those of conn. 0 if out of memory. */
+static int _PylibMC_PipeEncode(pylibmc_pipe_conn *conn,
+        pylibmc_pipe_cmd *cmds, size_t i) {
+    pylibmc_pipe_cmd *cmd = &cmds[i];
+    pylibmc_mset *m = &cmd->mset;
+    char head[MEMCACHED_MAX_KEY + 64];
+    size_t need;
+    int head_len;
+
+    if (cmd->incr.incr_func != NULL) {
+        head_len = snprintf(head, sizeof(head), "%s %.*s %u\r\n",
+                            PylibMC_op_names[cmd->op], (int)m->key_len,
+                            m->key, cmd->incr.delta);
+    } else if (cmd->set_func == NULL) {
+        head_len = m->time ? snprintf(head, sizeof(head),
+                                      "delete %.*s %lu\r\n", (int)m->key_len,
+                                      m->key, (unsigned long)m->time)
+                           : snprintf(head, sizeof(head), "delete %.*s\r\n",
+                                      (int)m->key_len, m->key);
+    } else {
+        head_len = snprintf(head, sizeof(head), "%s %.*s %u %lu %lu\r\n",
+                            PylibMC_op_names[cmd->op], (int)m->key_len,
+                            m->key, m->flags, (unsigned long)m->time,
+                            (unsigned long)m->value_len);
+    }
+    need = head_len + ((cmd->set_func != NULL) ? m->value_len + 2 : 0);
+
+    if (conn->out_size - conn->out_len < need) {
+        size_t size = conn->out_size * 2 + need + 4096;
+        char *out = realloc(conn->out, size);
+
+        if (out == NULL) {
+            return 0;
+        }
+        conn->out = out;
+        conn->out_size = size;
+    }
+    if (conn->ncmds == conn->cmds_size) {
+        size_t size = conn->cmds_size * 2 + 16;
+        size_t *indexes = realloc(conn->cmds, sizeof(size_t) * size);
+
+        if (indexes == NULL) {
+            return 0;
+        }
+        conn->cmds = indexes;
+        conn->cmds_size = size;
+    }
+
+    memcpy(conn->out + conn->out_len, head, head_len);
+    conn->out_len += head_len;
+    if (cmd->set_func != NULL) {
+        memcpy(conn->out + conn->out_len, m->value, m->value_len);
+        memcpy(conn->out + conn->out_len + m->value_len, "\r\n", 2);
+        conn->out_len += m->value_len + 2;
+    }
+    conn->cmds[conn->ncmds++] = i;
+    return 1;
+}
+
+/* Write out the requests of conns and read their replies, until every one
+ * is answered or its connection fails or goes quiet for longer than the
+ * poll timeout. Doesn't need the GIL. */
+static void _PylibMC_PipeRun(memcached_st *mc, pylibmc_pipe_conn *conns,
+        size_t nconns, pylibmc_pipe_cmd *cmds) {
+    struct pollfd *pfds;
+    size_t *servers, i;
+    int32_t timeout;
+    int n, k, ready;
+
+    timeout = (int32_t)memcached_behavior_get(mc,
+            MEMCACHED_BEHAVIOR_POLL_TIMEOUT);
+    pfds = malloc(sizeof(struct pollfd) * nconns);
+    servers = malloc(sizeof(size_t) * nconns);
+
+    for (;;) {
+        n = 0;
+        for (i = 0; i < nconns; i++) {
+            pylibmc_pipe_conn *conn = &conns[i];
+
+            if (conn->fd == -1 || conn->next == conn->ncmds) {
+                continue;
+            } else if (pfds == NULL || servers == NULL) {
+                conn->rc = MEMCACHED_MEMORY_ALLOCATION_FAILURE;
+                _PylibMC_PipeFail(mc, conn, cmds);
+                continue;
+            }
+            pfds[n].fd = conn->fd;
+            pfds[n].events = POLLIN;
+            if (conn->out_off < conn->out_len) {
+                pfds[n].events |= POLLOUT;
+            }
+            pfds[n].revents = 0;
+            servers[n++] = i;
+        }
+        if (!n) {
+            break;
+        }
+
+        ready = poll(pfds, n, (timeout > 0) ? timeout : -1);
+        if (ready == -1 && errno == EINTR) {
+            continue;
+        }
+
+        for (k = 0; k < n; k++) {
+            pylibmc_pipe_conn *conn = &conns[servers[k]];
+
+            if (ready == 0) {
+                conn->rc = MEMCACHED_TIMEOUT;
+            } else if (ready == -1) {
+                conn->rc = MEMCACHED_ERRNO;
+            } else {
+                if (pfds[k].revents & POLLOUT) {
+                    _PylibMC_PipeWrite(conn);
+                }
+                if (conn->rc == MEMCACHED_SUCCESS && (pfds[k].revents
+                        & (POLLIN | POLLHUP | POLLERR))) {
+                    _PylibMC_PipeRead(conn, cmds);
+                }
+            }
+            if (conn->rc != MEMCACHED_SUCCESS) {
+                _PylibMC_PipeFail(mc, conn, cmds);
+            }
+        }
+    }
+
+    free(pfds);
+    free(servers);
+}
+
+static void _PylibMC_PipeWrite(pylibmc_pipe_conn *conn) {
+    ssize_t n;
+
+    n = send(conn->fd, conn->out + conn->out_off,
+             conn->out_len - conn->out_off, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n > 0) {
+        conn->out_off += n;
+    } else if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK
+               && errno != EINTR) {
+        conn->rc = MEMCACHED_WRITE_FAILURE;
+    }
+}
+
+/* Read what's there, and hand each whole line to the next command. */
+static void _PylibMC_PipeRead(pylibmc_pipe_conn *conn,
+        pylibmc_pipe_cmd *cmds) {
+    char *line, *eol;
+    ssize_t n;
+
+    n = recv(conn->fd, conn->in + conn->in_len,
+             sizeof(conn->in) - conn->in_len, MSG_DONTWAIT);
+    if (n == 0) {
+        conn->rc = MEMCACHED_READ_FAILURE;
+        return;
+    } else if (n == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            conn->rc = MEMCACHED_READ_FAILURE;
+        }
+        return;
+    }
+    conn->in_len += n;
+    if (conn->stats != NULL) {
+        conn->stats->bytes_in += n;
+    }
+
+    line = conn->in;
+    while ((eol = memchr(line, '\n', conn->in + conn->in_len - line))
+            != NULL) {
+        if (conn->next == conn->ncmds
+                || !_PylibMC_PipeReply(&cmds[conn->cmds[conn->next]], line,
+                                       eol - line + 1)) {
+            conn->rc = MEMCACHED_PROTOCOL_ERROR;
+            return;
+        }
+        conn->next++;
+        if (conn->stats != NULL) {
+            conn->stats->depth--;
+        }
+        line = eol + 1;
+    }
+
+    conn->in_len -= line - conn->in;
+    memmove(conn->in, line, conn->in_len);
+    if (conn->in_len == sizeof(conn->in)) {
+        /* no reply is that long */
+        conn->rc = MEMCACHED_PROTOCOL_ERROR;
+    }
+}
+
+/* Take a reply line, with its \r\n, to cmd. 0 if it makes no sense. */
+static int _PylibMC_PipeReply(pylibmc_pipe_cmd *cmd, const char *line,
+        size_t len) {
+#define PYLIBMC_IS(s) (len == sizeof(s) - 1 && !memcmp(line, s, len))
+    if (len < 2 || line[len - 2] != '\r') {
+        return 0;
+    }
+    len -= 2;
+
+    if (len >= 12 && !memcmp(line, "SERVER_ERROR", 12)) {
+        cmd->rc = MEMCACHED_SERVER_ERROR;
+    } else if (len >= 12 && !memcmp(line, "CLIENT_ERROR", 12)) {
+        cmd->rc = MEMCACHED_CLIENT_ERROR;
+    } else if (PYLIBMC_IS("ERROR")) {
+        cmd->rc = MEMCACHED_PROTOCOL_ERROR;
+    } else if (PYLIBMC_IS("NOT_FOUND")) {
+        cmd->rc = MEMCACHED_NOTFOUND;
+    } else if (cmd->incr.incr_func != NULL) {
+        uint64_t value = 0;
+        size_t i;
+
+        if (!len || len > 20) {
+            return 0;
+        }
+        for (i = 0; i < len; i++) {
+            if (line[i] < '0' || line[i] > '9') {
+                return 0;
+            }
+            value = value * 10 + (line[i] - '0');
+        }
+        cmd->incr.result = value;
+        cmd->rc = MEMCACHED_SUCCESS;
+    } else if (cmd->set_func == NULL) {
+        if (!PYLIBMC_IS("DELETED")) {
+            return 0;
+        }
+        cmd->rc = MEMCACHED_SUCCESS;
+    } else if (PYLIBMC_IS("STORED")) {
+        cmd->rc = MEMCACHED_SUCCESS;
+    } else if (PYLIBMC_IS("NOT_STORED")) {
+        cmd->rc = MEMCACHED_NOTSTORED;
+    } else if (PYLIBMC_IS("EXISTS")) {
+        cmd->rc = MEMCACHED_DATA_EXISTS;
+    } else {
+        return 0;
+    }
+    return 1;
+#undef PYLIBMC_IS
+}
+
+/* Give up on a connection. Its unanswered commands get its rc, and it's
+ * closed, as it may still owe replies. */
+static void _PylibMC_PipeFail(memcached_st *mc, pylibmc_pipe_conn *conn,
+        pylibmc_pipe_cmd *cmds) {
+    memcached_server_st *server = &memcached_server_list(mc)[conn->server];
+
+    if (conn->stats != NULL) {
+        conn->stats->depth -= conn->ncmds - conn->next;
+    }
+    for (; conn->next < conn->ncmds; conn->next++) {
+        cmds[conn->cmds[conn->next]].rc = conn->rc;
+    }
+    if (conn->lane) {
+        close(conn->fd);
+        conn->stats->fd = -1;
+    } else {
+        _PylibMC_CloseServer(server);
+    }
+    conn->fd = -1;
+}
+
+/* Run a command through libmemcached. Doesn't need the GIL. */
+static void _PylibMC_PipeSlow(memcached_st *mc, pylibmc_pipe_cmd *cmd) {
+    pylibmc_mset *m = &cmd->mset;
+
+    if (cmd->incr.incr_func != NULL) {
+        cmd->rc = cmd->incr.incr_func(mc, m->key, m->key_len,
+                                      cmd->incr.delta, &cmd->incr.result);
+    } else if (cmd->set_func != NULL) {
+        cmd->rc = cmd->set_func(mc, m->key, m->key_len, m->value,
+                                m->value_len, m->time, m->flags);
+    } else {
+        cmd->rc = memcached_delete(mc, m->key, m->key_len, m->time);
+    }
+}
+
+/* Have the replicas and hot key copies of a command's key follow it, as
+ * they do the plain commands. Doesn't need the GIL. */
+static void _PylibMC_PipeCopy(memcached_st *mc, pylibmc_replicas *r,
+        pylibmc_breakers *b, pylibmc_pipe_cmd *cmd,
+        const pylibmc_hot_copies *hot, time_t hot_ttl) {
+    pylibmc_mset *m = &cmd->mset;
+    int ok = (cmd->rc == MEMCACHED_SUCCESS);
+    int failed = _PylibMC_IsServerFailure(cmd->rc);
+
+    if (!m->key_len) {
+        return;
+    }
+
+    if (r == NULL) {
+        /* nothing to copy to */
+    } else if (cmd->incr.incr_func != NULL) {
+        if (ok) {
+            char value[24];
+            int value_len = snprintf(value, sizeof(value), "%llu",
+                                     (unsigned long long)cmd->incr.result);
+
+            _PylibMC_ReplicaWrite(mc, r, b, cmd->server, memcached_set_by_key,
+                                  m->key, m->key_len, value, value_len, 0,
+                                  PYLIBMC_FLAG_INTEGER, 0);
+        }
+    } else if (cmd->set_func != NULL) {
+        if ((ok || failed) && _PylibMC_ReplicaWrite(mc, r, b, cmd->server,
+                    _PylibMC_ReplicaCommand(cmd->set_func, ok), m->key,
+                    m->key_len, m->value, m->value_len, m->time, m->flags,
+                    failed)
+                && failed) {
+            cmd->rc = MEMCACHED_SUCCESS;
+        }
+    } else if (ok || failed || cmd->rc == MEMCACHED_NOTFOUND) {
+        if (_PylibMC_ReplicaWrite(mc, r, b, cmd->server, NULL, m->key,
+                                  m->key_len, NULL, 0, m->time, 0, failed)
+                && failed) {
+            cmd->rc = MEMCACHED_SUCCESS;
+        }
+    }
+
+    if (hot != NULL && hot->n && (cmd->rc == MEMCACHED_SUCCESS
+                                  || cmd->op == PYLIBMC_OP_DELETE)) {
+        _PylibMC_HotFanOut(mc, hot, m->key, m->key_len,
+                           (cmd->set_func == memcached_set) ? m->value : NULL,
+                           m->value_len, m->time, m->flags, hot_ttl);
+    }
+}
+/* }}} */
+
+/* {{{ Submitted requests */
+/* The client's submitted requests, set up on first use, and started over
+ * when the client finds it's been forked: the connections are then the
+ * parent's, and so are the requests. NULL with an exception on failure. */
+static pylibmc_async *_PylibMC_Async(PylibMC_Client *self) {
+    pylibmc_async *a = self->async;
+    uint32_t i, nservers;
+
+    if (!_PylibMC_ClientReady(self)) {
+        return NULL;
+    } else if (a != NULL && a->forks == _PylibMC_forks) {
+        return a;
+    } else if (a != NULL) {
+        _PylibMC_FreeAsync(a);
+        self->async = NULL;
+    }
+
+    nservers = memcached_server_count(self->mc);
+    if ((a = PyMem_New(pylibmc_async, 1)) == NULL) {
+        return (pylibmc_async *)PyErr_NoMemory();
+    }
+    memset(a, 0, sizeof(*a));
+    if ((a->conns = PyMem_New(pylibmc_async_conn,
+                              nservers ? nservers : 1)) == NULL) {
+        PyMem_Free(a);
+        return (pylibmc_async *)PyErr_NoMemory();
+    }
+    memset(a->conns, 0, sizeof(pylibmc_async_conn) * (nservers ? nservers : 1));
+    for (i = 0; i < nservers; i++) {
+        a->conns[i].fd = -1;
+    }
+    if ((a->epfd = epoll_create(nservers ? nservers : 1)) == -1) {
+        PyMem_Free(a->conns);
+        PyMem_Free(a);
+        return (pylibmc_async *)PyErr_SetFromErrno(PyExc_OSError);
+    }
+    a->nconns = nservers;
+    a->forks = _PylibMC_forks;
+
+    self->async = a;
+    return a;
+}
+
+/* Closing the sockets takes them out of the epoll instance, which after a
+ * fork the parent still has too, so it's never told to drop them. */
+static void _PylibMC_FreeAsync(pylibmc_async *a) {
+    uint32_t i;
+
+    for (i = 0; i < a->nconns; i++) {
+        pylibmc_async_conn *conn = &a->conns[i];
+
+        if (conn->fd != -1) {
+            close(conn->fd);
+        }
+        free(conn->out);
+        free(conn->in);
+        free(conn->waits);
+    }
+    for (i = 0; i < a->nreqs; i++) {
+        Py_XDECREF(a->reqs[i].keys);
+        Py_XDECREF(a->reqs[i].result);
+        Py_XDECREF(a->reqs[i].error);
+    }
+    close(a->epfd);
+    Py_XDECREF(a->done);
+    Py_XDECREF(a->prefetched);
+    Py_XDECREF(a->prefetching);
+    PyMem_Free(a->conns);
+    PyMem_Free(a->reqs);
+    PyMem_Free(a);
+}
+
+/* Take a free slot for a request of op, owing the one reply that the
+ * submit_ method itself gives once it has sent the request off. Returns
+ * the slot, or -1 with MemoryError. */
+static int _PylibMC_AsyncSlot(pylibmc_async *a, int op) {
+    pylibmc_async_req *r;
+    uint32_t slot;
+
+    if (!a->free_head) {
+        pylibmc_async_req *reqs = a->reqs;
+        uint32_t i, n = a->nreqs ? a->nreqs * 2 : 16;
+
+        if (PyMem_Resize(reqs, pylibmc_async_req, n) == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        for (i = a->nreqs; i < n; i++) {
+            memset(&reqs[i], 0, sizeof(pylibmc_async_req));
+            reqs[i].op = -1;
+            reqs[i].next_free = (i + 1 < n) ? i + 2 : 0;
+        }
+        a->free_head = a->nreqs + 1;
+        a->reqs = reqs;
+        a->nreqs = n;
+    }
+
+    slot = a->free_head - 1;
+    r = &a->reqs[slot];
+    a->free_head = r->next_free;
+    r->gen++;
+    r->op = op;
+    r->owed = 1;
+    r->rc = MEMCACHED_SUCCESS;
+    r->server = UINT32_MAX;
+    r->bytes = 0;
+    r->started = _PylibMC_Now();
+    r->prefetch_ttl = 0;
+    return (int)slot;
+}
+
+static void _PylibMC_AsyncRelease(pylibmc_async *a, uint32_t slot) {
+    pylibmc_async_req *r = &a->reqs[slot];
+
+    Py_CLEAR(r->keys);
+    Py_CLEAR(r->result);
+    Py_CLEAR(r->error);
+    r->op = -1;
+    r->next_free = a->free_head;
+    a->free_head = slot + 1;
+}
+
+/* Start connecting to server i unless that's done or underway. 0 if it
+ * can't be. */
+static int _PylibMC_AsyncConnect(PylibMC_Client *self, pylibmc_async *a,
+        uint32_t i) {
+    memcached_server_st *server = &memcached_server_list(self->mc)[i];
+    pylibmc_async_conn *conn = &a->conns[i];
+    struct epoll_event ev;
+    int fd, err, one = 1;
+
+    if (conn->fd != -1) {
+        return 1;
+    } else if (server->type == MEMCACHED_CONNECTION_UDP) {
+        return 0;
+    } else if ((fd = _PylibMC_StartConnect(server->hostname, server->port,
+                                           server->type, &err)) == -1) {
+        return 0;
+    }
+
+    if (server->type == MEMCACHED_CONNECTION_TCP
+            && memcached_behavior_get(self->mc,
+                                      MEMCACHED_BEHAVIOR_TCP_NODELAY)) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    /* A connect that's underway is done once the socket is writable. */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = err ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    ev.data.u32 = i;
+    if (epoll_ctl(a->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        close(fd);
+        return 0;
+    }
+    conn->fd = fd;
+    conn->connecting = (err != 0);
+    conn->events = ev.events;
+    conn->out_len = conn->out_off = conn->in_len = conn->want = 0;
+    return 1;
+}
+
+/* Have the epoll instance watch conn i for writability only while there's
+ * something to write, or a connect to finish. */
+static void _PylibMC_AsyncWatch(pylibmc_async *a, uint32_t i) {
+    pylibmc_async_conn *conn = &a->conns[i];
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    if (conn->connecting || conn->out_off < conn->out_len) {
+        ev.events |= EPOLLOUT;
+    }
+    ev.data.u32 = i;
+    if (conn->fd != -1 && ev.events != conn->events
+            && epoll_ctl(a->epfd, EPOLL_CTL_MOD, conn->fd, &ev) == 0) {
+        conn->events = ev.events;
+    }
+}
+
+/* Add a request of slot's, head and then body with its \r\n if any, to
+ * those of conn i, which then owes slot a reply, and write what can be
+ * written right away. */
+static void _PylibMC_AsyncQueue(PylibMC_Client *self, pylibmc_async *a,
+        uint32_t i, uint32_t slot, const char *head, size_t head_len,
+        const char *body, size_t body_len) {
+    pylibmc_async_conn *conn = &a->conns[i];
+    size_t need = head_len + ((body != NULL) ? body_len + 2 : 0);
+
+    a->reqs[slot].owed++;
+
+    if (conn->out_off == conn->out_len) {
+        conn->out_off = conn->out_len = 0;
+    }
+    if (conn->out_size - conn->out_len < need) {
+        size_t size = conn->out_size * 2 + need + 4096;
+        char *out = realloc(conn->out, size);
+
+        if (out == NULL) {
+            _PylibMC_AsyncAnswered(self, a, slot,
+                                   MEMCACHED_MEMORY_ALLOCATION_FAILURE);
+            return;
+        }
+        conn->out = out;
+        conn->out_size = size;
+    }
+    if (conn->wait_head == conn->nwaits) {
+        conn->wait_head = conn->nwaits = 0;
+    }
+    if (conn->nwaits == conn->waits_size) {
+        size_t size = conn->waits_size * 2 + 16;
+        uint32_t *waits = realloc(conn->waits, sizeof(uint32_t) * size);
+
+        if (waits == NULL) {
+            _PylibMC_AsyncAnswered(self, a, slot,
+                                   MEMCACHED_MEMORY_ALLOCATION_FAILURE);
+            return;
+        }
+        conn->waits = waits;
+        conn->waits_size = size;
+    }
+
+    memcpy(conn->out + conn->out_len, head, head_len);
+    conn->out_len += head_len;
+    if (body != NULL) {
+        memcpy(conn->out + conn->out_len, body, body_len);
+        memcpy(conn->out + conn->out_len + body_len, "\r\n", 2);
+        conn->out_len += body_len + 2;
+    }
+    if (conn->wait_head == conn->nwaits) {
+        conn->since = _PylibMC_Now();
+    }
+    conn->waits[conn->nwaits++] = slot;
+
+    if (!conn->connecting) {
+        _PylibMC_AsyncWrite(self, a, i);
+    }
+    _PylibMC_AsyncWatch(a, i);
+}
+
+/* One of the replies slot owes is in, or won't be because of rc. Once
+ * they all are, its handle is put in for poll() to give, or for a
+ * prefetch, what it got is kept and the slot let go of. */
+static void _PylibMC_AsyncAnswered(PylibMC_Client *self, pylibmc_async *a,
+        uint32_t slot, memcached_return rc) {
+    pylibmc_async_req *r = &a->reqs[slot];
+    PyObject *handle;
+
+    if (rc != MEMCACHED_SUCCESS && r->rc == MEMCACHED_SUCCESS) {
+        r->rc = rc;
+    }
+    if (--r->owed) {
+        return;
+    }
+
+    if (_PylibMC_Metered(self)) {
+        _PylibMC_Meter(self, r->op, r->server, _PylibMC_Now() - r->started,
+                       (r->op == PYLIBMC_OP_SET) ? _PylibMC_Outcome(r->rc)
+                                                 : -1,
+                       0, r->bytes);
+    }
+    if (r->prefetch_ttl) {
+        _PylibMC_PrefetchDone(a, slot);
+        _PylibMC_AsyncRelease(a, slot);
+        return;
+    }
+
+    handle = PyLong_FromUnsignedLongLong(((uint64_t)r->gen << 32) | slot);
+    if (handle == NULL || (a->done == NULL
+                           && (a->done = PyList_New(0)) == NULL)
+            || PyList_Append(a->done, handle) == -1) {
+        /* results() still has it */
+        PyErr_Clear();
+    }
+    Py_XDECREF(handle);
+}
+
+/* Give up on conn i: close it, and fail the requests still waiting on it
+ * with rc. The next request for its server connects anew. */
+static void _PylibMC_AsyncFail(PylibMC_Client *self, pylibmc_async *a,
+        uint32_t i, memcached_return rc) {
+    pylibmc_async_conn *conn = &a->conns[i];
+
+    if (conn->fd != -1) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    conn->connecting = 0;
+    conn->events = 0;
+    conn->out_len = conn->out_off = conn->in_len = conn->want = 0;
+    while (conn->wait_head < conn->nwaits) {
+        _PylibMC_AsyncAnswered(self, a, conn->waits[conn->wait_head++], rc);
+    }
+    conn->wait_head = conn->nwaits = 0;
+}
+
+/* Do whatever I/O can be done right now, and fail connections that have
+ * kept requests waiting for longer than the poll timeout. */
+static void _PylibMC_AsyncProgress(PylibMC_Client *self, pylibmc_async *a) {
+    struct epoll_event events[64];
+    int32_t timeout;
+    double now;
+    uint32_t i;
+    int n, k;
+
+    n = epoll_wait(a->epfd, events, 64, 0);
+    for (k = 0; k < n; k++) {
+        pylibmc_async_conn *conn;
+
+        if ((i = events[k].data.u32) >= a->nconns
+                || (conn = &a->conns[i])->fd == -1) {
+            continue;
+        } else if (conn->connecting) {
+            int err = 0;
+            socklen_t errlen = sizeof(err);
+
+            if (!(events[k].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                continue;
+            } else if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR,
+                                  &err, &errlen)) {
+                err = errno;
+            }
+            if (err) {
+                _PylibMC_AsyncFail(self, a, i, MEMCACHED_CONNECTION_FAILURE);
+                continue;
+            }
+            conn->connecting = 0;
+        }
+
+        if (conn->out_off < conn->out_len
+                && (events[k].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            _PylibMC_AsyncWrite(self, a, i);
+        }
+        if (conn->fd != -1
+                && (events[k].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+            _PylibMC_AsyncRead(self, a, i);
+        }
+        _PylibMC_AsyncWatch(a, i);
+    }
+
+    timeout = (int32_t)memcached_behavior_get(self->mc,
+            MEMCACHED_BEHAVIOR_POLL_TIMEOUT);
+    if (timeout <= 0) {
+        return;
+    }
+    now = _PylibMC_Now();
+    for (i = 0; i < a->nconns; i++) {
+        pylibmc_async_conn *conn = &a->conns[i];
+
+        if (conn->wait_head < conn->nwaits
+                && now - conn->since > timeout / 1000.0) {
+            _PylibMC_AsyncFail(self, a, i, MEMCACHED_TIMEOUT);
+        }
+    }
+}
+
+static void _PylibMC_AsyncWrite(PylibMC_Client *self, pylibmc_async *a,
+        uint32_t i) {
+    pylibmc_async_conn *conn = &a->conns[i];
+    ssize_t n;
+
+    n = send(conn->fd, conn->out + conn->out_off,
+             conn->out_len - conn->out_off, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n > 0) {
+        conn->out_off += n;
+    } else if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK
+               && errno != EINTR) {
+        _PylibMC_AsyncFail(self, a, i, MEMCACHED_WRITE_FAILURE);
+    }
+}
+
+/* Read what's there, making room for the whole of a value being read. */
+static void _PylibMC_AsyncRead(PylibMC_Client *self, pylibmc_async *a,
+        uint32_t i) {
+    pylibmc_async_conn *conn = &a->conns[i];
+    size_t need = conn->in_len + 4096;
+    ssize_t n;
+
+    if (conn->want > need) {
+        need = conn->want;
+    }
+    if (conn->in_size < need) {
+        size_t size = (conn->in_size * 2 > need) ? conn->in_size * 2 : need;
+        char *in = realloc(conn->in, size);
+
+        if (in == NULL) {
+            _PylibMC_AsyncFail(self, a, i,
+                               MEMCACHED_MEMORY_ALLOCATION_FAILURE);
+            return;
+        }
+        conn->in = in;
+        conn->in_size = size;
+    }
+
+    n = recv(conn->fd, conn->in + conn->in_len,
+             conn->in_size - conn->in_len, MSG_DONTWAIT);
+    if (n == 0) {
+        _PylibMC_AsyncFail(self, a, i, MEMCACHED_READ_FAILURE);
+    } else if (n == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            _PylibMC_AsyncFail(self, a, i, MEMCACHED_READ_FAILURE);
+        }
+    } else {
+        conn->in_len += n;
+        if (!_PylibMC_AsyncParse(self, a, i)) {
+            _PylibMC_AsyncFail(self, a, i, MEMCACHED_PROTOCOL_ERROR);
+        }
+    }
+}
+
+/* Hand the whole replies read from conn i to the requests waiting for
+ * them: VALUE lines and their data, up to END, for gets, and a single line
+ * for sets. 0 if the server said something that makes no sense. */
+static int _PylibMC_AsyncParse(PylibMC_Client *self, pylibmc_async *a,
+        uint32_t i) {
+    pylibmc_async_conn *conn = &a->conns[i];
+    const char *p = conn->in, *end = conn->in + conn->in_len, *eol;
+
+    conn->want = 0;
+    while ((eol = memchr(p, '\n', end - p)) != NULL) {
+        size_t len = eol - p + 1;
+        uint32_t slot;
+        pylibmc_async_req *r;
+        pylibmc_pipe_cmd cmd;
+
+        if (conn->wait_head == conn->nwaits || len < 2 || eol[-1] != '\r') {
+            return 0;
+        }
+        slot = conn->waits[conn->wait_head];
+        r = &a->reqs[slot];
+
+        if (r->op == PYLIBMC_OP_GET_MULTI && len > 6
+                && !memcmp(p, "VALUE ", 6)) {
+            const char *key = p + 6, *key_end, *s;
+            unsigned long long flags, bytes;
+            PyObject *wire, *value;
+
+            if ((key_end = s = memchr(key, ' ', eol - key)) == NULL
+                    || !_PylibMC_AsyncNumber(&s, eol - 1, &flags)
+                    || !_PylibMC_AsyncNumber(&s, eol - 1, &bytes)
+                    || s != eol - 1 || flags > UINT32_MAX) {
+                return 0;
+            } else if ((size_t)(end - p) < len + bytes + 2) {
+                conn->want = len + bytes + 2;
+                break;
+            } else if (p[len + bytes] != '\r' || p[len + bytes + 1] != '\n') {
+                return 0;
+            }
+
+            wire = PyString_FromStringAndSize(key, key_end - key);
+            value = (wire == NULL) ? NULL : _PylibMC_parse_memcached_value(
+                    (char *)p + len, bytes, (uint32_t)flags, self);
+            if (value == NULL) {
+                _PylibMC_AsyncError(r);
+            } else {
+                PyObject *key_obj = PyDict_GetItem(r->keys, wire);
+
+                if (_PylibMC_MapStore(r->result,
+                                      (key_obj != NULL) ? key_obj : wire,
+                                      value) == -1) {
+                    _PylibMC_AsyncError(r);
+                }
+                if (_PylibMC_Metered(self)) {
+                    _PylibMC_MeterKey(self, PYLIBMC_OP_GET_MULTI, i,
+                                      PYLIBMC_HIT, bytes,
+                                      PyString_GET_SIZE(wire));
+                }
+            }
+            Py_XDECREF(wire);
+            Py_XDECREF(value);
+            p += len + bytes + 2;
+            conn->since = _PylibMC_Now();
+            continue;
+        }
+
+        if (r->op == PYLIBMC_OP_GET_MULTI && len == 5
+                && !memcmp(p, "END\r\n", 5)) {
+            cmd.rc = MEMCACHED_SUCCESS;
+        } else {
+            /* a set's reply, or an error instead of a get's */
+            memset(&cmd, 0, sizeof(cmd));
+            cmd.set_func = (r->op == PYLIBMC_OP_SET) ? memcached_set : NULL;
+            if (!_PylibMC_PipeReply(&cmd, p, len)) {
+                return 0;
+            } else if (cmd.rc == MEMCACHED_NOTSTORED
+                    || cmd.rc == MEMCACHED_DATA_EXISTS) {
+                Py_INCREF(Py_False);
+                Py_XDECREF(r->result);
+                r->result = Py_False;
+                cmd.rc = MEMCACHED_SUCCESS;
+            }
+        }
+        conn->wait_head++;
+        conn->since = _PylibMC_Now();
+        _PylibMC_AsyncAnswered(self, a, slot, cmd.rc);
+        p += len;
+    }
+
+    conn->in_len = end - p;
+    memmove(conn->in, p, conn->in_len);
+    return 1;
+}
+
+/* Read a space and a number from *s, which mustn't go past end. */
+static int _PylibMC_AsyncNumber(const char **s, const char *end,
+        unsigned long long *value) {
+    const char *c = *s;
+
+    if (c >= end || *c++ != ' ' || c >= end || *c < '0' || *c > '9') {
+        return 0;
+    }
+    for (*value = 0; c < end && *c >= '0' && *c <= '9'; c++) {
+        if (*value > (ULLONG_MAX - 9) / 10) {
+            return 0;
+        }
+        *value = *value * 10 + (*c - '0');
+    }
+    *s = c;
+    return 1;
+}
+
+/* Keep the exception raised while handling a reply for results() to raise,
+ * unless there's one already. */
+static void _PylibMC_AsyncError(pylibmc_async_req *r) {
+    PyObject *type, *value, *tb;
+
+    PyErr_Fetch(&type, &value, &tb);
+    if (r->error != NULL) {
+        Py_XDECREF(type);
+        Py_XDECREF(value);
+        Py_XDECREF(tb);
+        return;
+    }
+    PyErr_NormalizeException(&type, &value, &tb);
+    if (value == NULL) {
+        Py_INCREF(Py_None);
+        value = Py_None;
+    }
+    if (tb == NULL) {
+        Py_INCREF(Py_None);
+        tb = Py_None;
+    }
+    if ((r->error = Py_BuildValue("(NNN)", type, value, tb)) == NULL) {
+        PyErr_Clear();
+    }
+}
+
+static PyObject *PylibMC_Client_submit_get_multi(PylibMC_Client *self,
+        PyObject *keys) {
+    PyObject *it, *key, *wire, *handle;
+    pylibmc_async *a;
+    pylibmc_async_req *r;
+    int slot;
+
+    if ((a = _PylibMC_Async(self)) == NULL) {
+        return NULL;
+    } else if (!memcached_server_count(self->mc)) {
+        return PylibMC_ErrFromMemcached(self, "submit_get_multi",
+                                        MEMCACHED_NO_SERVERS);
+    } else if ((it = PyObject_GetIter(keys)) == NULL) {
+        return NULL;
+    } else if ((slot = _PylibMC_AsyncSlot(a, PYLIBMC_OP_GET_MULTI)) < 0) {
+        Py_DECREF(it);
+        return NULL;
+    }
+    r = &a->reqs[slot];
+    if ((r->keys = PyDict_New()) == NULL
+            || (r->result = PyDict_New()) == NULL) {
+        goto error;
+    }
+
+    while ((key = PyIter_Next(it)) != NULL) {
+        int ok;
+
+        if ((wire = _PylibMC_WireKey(self, key, NULL, 0)) == NULL) {
+            Py_DECREF(key);
+            goto error;
+        } else if (!PyString_GET_SIZE(wire)) {
+            ok = 1;
+        } else if (!_PylibMC_TextKey(PyString_AS_STRING(wire),
+                                     PyString_GET_SIZE(wire))) {
+            PyErr_SetString(PyExc_ValueError,
+                    "keys with spaces or control characters can't be "
+                    "submitted");
+            ok = 0;
+        } else {
+            ok = (_PylibMC_MapKey(r->keys, wire, key) == 0);
+        }
+        Py_DECREF(wire);
+        Py_DECREF(key);
+        if (!ok) {
+            goto error;
+        }
+    }
+    if (PyErr_Occurred() || !_PylibMC_AsyncSendGets(self, a, slot)) {
+        goto error;
+    }
+    Py_DECREF(it);
+
+    r = &a->reqs[slot];
+    handle = PyLong_FromUnsignedLongLong(((uint64_t)r->gen << 32) | slot);
+    _PylibMC_AsyncAnswered(self, a, slot, MEMCACHED_SUCCESS);
+    return handle;
+
+error:
+    Py_DECREF(it);
+    _PylibMC_AsyncRelease(a, slot);
+    return NULL;
+}
+
+/* Send slot's get_multi of its wire keys, one get per server of all its
+ * keys. 0 with an exception if it can't be, before anything's sent. */
+static int _PylibMC_AsyncSendGets(PylibMC_Client *self, pylibmc_async *a,
+        uint32_t slot) {
+    pylibmc_async_req *r = &a->reqs[slot];
+    PyObject *key, *wire;
+    uint32_t i, nservers = memcached_server_count(self->mc);
+    uint32_t *servers;
+    size_t *lens, *offsets, total = 0;
+    char *buf = NULL;
+    Py_ssize_t pos = 0, k = 0;
+
+    servers = PyMem_New(uint32_t, PyDict_Size(r->keys) + 1);
+    lens = PyMem_New(size_t, nservers);
+    offsets = PyMem_New(size_t, nservers);
+    if (servers == NULL || lens == NULL || offsets == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    memset(lens, 0, sizeof(size_t) * nservers);
+    while (PyDict_Next(r->keys, &pos, &wire, &key)) {
+        servers[k] = _PylibMC_ServerIndex(self, key, wire);
+        if (!lens[servers[k]]) {
+            lens[servers[k]] = 5;
+        }
+        lens[servers[k]] += PyString_GET_SIZE(wire) + 1;
+        k++;
+    }
+    for (i = 0; i < nservers; i++) {
+        offsets[i] = total;
+        total += lens[i];
+    }
+    if ((buf = PyMem_Malloc(total + 1)) == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    for (i = 0; i < nservers; i++) {
+        if (lens[i]) {
+            memcpy(buf + offsets[i], "get", 3);
+            lens[i] = 3;
+        }
+    }
+    pos = k = 0;
+    while (PyDict_Next(r->keys, &pos, &wire, &key)) {
+        char *at = buf + offsets[servers[k]] + lens[servers[k]];
+
+        *at = ' ';
+        memcpy(at + 1, PyString_AS_STRING(wire), PyString_GET_SIZE(wire));
+        lens[servers[k++]] += PyString_GET_SIZE(wire) + 1;
+    }
+
+    for (i = 0; i < nservers; i++) {
+        if (!lens[i]) {
+            continue;
+        }
+        memcpy(buf + offsets[i] + lens[i], "\r\n", 2);
+        if (_PylibMC_AsyncConnect(self, a, i)) {
+            _PylibMC_AsyncQueue(self, a, i, slot, buf + offsets[i],
+                                lens[i] + 2, NULL, 0);
+        } else {
+            a->reqs[slot].owed++;
+            _PylibMC_AsyncAnswered(self, a, slot,
+                                   MEMCACHED_CONNECTION_FAILURE);
+        }
+    }
+
+    PyMem_Free(buf);
+    PyMem_Free(servers);
+    PyMem_Free(lens);
+    PyMem_Free(offsets);
+    return 1;
+
+error:
+    PyMem_Free(servers);
+    PyMem_Free(lens);
+    PyMem_Free(offsets);
+    return 0;
+}
+
+static PyObject *PylibMC_Client_submit_set(PylibMC_Client *self,
+        PyObject *args, PyObject *kwds) {
+    static char *kws[] = { "key", "val", "time", "min_compress_len", NULL };
+    PyObject *key, *value, *handle;
+    unsigned int time = 0, min_compress = 0;
+    char head[MEMCACHED_MAX_KEY + 64];
+    pylibmc_async *a;
+    pylibmc_async_req *r;
+    pylibmc_mset mset;
+    uint32_t server;
+    int head_len, slot, metered;
+    double start;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|II", kws,
+                                     &key, &value, &time, &min_compress)) {
+        return NULL;
+    }
+#ifndef USE_ZLIB
+    if (min_compress) {
+        PyErr_SetString(PyExc_TypeError, "min_compress_len without zlib");
+        return NULL;
+    }
+#endif
+    if ((a = _PylibMC_Async(self)) == NULL) {
+        return NULL;
+    } else if (!memcached_server_count(self->mc)) {
+        return PylibMC_ErrFromMemcached(self, "submit_set",
+                                        MEMCACHED_NO_SERVERS);
+    }
+
+    memset(&mset, 0, sizeof(mset));
+    metered = _PylibMC_Metered(self);
+    start = metered ? _PylibMC_Now() : 0;
+    if (!_PylibMC_SerializeValue(self, key, NULL, value, time, &mset)) {
+        _PylibMC_FreeMset(&mset);
+        return NULL;
+    }
+    if (metered) {
+        _PylibMC_MeterTime(self, PYLIBMC_SERIALIZE, _PylibMC_Now() - start);
+    }
+    if (!_PylibMC_CompressMset(self, &mset, min_compress)) {
+        _PylibMC_FreeMset(&mset);
+        return NULL;
+    } else if (!_PylibMC_TextKey(mset.key, mset.key_len)) {
+        PyErr_SetString(PyExc_ValueError,
+                "keys with spaces or control characters can't be "
+                "submitted");
+        _PylibMC_FreeMset(&mset);
+        return NULL;
+    } else if ((slot = _PylibMC_AsyncSlot(a, PYLIBMC_OP_SET)) < 0) {
+        _PylibMC_FreeMset(&mset);
+        return NULL;
+    }
+
+    if (_PylibMC_Prefetches(self) != NULL) {
+        _PylibMC_PrefetchForget(a, mset.key, mset.key_len);
+    }
+
+    server = memcached_generate_hash(self->mc, mset.key, mset.key_len);
+    r = &a->reqs[slot];
+    Py_INCREF(Py_True);
+    r->result = Py_True;
+    r->server = server;
+    r->bytes = mset.value_len;
+
+    head_len = snprintf(head, sizeof(head), "set %.*s %u %lu %lu\r\n",
+                        (int)mset.key_len, mset.key, mset.flags,
+                        (unsigned long)mset.time,
+                        (unsigned long)mset.value_len);
+    if (_PylibMC_AsyncConnect(self, a, server)) {
+        _PylibMC_AsyncQueue(self, a, server, slot, head, head_len,
+                            mset.value, mset.value_len);
+    } else {
+        r->owed++;
+        _PylibMC_AsyncAnswered(self, a, slot, MEMCACHED_CONNECTION_FAILURE);
+    }
+    _PylibMC_FreeMset(&mset);
+
+    r = &a->reqs[slot];
+    handle = PyLong_FromUnsignedLongLong(((uint64_t)r->gen << 32) | slot);
+    _PylibMC_AsyncAnswered(self, a, slot, MEMCACHED_SUCCESS);
+    return handle;
+}
+
+static PyObject *PylibMC_Client_poll(PylibMC_Client *self) {
+    pylibmc_async *a;
+    PyObject *done;
+
+    if ((a = _PylibMC_Async(self)) == NULL) {
+        return NULL;
+    }
+    _PylibMC_AsyncProgress(self, a);
+
+    if ((done = a->done) == NULL) {
+        return PyList_New(0);
+    }
+    a->done = NULL;
+    return done;
+}
+
+static PyObject *PylibMC_Client_results(PylibMC_Client *self,
+        PyObject *handle_obj) {
+    unsigned PY_LONG_LONG handle;
+    pylibmc_async *a;
+    pylibmc_async_req *r;
+    PyObject *retval = NULL;
+    uint32_t slot;
+
+    handle = PyInt_AsUnsignedLongLongMask(handle_obj);
+    if (handle == (unsigned PY_LONG_LONG)-1 && PyErr_Occurred()) {
+        return NULL;
+    } else if ((a = _PylibMC_Async(self)) == NULL) {
+        return NULL;
+    }
+
+    slot = (uint32_t)handle;
+    if (slot >= a->nreqs || a->reqs[slot].op < 0
+            || a->reqs[slot].gen != (uint32_t)(handle >> 32)) {
+        PyErr_SetObject(PyExc_KeyError, handle_obj);
+        return NULL;
+    }
+    if (a->reqs[slot].owed) {
+        _PylibMC_AsyncProgress(self, a);
+        if (a->reqs[slot].owed) {
+            Py_RETURN_NONE;
+        }
+    }
+
+    r = &a->reqs[slot];
+    if (r->error != NULL) {
+        PyObject *type = PyTuple_GET_ITEM(r->error, 0);
+        PyObject *value = PyTuple_GET_ITEM(r->error, 1);
+        PyObject *tb = PyTuple_GET_ITEM(r->error, 2);
+
+        Py_INCREF(type);
+        Py_INCREF(value);
+        Py_INCREF(tb);
+        PyErr_Restore(type, value, (tb != Py_None) ? tb : NULL);
+        if (tb == Py_None) {
+            Py_DECREF(tb);
+        }
+    } else if (r->rc != MEMCACHED_SUCCESS) {
+        PylibMC_ErrFromMemcached(self, (r->op == PYLIBMC_OP_SET)
+                                       ? "submit_set" : "submit_get_multi",
+                                 r->rc);
+    } else {
+        retval = r->result;
+        Py_INCREF(retval);
+    }
+    _PylibMC_AsyncRelease(a, slot);
+    return retval;
+}
+
+static PyObject *PylibMC_Client_fileno(PylibMC_Client *self) {
+    pylibmc_async *a;
+
+    if ((a = _PylibMC_Async(self)) == NULL) {
+        return NULL;
+    }
+    return PyInt_FromLong(a->epfd);
+}
+/* }}} */
+
+/* {{{ Prefetches */
+static PyObject *PylibMC_Client_prefetch(PylibMC_Client *self,
+        PyObject *args, PyObject *kwds) {
+    static char *kws[] = { "keys", "ttl", NULL };
+    PyObject *keys, *it, *key, *wire, *handle = NULL;
+    pylibmc_async *a;
+    pylibmc_async_req *r;
+    double ttl = 1.0;
+    Py_ssize_t pos = 0;
+    int slot;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|d", kws, &keys, &ttl)) {
+        return NULL;
+    } else if (!(ttl > 0)) {
+        PyErr_SetString(PyExc_ValueError, "ttl must be positive");
+        return NULL;
+    } else if ((a = _PylibMC_Async(self)) == NULL) {
+        return NULL;
+    } else if (!memcached_server_count(self->mc)) {
+        return PylibMC_ErrFromMemcached(self, "prefetch",
+                                        MEMCACHED_NO_SERVERS);
+    } else if (a->prefetched == NULL
+            && ((a->prefetched = PyDict_New()) == NULL
+                || (a->prefetching = PyDict_New()) == NULL)) {
+        Py_CLEAR(a->prefetched);
+        return NULL;
+    }
+    _PylibMC_PrefetchSweep(a);
+
+    if ((it = PyObject_GetIter(keys)) == NULL) {
+        return NULL;
+    } else if ((slot = _PylibMC_AsyncSlot(a, PYLIBMC_OP_GET_MULTI)) < 0) {
+        Py_DECREF(it);
+        return NULL;
+    }
+    r = &a->reqs[slot];
+    if ((r->keys = PyDict_New()) == NULL
+            || (r->result = PyDict_New()) == NULL) {
+        goto error;
+    }
+
+    /* Replies are kept by wire key, which is what get and get_multi look
+     * them up by. Keys already on their way aren't asked for again. */
+    while ((key = PyIter_Next(it)) != NULL) {
+        int ok;
+
+        if ((wire = _PylibMC_WireKey(self, key, NULL, 0)) == NULL) {
+            Py_DECREF(key);
+            goto error;
+        } else if (!PyString_GET_SIZE(wire)
+                || PyDict_GetItem(a->prefetching, wire) != NULL) {
+            ok = 1;
+        } else if (!_PylibMC_TextKey(PyString_AS_STRING(wire),
+                                     PyString_GET_SIZE(wire))) {
+            PyErr_SetString(PyExc_ValueError,
+                    "keys with spaces or control characters can't be "
+                    "prefetched");
+            ok = 0;
+        } else {
+            ok = (PyDict_SetItem(r->keys, wire, wire) == 0);
+        }
+        Py_DECREF(wire);
+        Py_DECREF(key);
+        if (!ok) {
+            goto error;
+        }
+    }
+    if (PyErr_Occurred()) {
+        goto error;
+    }
+
+    handle = PyLong_FromUnsignedLongLong(((uint64_t)r->gen << 32) | slot);
+    while (handle != NULL && PyDict_Next(r->keys, &pos, &wire, &key)) {
+        if (PyDict_SetItem(a->prefetching, wire, handle) == -1) {
+            goto error;
+        }
+    }
+    if (handle == NULL || !_PylibMC_AsyncSendGets(self, a, slot)) {
+        goto error;
+    }
+    Py_DECREF(handle);
+    Py_DECREF(it);
+
+    a->reqs[slot].prefetch_ttl = ttl;
+    _PylibMC_AsyncAnswered(self, a, slot, MEMCACHED_SUCCESS);
+    Py_RETURN_NONE;
+
+error:
+    /* keys this one was to fetch aren't on their way after all */
+    if (handle != NULL) {
+        PyObject *type, *value, *tb;
+
+        PyErr_Fetch(&type, &value, &tb);
+        pos = 0;
+        while (PyDict_Next(r->keys, &pos, &wire, &key)) {
+            PyObject *pending = PyDict_GetItem(a->prefetching, wire);
+
+            if (pending != NULL && pending == handle
+                    && PyDict_DelItem(a->prefetching, wire) == -1) {
+                PyErr_Clear();
+            }
+        }
+        PyErr_Restore(type, value, tb);
+        Py_DECREF(handle);
+    }
+    Py_DECREF(it);
+    _PylibMC_AsyncRelease(a, slot);
+    return NULL;
+}
+
+/* The client's prefetches, having taken in whatever replies are there, or
+ * NULL if there's nothing in or on its way to look up. Cheap enough for
+ * every call when there isn't. */
+static pylibmc_async *_PylibMC_Prefetches(PylibMC_Client *self) {
+    pylibmc_async *a = self->async;
+
+    if (a == NULL || a->prefetched == NULL || a->forks != _PylibMC_forks) {
+        return NULL;
+    } else if (PyDict_Size(a->prefetching)) {
+        _PylibMC_AsyncProgress(self, a);
+    } else if (!PyDict_Size(a->prefetched)) {
+        return NULL;
+    }
+    return a;
+}
+
+/* Keep what slot's prefetch got: hits, and misses too if every server
+ * answered. Keys that were written meanwhile, or prefetched anew, are no
+ * longer slot's to fill in. */
+static void _PylibMC_PrefetchDone(pylibmc_async *a, uint32_t slot) {
+    pylibmc_async_req *r = &a->reqs[slot];
+    unsigned PY_LONG_LONG handle = ((uint64_t)r->gen << 32) | slot;
+    double expires = _PylibMC_Now() + r->prefetch_ttl;
+    PyObject *wire, *ignored, *pending, *value, *entry;
+    Py_ssize_t pos = 0;
+
+    while (PyDict_Next(r->keys, &pos, &wire, &ignored)) {
+        if ((pending = PyDict_GetItem(a->prefetching, wire)) == NULL
+                || PyLong_AsUnsignedLongLong(pending) != handle) {
+            continue;
+        } else if (PyDict_DelItem(a->prefetching, wire) == -1) {
+            PyErr_Clear();
+            continue;
+        }
+
+        if ((value = PyDict_GetItem(r->result, wire)) != NULL) {
+            entry = Py_BuildValue("(dO)", expires, value);
+        } else if (r->rc == MEMCACHED_SUCCESS && r->error == NULL) {
+            entry = Py_BuildValue("(d)", expires);
+        } else {
+            continue;
+        }
+        if (entry == NULL
+                || PyDict_SetItem(a->prefetched, wire, entry) == -1) {
+            PyErr_Clear();
+        }
+        Py_XDECREF(entry);
+    }
+}
+
+/* Take what a prefetch got for wire, first waiting for it if it's still
+ * on its way, but not past until (a _PylibMC_Now() time, or -1). 1 and a
+ * new reference in *value for a hit, 0 for a miss, and -1 if there's
+ * nothing fresh to go by. */
+static int _PylibMC_PrefetchTake(PylibMC_Client *self, pylibmc_async *a,
+        PyObject *wire, double until, PyObject **value) {
+    PyObject *entry;
+    int found = -1;
+
+    while (PyDict_GetItem(a->prefetching, wire) != NULL) {
+        if (!_PylibMC_AsyncWait(self, a, until)) {
+            return -1;
+        }
+    }
+    if ((entry = PyDict_GetItem(a->prefetched, wire)) == NULL) {
+        return -1;
+    }
+
+    /* a prefetch serves a single read */
+    Py_INCREF(entry);
+    if (PyDict_DelItem(a->prefetched, wire) == -1) {
+        PyErr_Clear();
+    }
+    if (PyFloat_AS_DOUBLE(PyTuple_GET_ITEM(entry, 0)) < _PylibMC_Now()) {
+        found = -1;
+    } else if (PyTuple_GET_SIZE(entry) == 2) {
+        *value = PyTuple_GET_ITEM(entry, 1);
+        Py_INCREF(*value);
+        found = 1;
+    } else {
+        found = 0;
+    }
+    Py_DECREF(entry);
+    return found;
+}
+
+/* Writing key through the client makes what was prefetched of it stale,
+ * and so what a prefetch still on its way gets back. */
+static void _PylibMC_PrefetchForget(pylibmc_async *a, const char *key,
+        size_t key_len) {
+    PyObject *wire;
+
+    if ((wire = PyString_FromStringAndSize(key, key_len)) == NULL) {
+        PyErr_Clear();
+        return;
+    }
+    if (PyDict_GetItem(a->prefetched, wire) != NULL
+            && PyDict_DelItem(a->prefetched, wire) == -1) {
+        PyErr_Clear();
+    }
+    if (PyDict_GetItem(a->prefetching, wire) != NULL
+            && PyDict_DelItem(a->prefetching, wire) == -1) {
+        PyErr_Clear();
+    }
+    Py_DECREF(wire);
+}
+
+/* Drop what prefetches got that nobody read in time. */
+static void _PylibMC_PrefetchSweep(pylibmc_async *a) {
+    PyObject *wire, *entry, *stale;
+    Py_ssize_t pos = 0, i;
+    double now = _PylibMC_Now();
+
+    if (!PyDict_Size(a->prefetched) || (stale = PyList_New(0)) == NULL) {
+        PyErr_Clear();
+        return;
+    }
+    while (PyDict_Next(a->prefetched, &pos, &wire, &entry)) {
+        if (PyFloat_AS_DOUBLE(PyTuple_GET_ITEM(entry, 0)) < now
+                && PyList_Append(stale, wire) == -1) {
+            PyErr_Clear();
+            break;
+        }
+    }
+    for (i = 0; i < PyList_GET_SIZE(stale); i++) {
+        if (PyDict_DelItem(a->prefetched, PyList_GET_ITEM(stale, i)) == -1) {
+            PyErr_Clear();
+        }
+    }
+    Py_DECREF(stale);
+}
+
+/* Wait for some connection to have something to do, without the GIL, and
+ * do it. 0 if until (a _PylibMC_Now() time, or -1) came first. Connections
+ * that go the poll timeout without progress are failed as ever, so that
+ * waiting on a request always ends. */
+static int _PylibMC_AsyncWait(PylibMC_Client *self, pylibmc_async *a,
+        double until) {
+    struct epoll_event event;
+    int32_t timeout;
+    int ms;
+
+    timeout = (int32_t)memcached_behavior_get(self->mc,
+            MEMCACHED_BEHAVIOR_POLL_TIMEOUT);
+    ms = (timeout > 0) ? timeout : -1;
+    if (until >= 0) {
+        double left = until - _PylibMC_Now();
+
+        if (left <= 0) {
+            return 0;
+        } else if (ms < 0 || left * 1000 < ms) {
+            ms = (int)(left * 1000) + 1;
+        }
+    }
+
+    PYLIBMC_BEGIN_ALLOW_THREADS(self)
+    epoll_wait(a->epfd, &event, 1, ms);
+    PYLIBMC_END_ALLOW_THREADS
+
+    _PylibMC_AsyncProgress(self, a);
+    return 1;
+}
+/* }}} */
+
+/* {{{ Write-behind */
+static pylibmc_writer *_PylibMC_NewWriter(memcached_st *mc, size_t size,
+        int policy, size_t batch) {
+    pylibmc_writer *w;
+    size_t nbuckets = 1;
+
+    if ((w = PyMem_New(pylibmc_writer, 1)) == NULL) {
+        return (pylibmc_writer *)PyErr_NoMemory();
+    }
+    memset(w, 0, sizeof(*w));
+    while (nbuckets < size) {
+        nbuckets <<= 1;
+    }
+    w->ring = PyMem_New(pylibmc_wb_entry *, size);
+    w->taken = PyMem_New(pylibmc_wb_entry *, batch);
+    if (policy == PYLIBMC_WB_COALESCE) {
+        w->buckets = PyMem_New(pylibmc_wb_entry *, nbuckets);
+    }
+    if (w->ring == NULL || w->taken == NULL
+            || (policy == PYLIBMC_WB_COALESCE && w->buckets == NULL)) {
+        PyMem_Free(w->ring);
+        PyMem_Free(w->taken);
+        PyMem_Free(w->buckets);
+        PyMem_Free(w);
+        return (pylibmc_writer *)PyErr_NoMemory();
+    }
+    if (w->buckets != NULL) {
+        memset(w->buckets, 0, sizeof(pylibmc_wb_entry *) * nbuckets);
+    }
+    w->mask = nbuckets - 1;
+    w->size = size;
+    w->policy = policy;
+    w->batch = batch;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->work, NULL);
+    pthread_cond_init(&w->room, NULL);
+
+    Py_BEGIN_ALLOW_THREADS
+    w->mc = memcached_clone(NULL, mc);
+    Py_END_ALLOW_THREADS
+    if (w->mc == NULL) {
+        _PylibMC_FreeWriter(w);
+        return (pylibmc_writer *)PyErr_NoMemory();
+    } else if (!_PylibMC_StartWriter(w)) {
+        _PylibMC_FreeWriter(w);
+        PyErr_SetString(PyExc_RuntimeError, "can't start write-behind thread");
+        return NULL;
+    }
+    return w;
+}
+
+/* Stop the writer once it has sent all that's queued, and free it. A
+ * writer started before a fork doesn't exist in the child, and what it had
+ * queued is the parent's to send. */
+static void _PylibMC_FreeWriter(pylibmc_writer *w) {
+    size_t i;
+
+    if (w->running && w->forks == _PylibMC_forks) {
+        pthread_mutex_lock(&w->lock);
+        w->stop = 1;
+        pthread_cond_signal(&w->work);
+        pthread_mutex_unlock(&w->lock);
+
+        Py_BEGIN_ALLOW_THREADS
+        pthread_join(w->thread, NULL);
+        Py_END_ALLOW_THREADS
+    }
+    for (i = 0; i < w->count; i++) {
+        free(w->ring[(w->head + i) % w->size]);
+    }
+    if (w->mc != NULL) {
+        if (w->forks != _PylibMC_forks) {
+            _PylibMC_DropConnections(w->mc);
+        }
+        memcached_free(w->mc);
+    }
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->work);
+    pthread_cond_destroy(&w->room);
+    PyMem_Free(w->ring);
+    PyMem_Free(w->taken);
+    PyMem_Free(w->buckets);
+    PyMem_Free(w);
+}
+
+static int _PylibMC_StartWriter(pylibmc_writer *w) {
+    w->stop = 0;
+    w->forks = _PylibMC_forks;
+    if (pthread_create(&w->thread, NULL, _PylibMC_WriterThread, w) != 0) {
+        return 0;
+    }
+    w->running = 1;
+    return 1;
+}
+
+/* The cluster's writer, set up with the defaults on first use, and started
+ * over in a child process: the parent's thread isn't there, its lock may
+ * have been held by a thread that's gone, and the queue and connections
+ * are the parent's. */
+static pylibmc_writer *_PylibMC_WriteBehind(PylibMC_Client *self) {
+    pylibmc_writer *w = self->cluster->writer;
+    size_t i;
+
+    if (w == NULL) {
+        w = _PylibMC_NewWriter(self->mc, 10000, PYLIBMC_WB_DROP, 64);
+        return self->cluster->writer = w;
+    } else if (w->forks == _PylibMC_forks) {
+        return w;
+    }
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->work, NULL);
+    pthread_cond_init(&w->room, NULL);
+    for (i = 0; i < w->count; i++) {
+        free(w->ring[(w->head + i) % w->size]);
+    }
+    if (w->buckets != NULL) {
+        memset(w->buckets, 0, sizeof(pylibmc_wb_entry *) * (w->mask + 1));
+    }
+    w->head = w->count = w->inflight = 0;
+    _PylibMC_DropConnections(w->mc);
+    w->running = 0;
+    if (!_PylibMC_StartWriter(w)) {
+        PyErr_SetString(PyExc_RuntimeError, "can't start write-behind thread");
+        return NULL;
+    }
+    return w;
+}
+
+/* Take what's queued batch at a time and pipeline it, until told to stop
+ * with nothing left to send. Sets are sent in the order they were queued,
+ * each server's over one connection, so the last set of a key wins. */
+static void *_PylibMC_WriterThread(void *arg) {
+    pylibmc_writer *w = (pylibmc_writer *)arg;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        pylibmc_pipe_cmd *cmds;
+        size_t i, n;
+
+        while (!w->count && !w->stop) {
+            pthread_cond_wait(&w->work, &w->lock);
+        }
+        if (!w->count) {
+            break;
+        }
+
+        n = (w->count < w->batch) ? w->count : w->batch;
+        for (i = 0; i < n; i++) {
+            pylibmc_wb_entry *e = w->ring[w->head];
+
+            w->head = (w->head + 1) % w->size;
+            if (w->buckets != NULL) {
+                _PylibMC_WriterUnlink(w, e);
+            }
+            w->taken[i] = e;
+        }
+        w->count -= n;
+        w->inflight = n;
+        pthread_cond_broadcast(&w->room);
+        pthread_mutex_unlock(&w->lock);
+
+        if ((cmds = calloc(n, sizeof(pylibmc_pipe_cmd))) != NULL) {
+            for (i = 0; i < n; i++) {
+                pylibmc_wb_entry *e = w->taken[i];
+                pylibmc_pipe_cmd *cmd = &cmds[i];
+
+                cmd->op = PYLIBMC_OP_SET;
+                cmd->set_func = memcached_set;
+                cmd->mset.key = e->key;
+                cmd->mset.key_len = e->key_len;
+                cmd->mset.value = e->value;
+                cmd->mset.value_len = e->value_len;
+                cmd->mset.flags = e->flags;
+                cmd->mset.time = e->time;
+                if (!memcached_server_count(w->mc)) {
+                    cmd->rc = MEMCACHED_NO_SERVERS;
+                } else {
+                    cmd->server = memcached_generate_hash(w->mc, e->key,
+                                                          e->key_len);
+                    cmd->rc = MEMCACHED_BUFFERED;
+                }
+            }
+            _PylibMC_PipeSend(w->mc, NULL, cmds, n);
+        }
+
+        pthread_mutex_lock(&w->lock);
+        for (i = 0; i < n; i++) {
+            if (cmds != NULL && cmds[i].rc == MEMCACHED_SUCCESS) {
+                w->sent++;
+            } else {
+                w->failed++;
+            }
+            free(w->taken[i]);
+        }
+        free(cmds);
+        w->inflight = 0;
+        w->batches++;
+        pthread_cond_broadcast(&w->room);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+/* Delete the hot key copies of the keys of msets, whose sets are being
+ * queued. The writer's thread doesn't bring them up to date, so they'd go
+ * on serving the old values; without them, gets fall back on the key. */
+static void _PylibMC_WriterForgetHot(PylibMC_Client *self,
+        pylibmc_mset *msets, Py_ssize_t n) {
+    pylibmc_hotkeys *hotkeys = _PylibMC_HotKeys(self);
+    pylibmc_hot_copies hot;
+    Py_ssize_t i;
+
+    for (i = 0; hotkeys != NULL && i < n; i++) {
+        if (!_PylibMC_HotLookup(hotkeys, msets[i].key, msets[i].key_len,
+                                &hot)) {
+            continue;
+        }
+        PYLIBMC_BEGIN_ALLOW_THREADS(self)
+        _PylibMC_HotFanOut(self->mc, &hot, msets[i].key, msets[i].key_len,
+                           NULL, 0, 0, 0, 0);
+        memcached_flush_buffers(self->mc);
+        PYLIBMC_END_ALLOW_THREADS
+        hotkeys = _PylibMC_HotKeys(self);
+    }
+}
+
+/* A copy of a serialized set for the queue, compressed as set would. NULL
+ * with an exception if it can't be made. */
+static pylibmc_wb_entry *_PylibMC_WriterEntry(PylibMC_Client *self,
+        pylibmc_mset *mset, unsigned int min_compress) {
+    pylibmc_wb_entry *e;
+
+    if (!_PylibMC_CompressMset(self, mset, min_compress)) {
+        return NULL;
+    } else if ((e = malloc(sizeof(pylibmc_wb_entry) + mset->key_len
+                           + mset->value_len)) == NULL) {
+        return (pylibmc_wb_entry *)PyErr_NoMemory();
+    }
+    e->chain = NULL;
+    e->hash = _PylibMC_HotKeyHash(mset->key, mset->key_len);
+    e->key_len = mset->key_len;
+    e->value_len = mset->value_len;
+    e->flags = mset->flags;
+    e->time = mset->time;
+    memcpy(e->key, mset->key, mset->key_len);
+    e->value = e->key + e->key_len;
+    memcpy(e->value, mset->value, mset->value_len);
+    return e;
+}
+
+/* Queue the entries, or replace the waiting ones of the same keys in a
+ * coalescing queue. Those queued are set to NULL, and the ones left over
+ * were dropped; returns how many were. Waits for room without the GIL
+ * with the block policy, so it must be called without it then. */
+static int _PylibMC_WriterPush(pylibmc_writer *w, pylibmc_wb_entry **entries,
+        size_t n) {
+    size_t i;
+    int dropped = 0;
+
+    pthread_mutex_lock(&w->lock);
+    for (i = 0; i < n; i++) {
+        pylibmc_wb_entry *e = entries[i], **p;
+
+        if (w->buckets != NULL) {
+            for (p = &w->buckets[e->hash & w->mask]; *p != NULL;
+                    p = &(*p)->chain) {
+                if ((*p)->hash == e->hash && (*p)->key_len == e->key_len
+                        && !memcmp((*p)->key, e->key, e->key_len)) {
+                    break;
+                }
+            }
+            if (*p != NULL) {
+                pylibmc_wb_entry *old = *p;
+
+                e->chain = old->chain;
+                e->at = old->at;
+                *p = e;
+                w->ring[e->at] = e;
+                free(old);
+                w->coalesced++;
+                entries[i] = NULL;
+                continue;
+            }
+        }
+
+        while (w->count == w->size && w->policy == PYLIBMC_WB_BLOCK) {
+            pthread_cond_signal(&w->work);
+            pthread_cond_wait(&w->room, &w->lock);
+        }
+        if (w->count == w->size) {
+            w->dropped++;
+            dropped++;
+            continue;
+        }
+
+        e->at = (w->head + w->count) % w->size;
+        w->ring[e->at] = e;
+        if (w->buckets != NULL) {
+            e->chain = w->buckets[e->hash & w->mask];
+            w->buckets[e->hash & w->mask] = e;
+        }
+        if (++w->count > w->peak) {
+            w->peak = w->count;
+        }
+        w->queued++;
+        entries[i] = NULL;
+    }
+    pthread_cond_signal(&w->work);
+    pthread_mutex_unlock(&w->lock);
+
+    return dropped;
+}
+
+static void _PylibMC_WriterUnlink(pylibmc_writer *w, pylibmc_wb_entry *e) {
+    pylibmc_wb_entry **p = &w->buckets[e->hash & w->mask];
+
+    while (*p != NULL && *p != e) {
+        p = &(*p)->chain;
+    }
+    if (*p != NULL) {
+        *p = e->chain;
+    }
+}
+
+static PyObject *PylibMC_Client_set_write_behind(PylibMC_Client *self,
+        PyObject *args, PyObject *kwds) {
+    static char *kws[] = { "size", "policy", "batch", NULL };
+    unsigned int size = 10000, batch = 64;
+    char *policy_name = "drop";
+    pylibmc_writer *w, *old;
+    int policy;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|IsI", kws,
+                                     &size, &policy_name, &batch)) {
+        return NULL;
+    } else if (!size || size > (1 << 24) || !batch || batch > 65536) {
+        PyErr_SetString(PyExc_ValueError,
+                "size must be within [1, 2**24], and batch within "
+                "[1, 65536]");
+        return NULL;
+    } else if (!strcmp(policy_name, "drop")) {
+        policy = PYLIBMC_WB_DROP;
+    } else if (!strcmp(policy_name, "block")) {
+        policy = PYLIBMC_WB_BLOCK;
+    } else if (!strcmp(policy_name, "coalesce")) {
+        policy = PYLIBMC_WB_COALESCE;
+    } else {
+        PyErr_Format(PyExc_ValueError, "unknown policy %s", policy_name);
+        return NULL;
+    }
+
+    if (!_PylibMC_ClientReady(self)) {
+        return NULL;
+    } else if ((w = _PylibMC_NewWriter(self->mc, size, policy,
+                                       batch)) == NULL) {
+        return NULL;
+    }
+    /* A clone may be waiting for room in the old one, so it's stopped
+     * once none can be. */
+    old = self->cluster->writer;
+    self->cluster->writer = w;
+    _PylibMC_Retire(self, PYLIBMC_RETIRED_WRITER, old);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *PylibMC_Client_set_async(PylibMC_Client *self,
+        PyObject *args, PyObject *kwds) {
+    static char *kws[] = { "key", "val", "time", "min_compress_len", NULL };
+    PyObject *key, *value;
+    unsigned int time = 0, min_compress = 0;
+    pylibmc_writer *w;
+    pylibmc_wb_entry *e;
+    pylibmc_async *prefetches;
+    pylibmc_mset mset;
+    int dropped, metered;
+    double start;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|II", kws,
+                                     &key, &value, &time, &min_compress)) {
+        return NULL;
+    }
+#ifndef USE_ZLIB
+    if (min_compress) {
+        PyErr_SetString(PyExc_TypeError, "min_compress_len without zlib");
+        return NULL;
+    }
+#endif
+    if (!_PylibMC_ClientReady(self)) {
+        return NULL;
+    } else if ((w = _PylibMC_WriteBehind(self)) == NULL) {
+        return NULL;
+    }
+
+    memset(&mset, 0, sizeof(mset));
+    metered = _PylibMC_Metered(self);
+    start = metered ? _PylibMC_Now() : 0;
+    if (!_PylibMC_SerializeValue(self, key, NULL, value, time, &mset)) {
+        _PylibMC_FreeMset(&mset);
+        return NULL;
+    }
+    if (metered) {
+        _PylibMC_MeterTime(self, PYLIBMC_SERIALIZE, _PylibMC_Now() - start);
+    }
+    if (!mset.key_len) {
+        /* as set does */
+        _PylibMC_FreeMset(&mset);
+        Py_RETURN_FALSE;
+    } else if ((e = _PylibMC_WriterEntry(self, &mset, min_compress)) == NULL) {
+        _PylibMC_FreeMset(&mset);
+        return NULL;
+    }
+    if ((prefetches = _PylibMC_Prefetches(self)) != NULL) {
+        _PylibMC_PrefetchForget(prefetches, mset.key, mset.key_len);
+    }
+    _PylibMC_WriterForgetHot(self, &mset, 1);
+    _PylibMC_FreeMset(&mset);
+
+    if (w->policy == PYLIBMC_WB_BLOCK) {
+        PYLIBMC_BEGIN_ALLOW_THREADS(self)
+        dropped = _PylibMC_WriterPush(w, &e, 1);
+        PYLIBMC_END_ALLOW_THREADS
+    } else {
+        dropped = _PylibMC_WriterPush(w, &e, 1);
+    }
+    free(e);
+
+    return PyBool_FromLong(!dropped);
+}
+
+static PyObject *PylibMC_Client_set_multi_async(PylibMC_Client *self,
+        PyObject *args, PyObject *kwds) {
+    static char *kws[] = { "keys", "key_prefix", "time", "min_compress_len",
+                           NULL };
+    PyObject *keys, *key_prefix = NULL, *key, *value, *retval = NULL;
+    PyObject *ns_prefix = NULL;
+    unsigned int time = 0, min_compress = 0;
+    pylibmc_writer *w;
+    pylibmc_wb_entry **entries = NULL;
+    pylibmc_async *prefetches;
+    pylibmc_mset *msets = NULL;
+    Py_ssize_t pos = 0, i, n = 0, nkeys;
+    int dropped, metered;
+    double start;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|O!II", kws,
+                                     &PyDict_Type, &keys,
+                                     &PyString_Type, &key_prefix,
+                                     &time, &min_compress)) {
+        return NULL;
+    }
+#ifndef USE_ZLIB
+    if (min_compress) {
+        PyErr_SetString(PyExc_TypeError, "min_compress_len without zlib");
+        return NULL;
+    }
+#endif
+    if (!_PylibMC_ClientReady(self)) {
+        return NULL;
+    } else if ((w = _PylibMC_WriteBehind(self)) == NULL) {
+        return NULL;
+    } else if (key_prefix != NULL && PyString_GET_SIZE(key_prefix)
+            && _PylibMC_Namespaces(self) != NULL) {
+        if ((ns_prefix = _PylibMC_NamespacePrefix(self,
+                        PyString_AS_STRING(key_prefix),
+                        PyString_GET_SIZE(key_prefix))) == NULL) {
+            return NULL;
+        }
+        key_prefix = ns_prefix;
+    }
+
+    nkeys = PyDict_Size(keys);
+    msets = PyMem_New(pylibmc_mset, nkeys ? nkeys : 1);
+    entries = PyMem_New(pylibmc_wb_entry *, nkeys ? nkeys : 1);
+    if (msets == NULL || entries == NULL) {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+    memset(msets, 0, sizeof(pylibmc_mset) * (nkeys ? nkeys : 1));
+    memset(entries, 0, sizeof(pylibmc_wb_entry *) * (nkeys ? nkeys : 1));
+
+    /* all of it is serialized before any of it is queued */
+    metered = _PylibMC_Metered(self);
+    start = metered ? _PylibMC_Now() : 0;
+    while (n < nkeys && PyDict_Next(keys, &pos, &key, &value)) {
+        if (!_PylibMC_SerializeValue(self, key, key_prefix, value, time,
+                                     &msets[n++])) {
+            goto cleanup;
+        }
+    }
+    if (metered) {
+        _PylibMC_MeterTime(self, PYLIBMC_SERIALIZE, _PylibMC_Now() - start);
+    }
+    for (i = 0; i < n; i++) {
+        if (msets[i].key_len
+                && (entries[i] = _PylibMC_WriterEntry(self, &msets[i],
+                                                      min_compress)) == NULL) {
+            goto cleanup;
+        }
+    }
+    if ((prefetches = _PylibMC_Prefetches(self)) != NULL) {
+        for (i = 0; i < n; i++) {
+            _PylibMC_PrefetchForget(prefetches, msets[i].key,
+                                    msets[i].key_len);
+        }
+    }
+    _PylibMC_WriterForgetHot(self, msets, n);
+
+    /* entries of empty keys are NULL, which the push takes as queued */
+    if (w->policy == PYLIBMC_WB_BLOCK) {
+        PYLIBMC_BEGIN_ALLOW_THREADS(self)
+        dropped = _PylibMC_WriterPush(w, entries, n);
+        PYLIBMC_END_ALLOW_THREADS
+    } else {
+        dropped = _PylibMC_WriterPush(w, entries, n);
+    }
+
+    if ((retval = PyList_New(0)) == NULL) {
+        goto cleanup;
+    }
+    for (i = 0; dropped && i < n; i++) {
+        if (entries[i] != NULL
+                && PyList_Append(retval, msets[i].key_obj) == -1) {
+            Py_CLEAR(retval);
+            break;
+        }
+    }
+
+cleanup:
+    for (i = 0; entries != NULL && i < n; i++) {
+        free(entries[i]);
+    }
+    for (i = 0; msets != NULL && i < n; i++) {
+        _PylibMC_FreeMset(&msets[i]);
+    }
+    PyMem_Free(entries);
+    PyMem_Free(msets);
+    Py_XDECREF(ns_prefix);
+    return retval;
+}
+
+static PyObject *PylibMC_Client_flush_write_behind(PylibMC_Client *self,
+        PyObject *args, PyObject *kwds) {
+    static char *kws[] = { "timeout", NULL };
+    PyObject *timeout_obj = NULL;
+    pylibmc_writer *w;
+    struct timespec until;
+    double timeout;
+    int drained;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kws, &timeout_obj)) {
+        return NULL;
+    } else if (!_PylibMC_ParseTimeout(timeout_obj, &timeout)) {
+        return NULL;
+    } else if ((w = self->cluster->writer) == NULL
+            || w->forks != _PylibMC_forks) {
+        Py_RETURN_TRUE;
+    }
+    if (timeout >= 0) {
+        _PylibMC_Deadline(timeout, &until);
+    }
+
+    PYLIBMC_BEGIN_ALLOW_THREADS(self)
+    pthread_mutex_lock(&w->lock);
+    while (w->count || w->inflight) {
+        if (timeout < 0) {
+            pthread_cond_wait(&w->room, &w->lock);
+        } else if (pthread_cond_timedwait(&w->room, &w->lock,
+                                          &until) == ETIMEDOUT) {
+            break;
+        }
+    }
+    drained = !w->count && !w->inflight;
+    pthread_mutex_unlock(&w->lock);
+    PYLIBMC_END_ALLOW_THREADS
+
+    return PyBool_FromLong(drained);
+}
+
+static PyObject *PylibMC_Client_write_behind_stats(PylibMC_Client *self) {
+    static pylibmc_writer none;
+    pylibmc_writer *w = self->cluster->writer;
+    size_t depth, peak;
+    uint64_t counts[6];
+
+    if (w == NULL || w->forks != _PylibMC_forks) {
+        w = &none;
+    } else {
+        pthread_mutex_lock(&w->lock);
+    }
+    depth = w->count + w->inflight;
+    peak = w->peak;
+    counts[0] = w->queued;
+    counts[1] = w->coalesced;
+    counts[2] = w->dropped;
+    counts[3] = w->sent;
+    counts[4] = w->failed;
+    counts[5] = w->batches;
+    if (w != &none) {
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    return Py_BuildValue("{s:n,s:n,s:K,s:K,s:K,s:K,s:K,s:K}",
+            "depth", (Py_ssize_t)depth, "peak_depth", (Py_ssize_t)peak,
+            "queued", (unsigned PY_LONG_LONG)counts[0],
+            "coalesced", (unsigned PY_LONG_LONG)counts[1],
+            "dropped", (unsigned PY_LONG_LONG)counts[2],
+            "sent", (unsigned PY_LONG_LONG)counts[3],
+            "failed", (unsigned PY_LONG_LONG)counts[4],
+            "batches", (unsigned PY_LONG_LONG)counts[5]);
+}
+/* }}} */
+
+/* {{{ Namespaces */
+/* The namespaces of self's cluster if they're on, or NULL. */
+static pylibmc_namespaces *_PylibMC_Namespaces(PylibMC_Client *self) {
+    return self->cluster->namespaces;
+}
+
+/* Namespaces with counters under counter_prefix, caching generations for
+ * ttl seconds. NULL with an exception if they can't be made. */
+static pylibmc_namespaces *_PylibMC_NewNamespaces(double ttl,
+        PyObject *counter_prefix) {
+    pylibmc_namespaces *ns;
+
+    if ((ns = PyMem_New(pylibmc_namespaces, 1)) == NULL) {
+        return (pylibmc_namespaces *)PyErr_NoMemory();
+    }
+    ns->ttl = ttl;
+    ns->hits = ns->fetches = ns->bumps = 0;
+    ns->counter_prefix = counter_prefix;
+    Py_INCREF(counter_prefix);
+    if ((ns->gens = PyDict_New()) == NULL) {
+        _PylibMC_FreeNamespaces(ns);
+        return NULL;
+    }
+    return ns;
+}
+
+static void _PylibMC_FreeNamespaces(pylibmc_namespaces *ns) {
+    Py_XDECREF(ns->counter_prefix);
+    Py_XDECREF(ns->gens);
+    PyMem_Free(ns);
+}
+
+/* The key a prefix's generation is kept in. */
+static PyObject *_PylibMC_NamespaceCounter(pylibmc_namespaces *ns,
+        PyObject *name) {
+    Py_ssize_t len = PyString_GET_SIZE(ns->counter_prefix);
+    PyObject *counter;
+
+    counter = PyString_FromStringAndSize(NULL,
+            len + PyString_GET_SIZE(name));
+    if (counter == NULL) {
+        return NULL;
+    }
+    memcpy(PyString_AS_STRING(counter),
+           PyString_AS_STRING(ns->counter_prefix), len);
+    memcpy(PyString_AS_STRING(counter) + len, PyString_AS_STRING(name),
+           PyString_GET_SIZE(name));
+
+    if (!_PylibMC_CheckKey(counter)) {
+        Py_DECREF(counter);
+        return NULL;
+    }
+    return counter;
+}
+
+/* Get the generation in counter, or with bump, increment it. A counter
+ * that isn't there is added, starting from the time in microseconds, so
+ * that one that was evicted doesn't start over at a generation whose keys
+ * may still be around. Returns 0 with an exception on failure. */
+static int _PylibMC_NamespaceFetch(PylibMC_Client *self, PyObject *counter,
+        int bump, uint64_t *gen) {
+    const char *key = PyString_AS_STRING(counter);
+    size_t key_len = PyString_GET_SIZE(counter);
+    char *what = bump ? "memcached_increment" : "memcached_get";
+    char *val, start[24];
+    size_t val_len;
+    uint32_t flags;
+    struct timeval now;
+    memcached_return rc;
+    int tries, len;
+
+    if (!_PylibMC_ClientReady(self)) {
+        return 0;
+    }
+
+    PYLIBMC_BEGIN_ALLOW_THREADS(self)
+    for (tries = 0; tries < 3; tries++) {
+        if (bump) {
+            rc = memcached_increment(self->mc, key, key_len, 1, gen);
+        } else if ((val = memcached_get(self->mc, key, key_len, &val_len,
+                                        &flags, &rc)) != NULL) {
+            *gen = strtoull(val, NULL, 10);
+            free(val);
+        } else if (rc == MEMCACHED_SUCCESS) {
+            *gen = 0;
+        }
+        if (rc != MEMCACHED_NOTFOUND) {
+            break;
+        }
+
+        gettimeofday(&now, NULL);
+        *gen = (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+        len = snprintf(start, sizeof(start), "%llu",
+                       (unsigned long long)*gen);
+        rc = memcached_add(self->mc, key, key_len, start, len, 0, 0);
+        if (rc != MEMCACHED_NOTSTORED && rc != MEMCACHED_DATA_EXISTS) {
+            what = "memcached_add";
+            break;
+        }
+        /* someone else added it first; theirs it is */
+    }
+    PYLIBMC_END_ALLOW_THREADS
+
+    if (rc != MEMCACHED_SUCCESS) {
+        PylibMC_ErrFromMemcached(self, what, rc);
+        return 0;
+    }
+    return 1;
+}
+
+/* The prefix name stands for at generation gen, kept for ttl seconds if
+ * namespaces are still on. A new reference, or NULL with an exception. */
+static PyObject *_PylibMC_NamespaceCache(PylibMC_Client *self,
+        PyObject *name, uint64_t gen) {
+    pylibmc_namespaces *ns = _PylibMC_Namespaces(self);
+    PyObject *folded, *entry, *k, *v;
+    Py_ssize_t pos = 0;
+    char suffix[24];
+    double now;
+    int len;
+
+    len = snprintf(suffix, sizeof(suffix), "#%llu:",
+                   (unsigned long long)gen);
+    folded = PyString_FromStringAndSize(NULL,
+            PyString_GET_SIZE(name) + len);
+    if (folded == NULL) {
+        return NULL;
+    }
+    memcpy(PyString_AS_STRING(folded), PyString_AS_STRING(name),
+           PyString_GET_SIZE(name));
+    memcpy(PyString_AS_STRING(folded) + PyString_GET_SIZE(name), suffix,
+           len);
+    if (ns == NULL || !ns->ttl) {
+        return folded;
+    }
+
+    /* Keep the cache from growing without bound with one-off prefixes. */
+    now = _PylibMC_Now();
+    if (PyDict_Size(ns->gens) >= PYLIBMC_NS_MAX) {
+        PyObject *stale = PyList_New(0);
+
+        while (stale != NULL && PyDict_Next(ns->gens, &pos, &k, &v)) {
+            if (now - PyFloat_AS_DOUBLE(PyTuple_GET_ITEM(v, 0)) >= ns->ttl
+                    && PyList_Append(stale, k) == -1) {
+                Py_CLEAR(stale);
+            }
+        }
+        for (pos = 0; stale != NULL && pos < PyList_GET_SIZE(stale); pos++) {
+            PyDict_DelItem(ns->gens, PyList_GET_ITEM(stale, pos));
+        }
+        if (stale == NULL || PyDict_Size(ns->gens) >= PYLIBMC_NS_MAX) {
+            PyErr_Clear();
+            PyDict_Clear(ns->gens);
+        }
+        Py_XDECREF(stale);
+    }
+
+    if ((entry = Py_BuildValue("(dO)", now, folded)) == NULL
+            || PyDict_SetItem(ns->gens, name, entry) == -1) {
+        Py_XDECREF(entry);
+        Py_DECREF(folded);
+        return NULL;
+    }
+    Py_DECREF(entry);
+    return folded;
+}
+
+/* The prefix a key_prefix stands for with namespaces on: itself followed
+ * by its generation, which costs a round trip unless it was cached less
+ * than ttl seconds ago. A new reference, or NULL with an exception. */
+static PyObject *_PylibMC_NamespacePrefix(PylibMC_Client *self,
+        const char *prefix, Py_ssize_t prefix_len) {
+    pylibmc_namespaces *ns = _PylibMC_Namespaces(self);
+    PyObject *name, *entry, *counter, *folded = NULL;
+    uint64_t gen;
+
+    if ((name = PyString_FromStringAndSize(prefix, prefix_len)) == NULL) {
+        return NULL;
+    }
+    entry = PyDict_GetItem(ns->gens, name);
+    if (entry != NULL && _PylibMC_Now()
+            - PyFloat_AS_DOUBLE(PyTuple_GET_ITEM(entry, 0)) < ns->ttl) {
+        ns->hits++;
+        folded = PyTuple_GET_ITEM(entry, 1);
+        Py_INCREF(folded);
+    } else if ((counter = _PylibMC_NamespaceCounter(ns, name)) != NULL) {
+        if (_PylibMC_NamespaceFetch(self, counter, 0, &gen)) {
+            /* namespaces may have been turned off or anew meanwhile */
+            if ((ns = _PylibMC_Namespaces(self)) != NULL) {
+                ns->fetches++;
+            }
+            folded = _PylibMC_NamespaceCache(self, name, gen);
+        }
+        Py_DECREF(counter);
+    }
+    Py_DECREF(name);
+
+    return folded;
+}
+
+static PyObject *PylibMC_Client_set_namespaces(PylibMC_Client *self,
+        PyObject *args, PyObject *kwds) {
+    static char *kws[] = { "enabled", "ttl", "counter_prefix", NULL };
+    PyObject *enabled = Py_True, *counter_prefix = NULL;
+    pylibmc_namespaces *ns = NULL;
+    double ttl = 1.0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OdS", kws,
+                                     &enabled, &ttl, &counter_prefix)) {
+        return NULL;
+    } else if (ttl < 0) {
+        PyErr_SetString(PyExc_ValueError, "ttl must not be negative");
         return NULL;
     }
 
-    Py_BEGIN_ALLOW_THREADS
-    clone->mc = memcached_clone(NULL, self->mc);
-    Py_END_ALLOW_THREADS
-    return (PyObject *)clone;
+    switch (PyObject_IsTrue(enabled)) {
+        case -1:
+            return NULL;
+        case 1:
+            if (counter_prefix == NULL) {
+                counter_prefix = PyString_FromString("ns:");
+            } else {
+                Py_INCREF(counter_prefix);
+            }
+            if (counter_prefix == NULL) {
+                return NULL;
+            }
+            ns = _PylibMC_NewNamespaces(ttl, counter_prefix);
+            Py_DECREF(counter_prefix);
+            if (ns == NULL) {
+                return NULL;
+            }
+            break;
+    }
+    if (self->cluster->namespaces != NULL) {
+        _PylibMC_FreeNamespaces(self->cluster->namespaces);
+    }
+    self->cluster->namespaces = ns;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *PylibMC_Client_bump_namespace(PylibMC_Client *self,
+        PyObject *args) {
+    pylibmc_namespaces *ns = _PylibMC_Namespaces(self);
+    PyObject *name, *counter, *folded;
+    uint64_t gen;
+
+    if (!PyArg_ParseTuple(args, "S", &name)) {
+        return NULL;
+    } else if (ns == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "namespaces are off");
+        return NULL;
+    } else if (!PyString_GET_SIZE(name)) {
+        PyErr_SetString(PyExc_ValueError, "key_prefix must not be empty");
+        return NULL;
+    } else if ((counter = _PylibMC_NamespaceCounter(ns, name)) == NULL) {
+        return NULL;
+    }
+
+    if (!_PylibMC_NamespaceFetch(self, counter, 1, &gen)) {
+        Py_DECREF(counter);
+        return NULL;
+    }
+    Py_DECREF(counter);
+    if ((ns = _PylibMC_Namespaces(self)) != NULL) {
+        ns->bumps++;
+    }
+    /* this client sees the new generation right away, others within ttl */
+    if ((folded = _PylibMC_NamespaceCache(self, name, gen)) == NULL) {
+        return NULL;
+    }
+    Py_DECREF(folded);
+
+    return PyLong_FromUnsignedLongLong(gen);
+}
+
+static PyObject *PylibMC_Client_namespace_stats(PylibMC_Client *self) {
+    pylibmc_namespaces *ns = _PylibMC_Namespaces(self);
+
+    if (ns == NULL) {
+        Py_RETURN_NONE;
+    }
+    return Py_BuildValue("{s:n,s:k,s:k,s:k}",
+            "cached", PyDict_Size(ns->gens), "hits", ns->hits,
+            "fetches", ns->fetches, "bumps", ns->bumps);
 }
 /* }}} */
 
-static PyObject *PylibMC_ErrFromMemcached(PylibMC_Client *self, const char *what,
-        memcached_return error) {
-    if (error == MEMCACHED_ERRNO) {
-        PyErr_Format(PylibMCExc_MemcachedError,
-                "system error %d from %s: %s", errno, what, strerror(errno));
-    /* The key exists, but it has no value */
-    } else if (error == MEMCACHED_SUCCESS) {
-        PyErr_Format(PyExc_RuntimeError, "error == 0? %s:%d",
-                     __FILE__, __LINE__);
-    } else { 
-        PylibMC_McErr *err;
-        PyObject *exc = (PyObject *)PylibMCExc_MemcachedError;
+/* {{{ Long keys */
+#define PYLIBMC_ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
 
-        for (err = PylibMCExc_mc_errs; err->name != NULL; err++) {
-            if (err->rc == error) {
-                exc = err->exc;
-                break;
-            }
-        }
+static uint64_t _PylibMC_Fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
 
-        PyErr_Format(exc, "error %d from %s: %s", error, what,
-                     memcached_strerror(self->mc, error));
+static uint64_t _PylibMC_Load64(const unsigned char *p) {
+    uint64_t v = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--) {
+        v = (v << 8) | p[i];
     }
-    return NULL;
+    return v;
 }
 
-/* {{{ Pickling */
-static PyObject *_PylibMC_GetPickles(const char *attname) {
-    PyObject *pickle, *pickle_attr;
+/* MurmurHash3's x64 128-bit variant with a seed of 0, reading little-endian
+ * whatever the host, so that every client hashes a key the same. */
+static void _PylibMC_Hash128(const char *key, size_t len, uint64_t *out) {
+    const unsigned char *data = (const unsigned char *)key, *tail;
+    const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = 0, h2 = 0, k1, k2;
+    size_t i, rest = len & 15;
+
+    for (i = 0; i < len / 16; i++) {
+        k1 = _PylibMC_Load64(data + i * 16);
+        k2 = _PylibMC_Load64(data + i * 16 + 8);
+
+        k1 *= c1; k1 = PYLIBMC_ROTL64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = PYLIBMC_ROTL64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = PYLIBMC_ROTL64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = PYLIBMC_ROTL64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
 
-    pickle_attr = NULL;
-    /* Import cPickle or pickle. */
-    pickle = PyImport_ImportModule("cPickle");
-    if (pickle == NULL) {
-        PyErr_Clear();
-        pickle = PyImport_ImportModule("pickle");
+    tail = data + (len & ~(size_t)15);
+    k1 = k2 = 0;
+    for (i = rest; i > 8; i--) {
+        k2 ^= (uint64_t)tail[i - 1] << ((i - 9) * 8);
+    }
+    if (rest > 8) {
+        k2 *= c2; k2 = PYLIBMC_ROTL64(k2, 33); k2 *= c1; h2 ^= k2;
+    }
+    for (i = (rest > 8) ? 8 : rest; i > 0; i--) {
+        k1 ^= (uint64_t)tail[i - 1] << ((i - 1) * 8);
+    }
+    if (rest) {
+        k1 *= c1; k1 = PYLIBMC_ROTL64(k1, 31); k1 *= c2; h1 ^= k1;
     }
 
-    /* Find attribute and return it. */
-    if (pickle != NULL) {
-        pickle_attr = PyObject_GetAttrString(pickle, attname);
-        Py_DECREF(pickle);
+    h1 ^= len;
+    h2 ^= len;
+    h1 += h2;
+    h2 += h1;
+    h1 = _PylibMC_Fmix64(h1);
+    h2 = _PylibMC_Fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    out[0] = h1;
+    out[1] = h2;
+}
+
+/* The wire key standing for a long one: its first key_hash_keep bytes, so
+ * that keys stay recognizable in stats and dumps, then 32 hex digits of its
+ * hash. A new reference, or NULL with an exception. */
+static PyObject *_PylibMC_HashKey(pylibmc_cluster *cluster, PyObject *wire) {
+    size_t keep = cluster->key_hash_keep;
+    uint64_t h[2];
+    PyObject *hashed;
+
+    _PylibMC_Hash128(PyString_AS_STRING(wire), PyString_GET_SIZE(wire), h);
+    if ((hashed = PyString_FromStringAndSize(NULL, keep + 32)) == NULL) {
+        return NULL;
     }
+    memcpy(PyString_AS_STRING(hashed), PyString_AS_STRING(wire), keep);
+    /* snprintf's NUL lands on the one Python strings keep past the end */
+    snprintf(PyString_AS_STRING(hashed) + keep, 33, "%016llx%016llx",
+             (unsigned long long)h[0], (unsigned long long)h[1]);
+    return hashed;
+}
 
-    return pickle_attr;
+static PyObject *PylibMC_Client_set_key_hashing(PylibMC_Client *self,
+        PyObject *args, PyObject *kwds) {
+    static char *kws[] = { "threshold", "keep", NULL };
+    unsigned int threshold = 128, keep = 32;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|II", kws,
+                                     &threshold, &keep)) {
+        return NULL;
+    } else if (threshold && (threshold > MEMCACHED_MAX_KEY
+                || threshold < 32 || keep > threshold - 32)) {
+        PyErr_Format(PyExc_ValueError,
+                "threshold must be within [keep + 32, %d], or 0",
+                MEMCACHED_MAX_KEY);
+        return NULL;
+    }
+
+    self->cluster->key_hash_threshold = threshold;
+    self->cluster->key_hash_keep = threshold ? keep : 0;
+    /* Key objects cached the servers of the keys as they were */
+    self->cluster->topology = _PylibMC_NewTopology();
+
+    Py_RETURN_NONE;
 }
+/* }}} */
 
-static PyObject *_PylibMC_Unpickle(const char *buff, size_t size) {
-    PyObject *pickle_load;
-    PyObject *retval = NULL;
-    
-    retval = NULL;
-    pickle_load = _PylibMC_GetPickles("loads");
-    if (pickle_load != NULL) {
-        retval = PyObject_CallFunction(pickle_load, "s#", buff, size);
-        Py_DECREF(pickle_load);
+/* {{{ Batcher type */
+static PyObject *PylibMC_BatcherType_new(PyTypeObject *type, PyObject *args,
+        PyObject *kwds) {
+    PylibMC_Batcher *self;
+
+    self = (PylibMC_Batcher *)PyType_GenericNew(type, args, kwds);
+    if (self != NULL) {
+        pthread_mutex_init(&self->lock, NULL);
+        pthread_mutex_init(&self->io_lock, NULL);
     }
 
-    return retval;
+    return (PyObject *)self;
 }
 
-static PyObject *_PylibMC_Pickle(PyObject *val) {
-    PyObject *pickle_dump;
-    PyObject *retval = NULL;
+static void PylibMC_BatcherType_dealloc(PylibMC_Batcher *self) {
+    /* Threads in get hold a reference, so no batch is open by now. */
+    Py_XDECREF(self->client);
 
-    pickle_dump = _PylibMC_GetPickles("dumps");
-    if (pickle_dump != NULL) {
-        retval = PyObject_CallFunction(pickle_dump, "Oi", val, -1);
-        Py_DECREF(pickle_dump);
+    pthread_mutex_destroy(&self->io_lock);
+    pthread_mutex_destroy(&self->lock);
+
+    self->ob_type->tp_free(self);
+}
+
+static int PylibMC_Batcher_init(PylibMC_Batcher *self, PyObject *args,
+        PyObject *kwds) {
+    PylibMC_Client *mc;
+    double window = 0.0002;
+    unsigned int size = 32;
+
+    static char *kws[] = { "mc", "window", "size", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|dI", kws,
+                                     &PylibMC_ClientType, &mc,
+                                     &window, &size)) {
+        return -1;
+    } else if (self->client != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "batcher is already set up");
+        return -1;
+    } else if (window < 0) {
+        PyErr_SetString(PyExc_ValueError, "window must not be negative");
+        return -1;
+    } else if (!size) {
+        PyErr_SetString(PyExc_ValueError, "size must be at least 1");
+        return -1;
+    } else if ((self->client = _PylibMC_Clone(mc, 0)) == NULL) {
+        return -1;
     }
 
-    return retval;
+    self->window = window;
+    self->size = size;
+    return 0;
+}
+
+static PyObject *PylibMC_Batcher_get(PylibMC_Batcher *self, PyObject *arg) {
+    PylibMC_Client *client = self->client;
+    pylibmc_batch_get get;
+    PyObject *key, *retval;
+    double began = 0;
+    int metered;
+
+    if (client == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "batcher isn't set up");
+        return NULL;
+    } else if (!_PylibMC_ClientReady(client)) {
+        return NULL;
+    } else if ((key = _PylibMC_WireKey(client, arg, NULL, 0)) == NULL) {
+        return NULL;
+    } else if (!PyString_GET_SIZE(key)) {
+        Py_DECREF(key);
+        Py_RETURN_NONE;
+    }
+
+    get.key = PyString_AS_STRING(key);
+    get.key_len = PyString_GET_SIZE(key);
+    get.value = NULL;
+    get.value_len = 0;
+    get.flags = 0;
+    get.server = UINT32_MAX;
+    get.rc = MEMCACHED_NOTFOUND;
+    if ((metered = _PylibMC_Metered(client))) {
+        began = _PylibMC_Now();
+    }
+
+    PYLIBMC_BEGIN_ALLOW_THREADS(client)
+    _PylibMC_BatchJoin(self, &get);
+    PYLIBMC_END_ALLOW_THREADS
+
+    if (metered) {
+        _PylibMC_Meter(client, PYLIBMC_OP_GET, get.server,
+                       _PylibMC_Now() - began,
+                       (get.value != NULL) ? PYLIBMC_HIT
+                                           : _PylibMC_Outcome(get.rc),
+                       get.value_len, get.key_len);
+    }
+    Py_DECREF(key);
+
+    if (get.value != NULL) {
+        retval = _PylibMC_parse_memcached_value(get.value, get.value_len,
+                                                get.flags, client);
+        free(get.value);
+        return retval;
+    } else if (get.rc == MEMCACHED_NOTFOUND) {
+        Py_RETURN_NONE;
+    }
+    return PylibMC_ErrFromMemcached(client, "memcached_mget", get.rc);
+}
+
+/* Puts *get* in the open batch, or opens one and leads it, and returns once
+ * the batch has been sent. Called without the GIL. */
+static void _PylibMC_BatchJoin(PylibMC_Batcher *self, pylibmc_batch_get *get) {
+    pylibmc_batch *batch;
+    int leader = 0, last;
+
+    pthread_mutex_lock(&self->lock);
+    if ((batch = self->open) == NULL) {
+        batch = malloc(sizeof(pylibmc_batch)
+                       + sizeof(pylibmc_batch_get *) * self->size);
+        if (batch == NULL) {
+            pthread_mutex_unlock(&self->lock);
+            get->rc = MEMCACHED_MEMORY_ALLOCATION_FAILURE;
+            return;
+        }
+        batch->gets = (pylibmc_batch_get **)(batch + 1);
+        batch->n = 0;
+        batch->refs = 0;
+        batch->done = 0;
+        pthread_cond_init(&batch->cond, NULL);
+        self->open = batch;
+        leader = 1;
+    }
+
+    batch->gets[batch->n++] = get;
+    batch->refs++;
+    self->gets++;
+    if (batch->n == self->size) {
+        /* Full, so the leader needn't wait out the window. */
+        self->open = NULL;
+        self->full++;
+        pthread_cond_broadcast(&batch->cond);
+    }
+
+    if (leader) {
+        if (self->open == batch && self->window > 0) {
+            struct timespec until;
+
+            _PylibMC_Deadline(self->window, &until);
+            while (self->open == batch
+                    && pthread_cond_timedwait(&batch->cond, &self->lock,
+                                              &until) != ETIMEDOUT);
+        }
+        if (self->open == batch) {
+            self->open = NULL;
+        }
+        self->batches++;
+        if (batch->n > self->largest) {
+            self->largest = batch->n;
+        }
+        pthread_mutex_unlock(&self->lock);
+
+        _PylibMC_BatchSend(self, batch);
+
+        pthread_mutex_lock(&self->lock);
+        batch->done = 1;
+        pthread_cond_broadcast(&batch->cond);
+    } else {
+        while (!batch->done) {
+            pthread_cond_wait(&batch->cond, &self->lock);
+        }
+    }
+    last = (--batch->refs == 0);
+    pthread_mutex_unlock(&self->lock);
+
+    if (last) {
+        pthread_cond_destroy(&batch->cond);
+        free(batch);
+    }
+}
+
+/* Sends a closed batch as one mget and gives each get its reply. Batches
+ * take turns on the client; one waiting for its turn keeps filling up.
+ * Called without the GIL. */
+static void _PylibMC_BatchSend(PylibMC_Batcher *self, pylibmc_batch *batch) {
+    memcached_st *mc = self->client->mc;
+    pylibmc_mget_result *results;
+    pylibmc_deadline dl;
+    memcached_return rc;
+    char **keys, *err_func = NULL;
+    size_t *key_lens;
+    size_t nkeys = 0, nresults = 0, i;
+    uint32_t n;
+
+    keys = malloc(sizeof(char *) * batch->n);
+    key_lens = malloc(sizeof(size_t) * batch->n);
+    results = malloc(sizeof(pylibmc_mget_result) * batch->n);
+    if (keys == NULL || key_lens == NULL || results == NULL) {
+        free(keys);
+        free(key_lens);
+        free(results);
+        for (n = 0; n < batch->n; n++) {
+            batch->gets[n]->rc = MEMCACHED_MEMORY_ALLOCATION_FAILURE;
+        }
+        return;
+    }
+
+    /* Threads after the same key share the one reply. */
+    for (n = 0; n < batch->n; n++) {
+        pylibmc_batch_get *get = batch->gets[n];
+
+        for (i = 0; i < nkeys; i++) {
+            if (key_lens[i] == get->key_len
+                    && !memcmp(keys[i], get->key, get->key_len)) {
+                break;
+            }
+        }
+        if (i == nkeys) {
+            keys[nkeys] = get->key;
+            key_lens[nkeys++] = get->key_len;
+        }
+    }
+
+    pthread_mutex_lock(&self->io_lock);
+    if (memcached_server_count(mc)) {
+        for (n = 0; n < batch->n; n++) {
+            batch->gets[n]->server = memcached_generate_hash(mc,
+                    batch->gets[n]->key, batch->gets[n]->key_len);
+        }
+    }
+    _PylibMC_DeadlineStart(mc, -1, &dl);
+    rc = pylibmc_memcached_fetch_multi(mc, NULL, 0, keys, nkeys, key_lens,
+                                       results, &nresults, nkeys,
+                                       &err_func, &dl);
+    pthread_mutex_unlock(&self->io_lock);
+
+    /* Keys that weren't answered are misses, unless the mget failed. */
+    if (rc == MEMCACHED_SUCCESS || rc == MEMCACHED_SOME_ERRORS) {
+        rc = MEMCACHED_NOTFOUND;
+    }
+    for (n = 0; n < batch->n; n++) {
+        batch->gets[n]->rc = rc;
+    }
+    for (i = 0; i < nresults; i++) {
+        pylibmc_mget_result *r = results + i;
+        char *given = NULL;
+
+        for (n = 0; n < batch->n; n++) {
+            pylibmc_batch_get *get = batch->gets[n];
+
+            if (get->value != NULL || get->key_len != r->key_len
+                    || memcmp(get->key, r->key, r->key_len)) {
+                continue;
+            } else if (given == NULL) {
+                get->value = given = r->value;
+            } else if ((get->value = malloc(r->value_len + 1)) != NULL) {
+                memcpy(get->value, given, r->value_len);
+            } else {
+                get->rc = MEMCACHED_MEMORY_ALLOCATION_FAILURE;
+                continue;
+            }
+            get->value_len = r->value_len;
+            get->flags = r->flags;
+            get->rc = MEMCACHED_SUCCESS;
+        }
+        if (given == NULL) {
+            free(r->value);
+        }
+    }
+
+    free(keys);
+    free(key_lens);
+    free(results);
+}
+
+static PyObject *PylibMC_Batcher_stats(PylibMC_Batcher *self) {
+    uint64_t batches, gets, full;
+    uint32_t largest;
+
+    pthread_mutex_lock(&self->lock);
+    batches = self->batches;
+    gets = self->gets;
+    full = self->full;
+    largest = self->largest;
+    pthread_mutex_unlock(&self->lock);
+
+    return Py_BuildValue("{s:K,s:K,s:K,s:I}",
+            "batches", (unsigned PY_LONG_LONG)batches,
+            "gets", (unsigned PY_LONG_LONG)gets,
+            "full", (unsigned PY_LONG_LONG)full,
+            "largest", (unsigned int)largest);
 }
 /* }}} */
 
-static int _PylibMC_CheckKey(PyObject *key) {
-    if (key == NULL) {
-        PyErr_SetString(PyExc_ValueError, "key must be given");
-        return 0;
-    } else if (!PyString_Check(key)) {
-        PyErr_SetString(PyExc_TypeError, "key must be an instance of str");
-        return 0;
+/* {{{ Reservation type */
+static PyObject *_PylibMC_Reserved(PyObject *owner, PyObject *client,
+        int slot, void (*release)(PyObject *, int)) {
+    PylibMC_Reservation *self;
+
+    self = PyObject_New(PylibMC_Reservation, &PylibMC_ReservationType);
+    if (self == NULL) {
+        if (release != NULL) {
+            release(owner, slot);
+        }
+        return NULL;
     }
 
-    return _PylibMC_CheckKeyStringAndSize(
-            PyString_AS_STRING(key), PyString_GET_SIZE(key));
+    Py_INCREF(owner);
+    self->owner = owner;
+    Py_INCREF(client);
+    self->client = client;
+    self->slot = slot;
+    self->release = release;
+
+    return (PyObject *)self;
 }
 
-static int _PylibMC_CheckKeyStringAndSize(char *key, Py_ssize_t size) {
-    if (size > MEMCACHED_MAX_KEY) {
-        PyErr_Format(PyExc_ValueError, "key too long, max is %d",
-                MEMCACHED_MAX_KEY);
-        return 0;
+static void _PylibMC_Unreserve(PylibMC_Reservation *self) {
+    if (self->slot >= 0 && self->release != NULL) {
+        self->release(self->owner, self->slot);
     }
-    /* TODO Check key contents here. */
+    self->slot = -1;
+}
 
-    return key != NULL;
+static void PylibMC_ReservationType_dealloc(PylibMC_Reservation *self) {
+    _PylibMC_Unreserve(self);
+    Py_DECREF(self->client);
+    Py_DECREF(self->owner);
+    PyObject_Del(self);
+}
+
+static PyObject *PylibMC_Reservation_enter(PylibMC_Reservation *self) {
+    Py_INCREF(self->client);
+    return self->client;
+}
+
+static PyObject *PylibMC_Reservation_exit(PylibMC_Reservation *self,
+        PyObject *args) {
+    _PylibMC_Unreserve(self);
+    Py_RETURN_FALSE;
 }
+/* }}} */
 
 static PyMethodDef PylibMC_functions[] = {
     {NULL, NULL, 0, NULL}
@@ -1662,11 +11774,48 @@ PyMODINIT_FUNC init_pylibmc(void) {
             LIBMEMCACHED_VERSION_STRING);
         return;
     }
+    /* Releases without LIBMEMCACHED_VERSION_HEX get past the check in
+     * _pylibmcmodule.h; the server fields we use are only known in 0.32. */
+    if (strcmp(LIBMEMCACHED_VERSION_STRING, "0.32")) {
+        PyErr_Format(PyExc_RuntimeError,
+            "pylibmc uses libmemcached 0.32 internals, was compiled with %s",
+            LIBMEMCACHED_VERSION_STRING);
+        return;
+    }
 
     if (PyType_Ready(&PylibMC_ClientType) < 0) {
         return;
     }
 
+    if (pthread_atfork(NULL, NULL, _PylibMC_AtForkChild) != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "pthread_atfork failed");
+        return;
+    }
+
+    if (PyType_Ready(&PylibMC_KeyType) < 0) {
+        return;
+    }
+
+    if (PyType_Ready(&PylibMC_PoolType) < 0) {
+        return;
+    }
+
+    if (PyType_Ready(&PylibMC_ReservationType) < 0) {
+        return;
+    }
+
+    if (PyType_Ready(&PylibMC_PipelineType) < 0) {
+        return;
+    }
+
+    if (PyType_Ready(&PylibMC_ThreadPoolType) < 0) {
+        return;
+    }
+
+    if (PyType_Ready(&PylibMC_BatcherType) < 0) {
+        return;
+    }
+
     module = Py_InitModule3("_pylibmc", PylibMC_functions,
             "Hand-made wrapper for libmemcached.\n\
 \n\
@@ -1720,11 +11869,47 @@ Oh, and: plankton.\n");
             Py_BuildValue("sO", err->name, (PyObject *)err->exc));
     }
 
+    PylibMCExc_ServerDown = PyErr_NewException(
+            "_pylibmc.ServerDown", PylibMCExc_MemcachedError, NULL);
+    PyModule_AddObject(module, "ServerDown", PylibMCExc_ServerDown);
+    PyList_Append(exc_objs,
+        Py_BuildValue("sO", "ServerDown", PylibMCExc_ServerDown));
+
+    PylibMCExc_DeadlineExceeded = PyErr_NewException(
+            "_pylibmc.DeadlineExceeded", PylibMCExc_MemcachedError, NULL);
+    PyModule_AddObject(module, "DeadlineExceeded", PylibMCExc_DeadlineExceeded);
+    PyList_Append(exc_objs,
+        Py_BuildValue("sO", "DeadlineExceeded", PylibMCExc_DeadlineExceeded));
+
     PyModule_AddObject(module, "exceptions", exc_objs);
 
+    /* Pools run out the same way a Queue does. */
+    if ((PylibMCExc_PoolEmpty = PyImport_ImportModule("Queue")) != NULL) {
+        PyObject *queue = PylibMCExc_PoolEmpty;
+
+        PylibMCExc_PoolEmpty = PyObject_GetAttrString(queue, "Empty");
+        Py_DECREF(queue);
+    }
+    if (PylibMCExc_PoolEmpty == NULL) {
+        return;
+    }
+
     Py_INCREF(&PylibMC_ClientType);
     PyModule_AddObject(module, "client", (PyObject *)&PylibMC_ClientType);
 
+    Py_INCREF(&PylibMC_KeyType);
+    PyModule_AddObject(module, "key", (PyObject *)&PylibMC_KeyType);
+
+    Py_INCREF(&PylibMC_PoolType);
+    PyModule_AddObject(module, "pool", (PyObject *)&PylibMC_PoolType);
+
+    Py_INCREF(&PylibMC_ThreadPoolType);
+    PyModule_AddObject(module, "thread_mapped_pool",
+                       (PyObject *)&PylibMC_ThreadPoolType);
+
+    Py_INCREF(&PylibMC_BatcherType);
+    PyModule_AddObject(module, "batcher", (PyObject *)&PylibMC_BatcherType);
+
     PyModule_AddIntConstant(module, "server_type_tcp", PYLIBMC_SERVER_TCP);
     PyModule_AddIntConstant(module, "server_type_udp", PYLIBMC_SERVER_UDP);
     PyModule_AddIntConstant(module, "server_type_unix", PYLIBMC_SERVER_UNIX);
@@ -39,10 +39,22 @@
 #define PY_SSIZE_T_CLEAN
 
 #include <Python.h>
+#include <structmember.h>
+#include <pthread.h>
+#include <sys/uio.h>
 #include <libmemcached/memcached.h>
 
 #include "pylibmc-version.h"
 
+/* The hedged get, read engine and pipelines reuse libmemcached's own
+ * connections, which means reading and resetting fields of
+ * memcached_server_st that aren't part of its API, and shared clones point
+ * memcached_st's continuum at one they share. They are as laid out in 0.32;
+ * later releases, which define LIBMEMCACHED_VERSION_HEX, moved them. */
+#ifdef LIBMEMCACHED_VERSION_HEX
+#error "pylibmc needs the memcached_server_st of libmemcached 0.32"
+#endif
+
 /* Py_ssize_t appeared in Python 2.5. */
 #ifndef PY_SSIZE_T_MAX
 typedef ssize_t Py_ssize_t;
@@ -72,6 +84,9 @@ typedef memcached_return (*_PylibMC_SetCommand)(memcached_st *, const char *,
         size_t, const char *, size_t, time_t, uint32_t);
 typedef memcached_return (*_PylibMC_IncrCommand)(memcached_st *,
         const char *, size_t, unsigned int, uint64_t*);
+typedef memcached_return (*_PylibMC_SetByKeyCommand)(memcached_st *,
+        const char *, size_t, const char *, size_t, const char *, size_t,
+        time_t, uint32_t);
 
 typedef struct {
   char key[MEMCACHED_MAX_KEY];
@@ -109,6 +124,12 @@ typedef struct {
 
 /* {{{ Exceptions */
 static PyObject *PylibMCExc_MemcachedError;
+/* Queue.Empty, raised when a pool has no client to hand out in time. */
+static PyObject *PylibMCExc_PoolEmpty;
+/* Raised instead of calling a server whose circuit breaker is open. */
+static PyObject *PylibMCExc_ServerDown;
+/* Raised when a call runs out of time, with the keys it didn't get to. */
+static PyObject *PylibMCExc_DeadlineExceeded;
 
 /* Mapping of memcached_return value -> Python exception object. */
 typedef struct {
@@ -219,23 +240,598 @@ static PylibMC_Behavior PylibMC_distributions[] = {
 /* }}} */
 
 /* {{{ _pylibmc.client */
+#define PYLIBMC_BREAKER_CLOSED    0
+#define PYLIBMC_BREAKER_OPEN      1
+#define PYLIBMC_BREAKER_HALF_OPEN 2
+
+/* Circuit breaker of a single server. */
+typedef struct {
+    int state;
+    /* Calls, failed calls and slow calls in the current window. */
+    unsigned int calls, failures, slow;
+    double window_start;
+    double opened_at;
+    /* A half-open breaker lets one trial call through at a time. */
+    unsigned char trial;
+    unsigned long trips, rejected;
+    /* Outcome of the last probe: 1 up, 0 down, -1 not probed yet. */
+    int probe_ok;
+    double probe_latency;
+    /* Where to probe, copied so the prober never looks at a memcached_st. */
+    char hostname[MEMCACHED_MAX_HOST_LENGTH];
+    unsigned int port;
+    memcached_connection type;
+} pylibmc_breaker;
+
+/* The circuit breakers of a cluster's servers and their settings. Calls
+ * consult them with the GIL released, and the prober thread updates them,
+ * so all of it is guarded by lock. */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    unsigned char enabled, fallback;
+    /* Trip when this share of at least min_calls calls in a window of
+     * window seconds failed, or took longer than slow_after seconds. */
+    double error_rate, slow_rate, slow_after, window;
+    unsigned int min_calls;
+    /* Seconds an open breaker waits before letting a trial call through. */
+    double cooldown;
+    double probe_interval;
+    uint32_t nservers;
+    pylibmc_breaker *servers;
+    pthread_t prober;
+    unsigned char probing, stop;
+    /* Fork generation the prober was started in. */
+    unsigned long forks;
+} pylibmc_breakers;
+
+/* Room for the keys _PylibMC_NewReplicas routes by. */
+#define PYLIBMC_ROUTE_LEN 32
+
+/* Replication of a cluster's keys onto the copies servers following the
+ * one each key maps to. route[i] is a key that maps to server i, which is
+ * how the _by_key calls are pointed at a replica. The counters are bumped
+ * with the GIL released. */
+typedef struct {
+    unsigned int copies;
+    uint32_t nservers;
+    char (*route)[PYLIBMC_ROUTE_LEN];
+    /* Reads served by the primary in served[0], and by replica i in
+     * served[i]. */
+    unsigned long *served;
+    unsigned long write_errors;
+} pylibmc_replicas;
+
+/* Primary latencies seen before hedging goes by its percentile estimate,
+ * and the share of itself the estimate moves by with each. */
+#define PYLIBMC_HEDGE_WARMUP 32
+#define PYLIBMC_HEDGE_STEP 0.05
+
+/* Hedged reads: a get the primary hasn't answered within threshold seconds
+ * is sent to the first replica too. threshold is after, or a running
+ * estimate of the percentile of primary latencies once there have been
+ * enough of them. tokens grow by budget every get and a hedge takes one, so
+ * at most that share of gets are hedged. Used with the GIL released, so
+ * guarded by lock. */
+typedef struct {
+    pthread_mutex_t lock;
+    double after, percentile, budget;
+    double threshold, tokens;
+    double estimate;
+    unsigned int nsamples;
+    unsigned long gets, hedged, won;
+    /* Fork generation lock was made in. */
+    unsigned long forks;
+} pylibmc_hedging;
+
+/* A reply to a hedged get, read by hand off a connection of libmemcached's.
+ * status is 0 while it's coming in, 1 for a hit, 2 for a miss and -1 if it
+ * went wrong. */
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len, size;
+    int status;
+    uint32_t flags;
+    size_t value_off, value_len;
+} pylibmc_hedge_read;
+
+/* A key the hot key sampler ranks among the top ones. count is its
+ * estimated number of samples, bytes the value bytes those samples moved. */
+typedef struct {
+    char key[MEMCACHED_MAX_KEY];
+    size_t key_len;
+    uint64_t hash;
+    uint32_t server;
+    uint32_t count;
+    uint64_t bytes;
+} pylibmc_hot_key;
+
+/* Most copies a hot key can be given. */
+#define PYLIBMC_HOT_COPIES_MAX 8
+
+/* Where the copies of a hot key are: copy i is stored under the key with
+ * ":hot:<suffix[i]>" appended, which maps to server[i]. */
+typedef struct {
+    unsigned int n;
+    uint32_t suffix[PYLIBMC_HOT_COPIES_MAX];
+    uint32_t server[PYLIBMC_HOT_COPIES_MAX];
+} pylibmc_hot_copies;
+
+/* A slot of the table of keys hot enough to be copied; key_len is 0 for an
+ * empty one. */
+typedef struct {
+    char key[MEMCACHED_MAX_KEY];
+    size_t key_len;
+    uint64_t hash;
+    pylibmc_hot_copies copies;
+} pylibmc_hot_slot;
+
+/* Hot key detection. A sample of gets and sets feed a count-min sketch of
+ * depth rows of width counters, and the keys with the highest estimates are
+ * kept in a min-heap of size entries. Everything is halved every window
+ * seconds, so keys that cool off drop out.
+ *
+ * With copies set, top keys estimated to see threshold calls a second or
+ * more are copied to that many other servers, where reads are spread. The
+ * copies live for ttl seconds at most, which bounds how stale they get from
+ * writes they don't see. Only touched while holding the GIL. */
+typedef struct {
+    double rate;
+    /* a call is sampled when the next 32-bit random number is below this */
+    uint64_t cutoff;
+    uint64_t rng;
+    uint32_t width, depth;
+    uint32_t *sketch;
+    unsigned int size, nheap;
+    pylibmc_hot_key *heap;
+    double window, decayed_at;
+    unsigned long samples;
+    unsigned int copies;
+    double threshold;
+    time_t ttl;
+    /* threshold, in samples per window */
+    uint32_t hot_count;
+    pylibmc_hot_slot *hot;
+    unsigned int hot_mask, nhot;
+} pylibmc_hotkeys;
+
+/* Operations metrics are kept for, indexing pylibmc_metrics.ops. */
+#define PYLIBMC_OP_GET          0
+#define PYLIBMC_OP_GET_MULTI    1
+#define PYLIBMC_OP_SET          2
+#define PYLIBMC_OP_ADD          3
+#define PYLIBMC_OP_REPLACE      4
+#define PYLIBMC_OP_APPEND       5
+#define PYLIBMC_OP_PREPEND      6
+#define PYLIBMC_OP_SET_MULTI    7
+#define PYLIBMC_OP_ADD_MULTI    8
+#define PYLIBMC_OP_DELETE       9
+#define PYLIBMC_OP_DELETE_MULTI 10
+#define PYLIBMC_OP_INCR         11
+#define PYLIBMC_OP_DECR         12
+#define PYLIBMC_OP_INCR_MULTI   13
+#define PYLIBMC_OP_PIPELINE     14
+#define PYLIBMC_OPS             15
+
+static char *PylibMC_op_names[PYLIBMC_OPS] = {
+    "get", "get_multi", "set", "add", "replace", "append", "prepend",
+    "set_multi", "add_multi", "delete", "delete_multi", "incr", "decr",
+    "incr_multi", "pipeline"
+};
+
+/* Latency histograms have 8 buckets to every power of two microseconds,
+ * which is within 12.5% of the real value, up to 2 ** 30 microseconds. */
+#define PYLIBMC_HIST_SUB_BITS 3
+#define PYLIBMC_HIST_BUCKETS  ((30 - PYLIBMC_HIST_SUB_BITS + 1) \
+                               << PYLIBMC_HIST_SUB_BITS)
+
+/* How a key fared in a call, for metrics: a hit is a key found, stored or
+ * deleted, a miss one that wasn't there or wasn't stored. */
+#define PYLIBMC_HIT   0
+#define PYLIBMC_MISS  1
+#define PYLIBMC_ERROR 2
+
+/* Parts of a call spent in Python's objects rather than waiting on servers,
+ * for metrics and traces. */
+#define PYLIBMC_SERIALIZE   0
+#define PYLIBMC_DESERIALIZE 1
+#define PYLIBMC_COMPRESS    2
+#define PYLIBMC_DECOMPRESS  3
+
+/* Counters and latency of an operation, or of a server. Everything is a
+ * uint64_t, so that it can be reset and read a word at a time. bytes_out
+ * counts keys and values sent, bytes_in values received. */
+typedef struct {
+    uint64_t calls, hits, misses, errors;
+    uint64_t bytes_in, bytes_out;
+    uint64_t latency_sum;
+    uint64_t latency[PYLIBMC_HIST_BUCKETS];
+} pylibmc_op_metrics;
+
+/* Metrics of a cluster, updated with relaxed atomics from any thread, with
+ * or without the GIL. Calls with many keys count once for their operation,
+ * and once per key for the key's server; only single-key calls go into the
+ * servers' latencies. Times are in microseconds. */
+typedef struct {
+    pylibmc_op_metrics ops[PYLIBMC_OPS];
+    uint32_t nservers;
+    pylibmc_op_metrics *servers;
+    uint64_t serialize, deserialize, compress, decompress;
+    double since;
+} pylibmc_metrics;
+
+/* A traced call. start is the wall-clock time it began, the others are
+ * seconds; marshal counts serializing and compressing, unmarshal the
+ * reverse, and the rest of total is spent on the network. server is that
+ * of all its keys, or UINT32_MAX when they're on several. */
+typedef struct {
+    int op;
+    double start, began, total, marshal, unmarshal;
+    uint32_t server;
+    uint64_t hits, misses, errors, bytes_in, bytes_out;
+    size_t key_len;
+    char key[MEMCACHED_MAX_KEY];
+} pylibmc_span;
+
+/* Tracing of a cluster: one in every calls is traced, and either handed to
+ * hook or kept in a ring of size spans until traces() drains it, the oldest
+ * making way when it's full. Only touched while holding the GIL. */
+typedef struct {
+    unsigned int every, counter;
+    PyObject *hook;
+    size_t size, head, count;
+    pylibmc_span *ring;
+} pylibmc_tracing;
+
+/* A counter of incr_buffered, and the delta it has yet to be sent. server
+ * is only set on the way out. */
+typedef struct {
+    char key[MEMCACHED_MAX_KEY];
+    size_t key_len;
+    int64_t delta;
+    uint32_t server;
+} pylibmc_counter;
+
+/* Deltas added up by incr_buffered, sent by the first incr_buffered once
+ * interval seconds have passed since they last were, when size counters are
+ * pending, or on flush_counters(); nothing sends them on a timer. An
+ * open-addressed table of a power of two slots, at
+ * most three quarters full. Only touched while holding the GIL. */
+typedef struct {
+    double interval, flushed_at;
+    unsigned int size, mask, pending;
+    pylibmc_counter *slots;
+    uint64_t events, flushes, sent;
+} pylibmc_counters;
+
+/* What set_async does when the write-behind queue is full: drop the set,
+ * wait for room, or drop it unless it replaces a set of the same key
+ * that's still waiting, which a coalescing queue always does. */
+#define PYLIBMC_WB_DROP     0
+#define PYLIBMC_WB_BLOCK    1
+#define PYLIBMC_WB_COALESCE 2
+
+/* A set waiting in the write-behind queue, serialized and compressed as
+ * it'll be sent, with its key and then its value after it in the same
+ * allocation. at is its place in the ring, and chain links the entries of
+ * a coalescing queue's bucket. */
+typedef struct pylibmc_wb_entry {
+    struct pylibmc_wb_entry *chain;
+    size_t at;
+    uint64_t hash;
+    char *value;
+    size_t key_len, value_len;
+    uint32_t flags;
+    time_t time;
+    char key[1];
+} pylibmc_wb_entry;
+
+/* The write-behind queue of set_async: a ring of size entries, which the
+ * writer thread takes batch at a time and pipelines to the servers over a
+ * memcached_st of its own. work wakes the writer, and room those waiting
+ * for the queue to drain. All of it is guarded by lock, and none of it is
+ * a Python object, so the writer never needs the GIL. */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work, room;
+    int policy;
+    size_t size, batch;
+    pylibmc_wb_entry **ring;
+    size_t head, count, peak;
+    /* a coalescing queue's entries by key hash; mask + 1 buckets */
+    pylibmc_wb_entry **buckets;
+    size_t mask;
+    /* what the writer took, and is sending */
+    pylibmc_wb_entry **taken;
+    size_t inflight;
+    memcached_st *mc;
+    pthread_t thread;
+    unsigned char running, stop;
+    /* fork generation the writer was started in */
+    unsigned long forks;
+    uint64_t queued, coalesced, dropped, sent, failed, batches;
+} pylibmc_writer;
+
+/* Generations a namespace cache holds before the stale ones are let go. */
+#define PYLIBMC_NS_MAX 4096
+
+/* Namespaces: key prefixes standing for themselves followed by a
+ * generation, kept in a counter key of counter_prefix and the prefix, so
+ * that incrementing it leaves all keys under the prefix behind. gens maps a
+ * prefix to a (fetched at, prefix with generation) tuple, good for ttl
+ * seconds. */
+typedef struct {
+    double ttl;
+    PyObject *counter_prefix;
+    PyObject *gens;
+    unsigned long hits, fetches, bumps;
+} pylibmc_namespaces;
+
+/* How get and get_multi read: through libmemcached, or with the client's
+ * own loop over epoll; see set_read_engine. */
+#define PYLIBMC_ENGINE_LIBMEMCACHED 0
+#define PYLIBMC_ENGINE_EPOLL        1
+
+/* The most iovecs the epoll engine hands to one sendmsg, and how much
+ * input it reads at a time unless a value needs more. */
+#define PYLIBMC_ENGINE_IOV    1024
+#define PYLIBMC_ENGINE_BUFFER 16384
+
+/* One of the connections to a server that the epoll engine and pipelines
+ * use: libmemcached's own, or one of the client's, whose fd it is. depth
+ * is how many keys or commands are written to it and not yet answered, and
+ * peak the most there have been. */
+typedef struct {
+    int fd;
+    size_t depth, peak;
+    unsigned long requests;
+    unsigned long long bytes_out, bytes_in;
+} pylibmc_lane;
+
+/* The connections of set_connections. Each server has nlanes of them:
+ * libmemcached's, then stripes - 1 of the client's own that batches are
+ * striped across, then one for large values if large_value is set. Made
+ * anew after a fork or when the setting changes. */
+typedef struct {
+    unsigned long forks;
+    uint32_t nservers;
+    unsigned int stripes, nlanes;
+    size_t large_value;
+    pylibmc_lane *lanes;
+} pylibmc_lanes;
+
+/* One connection's part of a read by the epoll engine: a single get for
+ * its keys, written from the keys where they are with an iovec each, and
+ * the reply read so far. want is how much input the value being read needs
+ * in all, and done is set once END is read. lane is the connection's
+ * place among its server's; 0 is libmemcached's. */
+typedef struct {
+    int fd;
+    uint32_t server;
+    unsigned int lane;
+    pylibmc_lane *stats;
+    size_t nkeys;
+    memcached_return rc;
+    struct iovec *iov;
+    size_t niov, iov_at;
+    char *in;
+    size_t in_len, in_size, want;
+    int done;
+} pylibmc_engine_conn;
+
+/* Where the epoll engine puts what it reads. Values go one after the
+ * other into slab, each NUL-terminated, instead of a malloc of their own;
+ * the results are pointed into it once all are in. */
+typedef struct {
+    pylibmc_mget_result *results;
+    size_t nresults, max_results;
+    char *slab;
+    size_t slab_len, slab_size;
+} pylibmc_engine_sink;
+
+/* Settings of a cluster that were replaced while calls running without the
+ * GIL could still be using them, kept until those calls are done. kind is
+ * one of PYLIBMC_RETIRED_*, saying what block is. */
+typedef struct pylibmc_retired {
+    int kind;
+    void *block;
+    struct pylibmc_retired *next;
+} pylibmc_retired;
+
+#define PYLIBMC_RETIRED_REPLICAS 0
+#define PYLIBMC_RETIRED_HEDGING  1
+#define PYLIBMC_RETIRED_HOTKEYS  2
+#define PYLIBMC_RETIRED_METRICS  3
+#define PYLIBMC_RETIRED_WRITER   4
+#define PYLIBMC_RETIRED_TRACING  5
+
+/* What a client has in common with its clones: the server list and the
+ * distribution settings. proto is a connectionless copy of the client's
+ * memcached_st that shared clones are materialized from, and whose
+ * continuum they route by; it's made when the first shared clone is, and
+ * never used for I/O or changed. Only touched while holding the GIL. */
+typedef struct {
+    int refcnt;
+    /* Calls of the client and its clones that are running without the GIL,
+     * and the settings replaced meanwhile. Those calls may still be using
+     * them, so they're freed once busy is back to 0. */
+    unsigned int busy;
+    pylibmc_retired *retired;
+    /* Identifies the server list and distribution settings, so that server
+     * lookups cached on key objects can be reused. */
+    unsigned long topology;
+    memcached_st *proto;
+    /* NULL until set_breaker is first called. */
+    pylibmc_breakers *breakers;
+    /* NULL unless set_replicas was called. */
+    pylibmc_replicas *replicas;
+    /* NULL unless set_hedging was called. */
+    pylibmc_hedging *hedging;
+    /* NULL unless set_hot_keys was called. */
+    pylibmc_hotkeys *hotkeys;
+    /* NULL unless set_metrics turned them on. */
+    pylibmc_metrics *metrics;
+    /* NULL unless set_tracing turned it on. */
+    pylibmc_tracing *tracing;
+    /* NULL until incr_buffered or set_counters is first called. */
+    pylibmc_counters *counters;
+    /* NULL until set_async or set_write_behind is first called. */
+    pylibmc_writer *writer;
+    /* NULL unless set_namespaces turned them on. */
+    pylibmc_namespaces *namespaces;
+    /* wire keys longer than key_hash_threshold are cut to key_hash_keep
+     * bytes and their hash, as set by set_key_hashing; 0 is never */
+    size_t key_hash_threshold, key_hash_keep;
+    /* PYLIBMC_ENGINE_*, as set by set_read_engine. */
+    int read_engine;
+    /* connections per server and the large value lane's threshold, as set
+     * by set_connections */
+    unsigned int connections;
+    size_t large_value;
+} pylibmc_cluster;
+
+/* Py_BEGIN_ALLOW_THREADS and Py_END_ALLOW_THREADS for a call of client,
+ * which counts among its cluster's busy calls in between. Settings read
+ * before are read again after, as they may have been replaced. */
+#define PYLIBMC_BEGIN_ALLOW_THREADS(client) { \
+        pylibmc_cluster *_busy_cluster = (client)->cluster; \
+        _busy_cluster->busy++; \
+        Py_BEGIN_ALLOW_THREADS
+#define PYLIBMC_END_ALLOW_THREADS \
+        Py_END_ALLOW_THREADS \
+        _PylibMC_ClusterIdle(_busy_cluster); }
+
+/* A request made with a submit_ method, in the slot its handle names. owed
+ * counts the replies still to come, one per server asked. Requests are made
+ * and answered while holding the GIL, and never block. */
+typedef struct {
+    uint32_t gen;
+    /* -1 while the slot is free */
+    int op;
+    uint32_t owed;
+    memcached_return rc;
+    /* get_multi's wire keys to the keys as given */
+    PyObject *keys;
+    /* what results() gives, filled in as replies come */
+    PyObject *result;
+    /* (type, value, traceback) of a reply that couldn't be unpickled */
+    PyObject *error;
+    /* for the metrics: a set's server and value size */
+    uint32_t server;
+    size_t bytes;
+    double started;
+    /* for a prefetch, how long what it gets is kept; 0 otherwise */
+    double prefetch_ttl;
+    uint32_t next_free;
+} pylibmc_async_req;
+
+/* A connection of the client's own to a server, only for submitted
+ * requests, which speaks the text protocol whatever the client uses. waits
+ * are the slots of the requests written to it, in order. want is how much
+ * input the reply being read needs in all, and since is when it last made
+ * progress on its waits. */
+typedef struct {
+    int fd;
+    int connecting;
+    uint32_t events;
+    char *out;
+    size_t out_len, out_off, out_size;
+    char *in;
+    size_t in_len, in_size, want;
+    uint32_t *waits;
+    size_t wait_head, nwaits, waits_size;
+    double since;
+} pylibmc_async_conn;
+
+/* Submitted requests, and a connection per server for them. Started over
+ * after a fork. */
+typedef struct {
+    /* watches every connection; given out by fileno() */
+    int epfd;
+    unsigned long forks;
+    pylibmc_async_conn *conns;
+    uint32_t nconns;
+    pylibmc_async_req *reqs;
+    uint32_t nreqs;
+    /* free slots, as index + 1 so that 0 terminates */
+    uint32_t free_head;
+    /* handles of requests finished since the last poll() */
+    PyObject *done;
+    /* NULL until the first prefetch. Wire keys to the (expires, value)
+     * that prefetches got, or (expires,) for misses, and wire keys to the
+     * handle of the prefetch on its way for them. */
+    PyObject *prefetched;
+    PyObject *prefetching;
+} pylibmc_async;
+
 typedef struct {
     PyObject_HEAD
+    /* NULL for a shared clone that hasn't been used yet. */
     memcached_st *mc;
+    pylibmc_cluster *cluster;
+    /* The fork generation mc's connections were made in; see
+     * _PylibMC_ClientReady. */
+    unsigned long forks;
+    /* Called with the client once it notices it's been forked. */
+    PyObject *fork_hook;
+    unsigned char fork_connect;
+    /* The call being traced, if any. */
+    pylibmc_span *span;
+    /* Errors of noreply calls, until noreply_errors() takes them. */
+    PyObject *deferred;
+    /* NULL until submitted requests are first used. */
+    pylibmc_async *async;
+    /* NULL unless set_connections asks for more than libmemcached's. */
+    pylibmc_lanes *lanes;
 } PylibMC_Client;
 
+/* The most noreply errors a client keeps; older ones make way. */
+#define PYLIBMC_MAX_DEFERRED 100
+
+/* Outcome of connecting to one server in _PylibMC_ConnectAll. */
+#define PYLIBMC_CONNECT_OK      0
+#define PYLIBMC_CONNECT_ALREADY 1
+#define PYLIBMC_CONNECT_SKIPPED 2
+#define PYLIBMC_CONNECT_FAILED  3
+
+typedef struct {
+    int status;
+    /* errno of a failure */
+    int err;
+    /* seconds taken to connect */
+    double latency;
+} pylibmc_connect;
+
+/* The time budget of a call. libmemcached has no notion of one, so before
+ * each step of the call its poll timeout is capped to what's left. */
+typedef struct {
+    /* _PylibMC_Now() time the budget runs out, or -1 for none */
+    double at;
+    /* the poll_timeout behavior, restored afterwards */
+    int32_t poll_timeout;
+    int expired;
+} pylibmc_deadline;
+
+/* Breaker bookkeeping of a single-key call; server is -1 when breakers are
+ * off. */
+typedef struct {
+    int server;
+    double start;
+} pylibmc_call;
+
 /* {{{ Prototypes */
 static PylibMC_Client *PylibMC_ClientType_new(PyTypeObject *, PyObject *,
         PyObject *);
 static void PylibMC_ClientType_dealloc(PylibMC_Client *);
 static int PylibMC_Client_init(PylibMC_Client *, PyObject *, PyObject *);
-static PyObject *PylibMC_Client_get(PylibMC_Client *, PyObject *arg);
+static PyObject *PylibMC_Client_get(PylibMC_Client *, PyObject *, PyObject *);
 static PyObject *PylibMC_Client_set(PylibMC_Client *, PyObject *, PyObject *);
 static PyObject *PylibMC_Client_replace(PylibMC_Client *, PyObject *, PyObject *);
 static PyObject *PylibMC_Client_add(PylibMC_Client *, PyObject *, PyObject *);
 static PyObject *PylibMC_Client_prepend(PylibMC_Client *, PyObject *, PyObject *);
 static PyObject *PylibMC_Client_append(PylibMC_Client *, PyObject *, PyObject *);
-static PyObject *PylibMC_Client_delete(PylibMC_Client *, PyObject *);
+static PyObject *PylibMC_Client_delete(PylibMC_Client *, PyObject *, PyObject *);
 static PyObject *PylibMC_Client_incr(PylibMC_Client *, PyObject *);
 static PyObject *PylibMC_Client_decr(PylibMC_Client *, PyObject *);
 static PyObject *PylibMC_Client_incr_multi(PylibMC_Client*, PyObject*, PyObject*);
@@ -247,14 +843,224 @@ static PyObject *PylibMC_Client_get_behaviors(PylibMC_Client *);
 static PyObject *PylibMC_Client_set_behaviors(PylibMC_Client *, PyObject *);
 static PyObject *PylibMC_Client_flush_all(PylibMC_Client *, PyObject *, PyObject *);
 static PyObject *PylibMC_Client_disconnect_all(PylibMC_Client *);
-static PyObject *PylibMC_Client_clone(PylibMC_Client *);
+static PyObject *PylibMC_Client_clone(PylibMC_Client *, PyObject *, PyObject *);
+static PyObject *PylibMC_Client_server_for(PylibMC_Client *, PyObject *);
+static PyObject *PylibMC_Client_connect_all(PylibMC_Client *, PyObject *, PyObject *);
+static PyObject *PylibMC_Client_after_fork(PylibMC_Client *, PyObject *, PyObject *);
+static PyObject *PylibMC_Client_set_breaker(PylibMC_Client *, PyObject *, PyObject *);
+static PyObject *PylibMC_Client_breaker_stats(PylibMC_Client *);
+static PyObject *PylibMC_Client_set_replicas(PylibMC_Client *, PyObject *);
+static PyObject *PylibMC_Client_replica_stats(PylibMC_Client *);
+static PyObject *PylibMC_Client_set_hedging(PylibMC_Client *, PyObject *,
+        PyObject *);
+static PyObject *PylibMC_Client_hedge_stats(PylibMC_Client *);
+static PyObject *PylibMC_Client_set_hot_keys(PylibMC_Client *, PyObject *,
+        PyObject *);
+static PyObject *PylibMC_Client_hot_keys(PylibMC_Client *, PyObject *,
+        PyObject *);
+static PyObject *PylibMC_Client_set_metrics(PylibMC_Client *, PyObject *);
+static PyObject *PylibMC_Client_metrics(PylibMC_Client *);
+static PyObject *PylibMC_Client_reset_metrics(PylibMC_Client *);
+static PyObject *PylibMC_Client_metrics_text(PylibMC_Client *);
+static PyObject *PylibMC_Client_set_tracing(PylibMC_Client *, PyObject *,
+        PyObject *);
+static PyObject *PylibMC_Client_traces(PylibMC_Client *);
+static PyObject *PylibMC_Client_set_counters(PylibMC_Client *, PyObject *,
+        PyObject *);
+static PyObject *PylibMC_Client_incr_buffered(PylibMC_Client *, PyObject *);
+static PyObject *PylibMC_Client_flush_counters(PylibMC_Client *);
+static PyObject *PylibMC_Client_counter_stats(PylibMC_Client *);
+static PyObject *PylibMC_Client_set_write_behind(PylibMC_Client *,
+        PyObject *, PyObject *);
+static PyObject *PylibMC_Client_set_async(PylibMC_Client *, PyObject *,
+        PyObject *);
+static PyObject *PylibMC_Client_set_multi_async(PylibMC_Client *,
+        PyObject *, PyObject *);
+static PyObject *PylibMC_Client_flush_write_behind(PylibMC_Client *,
+        PyObject *, PyObject *);
+static PyObject *PylibMC_Client_write_behind_stats(PylibMC_Client *);
+static PyObject *PylibMC_Client_set_namespaces(PylibMC_Client *, PyObject *,
+        PyObject *);
+static PyObject *PylibMC_Client_bump_namespace(PylibMC_Client *,
+        PyObject *);
+static PyObject *PylibMC_Client_namespace_stats(PylibMC_Client *);
+static PyObject *PylibMC_Client_set_key_hashing(PylibMC_Client *,
+        PyObject *, PyObject *);
+static PyObject *PylibMC_Client_pipeline(PylibMC_Client *);
+static PyObject *PylibMC_Client_noreply_errors(PylibMC_Client *);
+static PyObject *PylibMC_Client_submit_get_multi(PylibMC_Client *,
+        PyObject *);
+static PyObject *PylibMC_Client_submit_set(PylibMC_Client *, PyObject *,
+        PyObject *);
+static PyObject *PylibMC_Client_poll(PylibMC_Client *);
+static PyObject *PylibMC_Client_results(PylibMC_Client *, PyObject *);
+static PyObject *PylibMC_Client_fileno(PylibMC_Client *);
+static PyObject *PylibMC_Client_prefetch(PylibMC_Client *, PyObject *,
+        PyObject *);
+static PyObject *PylibMC_Client_set_read_engine(PylibMC_Client *,
+        PyObject *);
+static PyObject *PylibMC_Client_set_connections(PylibMC_Client *,
+        PyObject *, PyObject *);
+static PyObject *PylibMC_Client_connection_stats(PylibMC_Client *);
+static PyObject *PylibMC_Client_set_fork_hook(PylibMC_Client *, PyObject *, PyObject *);
 static PyObject *PylibMC_ErrFromMemcached(PylibMC_Client *, const char *,
         memcached_return);
 static PyObject *_PylibMC_Unpickle(const char *, size_t);
 static PyObject *_PylibMC_Pickle(PyObject *);
 static int _PylibMC_CheckKey(PyObject *);
 static int _PylibMC_CheckKeyStringAndSize(char *, Py_ssize_t);
-static int _PylibMC_SerializeValue(PyObject* key_obj,
+static PyObject *_PylibMC_WireKey(PylibMC_Client *, PyObject *,
+        const char *, Py_ssize_t);
+static PylibMC_Client *_PylibMC_Clone(PylibMC_Client *, int);
+static int _PylibMC_ClientReady(PylibMC_Client *);
+static void _PylibMC_ShareContinuum(memcached_st *, memcached_st *);
+static int _PylibMC_SharesContinuum(PylibMC_Client *);
+static int _PylibMC_OwnContinuum(PylibMC_Client *);
+static int _PylibMC_NewCluster(PylibMC_Client *);
+static void _PylibMC_ReleaseCluster(pylibmc_cluster *);
+static void _PylibMC_ClusterIdle(pylibmc_cluster *);
+static void _PylibMC_Retire(PylibMC_Client *, int, void *);
+static void _PylibMC_FreeRetired(pylibmc_cluster *);
+static void _PylibMC_FreeSettings(int, void *);
+static void _PylibMC_AtForkChild(void);
+static int _PylibMC_AfterFork(PylibMC_Client *, int);
+static void _PylibMC_DropConnections(memcached_st *);
+static void _PylibMC_CloseServer(memcached_server_st *);
+static void _PylibMC_ConnectAll(memcached_st *, double, const unsigned char *,
+        pylibmc_connect *);
+static void _PylibMC_DeadlineStart(memcached_st *, double, pylibmc_deadline *);
+static int _PylibMC_DeadlineArm(memcached_st *, pylibmc_deadline *);
+static int _PylibMC_DeadlineCheck(pylibmc_deadline *);
+static void _PylibMC_DeadlineConnect(memcached_st *, pylibmc_deadline *,
+        char **, size_t *, size_t);
+static unsigned char *_PylibMC_DeadlinePending(memcached_st *);
+static void _PylibMC_DeadlineEnd(memcached_st *, pylibmc_deadline *);
+static PyObject *_PylibMC_DeadlineExceeded(PyObject *, PyObject *);
+static PyObject *_PylibMC_Get(PylibMC_Client *, PyObject *, double);
+static PyObject *_PylibMC_Delete(PylibMC_Client *, PyObject *, unsigned int,
+        bool);
+static void _PylibMC_NoReplyStart(memcached_st *, uint64_t *);
+static memcached_return _PylibMC_NoReplyEnd(memcached_st *, const uint64_t *,
+        memcached_return);
+static int _PylibMC_Defer(PylibMC_Client *);
+static int _PylibMC_StartConnect(const char *, unsigned int,
+        memcached_connection, int *);
+static void _PylibMC_Deadline(double, struct timespec *);
+static int _PylibMC_IsServerFailure(memcached_return);
+static pylibmc_breakers *_PylibMC_Breakers(PylibMC_Client *);
+static int _PylibMC_BreakerAllow(pylibmc_breakers *, uint32_t, double);
+static void _PylibMC_BreakerRecord(pylibmc_breakers *, uint32_t, int, double);
+static int _PylibMC_BreakerOpen(pylibmc_breakers *, uint32_t, double);
+static void _PylibMC_FreeBreakers(pylibmc_breakers *);
+static pylibmc_breakers *_PylibMC_CopyBreakers(PylibMC_Client *,
+        pylibmc_breakers *);
+static void _PylibMC_BreakersAfterFork(pylibmc_breakers *);
+static int _PylibMC_CallStart(PylibMC_Client *, PyObject *, PyObject *,
+        pylibmc_call *);
+static void _PylibMC_CallDone(PylibMC_Client *, pylibmc_call *,
+        memcached_return);
+static PyObject *_PylibMC_ServerDown(PylibMC_Client *, uint32_t);
+static pylibmc_replicas *_PylibMC_Replicas(PylibMC_Client *);
+static int _PylibMC_NewReplicas(PylibMC_Client *, unsigned int);
+static void _PylibMC_FreeReplicas(pylibmc_replicas *);
+static unsigned int _PylibMC_ReplicaWrite(memcached_st *, pylibmc_replicas *,
+        pylibmc_breakers *, uint32_t, _PylibMC_SetByKeyCommand, const char *,
+        size_t, const char *, size_t, time_t, uint32_t, int);
+static void _PylibMC_ReplicaFlush(memcached_st *);
+static size_t _PylibMC_KeySlot(size_t *, size_t, char **, size_t *,
+        const char *, size_t);
+static _PylibMC_SetByKeyCommand _PylibMC_ReplicaCommand(_PylibMC_SetCommand,
+        int);
+static char *_PylibMC_ReplicaGet(memcached_st *, pylibmc_replicas *,
+        pylibmc_breakers *, uint32_t, const char *, size_t, size_t *,
+        uint32_t *, memcached_return *, pylibmc_deadline *);
+static void _PylibMC_ReplicaGetMulti(memcached_st *, pylibmc_replicas *,
+        pylibmc_breakers *, char **, size_t *, size_t, pylibmc_mget_result *,
+        size_t *, pylibmc_deadline *);
+static pylibmc_hedging *_PylibMC_Hedging(PylibMC_Client *);
+static pylibmc_hedging *_PylibMC_NewHedging(double, double, double);
+static void _PylibMC_FreeHedging(pylibmc_hedging *);
+static void _PylibMC_HedgingAfterFork(pylibmc_hedging *);
+static void _PylibMC_HedgeSample(pylibmc_hedging *, double);
+static int _PylibMC_ServerIdle(memcached_server_st *);
+static int _PylibMC_HedgeParse(pylibmc_hedge_read *);
+static int _PylibMC_HedgeRead(pylibmc_hedge_read *);
+static int _PylibMC_HedgedGet(memcached_st *, pylibmc_replicas *,
+        pylibmc_hedging *, pylibmc_breakers *, uint32_t, const char *, size_t,
+        char **, size_t *, uint32_t *, memcached_return *, unsigned int *,
+        pylibmc_deadline *);
+static pylibmc_hotkeys *_PylibMC_HotKeys(PylibMC_Client *);
+static pylibmc_hotkeys *_PylibMC_NewHotKeys(double, uint32_t, uint32_t,
+        unsigned int, double, unsigned int, double, time_t);
+static void _PylibMC_FreeHotKeys(pylibmc_hotkeys *);
+static void _PylibMC_HotKeySample(pylibmc_hotkeys *, memcached_st *,
+        const char *, size_t, size_t);
+static void _PylibMC_HotKeySift(pylibmc_hotkeys *, unsigned int);
+static int _PylibMC_CompareHotKeys(const void *, const void *);
+static uint64_t _PylibMC_HotKeyHash(const char *, size_t);
+static uint32_t _PylibMC_HotRandom(pylibmc_hotkeys *);
+static size_t _PylibMC_HotCopyKey(const char *, size_t, uint32_t, char *);
+static pylibmc_hot_slot *_PylibMC_HotSlot(pylibmc_hotkeys *, const char *,
+        size_t, uint64_t);
+static void _PylibMC_HotPromote(pylibmc_hotkeys *, memcached_st *,
+        const char *, size_t, uint64_t);
+static void _PylibMC_HotRebuild(pylibmc_hotkeys *, memcached_st *);
+static unsigned int _PylibMC_HotLookup(pylibmc_hotkeys *, const char *,
+        size_t, pylibmc_hot_copies *);
+static void _PylibMC_HotFanOut(memcached_st *, const pylibmc_hot_copies *,
+        const char *, size_t, const char *, size_t, time_t, uint32_t,
+        time_t);
+static PyObject *_PylibMC_HotCopyGet(PylibMC_Client *, const char *,
+        size_t, size_t *, double *);
+static pylibmc_metrics *_PylibMC_Metrics(PylibMC_Client *);
+static pylibmc_metrics *_PylibMC_NewMetrics(uint32_t);
+static void _PylibMC_FreeMetrics(pylibmc_metrics *);
+static void _PylibMC_Record(pylibmc_metrics *, int, uint32_t, double, int,
+        size_t, size_t);
+static void _PylibMC_RecordKey(pylibmc_metrics *, int, uint32_t, int,
+        size_t, size_t);
+static void _PylibMC_RecordTime(uint64_t *, double);
+static int _PylibMC_Metered(PylibMC_Client *);
+static void _PylibMC_Meter(PylibMC_Client *, int, uint32_t, double, int,
+        size_t, size_t);
+static void _PylibMC_MeterKey(PylibMC_Client *, int, uint32_t, int,
+        size_t, size_t);
+static void _PylibMC_MeterTime(PylibMC_Client *, int, double);
+static void _PylibMC_MeterGetMulti(PylibMC_Client *, char **, size_t *,
+        size_t, pylibmc_mget_result *, size_t, size_t, bool, double);
+static int _PylibMC_Outcome(memcached_return);
+static int _PylibMC_SetOp(_PylibMC_SetCommand, int);
+static unsigned int _PylibMC_HistBucket(uint64_t);
+static uint64_t _PylibMC_HistUpper(unsigned int);
+static void _PylibMC_LoadMetrics(pylibmc_op_metrics *, pylibmc_op_metrics *);
+static PyObject *_PylibMC_OpMetrics(pylibmc_op_metrics *);
+static int _PylibMC_Printf(char **, size_t *, size_t *, const char *, ...);
+static int _PylibMC_MetricsText(char **, size_t *, size_t *, const char *,
+        const char *, pylibmc_op_metrics *);
+static pylibmc_tracing *_PylibMC_NewTracing(unsigned int, PyObject *,
+        size_t);
+static void _PylibMC_FreeTracing(pylibmc_tracing *);
+static pylibmc_span *_PylibMC_TraceStart(PylibMC_Client *, pylibmc_span *,
+        int, PyObject *);
+static PyObject *_PylibMC_TraceEnd(PylibMC_Client *, pylibmc_span *,
+        PyObject *);
+static void _PylibMC_TraceKey(pylibmc_span *, uint32_t, int, size_t, size_t);
+static PyObject *_PylibMC_SpanObject(PylibMC_Client *, pylibmc_span *);
+static pylibmc_counters *_PylibMC_NewCounters(double, unsigned int);
+static void _PylibMC_FreeCounters(pylibmc_counters *);
+static void _PylibMC_CounterAdd(pylibmc_counters *, const char *, size_t,
+        int64_t);
+static int _PylibMC_CompareCounters(const void *, const void *);
+static Py_ssize_t _PylibMC_FlushCounters(PylibMC_Client *);
+static double _PylibMC_Now(void);
+static int _PylibMC_ParseTimeout(PyObject *, double *);
+static uint32_t _PylibMC_ServerIndex(PylibMC_Client *, PyObject *, PyObject *);
+static int _PylibMC_MapKey(PyObject *, PyObject *, PyObject *);
+static PyObject *_PylibMC_NewKeyMap(PyObject **, size_t, PyObject **, size_t,
+        Py_ssize_t);
+static int _PylibMC_MapStore(PyObject *, PyObject *, PyObject *);
+static int _PylibMC_SerializeValue(PylibMC_Client* self,
+                                   PyObject* key_obj,
                                    PyObject* key_prefix,
                                    PyObject* value_obj,
                                    time_t time,
@@ -267,19 +1073,103 @@ static PyObject *_PylibMC_RunSetCommandMulti(PylibMC_Client* self,
 static bool _PylibMC_RunSetCommand(PylibMC_Client* self,
                                    _PylibMC_SetCommand f, char *fname,
                                    pylibmc_mset* msets, size_t nkeys,
-                                   size_t min_compress);
+                                   size_t min_compress,
+                                   double timeout, size_t *expired_at,
+                                   bool noreply);
 static int _PylibMC_Deflate(char* value, size_t value_len,
                             char** result, size_t *result_len);
-static bool _PylibMC_IncrDecr(PylibMC_Client*, pylibmc_incr*, size_t);
+static int _PylibMC_CompressMset(PylibMC_Client *, pylibmc_mset *,
+        unsigned int);
+static pylibmc_async *_PylibMC_Async(PylibMC_Client *);
+static void _PylibMC_FreeAsync(pylibmc_async *);
+static int _PylibMC_AsyncSlot(pylibmc_async *, int);
+static void _PylibMC_AsyncRelease(pylibmc_async *, uint32_t);
+static int _PylibMC_AsyncConnect(PylibMC_Client *, pylibmc_async *,
+        uint32_t);
+static void _PylibMC_AsyncQueue(PylibMC_Client *, pylibmc_async *, uint32_t,
+        uint32_t, const char *, size_t, const char *, size_t);
+static void _PylibMC_AsyncWatch(pylibmc_async *, uint32_t);
+static void _PylibMC_AsyncAnswered(PylibMC_Client *, pylibmc_async *,
+        uint32_t, memcached_return);
+static void _PylibMC_AsyncFail(PylibMC_Client *, pylibmc_async *, uint32_t,
+        memcached_return);
+static void _PylibMC_AsyncProgress(PylibMC_Client *, pylibmc_async *);
+static void _PylibMC_AsyncWrite(PylibMC_Client *, pylibmc_async *, uint32_t);
+static void _PylibMC_AsyncRead(PylibMC_Client *, pylibmc_async *, uint32_t);
+static int _PylibMC_AsyncParse(PylibMC_Client *, pylibmc_async *, uint32_t);
+static int _PylibMC_AsyncNumber(const char **, const char *,
+        unsigned long long *);
+static void _PylibMC_AsyncError(pylibmc_async_req *);
+static int _PylibMC_AsyncSendGets(PylibMC_Client *, pylibmc_async *,
+        uint32_t);
+static int _PylibMC_AsyncWait(PylibMC_Client *, pylibmc_async *, double);
+static pylibmc_async *_PylibMC_Prefetches(PylibMC_Client *);
+static void _PylibMC_PrefetchDone(pylibmc_async *, uint32_t);
+static int _PylibMC_PrefetchTake(PylibMC_Client *, pylibmc_async *,
+        PyObject *, double, PyObject **);
+static void _PylibMC_PrefetchForget(pylibmc_async *, const char *, size_t);
+static void _PylibMC_PrefetchSweep(pylibmc_async *);
+static pylibmc_writer *_PylibMC_NewWriter(memcached_st *, size_t, int,
+        size_t);
+static void _PylibMC_FreeWriter(pylibmc_writer *);
+static pylibmc_writer *_PylibMC_WriteBehind(PylibMC_Client *);
+static int _PylibMC_StartWriter(pylibmc_writer *);
+static void *_PylibMC_WriterThread(void *);
+static void _PylibMC_WriterForgetHot(PylibMC_Client *, pylibmc_mset *,
+        Py_ssize_t);
+static pylibmc_wb_entry *_PylibMC_WriterEntry(PylibMC_Client *,
+        pylibmc_mset *, unsigned int);
+static int _PylibMC_WriterPush(pylibmc_writer *, pylibmc_wb_entry **,
+        size_t);
+static void _PylibMC_WriterUnlink(pylibmc_writer *, pylibmc_wb_entry *);
+static pylibmc_namespaces *_PylibMC_Namespaces(PylibMC_Client *);
+static pylibmc_namespaces *_PylibMC_NewNamespaces(double, PyObject *);
+static void _PylibMC_FreeNamespaces(pylibmc_namespaces *);
+static PyObject *_PylibMC_NamespaceCounter(pylibmc_namespaces *,
+        PyObject *);
+static int _PylibMC_NamespaceFetch(PylibMC_Client *, PyObject *, int,
+        uint64_t *);
+static PyObject *_PylibMC_NamespaceCache(PylibMC_Client *, PyObject *,
+        uint64_t);
+static PyObject *_PylibMC_NamespacePrefix(PylibMC_Client *, const char *,
+        Py_ssize_t);
+static void _PylibMC_Hash128(const char *, size_t, uint64_t *);
+static PyObject *_PylibMC_HashKey(pylibmc_cluster *, PyObject *);
+static pylibmc_lanes *_PylibMC_Lanes(PylibMC_Client *);
+static void _PylibMC_FreeLanes(pylibmc_lanes *);
+static int _PylibMC_LaneFd(memcached_st *, pylibmc_lanes *, uint32_t,
+        unsigned int);
+static void _PylibMC_LaneSent(pylibmc_lane *, size_t, size_t);
+static int _PylibMC_CompareHashes(const void *, const void *);
+static int _PylibMC_EngineFetch(memcached_st *, pylibmc_lanes *, char **,
+        size_t *, const uint32_t *, size_t, pylibmc_engine_sink *, char **,
+        memcached_return *, pylibmc_deadline *);
+static void _PylibMC_EngineWait(memcached_st *, int, pylibmc_engine_conn *,
+        size_t, size_t, pylibmc_engine_sink *, pylibmc_deadline *);
+static void _PylibMC_EngineWrite(pylibmc_engine_conn *);
+static void _PylibMC_EngineRead(pylibmc_engine_conn *,
+        pylibmc_engine_sink *);
+static void _PylibMC_EngineParse(pylibmc_engine_conn *,
+        pylibmc_engine_sink *);
+static int _PylibMC_EngineKeep(pylibmc_engine_sink *, const char *, size_t,
+        const char *, size_t, uint32_t);
+static void _PylibMC_EngineFail(memcached_st *, pylibmc_engine_conn *,
+        memcached_return);
+static bool _PylibMC_IncrDecr(PylibMC_Client*, pylibmc_incr*, size_t,
+        double, size_t *);
 
 /* }}} */
 
 /* {{{ Type's method table */
 static PyMethodDef PylibMC_ClientType_methods[] = {
-    {"get", (PyCFunction)PylibMC_Client_get, METH_O,
-        "Retrieve a key from a memcached."},
+    {"get", (PyCFunction)PylibMC_Client_get, METH_VARARGS|METH_KEYWORDS,
+        "Retrieve a key from a memcached.\n\n"
+        "Given a timeout in seconds, raises DeadlineExceeded rather than wait "
+        "any longer than that for it."},
     {"set", (PyCFunction)PylibMC_Client_set, METH_VARARGS|METH_KEYWORDS,
-        "Set a key unconditionally."},
+        "Set a key unconditionally.\n\n"
+        "With noreply=True, doesn't wait for the server's reply and gives "
+        "True; errors are kept for noreply_errors() instead of raised."},
     {"replace", (PyCFunction)PylibMC_Client_replace, METH_VARARGS|METH_KEYWORDS,
         "Set a key only if it exists."},
     {"add", (PyCFunction)PylibMC_Client_add, METH_VARARGS|METH_KEYWORDS,
@@ -288,8 +1178,9 @@ static PyMethodDef PylibMC_ClientType_methods[] = {
         "Prepend data to  a key."},
     {"append", (PyCFunction)PylibMC_Client_append, METH_VARARGS|METH_KEYWORDS,
         "Append data to a key."},
-    {"delete", (PyCFunction)PylibMC_Client_delete, METH_VARARGS,
-        "Delete a key."},
+    {"delete", (PyCFunction)PylibMC_Client_delete, METH_VARARGS|METH_KEYWORDS,
+        "Delete a key.\n\n"
+        "Takes noreply=True like set does."},
     {"incr", (PyCFunction)PylibMC_Client_incr, METH_VARARGS,
         "Increment a key by a delta."},
     {"decr", (PyCFunction)PylibMC_Client_decr, METH_VARARGS,
@@ -297,13 +1188,18 @@ static PyMethodDef PylibMC_ClientType_methods[] = {
     {"incr_multi", (PyCFunction)PylibMC_Client_incr_multi, METH_VARARGS|METH_KEYWORDS,
         "Increment more than one key by a delta."},
     {"get_multi", (PyCFunction)PylibMC_Client_get_multi,
-        METH_VARARGS|METH_KEYWORDS, "Get multiple keys at once."},
+        METH_VARARGS|METH_KEYWORDS, "Get multiple keys at once.\n\n"
+        "Given a timeout in seconds, raises DeadlineExceeded once it's up. "
+        "Its keys attribute lists the keys that weren't answered for, its "
+        "partial attribute is the dict of those that were."},
     {"set_multi", (PyCFunction)PylibMC_Client_set_multi,
-        METH_VARARGS|METH_KEYWORDS, "Set multiple keys at once."},
+        METH_VARARGS|METH_KEYWORDS, "Set multiple keys at once.\n\n"
+        "Takes noreply=True like set does, and then gives an empty list."},
     {"add_multi", (PyCFunction)PylibMC_Client_add_multi,
         METH_VARARGS|METH_KEYWORDS, "Add multiple keys at once."},
     {"delete_multi", (PyCFunction)PylibMC_Client_delete_multi,
-        METH_VARARGS|METH_KEYWORDS, "Delete multiple keys at once."},
+        METH_VARARGS|METH_KEYWORDS, "Delete multiple keys at once.\n\n"
+        "Takes noreply=True like set does."},
     {"get_behaviors", (PyCFunction)PylibMC_Client_get_behaviors, METH_NOARGS,
         "Get behaviors dict."},
     {"set_behaviors", (PyCFunction)PylibMC_Client_set_behaviors, METH_O,
@@ -312,9 +1208,205 @@ static PyMethodDef PylibMC_ClientType_methods[] = {
         METH_VARARGS|METH_KEYWORDS, "Flush all data on all servers."},
     {"disconnect_all", (PyCFunction)PylibMC_Client_disconnect_all, METH_NOARGS,
         "Disconnect from all servers and reset own state."},
-    {"clone", (PyCFunction)PylibMC_Client_clone, METH_NOARGS,
+    {"clone", (PyCFunction)PylibMC_Client_clone, METH_VARARGS|METH_KEYWORDS,
         "Clone this client entirely such that it is safe to access from "
-        "another thread. This creates a new connection."},
+        "another thread. This creates a new connection.\n\n"
+        "With shared=True, the clone only copies this client's server list "
+        "on first use, and routes keys by the same continuum."},
+    {"server_for", (PyCFunction)PylibMC_Client_server_for, METH_O,
+        "Name the server a key maps to, as host:port."},
+    {"connect_all", (PyCFunction)PylibMC_Client_connect_all,
+        METH_VARARGS|METH_KEYWORDS,
+        "Connect to every server at once, waiting at most timeout seconds "
+        "(default: the connect_timeout behavior). Returns a list of "
+        "(server, latency, error) with one entry per server."},
+    {"after_fork", (PyCFunction)PylibMC_Client_after_fork,
+        METH_VARARGS|METH_KEYWORDS,
+        "Drop connections inherited from a parent process without closing "
+        "them for the parent, and reconnect to all servers at once if "
+        "connect is true. Clients do this by themselves on their first use "
+        "after a fork."},
+    {"set_fork_hook", (PyCFunction)PylibMC_Client_set_fork_hook,
+        METH_VARARGS|METH_KEYWORDS,
+        "Set a callable to be called with the client after it has dropped "
+        "its inherited connections, and whether to reconnect to all servers "
+        "at once before that."},
+    {"set_breaker", (PyCFunction)PylibMC_Client_set_breaker,
+        METH_VARARGS|METH_KEYWORDS,
+        "Configure per-server circuit breakers, which are shared with "
+        "clones. A breaker opens when at least min_calls calls to its server "
+        "within window seconds saw error_rate of them fail, or slow_rate of "
+        "them take slow_after seconds or more. Calls to it then raise "
+        "ServerDown, or act as misses if fallback is true, until cooldown "
+        "seconds have passed, after which one trial call at a time is let "
+        "through until one succeeds. With probe_interval set, a background "
+        "thread asks every server for its version that often, opening "
+        "breakers of servers that don't answer and half-opening those of "
+        "servers that do."},
+    {"breaker_stats", (PyCFunction)PylibMC_Client_breaker_stats, METH_NOARGS,
+        "State and counters of every server's circuit breaker."},
+    {"set_replicas", (PyCFunction)PylibMC_Client_set_replicas, METH_VARARGS,
+        "Keep copies of every key on the given number of servers besides "
+        "its own, the next ones in the server list. Writes go to all of "
+        "them, and reads that miss or fail on the key's own server are "
+        "tried on its replicas. Shared with clones; 0 turns it off."},
+    {"replica_stats", (PyCFunction)PylibMC_Client_replica_stats, METH_NOARGS,
+        "How many reads the primaries and each replica served, and how many "
+        "replica writes failed."},
+    {"set_hedging", (PyCFunction)PylibMC_Client_set_hedging,
+        METH_VARARGS|METH_KEYWORDS,
+        "Hedge gets on replicated clients: if a key's server hasn't answered "
+        "after seconds, or within the given percentile of its recent "
+        "latencies, ask the first replica too and take whichever answers "
+        "first. At most budget (a share of all gets) are hedged. Shared "
+        "with clones; with neither after nor percentile, turns it off."},
+    {"hedge_stats", (PyCFunction)PylibMC_Client_hedge_stats, METH_NOARGS,
+        "Gets seen, hedges sent and won, and the current threshold."},
+    {"set_hot_keys", (PyCFunction)PylibMC_Client_set_hot_keys,
+        METH_VARARGS|METH_KEYWORDS,
+        "Sample the given share of gets and sets to find the hottest keys, "
+        "counting them in a sketch of depth rows of width counters and "
+        "keeping the top ones. Counts are halved every window seconds. "
+        "With copies, top keys seeing threshold calls a second or more are "
+        "copied to that many other servers for at most ttl seconds, and "
+        "gets are spread over the copies. Shared with clones; a sample of 0 "
+        "turns it off."},
+    {"hot_keys", (PyCFunction)PylibMC_Client_hot_keys,
+        METH_VARARGS|METH_KEYWORDS,
+        "The n hottest keys seen, as (key, server, count, bytes, copies) "
+        "with count and bytes estimated from the sample, hottest first. "
+        "copies lists the keys a hot key is copied to."},
+    {"set_metrics", (PyCFunction)PylibMC_Client_set_metrics, METH_VARARGS,
+        "Turn latency histograms and counters of every operation and "
+        "server on or off. Shared with clones; turning them on anew resets "
+        "them."},
+    {"metrics", (PyCFunction)PylibMC_Client_metrics, METH_NOARGS,
+        "Counters, latency percentiles and histogram buckets of every "
+        "operation and server, and time spent serializing and compressing, "
+        "as a dict. None if metrics are off."},
+    {"reset_metrics", (PyCFunction)PylibMC_Client_reset_metrics,
+        METH_NOARGS, "Zero all metrics."},
+    {"metrics_text", (PyCFunction)PylibMC_Client_metrics_text, METH_NOARGS,
+        "The metrics in the Prometheus text exposition format."},
+    {"set_tracing", (PyCFunction)PylibMC_Client_set_tracing,
+        METH_VARARGS|METH_KEYWORDS,
+        "Trace one in every calls, timing its marshalling, network and "
+        "unmarshalling. Each trace is passed to hook, or kept for traces() "
+        "in a ring of size. Shared with clones; every=0 turns it off."},
+    {"traces", (PyCFunction)PylibMC_Client_traces, METH_NOARGS,
+        "Drain the traces kept, oldest first, as dicts."},
+    {"set_counters", (PyCFunction)PylibMC_Client_set_counters,
+        METH_VARARGS|METH_KEYWORDS,
+        "Flush buffered counters on the first incr_buffered once interval "
+        "seconds have passed since the last flush, or once size of them are "
+        "pending. Flushes what's pending first."},
+    {"incr_buffered", (PyCFunction)PylibMC_Client_incr_buffered,
+        METH_VARARGS,
+        "Add delta to key locally, to be sent with the next flush. Deltas "
+        "may be negative. Counters that don't exist are created at 0."},
+    {"flush_counters", (PyCFunction)PylibMC_Client_flush_counters,
+        METH_NOARGS,
+        "Send the buffered deltas, pipelined. Returns the number of "
+        "counters sent. Nothing flushes on a timer, so call this to have "
+        "deltas sent when incr_buffered isn't being called."},
+    {"counter_stats", (PyCFunction)PylibMC_Client_counter_stats,
+        METH_NOARGS,
+        "Counters pending, and deltas added, flushes and counters sent."},
+    {"set_write_behind", (PyCFunction)PylibMC_Client_set_write_behind,
+        METH_VARARGS|METH_KEYWORDS,
+        "Set up the write-behind queue of set_async: size sets at most, "
+        "sent batch at a time by a thread of its own. policy is what a "
+        "set does when it's full: 'drop' it, 'block' until there's room, "
+        "or 'coalesce', which replaces a set of the same key still "
+        "waiting, and otherwise drops. What's queued is still sent. "
+        "Shared with clones."},
+    {"set_async", (PyCFunction)PylibMC_Client_set_async,
+        METH_VARARGS|METH_KEYWORDS,
+        "Serialize a set and queue it for the write-behind thread, "
+        "without waiting for it to be sent. False if it was dropped. The "
+        "key's hot key copies are deleted rather than brought up to "
+        "date."},
+    {"set_multi_async", (PyCFunction)PylibMC_Client_set_multi_async,
+        METH_VARARGS|METH_KEYWORDS,
+        "set_async of a mapping's items. Gives the keys that were "
+        "dropped."},
+    {"flush_write_behind", (PyCFunction)PylibMC_Client_flush_write_behind,
+        METH_VARARGS|METH_KEYWORDS,
+        "Wait until all that's queued has been sent, or timeout seconds "
+        "have passed. False if it timed out."},
+    {"write_behind_stats", (PyCFunction)PylibMC_Client_write_behind_stats,
+        METH_NOARGS,
+        "Sets waiting, and the most there have been, and sets queued, "
+        "coalesced, dropped, sent and failed, and batches sent."},
+    {"set_namespaces", (PyCFunction)PylibMC_Client_set_namespaces,
+        METH_VARARGS|METH_KEYWORDS,
+        "Turn namespaces on or off. With them on, a key_prefix stands for "
+        "itself followed by its generation, kept in the counter key "
+        "counter_prefix + key_prefix and cached for ttl seconds. Shared "
+        "with clones."},
+    {"bump_namespace", (PyCFunction)PylibMC_Client_bump_namespace,
+        METH_VARARGS,
+        "Increment a key prefix's generation, leaving the keys under it "
+        "behind. Gives the new generation."},
+    {"namespace_stats", (PyCFunction)PylibMC_Client_namespace_stats,
+        METH_NOARGS,
+        "Generations served from the cache, fetched and bumped. None if "
+        "namespaces are off."},
+    {"set_key_hashing", (PyCFunction)PylibMC_Client_set_key_hashing,
+        METH_VARARGS|METH_KEYWORDS,
+        "Send keys longer than threshold bytes, key_prefix included, as "
+        "their first keep bytes followed by the hex of their 128-bit hash. "
+        "Results are given under the keys as passed. Shared with clones; "
+        "a threshold of 0 turns it off."},
+    {"noreply_errors", (PyCFunction)PylibMC_Client_noreply_errors,
+        METH_NOARGS,
+        "Take the exceptions noreply calls would have raised, oldest "
+        "first."},
+    {"submit_get_multi", (PyCFunction)PylibMC_Client_submit_get_multi,
+        METH_O,
+        "Send a get_multi of keys without waiting for it, and give a "
+        "handle for results()."},
+    {"submit_set", (PyCFunction)PylibMC_Client_submit_set,
+        METH_VARARGS|METH_KEYWORDS,
+        "Send a set without waiting for it, and give a handle for "
+        "results()."},
+    {"poll", (PyCFunction)PylibMC_Client_poll, METH_NOARGS,
+        "Send and read what can be without blocking, and give the handles "
+        "of the submitted requests that have finished since the last "
+        "poll()."},
+    {"results", (PyCFunction)PylibMC_Client_results, METH_O,
+        "What a submitted request gave, which is then forgotten, or None "
+        "if it isn't done yet. Raises what the call would have raised."},
+    {"fileno", (PyCFunction)PylibMC_Client_fileno, METH_NOARGS,
+        "A descriptor that's readable whenever poll() has something to "
+        "do, for select, epoll and event loops."},
+    {"prefetch", (PyCFunction)PylibMC_Client_prefetch,
+        METH_VARARGS|METH_KEYWORDS,
+        "Send a get_multi of keys without waiting for it. get and "
+        "get_multi of those keys within ttl seconds are then served from "
+        "what it got, and wait for it only if it hasn't got back yet."},
+    {"set_read_engine", (PyCFunction)PylibMC_Client_set_read_engine,
+        METH_VARARGS,
+        "How get_multi reads, with the text protocol: 'libmemcached' (the "
+        "default), or 'epoll', which writes each server's get in one go "
+        "and reads the replies of all servers at once. get of one key "
+        "always goes through libmemcached. Shared with clones."},
+    {"set_connections", (PyCFunction)PylibMC_Client_set_connections,
+        METH_VARARGS|METH_KEYWORDS,
+        "Use n connections to each server instead of just libmemcached's, "
+        "striping the keys of get_multi (with the epoll read engine) and "
+        "the commands of pipelines across them. With large_value, values "
+        "of that many bytes or more are written over yet another "
+        "connection, so they don't hold up small ones. Shared with "
+        "clones."},
+    {"connection_stats", (PyCFunction)PylibMC_Client_connection_stats,
+        METH_NOARGS,
+        "Requests, bytes and queue depth of every connection of "
+        "set_connections."},
+    {"pipeline", (PyCFunction)PylibMC_Client_pipeline, METH_NOARGS,
+        "A pipeline to queue commands on and send them all at once.\n\n"
+        "Use it as a context manager, which executes it when the with "
+        "block ends without an exception."},
     {NULL, NULL, 0, NULL}
 };
 /* }}} */
@@ -375,4 +1467,723 @@ static PyTypeObject PylibMC_ClientType = {
 
 /* }}} */
 
+/* {{{ _pylibmc.key */
+typedef struct {
+    PyObject_HEAD
+    PyObject *key;
+    PyObject *prefix;
+    /* prefix + key, validated once: this is what goes on the wire. */
+    PyObject *full;
+    /* Server index of full, valid for the client topology it was
+     * computed for (0 meaning not computed yet.) */
+    unsigned long topology;
+    uint32_t server;
+} PylibMC_Key;
+
+#define PylibMC_Key_Check(op) PyObject_TypeCheck(op, &PylibMC_KeyType)
+
+static PyObject *PylibMC_KeyType_new(PyTypeObject *, PyObject *, PyObject *);
+static void PylibMC_KeyType_dealloc(PylibMC_Key *);
+static PyObject *PylibMC_KeyType_repr(PylibMC_Key *);
+static PyObject *PylibMC_KeyType_str(PylibMC_Key *);
+static long PylibMC_KeyType_hash(PylibMC_Key *);
+static PyObject *PylibMC_KeyType_richcompare(PyObject *, PyObject *, int);
+
+static PyMemberDef PylibMC_KeyType_members[] = {
+    {"key", T_OBJECT, offsetof(PylibMC_Key, key), READONLY,
+        "The key as given."},
+    {"key_prefix", T_OBJECT, offsetof(PylibMC_Key, prefix), READONLY,
+        "The prefix the key was built with, if any."},
+    {NULL}
+};
+
+static PyTypeObject PylibMC_KeyType = {
+    PyObject_HEAD_INIT(NULL)
+    0,
+    "key",
+    sizeof(PylibMC_Key),
+    0,
+    (destructor)PylibMC_KeyType_dealloc,
+
+    0,
+    0,
+    0,
+    0,
+    (reprfunc)PylibMC_KeyType_repr,
+
+    0,
+    0,
+    0,
+
+    (hashfunc)PylibMC_KeyType_hash,
+    0,
+    (reprfunc)PylibMC_KeyType_str,
+    0,
+    0,
+    0,
+    Py_TPFLAGS_DEFAULT,
+    "Immutable, pre-validated and optionally prefixed memcached key.\n\n"
+    "Use these in place of str keys for keys that are used over and over:\n"
+    "validation and prefixing is done once, and server lookups are cached.",
+    0,
+    0,
+    (richcmpfunc)PylibMC_KeyType_richcompare,
+    0,
+    0,
+    0,
+    0,
+    PylibMC_KeyType_members,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    (newfunc)PylibMC_KeyType_new,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0
+};
+/* }}} */
+
+/* {{{ _pylibmc.pool */
+typedef struct {
+    PyObject_HEAD
+    PylibMC_Client **slots;
+    uint32_t nslots;
+    /* Free stack of slots: next[i] links slot i to the slot below it, both
+     * stored as index + 1 so that 0 terminates. head carries a generation
+     * count in its upper half so that a compare-and-swap never mistakes a
+     * popped and re-pushed slot for an untouched stack. */
+    uint32_t *next;
+    volatile uint64_t head;
+    unsigned char *busy;
+    /* Only used to sleep on when the stack is empty. */
+    pthread_mutex_t wait_lock;
+    pthread_cond_t wait_cond;
+    volatile uint32_t waiters;
+    /* Statistics, updated atomically. in_use includes a slot that's being
+     * popped; see _PylibMC_PoolPop. */
+    volatile uint32_t in_use;
+    volatile uint32_t high_water;
+    volatile uint64_t acquires;
+    volatile uint64_t waits;
+    volatile uint64_t timeouts;
+    volatile uint64_t wait_usec;
+    volatile uint64_t max_wait_usec;
+} PylibMC_Pool;
+
+static PyObject *PylibMC_PoolType_new(PyTypeObject *, PyObject *, PyObject *);
+static void PylibMC_PoolType_dealloc(PylibMC_Pool *);
+static int PylibMC_Pool_init(PylibMC_Pool *, PyObject *, PyObject *);
+static PyObject *PylibMC_Pool_fill(PylibMC_Pool *, PyObject *, PyObject *);
+static PyObject *PylibMC_Pool_acquire(PylibMC_Pool *, PyObject *, PyObject *);
+static PyObject *PylibMC_Pool_release(PylibMC_Pool *, PyObject *);
+static PyObject *PylibMC_Pool_reserve(PylibMC_Pool *, PyObject *, PyObject *);
+static PyObject *PylibMC_Pool_get(PylibMC_Pool *, PyObject *);
+static PyObject *PylibMC_Pool_set(PylibMC_Pool *, PyObject *, PyObject *);
+static PyObject *PylibMC_Pool_delete(PylibMC_Pool *, PyObject *);
+static PyObject *PylibMC_Pool_incr(PylibMC_Pool *, PyObject *);
+static PyObject *PylibMC_Pool_get_multi(PylibMC_Pool *, PyObject *, PyObject *);
+static PyObject *PylibMC_Pool_set_multi(PylibMC_Pool *, PyObject *, PyObject *);
+static PyObject *PylibMC_Pool_stats(PylibMC_Pool *);
+static Py_ssize_t PylibMC_Pool_len(PylibMC_Pool *);
+static int _PylibMC_PoolAcquire(PylibMC_Pool *, int, double);
+static void _PylibMC_PoolRelease(PyObject *, int);
+
+static PyMethodDef PylibMC_PoolType_methods[] = {
+    {"fill", (PyCFunction)PylibMC_Pool_fill, METH_VARARGS|METH_KEYWORDS,
+        "Add n_slots clones of mc to the pool."},
+    {"acquire", (PyCFunction)PylibMC_Pool_acquire, METH_VARARGS|METH_KEYWORDS,
+        "Take a client out of the pool, waiting at most timeout seconds."},
+    {"release", (PyCFunction)PylibMC_Pool_release, METH_O,
+        "Put an acquired client back into the pool."},
+    {"reserve", (PyCFunction)PylibMC_Pool_reserve, METH_VARARGS|METH_KEYWORDS,
+        "Reserve a client for the duration of a with block."},
+    {"get", (PyCFunction)PylibMC_Pool_get, METH_O,
+        "Retrieve a key using any client in the pool."},
+    {"set", (PyCFunction)PylibMC_Pool_set, METH_VARARGS|METH_KEYWORDS,
+        "Set a key using any client in the pool."},
+    {"delete", (PyCFunction)PylibMC_Pool_delete, METH_VARARGS,
+        "Delete a key using any client in the pool."},
+    {"incr", (PyCFunction)PylibMC_Pool_incr, METH_VARARGS,
+        "Increment a key using any client in the pool."},
+    {"get_multi", (PyCFunction)PylibMC_Pool_get_multi,
+        METH_VARARGS|METH_KEYWORDS,
+        "Get multiple keys using any client in the pool."},
+    {"set_multi", (PyCFunction)PylibMC_Pool_set_multi,
+        METH_VARARGS|METH_KEYWORDS,
+        "Set multiple keys using any client in the pool."},
+    {"stats", (PyCFunction)PylibMC_Pool_stats, METH_NOARGS,
+        "Usage and wait statistics as a dict."},
+    {NULL, NULL, 0, NULL}
+};
+
+static PySequenceMethods PylibMC_Pool_as_sequence = {
+    (lenfunc)PylibMC_Pool_len,
+};
+
+static PyTypeObject PylibMC_PoolType = {
+    PyObject_HEAD_INIT(NULL)
+    0,
+    "pool",
+    sizeof(PylibMC_Pool),
+    0,
+    (destructor)PylibMC_PoolType_dealloc,
+
+    0,
+    0,
+    0,
+    0,
+    0,
+
+    0,
+    &PylibMC_Pool_as_sequence,
+    0,
+
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    "Pool of cloned clients for sharing between threads",
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    PylibMC_PoolType_methods,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    (initproc)PylibMC_Pool_init,
+    0,
+    (newfunc)PylibMC_PoolType_new,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0
+};
+/* }}} */
+
+/* {{{ _pylibmc.thread_mapped_pool */
+typedef struct _pylibmc_thread_client pylibmc_thread_client;
+
+/* What a pool's thread-local slots share with it, so that a thread exiting
+ * as the pool is freed doesn't touch freed memory. Held by the pool and by
+ * every slot, freed by whichever lets go last. Everything in it is only
+ * touched under lock. */
+typedef struct {
+    pthread_mutex_t lock;
+    unsigned int refcnt;
+    /* Clients of exited threads, pushed without the GIL and reaped with. */
+    pylibmc_thread_client *dead;
+    /* set once the pool is gone and has let go of its clients */
+    int closed;
+} pylibmc_thread_home;
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *master;
+    pthread_key_t key;
+    pylibmc_thread_home *home;
+    /* Every thread's client, only touched while holding the GIL. */
+    pylibmc_thread_client *live;
+    uint64_t created;
+    uint64_t reaped;
+} PylibMC_ThreadPool;
+
+/* A thread's client, held by its thread-local slot and by the pool's live
+ * list, and freed when both have let go of it. */
+struct _pylibmc_thread_client {
+    PyObject *client;
+    pylibmc_thread_home *home;
+    int owners;
+    pylibmc_thread_client *prev;
+    pylibmc_thread_client *next;
+    pylibmc_thread_client *dead_next;
+};
+
+static void _PylibMC_ThreadHomeRelease(pylibmc_thread_home *);
+static void _PylibMC_ThreadClientRelease(pylibmc_thread_client *);
+
+static PyObject *PylibMC_ThreadPoolType_new(PyTypeObject *, PyObject *,
+        PyObject *);
+static void PylibMC_ThreadPoolType_dealloc(PylibMC_ThreadPool *);
+static int PylibMC_ThreadPool_init(PylibMC_ThreadPool *, PyObject *,
+        PyObject *);
+static PyObject *PylibMC_ThreadPool_current(PylibMC_ThreadPool *);
+static PyObject *PylibMC_ThreadPool_reserve(PylibMC_ThreadPool *);
+static PyObject *PylibMC_ThreadPool_stats(PylibMC_ThreadPool *);
+
+static PyMethodDef PylibMC_ThreadPoolType_methods[] = {
+    {"current", (PyCFunction)PylibMC_ThreadPool_current, METH_NOARGS,
+        "The calling thread's client, cloned from master on first use."},
+    {"reserve", (PyCFunction)PylibMC_ThreadPool_reserve, METH_NOARGS,
+        "Reserve the calling thread's client for a with block."},
+    {"stats", (PyCFunction)PylibMC_ThreadPool_stats, METH_NOARGS,
+        "Counts of live, created and reaped clients as a dict."},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyMemberDef PylibMC_ThreadPoolType_members[] = {
+    {"master", T_OBJECT, offsetof(PylibMC_ThreadPool, master), READONLY,
+        "The client that per-thread clients are cloned from."},
+    {NULL}
+};
+
+static PyTypeObject PylibMC_ThreadPoolType = {
+    PyObject_HEAD_INIT(NULL)
+    0,
+    "thread_mapped_pool",
+    sizeof(PylibMC_ThreadPool),
+    0,
+    (destructor)PylibMC_ThreadPoolType_dealloc,
+
+    0,
+    0,
+    0,
+    0,
+    0,
+
+    0,
+    0,
+    0,
+
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    "One client per thread, freed when the thread exits",
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    PylibMC_ThreadPoolType_methods,
+    PylibMC_ThreadPoolType_members,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    (initproc)PylibMC_ThreadPool_init,
+    0,
+    (newfunc)PylibMC_ThreadPoolType_new,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0
+};
+/* }}} */
+
+/* {{{ _pylibmc.pipeline */
+/* A command queued on a pipeline. mset has its key, and for the storage
+ * commands its value, flags and time; a delete's time is there too. incr
+ * has an incr or decr's delta and, once run, its result. rc is how it went,
+ * MEMCACHED_BUFFERED while it's waiting for a reply. */
+typedef struct {
+    int op;
+    _PylibMC_SetCommand set_func;
+    pylibmc_mset mset;
+    pylibmc_incr incr;
+    uint32_t server;
+    memcached_return rc;
+} pylibmc_pipe_cmd;
+
+/* The commands of a pipeline for one connection to a server, written as
+ * text protocol requests to it, and answered line by line in the order
+ * they were written. lane is as for pylibmc_engine_conn. rc is what went
+ * wrong with the connection, if anything. */
+typedef struct {
+    int fd;
+    uint32_t server;
+    unsigned int lane;
+    pylibmc_lane *stats;
+    memcached_return rc;
+    char *out;
+    size_t out_len, out_off, out_size;
+    /* indexes of its commands, and how many of them have been answered */
+    size_t *cmds;
+    size_t ncmds, next, cmds_size;
+    char in[1024];
+    size_t in_len;
+} pylibmc_pipe_conn;
+
+typedef struct {
+    PyObject_HEAD
+    PylibMC_Client *client;
+    pylibmc_pipe_cmd *cmds;
+    size_t ncmds, size;
+    /* what the last execute gave */
+    PyObject *results;
+} PylibMC_Pipeline;
+
+static void PylibMC_PipelineType_dealloc(PylibMC_Pipeline *);
+static PyObject *PylibMC_Pipeline_set(PylibMC_Pipeline *, PyObject *,
+        PyObject *);
+static PyObject *PylibMC_Pipeline_add(PylibMC_Pipeline *, PyObject *,
+        PyObject *);
+static PyObject *PylibMC_Pipeline_replace(PylibMC_Pipeline *, PyObject *,
+        PyObject *);
+static PyObject *PylibMC_Pipeline_append(PylibMC_Pipeline *, PyObject *,
+        PyObject *);
+static PyObject *PylibMC_Pipeline_prepend(PylibMC_Pipeline *, PyObject *,
+        PyObject *);
+static PyObject *PylibMC_Pipeline_delete(PylibMC_Pipeline *, PyObject *);
+static PyObject *PylibMC_Pipeline_incr(PylibMC_Pipeline *, PyObject *);
+static PyObject *PylibMC_Pipeline_decr(PylibMC_Pipeline *, PyObject *);
+static PyObject *PylibMC_Pipeline_execute(PylibMC_Pipeline *);
+static PyObject *PylibMC_Pipeline_enter(PylibMC_Pipeline *);
+static PyObject *PylibMC_Pipeline_exit(PylibMC_Pipeline *, PyObject *);
+static Py_ssize_t PylibMC_Pipeline_len(PylibMC_Pipeline *);
+static pylibmc_pipe_cmd *_PylibMC_PipePush(PylibMC_Pipeline *, int);
+static void _PylibMC_PipeClear(PylibMC_Pipeline *);
+static PyObject *_PylibMC_PipeStore(PylibMC_Pipeline *, _PylibMC_SetCommand,
+        PyObject *, PyObject *);
+static PyObject *_PylibMC_PipeKey(PylibMC_Pipeline *, int, PyObject *,
+        time_t, _PylibMC_IncrCommand, unsigned int);
+static PyObject *_PylibMC_PipeExecute(PylibMC_Client *, pylibmc_pipe_cmd *,
+        size_t);
+static void _PylibMC_PipeSend(memcached_st *, pylibmc_lanes *,
+        pylibmc_pipe_cmd *, size_t);
+static void _PylibMC_PipeLanes(pylibmc_lanes *, pylibmc_pipe_cmd *,
+        size_t, unsigned int *);
+static int _PylibMC_PipeEncode(pylibmc_pipe_conn *, pylibmc_pipe_cmd *,
+        size_t);
+static void _PylibMC_PipeFlush(memcached_st *, pylibmc_pipe_conn *, size_t,
+        pylibmc_pipe_cmd *);
+static void _PylibMC_PipeRun(memcached_st *, pylibmc_pipe_conn *, size_t,
+        pylibmc_pipe_cmd *);
+static void _PylibMC_PipeWrite(pylibmc_pipe_conn *);
+static void _PylibMC_PipeRead(pylibmc_pipe_conn *, pylibmc_pipe_cmd *);
+static int _PylibMC_PipeReply(pylibmc_pipe_cmd *, const char *, size_t);
+static void _PylibMC_PipeFail(memcached_st *, pylibmc_pipe_conn *,
+        pylibmc_pipe_cmd *);
+static void _PylibMC_PipeSlow(memcached_st *, pylibmc_pipe_cmd *);
+static void _PylibMC_PipeCopy(memcached_st *, pylibmc_replicas *,
+        pylibmc_breakers *, pylibmc_pipe_cmd *, const pylibmc_hot_copies *,
+        time_t);
+static int _PylibMC_TextKey(const char *, size_t);
+static const char *_PylibMC_PipeName(pylibmc_pipe_cmd *);
+static size_t _PylibMC_CounterSteps(pylibmc_counter *, pylibmc_pipe_cmd *);
+
+static PyMethodDef PylibMC_PipelineType_methods[] = {
+    {"set", (PyCFunction)PylibMC_Pipeline_set, METH_VARARGS|METH_KEYWORDS,
+        "Queue a set."},
+    {"add", (PyCFunction)PylibMC_Pipeline_add, METH_VARARGS|METH_KEYWORDS,
+        "Queue an add."},
+    {"replace", (PyCFunction)PylibMC_Pipeline_replace,
+        METH_VARARGS|METH_KEYWORDS, "Queue a replace."},
+    {"append", (PyCFunction)PylibMC_Pipeline_append,
+        METH_VARARGS|METH_KEYWORDS, "Queue an append."},
+    {"prepend", (PyCFunction)PylibMC_Pipeline_prepend,
+        METH_VARARGS|METH_KEYWORDS, "Queue a prepend."},
+    {"delete", (PyCFunction)PylibMC_Pipeline_delete, METH_VARARGS,
+        "Queue a delete."},
+    {"incr", (PyCFunction)PylibMC_Pipeline_incr, METH_VARARGS,
+        "Queue an increment."},
+    {"decr", (PyCFunction)PylibMC_Pipeline_decr, METH_VARARGS,
+        "Queue a decrement."},
+    {"execute", (PyCFunction)PylibMC_Pipeline_execute, METH_NOARGS,
+        "Send the queued commands and give their results in order.\n\n"
+        "Storage commands and deletes give True or False, incr and decr "
+        "the new value, or None if the key doesn't exist."},
+    {"__enter__", (PyCFunction)PylibMC_Pipeline_enter, METH_NOARGS,
+        "Give the pipeline."},
+    {"__exit__", (PyCFunction)PylibMC_Pipeline_exit, METH_VARARGS,
+        "Execute the pipeline, unless the block raised."},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyMemberDef PylibMC_PipelineType_members[] = {
+    {"results", T_OBJECT, offsetof(PylibMC_Pipeline, results), READONLY,
+        "The results of the last execute, or None."},
+    {NULL}
+};
+
+static PySequenceMethods PylibMC_Pipeline_as_sequence = {
+    (lenfunc)PylibMC_Pipeline_len,
+};
+
+static PyTypeObject PylibMC_PipelineType = {
+    PyObject_HEAD_INIT(NULL)
+    0,
+    "pipeline",
+    sizeof(PylibMC_Pipeline),
+    0,
+    (destructor)PylibMC_PipelineType_dealloc,
+
+    0,
+    0,
+    0,
+    0,
+    0,
+
+    0,
+    &PylibMC_Pipeline_as_sequence,
+    0,
+
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    Py_TPFLAGS_DEFAULT,
+    "Commands queued to be sent at once, as a context manager",
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    PylibMC_PipelineType_methods,
+    PylibMC_PipelineType_members,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0
+};
+/* }}} */
+
+/* {{{ _pylibmc.batcher */
+/* A thread's get in a batch, on its own stack. The batch's leader fills in
+ * the value (malloc'd, or NULL for a miss), flags, rc and server. */
+typedef struct {
+    char *key;
+    size_t key_len;
+    char *value;
+    size_t value_len;
+    uint32_t flags;
+    uint32_t server;
+    memcached_return rc;
+} pylibmc_batch_get;
+
+/* Gets gathered for one mget. The first thread to join leads: it waits for
+ * the window to pass or the batch to fill, sends it and wakes the rest. The
+ * last thread to leave frees it. */
+typedef struct {
+    pylibmc_batch_get **gets;
+    uint32_t n;
+    uint32_t refs;
+    int done;
+    pthread_cond_t cond;
+} pylibmc_batch;
+
+typedef struct {
+    PyObject_HEAD
+    PylibMC_Client *client;
+    double window;
+    unsigned int size;
+    /* Guards open and the statistics; io_lock is held while a batch is
+     * being sent, since batches share the one client. */
+    pthread_mutex_t lock;
+    pthread_mutex_t io_lock;
+    pylibmc_batch *open;
+    uint64_t batches;
+    uint64_t gets;
+    uint64_t full;
+    uint32_t largest;
+} PylibMC_Batcher;
+
+static PyObject *PylibMC_BatcherType_new(PyTypeObject *, PyObject *,
+        PyObject *);
+static void PylibMC_BatcherType_dealloc(PylibMC_Batcher *);
+static int PylibMC_Batcher_init(PylibMC_Batcher *, PyObject *, PyObject *);
+static PyObject *PylibMC_Batcher_get(PylibMC_Batcher *, PyObject *);
+static PyObject *PylibMC_Batcher_stats(PylibMC_Batcher *);
+static void _PylibMC_BatchJoin(PylibMC_Batcher *, pylibmc_batch_get *);
+static void _PylibMC_BatchSend(PylibMC_Batcher *, pylibmc_batch *);
+
+static PyMethodDef PylibMC_BatcherType_methods[] = {
+    {"get", (PyCFunction)PylibMC_Batcher_get, METH_O,
+        "Retrieve a key, batched with other threads' concurrent gets."},
+    {"stats", (PyCFunction)PylibMC_Batcher_stats, METH_NOARGS,
+        "Counts of batches and gets as a dict."},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyMemberDef PylibMC_BatcherType_members[] = {
+    {"client", T_OBJECT, offsetof(PylibMC_Batcher, client), READONLY,
+        "The clone that batches are sent with."},
+    {"window", T_DOUBLE, offsetof(PylibMC_Batcher, window), READONLY,
+        "Seconds a batch waits for more gets before it's sent."},
+    {"size", T_UINT, offsetof(PylibMC_Batcher, size), READONLY,
+        "Gets a batch takes at most; a full batch is sent right away."},
+    {NULL}
+};
+
+static PyTypeObject PylibMC_BatcherType = {
+    PyObject_HEAD_INIT(NULL)
+    0,
+    "batcher",
+    sizeof(PylibMC_Batcher),
+    0,
+    (destructor)PylibMC_BatcherType_dealloc,
+
+    0,
+    0,
+    0,
+    0,
+    0,
+
+    0,
+    0,
+    0,
+
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    "Gets from many threads gathered into one mget",
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    PylibMC_BatcherType_methods,
+    PylibMC_BatcherType_members,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    (initproc)PylibMC_Batcher_init,
+    0,
+    (newfunc)PylibMC_BatcherType_new,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0
+};
+/* }}} */
+
+/* {{{ _pylibmc.reservation */
+/* A client handed out by a pool for the duration of a with block. */
+typedef struct {
+    PyObject_HEAD
+    PyObject *owner;
+    PyObject *client;
+    int slot;
+    void (*release)(PyObject *owner, int slot);
+} PylibMC_Reservation;
+
+static PyObject *_PylibMC_Reserved(PyObject *, PyObject *, int,
+        void (*)(PyObject *, int));
+static void PylibMC_ReservationType_dealloc(PylibMC_Reservation *);
+static PyObject *PylibMC_Reservation_enter(PylibMC_Reservation *);
+static PyObject *PylibMC_Reservation_exit(PylibMC_Reservation *, PyObject *);
+
+static PyMethodDef PylibMC_ReservationType_methods[] = {
+    {"__enter__", (PyCFunction)PylibMC_Reservation_enter, METH_NOARGS,
+        "Give the reserved client."},
+    {"__exit__", (PyCFunction)PylibMC_Reservation_exit, METH_VARARGS,
+        "Give the reserved client back."},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject PylibMC_ReservationType = {
+    PyObject_HEAD_INIT(NULL)
+    0,
+    "reservation",
+    sizeof(PylibMC_Reservation),
+    0,
+    (destructor)PylibMC_ReservationType_dealloc,
+
+    0,
+    0,
+    0,
+    0,
+    0,
+
+    0,
+    0,
+    0,
+
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    Py_TPFLAGS_DEFAULT,
+    "Client reserved from a pool, to be used as a context manager",
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    PylibMC_ReservationType_methods,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0
+};
+/* }}} */
+
 #endif /* def __PYLIBMC_H__ */
@@ -0,0 +1,88 @@
+"""Compares the read engines on a get_multi fanning out to every server,
+and on a get of a single key.
+
+Usage: python bench.py [-n keys] [-r rounds] [-s size] [server ...]
+
+Servers are given as host:port, and default to localhost:11211. The keys are
+set once, then each engine does the same get_multi of all of them in turns,
+and the same get of the first of them, and the latencies are reported per
+engine.
+"""
+
+# Fix up sys.path so as to include the correct build/lib.*/ directory.
+import sys
+from distutils.dist import Distribution
+from distutils.command.build import build
+
+build_cmd = build(Distribution({"ext_modules": True}))
+build_cmd.finalize_options()
+sys.path.insert(0, build_cmd.build_lib)
+
+import time
+from optparse import OptionParser
+
+import pylibmc
+
+engines = ("libmemcached", "epoll")
+
+def percentile(times, p):
+    return times[min(len(times) - 1, int(len(times) * p / 100.0))]
+
+def bench(mc, call, rounds):
+    """Time rounds calls of call per engine, alternating the engines so that
+    neither has the other's warm caches to itself. call is given the engine's
+    name, for its errors."""
+    times = dict((engine, []) for engine in engines)
+    for engine in engines:
+        mc.set_read_engine(engine)
+        call(engine)
+    for i in xrange(rounds):
+        for engine in engines:
+            mc.set_read_engine(engine)
+            start = time.time()
+            call(engine)
+            times[engine].append(time.time() - start)
+    return times
+
+def report(title, times):
+    print title
+    print "%-14s %10s %10s %10s" % ("engine", "median", "p99", "mean")
+    for engine in engines:
+        t = sorted(times[engine])
+        print "%-14s %8.3fms %8.3fms %8.3fms" % (engine,
+            percentile(t, 50) * 1000, percentile(t, 99) * 1000,
+            sum(t) / len(t) * 1000)
+
+def main(argv):
+    parser = OptionParser(usage=__doc__.split("\n\n")[1])
+    parser.add_option("-n", type="int", dest="nkeys", default=1000)
+    parser.add_option("-r", type="int", dest="rounds", default=500)
+    parser.add_option("-s", type="int", dest="size", default=100)
+    options, servers = parser.parse_args(argv)
+
+    mc = pylibmc.Client(servers or ["localhost:11211"])
+    keys = ["bench:%d" % i for i in xrange(options.nkeys)]
+    failed = mc.set_multi(dict((k, "x" * options.size) for k in keys))
+    if failed:
+        raise SystemExit("couldn't set %d keys" % len(failed))
+
+    def get_multi(engine):
+        got = mc.get_multi(keys)
+        if len(got) != len(keys):
+            raise SystemExit("%s got %d of %d keys"
+                             % (engine, len(got), len(keys)))
+
+    def get(engine):
+        if mc.get(keys[0]) is None:
+            raise SystemExit("%s missed %s" % (engine, keys[0]))
+
+    print "%d keys of %d bytes over %d servers, %d rounds" % (
+        options.nkeys, options.size, len(servers or [None]), options.rounds)
+    report("get_multi of every key", bench(mc, get_multi, options.rounds))
+    print
+    report("get of one key", bench(mc, get, options.rounds))
+
+    mc.delete_multi(keys)
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
@@ -56,6 +56,16 @@ Batch operation::
     >>> mc.delete_multi(["cats", "dogs", "bacon"])
     True
 
+Keys that are used over and over can be prepared once::
+
+    >>> hot = pylibmc.Key("hot", key_prefix="app:")
+    >>> mc.set(hot, "stuff")
+    True
+    >>> mc.get(hot)
+    'stuff'
+    >>> mc.get_multi([hot])
+    {Key('hot', key_prefix='app:'): 'stuff'}
+
 Further Reading
 ===============
 
@@ -64,9 +74,8 @@ See http://sendapatch.se/projects/pylibmc/
 
 import _pylibmc
 from warnings import warn
-from Queue import Queue
 
-__all__ = ["hashers", "distributions", "Client"]
+__all__ = ["hashers", "distributions", "Client", "Key"]
 __version__ = _pylibmc.__version__
 support_compression = _pylibmc.support_compression
 
@@ -91,6 +100,8 @@ for name in dir(_pylibmc):
         distributions[key] = value
         distributions_rvs[value] = key
 
+Key = _pylibmc.key
+
 class BehaviorDict(dict):
     def __init__(self, client, *args, **kwds):
         super(BehaviorDict, self).__init__(*args, **kwds)
@@ -176,16 +187,16 @@ class Client(_pylibmc.client):
     def behaviours(self):
         raise AttributeError("nobody uses british spellings")
 
-from contextlib import contextmanager
-
-class ClientPool(Queue):
+class ClientPool(_pylibmc.pool):
     """Client pooling helper.
 
     This is mostly useful in threaded environments, because a client isn't
     thread-safe at all. Instead, what you want to do is have each thread use
     its own client, but you don't want to reconnect these all the time.
 
-    The solution is a pool, and this class is a helper for that.
+    The solution is a pool, and this class is a helper for that. The pool
+    itself lives in C; reserving and giving back clients doesn't take any
+    locks unless a thread has to wait for a client to become available.
 
     >>> mc = Client(["127.0.0.1"])
     >>> pool = ClientPool()
@@ -196,40 +207,33 @@ class ClientPool(Queue):
     ... 
     True
     True
-    """
 
-    def __init__(self, mc=None, n_slots=None):
-        Queue.__init__(self, n_slots)
-        if mc is not None:
-            self.fill(mc, n_slots)
+    If *timeout* is given to `reserve`, it specifies how long to wait for a
+    client to become available before raising `Queue.Empty`.
 
-    @contextmanager
-    def reserve(self, timeout=None):
-        """Context manager for reserving a client from the pool.
+    Single operations can borrow a client for just the one call:
 
-        If *timeout* is given, it specifiecs how long to wait for a client to
-        become available.
-        """
-        mc = self.get(True, timeout=timeout)
-        try:
-            yield mc
-        finally:
-            self.put(mc)
-
-    def fill(self, mc, n_slots):
-        """Fill *n_slots* of the pool with clones of *mc*."""
-        for i in xrange(n_slots):
-            self.put(mc.clone())
-
-class ThreadMappedPool(dict):
+    >>> pool.set("hi", "ho")
+    True
+    >>> pool.get("hi")
+    'ho'
+    >>> pool.delete("hi")
+    True
+    >>> stats = pool.stats()
+    >>> stats["size"], stats["in_use"]
+    (4, 0)
+    """
+
+class ThreadMappedPool(_pylibmc.thread_mapped_pool):
     """Much like the *ClientPool*, helps you with pooling.
 
     In a threaded environment, you'd most likely want to have a client per
     thread. And there'd be no harm in one thread keeping the same client at all
     times. So, why not map threads to clients? That's what this class does.
 
-    If a client is reserved, this class checks for a key based on the current
-    thread, and if none exists, clones the master client and inserts that key.
+    If a client is reserved, this class checks for the current thread's client
+    in thread-local storage, and if none exists, clones the master client.
+    When a thread exits, its client is disconnected and freed.
 
     >>> mc = Client(["127.0.0.1"])
     >>> pool = ThreadMappedPool(mc)
@@ -239,35 +243,35 @@ class ThreadMappedPool(dict):
     ... 
     True
     True
-    """
 
-    def __new__(cls, master):
-        return super(ThreadMappedPool, cls).__new__(cls)
+    The current thread's client can also be had directly:
 
-    def __init__(self, master):
-        self.master = master
+    >>> pool.current() is pool.current()
+    True
+    """
 
-    @contextmanager
-    def reserve(self):
-        """Reserve a client.
+class BatchingClient(_pylibmc.batcher):
+    """Gathers the gets of many threads into one request.
 
-        Creates a new client based on the master client if none exists for the
-        current thread.
-        """
-        key = thread.get_ident()
-        mc = self.pop(key, None)
-        if mc is None:
-            mc = self.master.clone()
-        try:
-            yield mc
-        finally:
-            self[key] = mc
-
-# This makes sure ThreadMappedPool doesn't exist with non-thread Pythons.
-try:
-    import thread
-except ImportError:
-    del ThreadMappedPool
+    Threads that each `get` a single key at about the same time cost a round
+    trip apiece. Given to all of them instead, a batching client holds the
+    first get of a batch back for at most *window* seconds, or until *size*
+    gets have joined it, and then sends them all as one multi-get over a
+    clone of *mc*. Every thread waits without the GIL and gets its own
+    value back.
+
+    >>> mc = Client(["127.0.0.1"])
+    >>> mc.set("hi", "ho")
+    True
+    >>> batcher = BatchingClient(mc, window=0.0005, size=16)
+    >>> batcher.get("hi")
+    'ho'
+    >>> batcher.get("missing") is None
+    True
+    >>> stats = batcher.stats()
+    >>> stats["gets"], stats["batches"]
+    (2L, 2L)
+    """
 
 if __name__ == "__main__":
     import doctest
@@ -102,6 +102,43 @@ This didn't use to work, but now it does.
 >>> c.get_multi([])
 {}
 
+Prepared keys work everywhere a str key does.
+>>> k = _pylibmc.key("prepared", key_prefix="test_")
+>>> str(k), k.key, k.key_prefix
+('test_prepared', 'prepared', 'test_')
+>>> k == _pylibmc.key("test_prepared")
+True
+>>> c.set(k, "hello")
+True
+>>> c.get("test_prepared")
+'hello'
+>>> c.get(k)
+'hello'
+>>> r = c.get_multi([k, "prepared"], key_prefix="test_")
+>>> r[k], r["prepared"]
+('hello', 'hello')
+>>> sorted(c.get_multi(["test_prepared", k]).values())
+['hello', 'hello']
+>>> c.set_multi({k: 1})
+[]
+>>> c.incr(k)
+2L
+>>> c.incr_multi([k], delta=2)
+>>> c.get(k)
+4
+>>> c.server_for(k) == c.server_for("test_prepared") == "localhost:11211"
+True
+>>> c.delete_multi([k])
+True
+>>> _pylibmc.key("x" * 300)
+Traceback (most recent call last):
+  ...
+ValueError: key too long, max is 251
+>>> _pylibmc.key(1)
+Traceback (most recent call last):
+  ...
+TypeError: key must be an instance of str
+
 Getting stats is fun!
 >>> for (svr, stats) in c.get_stats():
 ...     print svr
@@ -157,6 +194,45 @@ True
 True
 >>> del c2
 
+Shared clones set up their own connection on first use, and don't see
+behavior changes made after they were cloned.
+>>> c2 = c.clone(shared=True)
+>>> c2.set("test", "shared")
+True
+>>> c.get("test")
+'shared'
+>>> c2.server_for("test") == c.server_for("test")
+True
+>>> c3 = c2.clone(shared=True)
+>>> c3.get("test")
+'shared'
+>>> c.set_behaviors({"tcp_nodelay": 1})
+>>> c.clone(shared=True).get_behaviors()["tcp_nodelay"]
+1
+>>> c3.get_behaviors()["tcp_nodelay"]
+0
+>>> c.set_behaviors({"tcp_nodelay": 0})
+>>> c3.delete("test")
+True
+>>> del c2, c3
+
+With consistent hashing, shared clones route by one continuum until one of
+them changes its behaviors.
+>>> kc = _pylibmc.client([test_server])
+>>> kc.set_behaviors({"ketama": 1})
+>>> k2, k3 = kc.clone(shared=True), kc.clone(shared=True)
+>>> k2.set("test", "ketama")
+True
+>>> k3.get("test")
+'ketama'
+>>> k2.set_behaviors({"ketama": 0})
+>>> del k2
+>>> k3.get("test")
+'ketama'
+>>> k3.delete("test")
+True
+>>> del kc, k3
+
 Per-error exceptions
 >>> c.incr("test")
 Traceback (most recent call last):
@@ -206,6 +282,781 @@ NotFound: error 16 from memcached_increment: NOT FOUND
 >>> c.delete('xa')
 True
 
+Pools hand out clones and take them back.
+>>> pool = _pylibmc.pool(c, 2)
+>>> len(pool)
+2
+>>> a = pool.acquire()
+>>> b = pool.acquire()
+>>> pool.acquire(block=False)
+Traceback (most recent call last):
+  ...
+Empty
+>>> pool.acquire(timeout=0.01)
+Traceback (most recent call last):
+  ...
+Empty
+>>> pool.release(b)
+>>> pool.release(b)
+Traceback (most recent call last):
+  ...
+ValueError: client isn't reserved from this pool
+>>> with pool.reserve() as r:
+...     r is b
+True
+>>> pool.release(a)
+>>> s = pool.stats()
+>>> s["size"], s["in_use"], s["high_water"], s["timeouts"]
+(2, 0, 2, 2)
+>>> pool.set("pooled", "yes")
+True
+>>> pool.get_multi(["pooled"])
+{'pooled': 'yes'}
+>>> pool.delete("pooled")
+True
+
+Thread-mapped pools clone once per thread and clean up after dead threads.
+>>> import threading
+>>> tpool = _pylibmc.thread_mapped_pool(c)
+>>> tpool.master is c
+True
+>>> mine = tpool.current()
+>>> mine is tpool.current() and mine is not c
+True
+>>> seen = []
+>>> def worker():
+...     with tpool.reserve() as twc:
+...         seen.append(twc)
+>>> for i in range(3):
+...     t = threading.Thread(target=worker)
+...     t.start()
+...     t.join()
+>>> len(set(map(id, seen))) <= 3 and mine not in seen
+True
+>>> del seen[:]
+>>> s = tpool.stats()
+>>> s["created"], s["reaped"] <= 3, s["live"] + s["reaped"]
+(4L, True, 4L)
+
+Batchers send the gets of concurrent threads as one mget.
+>>> c.set_multi({"bt1": "one", "bt2": 2})
+[]
+>>> bt = _pylibmc.batcher(c, window=0.05, size=4)
+>>> bt.client is not c, bt.size
+(True, 4)
+>>> got = {}
+>>> def batched(key):
+...     got[key] = bt.get(key)
+>>> ts = [threading.Thread(target=batched, args=(k,))
+...       for k in ("bt1", "bt2", "bt1", "btmissing")]
+>>> for t in ts:
+...     t.start()
+>>> for t in ts:
+...     t.join()
+>>> sorted(got.items())
+[('bt1', 'one'), ('bt2', 2), ('btmissing', None)]
+>>> s = bt.stats()
+>>> s["gets"], s["batches"] < 4, s["largest"] > 1
+(4L, True, True)
+>>> bt.get("")
+>>> _pylibmc.batcher(c, size=0)
+Traceback (most recent call last):
+  ...
+ValueError: size must be at least 1
+>>> c.delete_multi(["bt1", "bt2"])
+True
+>>> del bt, got, ts
+
+Forked children get connections of their own, and leave their parent's alone.
+>>> import os
+>>> c.set("forked", "parent")
+True
+>>> r, w = os.pipe()
+>>> def warm(mc):
+...     n = os.write(w, "warm ")
+>>> c.set_fork_hook(warm, connect=True)
+>>> pid = os.fork()
+>>> if not pid:
+...     n = os.write(w, repr(c.get("forked")))
+...     os._exit(0)
+>>> os.waitpid(pid, 0)[1]
+0
+>>> os.read(r, 100)
+"warm 'parent'"
+>>> c.get("forked")
+'parent'
+>>> c.set_fork_hook(None)
+>>> c.after_fork(connect=True)
+>>> c.delete("forked")
+True
+>>> os.close(r); os.close(w)
+
+Connecting up front, to all servers at once.
+>>> mc = _pylibmc.client([test_server])
+>>> [(name, latency >= 0, error) for (name, latency, error) in mc.connect_all(1)]
+[('localhost:11211', True, None)]
+>>> mc.get("forked")
+>>> mc.connect_all()[0][2] is None
+True
+>>> mc = _pylibmc.client([(_pylibmc.server_type_tcp, "127.0.0.1", 1)])
+>>> mc.connect_all(0.5)
+[('127.0.0.1:1', None, 'Connection refused')]
+>>> mc.connect_all(-1)
+Traceback (most recent call last):
+  ...
+ValueError: timeout must not be negative
+
+Circuit breakers stop calling servers that keep failing.
+>>> mc.breaker_stats()
+[]
+>>> def fail_twice():
+...     for i in range(2):
+...         try:
+...             mc.get("x")
+...         except _pylibmc.MemcachedError:
+...             pass
+>>> mc.set_breaker(min_calls=2, cooldown=60)
+>>> fail_twice()
+>>> mc.get("x")
+Traceback (most recent call last):
+  ...
+ServerDown: server 127.0.0.1:1 is down
+>>> mc.get_multi(["x", "y"])
+Traceback (most recent call last):
+  ...
+ServerDown: server 127.0.0.1:1 is down
+>>> [(s["state"], s["trips"], s["rejected"]) for s in mc.breaker_stats()]
+[('open', 1L, 2L)]
+>>> mc.set_breaker(min_calls=2, cooldown=60, fallback=True)
+>>> fail_twice()
+>>> mc.get("x"), mc.set("x", 1), mc.delete("x"), mc.incr("x")
+(None, False, False, None)
+>>> mc.get_multi(["x", "y"])
+{}
+>>> mc.clone().breaker_stats()[0]["state"]
+'open'
+>>> mc.set_breaker(min_calls=2, cooldown=0)
+>>> fail_twice()
+>>> mc.breaker_stats()[0]["state"]
+'open'
+>>> mc.set_breaker(min_calls=2, cooldown=60)
+>>> mc.set_behaviors({"tcp_nodelay": 1})
+>>> mc.breaker_stats()[0]["state"]
+'closed'
+>>> fail_twice()
+>>> mc.get("x")
+Traceback (most recent call last):
+  ...
+ServerDown: server 127.0.0.1:1 is down
+>>> del mc
+
+Probes run in the background.
+>>> c.set_breaker(probe_interval=0.05)
+>>> sleep(0.3)
+>>> [(s["state"], s["probe"]) for s in c.breaker_stats()]
+[('closed', True)]
+>>> c.set_breaker(enabled=False)
+
+Calls can be given a timeout, after which they give up.
+>>> c.set_multi({"dl1": 1, "dl2": 2}, timeout=1)
+[]
+>>> c.get("dl1", timeout=1), c.get(key="dl2")
+(1, 2)
+>>> c.get_multi(["dl1", "dl2"], timeout=1) == {"dl1": 1, "dl2": 2}
+True
+>>> c.get("dl1", timeout=0)
+Traceback (most recent call last):
+  ...
+DeadlineExceeded: deadline exceeded
+>>> def unserved(f, *a, **kw):
+...     try:
+...         f(*a, **kw)
+...     except _pylibmc.DeadlineExceeded, e:
+...         return sorted(e.keys), e.partial
+>>> unserved(c.get_multi, ["dl1", "dl2"], timeout=0)
+(['dl1', 'dl2'], {})
+>>> unserved(c.set_multi, {"dl1": 3}, timeout=0)
+(['dl1'], [])
+>>> unserved(c.incr_multi, ["dl1", "dl2"], timeout=0)
+(['dl1', 'dl2'], None)
+>>> unserved(c.delete_multi, ["dl1", "dl2"], timeout=0)
+(['dl1', 'dl2'], None)
+>>> c.get("dl1")
+1
+>>> c.get_multi(["dl1", "dl2"], timeout=-1)
+Traceback (most recent call last):
+  ...
+ValueError: timeout must not be negative
+>>> c.delete_multi(["dl1", "dl2", "dl3"], timeout=1)
+False
+>>> c.delete_multi({"dl1": 1})
+Traceback (most recent call last):
+  ...
+TypeError: keys must be a sequence, not a mapping
+
+Replicas keep copies of keys on other servers, here one that's down.
+>>> rc = _pylibmc.client([test_server, (_pylibmc.server_type_tcp, "127.0.0.1", 1)])
+>>> rc.set_replicas(2)
+Traceback (most recent call last):
+  ...
+ValueError: can't keep 2 replicas with 2 servers
+>>> rc.set_replicas(1)
+>>> keys = ["replica%d" % i for i in range(20)]
+>>> rc.set_multi(dict((k, k) for k in keys))
+[]
+>>> rc.get_multi(keys) == dict((k, k) for k in keys)
+True
+>>> [rc.get(k) for k in keys] == keys
+True
+>>> s = rc.replica_stats()
+>>> s["replicas"], s["served"][0] > 0, s["served"][1] > 0, sum(s["served"])
+(1, True, True, 40L)
+>>> s["write_errors"] > 0
+True
+
+A write the down server can't take only goes through if a replica stores it,
+which an add of a key the replica has doesn't.
+>>> def added(k):
+...     try:
+...         return rc.add(k, "again")
+...     except _pylibmc.MemcachedError:
+...         return False
+>>> [k for k in keys if added(k)]
+[]
+>>> rc.set_behaviors({"tcp_nodelay": 1})
+>>> rc.clone().replica_stats()["replicas"]
+1
+>>> rc.delete_multi(keys)
+True
+>>> rc.get_multi(keys)
+{}
+>>> rc2 = rc.clone()
+>>> rc.set_replicas(0)
+>>> rc.replica_stats()["replicas"], rc2.replica_stats()["replicas"]
+(0, 0)
+>>> del rc2
+>>> del rc
+
+Hedged gets ask a replica too when the primary is slow to answer. Here
+both are the same server, so either answer will do.
+>>> hc = _pylibmc.client([test_server, test_server])
+>>> hc.set_replicas(1)
+>>> hc.set_hedging(after=0.000001, budget=1)
+>>> hc.set("hedged", "yes")
+True
+>>> hc.connect_all()[0][2] is None
+True
+>>> [hc.get("hedged") for i in range(20)] == ["yes"] * 20
+True
+>>> s = hc.hedge_stats()
+>>> s["hedged"] > 0, s["won"] <= s["hedged"] <= s["gets"]
+(True, True)
+>>> hc.set_hedging(percentile=90)
+>>> hc.hedge_stats()["threshold"]
+0.0
+>>> [hc.get("hedged") for i in range(40)] == ["yes"] * 40
+True
+>>> hc.hedge_stats()["threshold"] > 0
+True
+>>> hc.set_hedging(percentile=100)
+Traceback (most recent call last):
+  ...
+ValueError: after must not be negative, and percentile within [0, 100)
+>>> hc2 = hc.clone()
+>>> hc.set_hedging()
+>>> hc.hedge_stats()["threshold"], hc2.hedge_stats()["threshold"]
+(None, None)
+>>> del hc2
+>>> hc.delete("hedged")
+True
+>>> del hc
+
+Hot keys are found by sampling gets and sets; sampling all of them, the
+counts are exact.
+>>> hk = _pylibmc.client([test_server])
+>>> hk.hot_keys()
+[]
+>>> hk.set_hot_keys(sample=1, top=4)
+>>> hk.set("hot", "x" * 10)
+True
+>>> [hk.get("hot") for i in range(50)] == ["x" * 10] * 50
+True
+>>> hk.set_multi({"warm": "abc"})
+[]
+>>> hk.get_multi(["warm", "cold"])
+{'warm': 'abc'}
+>>> hk.get("cold")
+>>> [(k, c, b) for (k, s, c, b, copies) in hk.hot_keys(2)]
+[('hot', 51L, 510L), ('warm', 2L, 6L)]
+>>> hk.hot_keys()[0][1] == "%s:%d" % test_server[1:]
+True
+>>> hk.set_hot_keys(sample=2)
+Traceback (most recent call last):
+  ...
+ValueError: sample must be within [0, 1]
+>>> hk2 = hk.clone()
+>>> hk.set_hot_keys(sample=0)
+>>> hk.hot_keys(), hk2.hot_keys()
+([], [])
+>>> del hk2
+>>> hk.delete_multi(["hot", "warm"])
+True
+>>> del hk
+
+Keys hot enough get copies on other servers, which gets are spread over.
+Copies that are missing when read are refilled from the key's own server,
+and writes and deletes go to them too. Here both servers are the same.
+>>> hk = _pylibmc.client([test_server, test_server])
+>>> plain = _pylibmc.client([test_server])
+>>> hk.set_hot_keys(sample=1, copies=1, threshold=0.001)
+>>> hk.set("hot", "x")
+True
+>>> copies = hk.hot_keys(1)[0][4]
+>>> copies
+['hot:hot:0']
+>>> [hk.get("hot") for i in range(20)] == ["x"] * 20
+True
+>>> plain.get(copies[0])
+'x'
+>>> hk.set("hot", "y")
+True
+>>> plain.get(copies[0])
+'y'
+
+Sets queued with set_async drop the copies instead, as the queue's thread
+doesn't write to them.
+>>> hk.set_async("hot", "w")
+True
+>>> plain.get(copies[0])
+>>> hk.flush_write_behind(timeout=5)
+True
+>>> hk.get("hot")
+'w'
+>>> hk.append("hot", "z")
+True
+>>> plain.get(copies[0])
+>>> hk.delete("hot")
+True
+>>> hk.get("hot")
+>>> hk.set_hot_keys(copies=9)
+Traceback (most recent call last):
+  ...
+ValueError: copies must be at most 8, threshold not negative, and ttl positive
+>>> del hk, plain
+
+Metrics count calls, hits and misses per operation and server, with
+latency histograms.
+>>> mc = _pylibmc.client([test_server])
+>>> mc.metrics()
+>>> mc.set_metrics()
+>>> mc.set("metered", "abc")
+True
+>>> mc.get("metered")
+'abc'
+>>> mc.get("unmetered")
+>>> mc.get_multi(["metered", "unmetered"])
+{'metered': 'abc'}
+>>> m = mc.metrics()
+>>> g = m["ops"]["get"]
+>>> (g["calls"], g["hits"], g["misses"], g["errors"], g["bytes_in"])
+(2L, 1L, 1L, 0L, 3L)
+>>> g["latency"]["count"] == g["calls"]
+True
+>>> g["latency"]["p50"] <= g["latency"]["max"]
+True
+>>> (m["ops"]["get_multi"]["hits"], m["ops"]["get_multi"]["misses"])
+(1L, 1L)
+>>> (m["ops"]["set"]["calls"], m["servers"][0]["calls"])
+(1L, 5L)
+>>> 'pylibmc_calls_total{op="get"} 2' in mc.metrics_text()
+True
+>>> mc.reset_metrics()
+>>> mc.metrics()["ops"]["get"]["calls"]
+0L
+>>> mc2 = mc.clone()
+>>> mc.set_metrics(False)
+>>> mc.metrics(), mc2.metrics()
+(None, None)
+>>> del mc2
+>>> mc.delete("metered")
+True
+>>> del mc
+
+Tracing samples one in every so many calls, and keeps them until drained,
+or hands them to a hook.
+>>> tc = _pylibmc.client([test_server])
+>>> tc.traces()
+[]
+>>> tc.set_tracing(every=2)
+>>> [tc.set("traced", str(i)) for i in range(4)]
+[True, True, True, True]
+>>> tc.get("traced")
+'3'
+>>> ts = tc.traces()
+>>> [(t["op"], t["key"], t["hits"]) for t in ts]
+[('set', 'traced', 1L), ('set', 'traced', 1L), ('get', 'traced', 1L)]
+>>> ts[-1]["server"] == "%s:%d" % test_server[1:]
+True
+>>> t = ts[-1]
+>>> abs(t["marshal"] + t["network"] + t["unmarshal"] - t["seconds"]) < 1e-6
+True
+>>> tc.traces()
+[]
+>>> seen = []
+>>> tc.set_tracing(every=1, hook=seen.append)
+>>> tc.get_multi(["traced", "untraced"])
+{'traced': '3'}
+>>> [(t["op"], t["key"], t["keys"], t["hits"], t["misses"]) for t in seen]
+[('get_multi', None, 2L, 1L, 1L)]
+>>> tc.traces()
+[]
+>>> tc.set_tracing(hook=1)
+Traceback (most recent call last):
+  ...
+TypeError: hook must be callable
+>>> tc.set_tracing(every=0)
+>>> tc.delete("traced")
+True
+>>> seen[1:]
+[]
+
+A hook may change the tracing it's called from, here through a clone.
+>>> tc2 = tc.clone()
+>>> def once(trace):
+...     seen.append(trace["op"])
+...     tc2.set_tracing(every=0)
+>>> tc.set_tracing(every=1, hook=once)
+>>> tc.get("traced")
+>>> tc.get("traced")
+>>> seen[1:]
+['get']
+>>> del tc, tc2, seen, once
+
+Buffered counters add up locally, and are sent one increment per counter
+when flushed.
+>>> bc = _pylibmc.client([test_server])
+>>> bc.set_counters(interval=0, size=2)
+>>> bc.set("clicks", 10)
+True
+>>> bc.set("views", 10)
+True
+>>> for i in range(100):
+...     bc.incr_buffered("clicks")
+>>> bc.incr_buffered("clicks", -20)
+>>> bc.get("clicks")
+10
+>>> bc.counter_stats()["pending"]
+1
+>>> bc.flush_counters()
+1
+>>> bc.get("clicks")
+90
+>>> bc.incr_buffered("clicks", 5)
+>>> bc.incr_buffered("views", 5)
+>>> (bc.get("clicks"), bc.get("views"))
+(95, 15)
+>>> sorted(bc.counter_stats().items())
+[('events', 103L), ('flushes', 2L), ('pending', 0), ('sent', 3L)]
+>>> bc.set_counters(size=0)
+Traceback (most recent call last):
+  ...
+ValueError: interval must not be negative, and size within [1, 2**20]
+>>> bc.incr_buffered("fresh", 3)
+>>> bc.incr_buffered("fresher", -3)
+>>> bc.flush_counters()
+2
+>>> bc.get("fresh"), bc.get("fresher")
+(3, 0)
+>>> bc.delete_multi(["clicks", "views", "fresh", "fresher"])
+True
+>>> del bc
+
+Pipelines queue commands, send them all at once and give their results in
+order when the with block ends.
+>>> pc = _pylibmc.client([test_server])
+>>> pc.set("pn", 1)
+True
+>>> with pc.pipeline() as p:
+...     p.set("pa", "x")
+...     p.add("pa", "y")
+...     p.append("pa", "z")
+...     p.incr("pn", 5)
+...     p.decr("pn")
+...     p.delete("pa")
+...     p.delete("pa")
+...     p.incr("pmissing")
+...     len(p)
+8
+>>> p.results
+[True, False, True, 6L, 5L, True, False, None]
+>>> pc.get("pn")
+5
+>>> len(p)
+0
+>>> p.set("pb", "y" * 1000)
+>>> p.execute()
+[True]
+>>> pc.get("pb") == "y" * 1000
+True
+>>> try:
+...     with pc.pipeline() as p:
+...         p.set("pc", 1)
+...         raise ValueError
+... except ValueError:
+...     pass
+>>> pc.get("pc") is None
+True
+
+Commands libmemcached has to send itself, like those whose key has a byte
+the text protocol can't carry, keep their place in the pipeline.
+>>> with pc.pipeline() as p:
+...     p.set("pk", "a")
+...     p.set("pk\x7f", "b")
+...     p.append("pk", "c")
+...     p.append("pk\x7f", "d")
+>>> p.results
+[True, True, True, True]
+>>> pc.get_multi(["pk", "pk\x7f"]) == {"pk": "ac", "pk\x7f": "bd"}
+True
+>>> pc.delete_multi(["pn", "pb", "pk", "pk\x7f"])
+True
+>>> del pc, p
+
+Writes with noreply=True don't wait for the server to answer. What they
+would have raised is kept for noreply_errors() instead.
+>>> nc = _pylibmc.client([test_server])
+>>> nc.set("nr", "a", noreply=True)
+True
+>>> nc.set_multi({"nr1": 1, "nr2": 2}, noreply=True)
+[]
+>>> nc.get_multi(["nr", "nr1", "nr2"]) == {"nr": "a", "nr1": 1, "nr2": 2}
+True
+>>> nc.delete("nr", noreply=True), nc.delete_multi(["nr1", "nr2"], noreply=True)
+(True, True)
+>>> nc.get_multi(["nr", "nr1", "nr2"])
+{}
+>>> nc.noreply_errors()
+[]
+>>> nc = _pylibmc.client([(_pylibmc.server_type_tcp, "127.0.0.1", 1)])
+>>> nc.set("nr", "a", noreply=True)
+True
+>>> nc.delete("nr", noreply=True)
+True
+>>> [isinstance(e, _pylibmc.MemcachedError) for e in nc.noreply_errors()]
+[True, True]
+>>> nc.noreply_errors()
+[]
+>>> del nc
+
+Requests can be submitted without waiting for them, and their results
+picked up once poll() says they're in, for use with event loops.
+>>> import select
+>>> def wait(mc, handles):
+...     left = set(handles)
+...     while left:
+...         r = select.select([mc.fileno()], [], [], 1.0)
+...         left.difference_update(mc.poll())
+>>> ac = _pylibmc.client([test_server])
+>>> hs = ac.submit_set("as1", "one"), ac.submit_set("as2", 2)
+>>> wait(ac, hs)
+>>> [ac.results(h) for h in hs]
+[True, True]
+>>> h = ac.submit_get_multi(["as1", "as2", "asmissing"])
+>>> wait(ac, [h])
+>>> sorted(ac.results(h).items())
+[('as1', 'one'), ('as2', 2)]
+>>> try:
+...     ac.results(h)
+... except KeyError:
+...     print "forgotten"
+forgotten
+>>> ac.results(ac.submit_get_multi([]))
+{}
+>>> ac.submit_set("has space", 1)
+Traceback (most recent call last):
+  ...
+ValueError: keys with spaces or control characters can't be submitted
+>>> ac.delete_multi(["as1", "as2"])
+True
+>>> ac = _pylibmc.client([(_pylibmc.server_type_tcp, "127.0.0.1", 1)])
+>>> h = ac.submit_set("as1", "one")
+>>> wait(ac, [h])
+>>> try:
+...     ac.results(h)
+... except _pylibmc.MemcachedError:
+...     print "failed"
+failed
+>>> del ac, hs, h
+
+With the epoll read engine, get and get_multi read the same things, and
+the client goes on working the usual way afterwards.
+>>> ec = _pylibmc.client([test_server])
+>>> ec.set_read_engine("epoll")
+>>> ec.set_multi({"ek1": "one", "ek2": 2, "ek3": "x" * 100000, "ek4": ""})
+[]
+>>> got = ec.get_multi(["ek1", "ek2", "ek3", "ek4", "ekmissing"])
+>>> got.pop("ek3") == "x" * 100000
+True
+>>> sorted(got.items())
+[('ek1', 'one'), ('ek2', 2), ('ek4', '')]
+>>> ec.get("ek2"), ec.get("ekmissing"), ec.get("ek4")
+(2, None, '')
+>>> ec.get_multi(["ek%d" % i for i in range(1000) if i != 3]) == got
+True
+>>> ec.delete_multi(["ek1", "ek2", "ek3", "ek4"])
+True
+>>> ec.set_read_engine("threads")
+Traceback (most recent call last):
+  ...
+ValueError: unknown read engine threads
+>>> del ec, got
+
+With set_connections, pipelines and epoll reads are spread over more
+connections per server, with large values kept to one of their own.
+>>> lc = _pylibmc.client([test_server])
+>>> lc.set_read_engine("epoll")
+>>> lc.set_connections(3, large_value=1000)
+>>> with lc.pipeline() as p:
+...     for i in range(100):
+...         p.set("lc%d" % i, "v" * (i * 20))
+>>> p.results == [True] * 100
+True
+>>> got = lc.get_multi(["lc%d" % i for i in range(100)])
+>>> all(got["lc%d" % i] == "v" * (i * 20) for i in range(1, 100))
+True
+>>> stats = lc.connection_stats()
+>>> [s["lane"] for s in stats]
+['libmemcached', 'stripe', 'stripe', 'large']
+>>> sum(s["requests"] for s in stats), sum(s["depth"] for s in stats)
+(200, 0)
+>>> stats[3]["requests"] == len([i for i in range(100) if i * 20 >= 1000])
+True
+>>> lc.set_connections(0)
+Traceback (most recent call last):
+  ...
+ValueError: n must be within [1, 64]
+>>> lc.set_connections(1)
+>>> lc.connection_stats()
+[]
+>>> del lc, got, stats
+
+Prefetched keys are served from what the prefetch got, once, even if
+they've changed on the server since. Writes through the same client drop
+what was prefetched, and so does the ttl running out.
+>>> import time
+>>> pc, other = _pylibmc.client([test_server]), _pylibmc.client([test_server])
+>>> pc.set_multi({"pf1": "one", "pf2": "two", "pf3": "three"})
+[]
+>>> pc.prefetch(["pf1", "pf2", "pf3", "pfmissing"])
+>>> other.set_multi({"pf1": "new", "pf2": "new", "pfmissing": "new"})
+[]
+>>> pc.get("pf1"), pc.get_multi(["pf2", "pfmissing"])
+('one', {'pf2': 'two'})
+>>> pc.get("pf1"), pc.get_multi(["pf2", "pfmissing"])
+('new', {'pf2': 'new', 'pfmissing': 'new'})
+>>> pc.set("pf3", "written")
+True
+>>> pc.get("pf3")
+'written'
+>>> pc.prefetch(["pf1"], ttl=0.01)
+>>> other.set("pf1", "newer")
+True
+>>> time.sleep(0.05)
+>>> pc.get("pf1")
+'newer'
+>>> pc.prefetch(["pf1"], ttl=0)
+Traceback (most recent call last):
+  ...
+ValueError: ttl must be positive
+>>> pc.delete_multi(["pf1", "pf2", "pf3", "pfmissing"])
+True
+>>> del pc, other
+
+Sets can be queued for a thread that sends them in the background, batch at
+a time. A coalescing queue keeps only the last set of a key still waiting.
+>>> wc = _pylibmc.client([test_server])
+>>> wc.set_write_behind(size=100, policy="coalesce", batch=8)
+>>> wc.set_async("wb1", "one"), wc.set_multi_async({"wb2": 2, "wb3": "three"})
+(True, [])
+>>> wc.flush_write_behind(timeout=5)
+True
+>>> wc.get_multi(["wb1", "wb2", "wb3"]) == {"wb1": "one", "wb2": 2,
+...                                         "wb3": "three"}
+True
+>>> stats = wc.write_behind_stats()
+>>> stats["queued"], stats["sent"], stats["failed"], stats["depth"]
+(3L, 3L, 0L, 0)
+>>> wc.set_write_behind(policy="fifo")
+Traceback (most recent call last):
+  ...
+ValueError: unknown policy fifo
+>>> wc2 = wc.clone()
+>>> wc.set_write_behind(size=10)
+>>> wc2.set_async("wb4", 4)
+True
+>>> wc.flush_write_behind(timeout=5)
+True
+>>> wc.get("wb4")
+4
+>>> del wc2
+>>> wc.delete_multi(["wb1", "wb2", "wb3", "wb4"])
+True
+>>> del wc, stats
+
+With namespaces on, a key_prefix stands for itself followed by a generation
+kept on the server. Bumping it leaves every key under the prefix behind.
+>>> nc = _pylibmc.client([test_server])
+>>> nc.set_namespaces(ttl=10)
+>>> nc.set_multi({"a": 1, "b": 2}, key_prefix="user:1:")
+[]
+>>> nc.get_multi(["a", "b"], key_prefix="user:1:")
+{'a': 1, 'b': 2}
+>>> gen = nc.bump_namespace("user:1:")
+>>> nc.get_multi(["a", "b"], key_prefix="user:1:")
+{}
+>>> nc.get("user:1:#%d:a" % (gen - 1))
+1
+>>> stats = nc.namespace_stats()
+>>> stats["hits"], stats["fetches"], stats["bumps"]
+(2, 1, 1)
+>>> nc.set_namespaces(ttl=-1)
+Traceback (most recent call last):
+  ...
+ValueError: ttl must not be negative
+>>> nc.delete_multi(["user:1:#%d:a" % (gen - 1), "user:1:#%d:b" % (gen - 1),
+...                  "ns:user:1:"])
+True
+>>> nc.set_namespaces(False)
+>>> nc.namespace_stats()
+>>> del nc, gen, stats
+
+With key hashing on, keys longer than the threshold go on the wire as their
+first keep bytes and a 128-bit hash. They come back as they were given.
+>>> hc = _pylibmc.client([test_server])
+>>> hc.set_key_hashing(threshold=64, keep=16)
+>>> long_key = "query:" + "&".join("p%d=%d" % (i, i) for i in range(100))
+>>> hc.set_multi({long_key: "rows", "short": "row"}, key_prefix="kh:")
+[]
+>>> hc.get("kh:" + long_key)
+'rows'
+>>> hc.get_multi([long_key, "short"], key_prefix="kh:") == {long_key: "rows",
+...                                                          "short": "row"}
+True
+>>> hc.delete("kh:" + long_key), hc.get("kh:" + long_key)
+(True, None)
+>>> hc.set_key_hashing(threshold=40, keep=16)
+Traceback (most recent call last):
+  ...
+ValueError: threshold must be within [keep + 32, 251], or 0
+>>> hc.set_key_hashing(threshold=0)
+>>> hc.get("kh:" + long_key)
+Traceback (most recent call last):
+  ...
+ValueError: key too long, max is 251
+>>> hc.delete("kh:short")
+True
+>>> del hc, long_key
+
 Empty server lists are bad for your health.
 >>> c = _pylibmc.client([])
 Traceback (most recent call last):